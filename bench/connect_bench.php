@@ -0,0 +1,149 @@
+<?php
+/*
+    Connect benchmark against the local mock server (tests/mock_mysql_server.php), no Azure server needed.
+
+    php -d extension=mysqlnd_azure bench/connect_bench.php [--iterations=N] [--delay-ms=N] [--paths=gateway,redirect,cache,fallback,failover]
+
+    Paths:
+      gateway   mysqlnd_azure.enableRedirect=off, plain connection to the gateway
+      redirect  cold connect, gateway handshake + redirect handshake (new user every time, so never cached)
+      cache     warm connect, cached redirect target is used directly
+      fallback  gateway announces a dead redirect target, preferred mode falls back to the gateway connection
+      failover  cached target is dead, cache entry is dropped and the full gateway + redirect round is done
+
+    For every path connects/sec and p50/p99/max latency are printed. --delay-ms adds a server side delay
+    before each greeting to emulate network distance.
+*/
+
+require_once(__DIR__ . "/../tests/mock_server.inc");
+
+$options = getopt("", array("iterations:", "delay-ms:", "paths:"));
+$iterations = isset($options["iterations"]) ? max(1, (int)$options["iterations"]) : 500;
+$delay_ms = isset($options["delay-ms"]) ? (int)$options["delay-ms"] : 0;
+$paths = isset($options["paths"]) ? explode(",", $options["paths"]) : array("gateway", "redirect", "cache", "fallback", "failover");
+
+if (!extension_loaded("mysqlnd_azure") || !extension_loaded("mysqli") || !extension_loaded("openssl")) {
+    fwrite(STDERR, "mysqlnd_azure, mysqli and openssl extensions are required\n");
+    exit(1);
+}
+
+$tmp = sys_get_temp_dir() . "/mysqlnd_azure_bench_" . getmypid();
+@mkdir($tmp);
+
+$backend_port    = MOCK_SERVER_BASE_PORT + 10;
+$gateway_port    = MOCK_SERVER_BASE_PORT + 11;
+$dead_port       = MOCK_SERVER_BASE_PORT + 12; //nothing listens here
+$flaky_port      = MOCK_SERVER_BASE_PORT + 13;
+$deadgw_port     = MOCK_SERVER_BASE_PORT + 14;
+
+$common = array("tls" => true, "delay-ms" => $delay_ms);
+$ok = mock_server_start($backend_port, $common)
+    && mock_server_start($gateway_port, $common + array("location" => "azure", "redirect-port" => $backend_port, "stats-file" => "$tmp/gateway.json"))
+    && mock_server_start($flaky_port, $common + array("control-file" => "$tmp/flaky.ctl"))
+    && mock_server_start($deadgw_port, $common + array("location" => "azure", "redirect-port" => $dead_port));
+if (!$ok) {
+    fwrite(STDERR, "cannot start the mock servers on ports " . MOCK_SERVER_BASE_PORT . "+10..14\n");
+    exit(1);
+}
+
+function bench_connect($port, $user) {
+    $link = mysqli_init();
+    $start = microtime(true);
+    $ret = @mysqli_real_connect($link, MOCK_SERVER_HOST, $user, "", NULL, $port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT);
+    $elapsed = microtime(true) - $start;
+    if ($ret) {
+        $link->close();
+    }
+    return $ret ? $elapsed : false;
+}
+
+function bench_report($name, array $samples, $errors, $wall) {
+    sort($samples);
+    $n = count($samples);
+    $pick = function ($q) use ($samples, $n) {
+        return $n ? $samples[min($n - 1, (int)floor($q * $n))] * 1000 : 0;
+    };
+    printf("%-10s %8d %6d %12.1f %10.2f %10.2f %10.2f\n", $name, $n, $errors,
+        $wall > 0 ? $n / $wall : 0, $pick(0.50), $pick(0.99), $n ? end($samples) * 1000 : 0);
+}
+
+function bench_run($name, $iterations, $connect) {
+    $samples = array();
+    $errors = 0;
+    $wall = 0.0;
+    for ($i = 0; $i < $iterations; $i++) {
+        $start = microtime(true);
+        $elapsed = $connect($i);
+        $wall += microtime(true) - $start;
+        if ($elapsed === false) {
+            $errors++;
+        } else {
+            $samples[] = $elapsed;
+        }
+    }
+    bench_report($name, $samples, $errors, $wall);
+}
+
+$run = getmypid();
+
+printf("%-10s %8s %6s %12s %10s %10s %10s\n", "path", "connects", "errors", "connects/s", "p50(ms)", "p99(ms)", "max(ms)");
+
+foreach ($paths as $path) {
+    switch ($path) {
+        case "gateway":
+            ini_set("mysqlnd_azure.enableRedirect", "off");
+            bench_run($path, $iterations, function ($i) use ($gateway_port) {
+                return bench_connect($gateway_port, "bench_gateway");
+            });
+            break;
+
+        case "redirect":
+            ini_set("mysqlnd_azure.enableRedirect", "preferred");
+            bench_run($path, $iterations, function ($i) use ($gateway_port, $run) {
+                return bench_connect($gateway_port, "bench_redirect_{$run}_{$i}");
+            });
+            break;
+
+        case "cache":
+            ini_set("mysqlnd_azure.enableRedirect", "preferred");
+            bench_connect($gateway_port, "bench_cache_{$run}"); //warm up the cache entry
+            bench_run($path, $iterations, function ($i) use ($gateway_port, $run) {
+                return bench_connect($gateway_port, "bench_cache_{$run}");
+            });
+            break;
+
+        case "fallback":
+            ini_set("mysqlnd_azure.enableRedirect", "preferred");
+            bench_run($path, $iterations, function ($i) use ($deadgw_port, $run) {
+                return bench_connect($deadgw_port, "bench_fallback_{$run}_{$i}");
+            });
+            break;
+
+        case "failover":
+            //learn "flaky" as redirect target for every user, then let it drop all connections
+            ini_set("mysqlnd_azure.enableRedirect", "preferred");
+            $control = "$tmp/failover_gateway.ctl";
+            mock_server_control($control, array("redirect-port" => $flaky_port));
+            $failover_gateway = MOCK_SERVER_BASE_PORT + 15;
+            if (!mock_server_start($failover_gateway, $common + array("location" => "azure", "redirect-port" => $flaky_port, "control-file" => $control))) {
+                fwrite(STDERR, "cannot start the failover gateway\n");
+                break;
+            }
+            mock_server_control("$tmp/flaky.ctl", array("fail-rate" => 0));
+            for ($i = 0; $i < $iterations; $i++) {
+                bench_connect($failover_gateway, "bench_failover_{$run}_{$i}");
+            }
+            mock_server_control("$tmp/flaky.ctl", array("fail-rate" => 1, "fail-mode" => "close"));
+            mock_server_control($control, array("redirect-port" => $backend_port));
+            bench_run($path, $iterations, function ($i) use ($failover_gateway, $run) {
+                return bench_connect($failover_gateway, "bench_failover_{$run}_{$i}");
+            });
+            break;
+
+        default:
+            fwrite(STDERR, "unknown path {$path}\n");
+    }
+}
+
+array_map("unlink", glob("$tmp/*"));
+@rmdir($tmp);
@@ -0,0 +1,222 @@
+<?php
+/*
+    Reconnect storm benchmark: N forked workers keep connecting through the local mock gateway
+    (tests/mock_mysql_server.php) while the redirect target moves, like FPM workers after a backend failover.
+
+    php -d extension=mysqlnd_azure bench/reconnect_storm.php [--workers=N] [--duration=S] [--switch-at=S]
+        [--think-ms=N] [--delay-ms=N] [--mode=preferred|on] [--query] [--raw=FILE]
+
+      --workers    number of forked worker processes (default 50)
+      --duration   length of the run in seconds (default 20)
+      --switch-at  second at which the gateway starts redirecting to the new backend and the old backend
+                   starts dropping connections (default 5)
+      --think-ms   pause between two connects of one worker (default 10)
+      --delay-ms   server side delay before each greeting, emulates network distance (default 0)
+      --mode       mysqlnd_azure.enableRedirect used by the workers (default preferred)
+      --query      run "SELECT 1" on every connection before closing it
+      --raw        write every connect as "time ok latency port errno worker" to FILE for further analysis
+
+    Every worker caches the redirect target in its own process. After the switch each worker's first connect
+    to the cached (now dead) target fails, the cache entry is dropped and the full gateway + redirect round is
+    done, so the report shows how many errors the application saw, how long each worker needed until it
+    reached the new backend, and how much extra load the storm put on the gateway.
+
+    Requires the pcntl, mysqli and openssl extensions.
+*/
+
+require_once(__DIR__ . "/../tests/mock_server.inc");
+
+$options = getopt("", array("workers:", "duration:", "switch-at:", "think-ms:", "delay-ms:", "mode:", "query", "raw:"));
+$workers   = isset($options["workers"]) ? max(1, (int)$options["workers"]) : 50;
+$duration  = isset($options["duration"]) ? max(1.0, (float)$options["duration"]) : 20.0;
+$switch_at = isset($options["switch-at"]) ? (float)$options["switch-at"] : 5.0;
+$think_ms  = isset($options["think-ms"]) ? max(0, (int)$options["think-ms"]) : 10;
+$delay_ms  = isset($options["delay-ms"]) ? (int)$options["delay-ms"] : 0;
+$mode      = isset($options["mode"]) ? $options["mode"] : "preferred";
+$query     = isset($options["query"]);
+$raw       = isset($options["raw"]) ? $options["raw"] : NULL;
+
+if (!extension_loaded("mysqlnd_azure") || !extension_loaded("mysqli") || !extension_loaded("openssl") || !function_exists("pcntl_fork")) {
+    fwrite(STDERR, "mysqlnd_azure, mysqli, openssl and pcntl extensions are required\n");
+    exit(1);
+}
+if ($switch_at <= 0 || $switch_at >= $duration) {
+    fwrite(STDERR, "--switch-at must be inside the run\n");
+    exit(1);
+}
+
+$tmp = sys_get_temp_dir() . "/mysqlnd_azure_storm_" . getmypid();
+@mkdir($tmp);
+
+$old_port     = MOCK_SERVER_BASE_PORT + 20;
+$new_port     = MOCK_SERVER_BASE_PORT + 21;
+$gateway_port = MOCK_SERVER_BASE_PORT + 22;
+
+$common = array("tls" => true, "delay-ms" => $delay_ms);
+mock_server_control("$tmp/old.ctl", array("fail-rate" => 0));
+mock_server_control("$tmp/gateway.ctl", array("redirect-port" => $old_port));
+$ok = mock_server_start($old_port, $common + array("control-file" => "$tmp/old.ctl"))
+    && mock_server_start($new_port, $common)
+    && mock_server_start($gateway_port, $common + array("location" => "azure", "redirect-port" => $old_port,
+        "control-file" => "$tmp/gateway.ctl", "stats-file" => "$tmp/gateway.json"));
+if (!$ok) {
+    fwrite(STDERR, "cannot start the mock servers on ports " . MOCK_SERVER_BASE_PORT . "+20..22\n");
+    exit(1);
+}
+
+ini_set("mysqlnd_azure.enableRedirect", $mode);
+
+function storm_worker($id, $gateway_port, $start, $end, $think_ms, $query, $log_file) {
+    $log = "";
+    while (($now = microtime(true)) < $end) {
+        $link = mysqli_init();
+        $ret = @mysqli_real_connect($link, MOCK_SERVER_HOST, "storm_user", "", NULL, $gateway_port, NULL,
+            MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT);
+        $port = 0;
+        $errno = 0;
+        if ($ret && $query && !$link->query("SELECT 1")) {
+            $ret = false;
+            $errno = $link->errno;
+        }
+        $latency = microtime(true) - $now;
+        if ($ret) {
+            if (preg_match('/-(\d+)$/', $link->server_info, $m)) {
+                $port = (int)$m[1];
+            }
+            $link->close();
+        } else if (!$errno) {
+            $errno = mysqli_connect_errno();
+        }
+        $log .= sprintf("%.6f %d %.6f %d %d %d\n", $now - $start, $ret ? 1 : 0, $latency, $port, $errno, $id);
+        if ($think_ms) {
+            usleep($think_ms * 1000);
+        }
+    }
+    file_put_contents($log_file, $log);
+}
+
+//all workers start together, give the forks a moment to get ready
+$start = microtime(true) + 0.5;
+$end = $start + $duration;
+$pids = array();
+for ($i = 0; $i < $workers; $i++) {
+    $pid = pcntl_fork();
+    if ($pid == -1) {
+        fwrite(STDERR, "fork failed after {$i} workers\n");
+        break;
+    }
+    if ($pid == 0) {
+        time_sleep_until($start);
+        storm_worker($i, $gateway_port, $start, $end, $think_ms, $query, "$tmp/worker_{$i}.log");
+        exit(0);
+    }
+    $pids[] = $pid;
+}
+
+//sample the gateway accept counter and move the backend at the switch time
+$gateway_samples = array();
+$switched = false;
+while (($now = microtime(true)) < $end + 1) {
+    if (!$switched && $now >= $start + $switch_at) {
+        mock_server_control("$tmp/gateway.ctl", array("redirect-port" => $new_port));
+        mock_server_control("$tmp/old.ctl", array("fail-rate" => 1, "fail-mode" => "close"));
+        $switched = true;
+    }
+    if ($now >= $start) {
+        $gateway_samples[] = array($now - $start, mock_server_accepted("$tmp/gateway.json"));
+    }
+    usleep(100000);
+}
+foreach ($pids as $pid) {
+    pcntl_waitpid($pid, $status);
+}
+
+$records = array();
+foreach (glob("$tmp/worker_*.log") as $file) {
+    foreach (file($file, FILE_IGNORE_NEW_LINES | FILE_SKIP_EMPTY_LINES) as $line) {
+        $records[] = array_map("floatval", explode(" ", $line));
+    }
+}
+usort($records, function ($a, $b) { return $a[0] < $b[0] ? -1 : ($a[0] > $b[0] ? 1 : 0); });
+if ($raw) {
+    file_put_contents($raw, implode("", array_map(function ($r) { return vsprintf("%.6f %d %.6f %d %d %d\n", $r); }, $records)));
+}
+
+function storm_percentile(array $values, $q) {
+    if (!$values) {
+        return 0;
+    }
+    sort($values);
+    return $values[min(count($values) - 1, (int)floor($q * count($values)))];
+}
+
+function storm_gateway_accepted_at(array $samples, $t) {
+    $accepted = 0;
+    foreach ($samples as $sample) {
+        if ($sample[0] > $t) {
+            break;
+        }
+        $accepted = $sample[1];
+    }
+    return $accepted;
+}
+
+printf("workers=%d duration=%.1fs switch=%.1fs think=%dms delay=%dms mode=%s%s\n\n",
+    count($pids), $duration, $switch_at, $think_ms, $delay_ms, $mode, $query ? " query" : "");
+
+//one line per second of the run
+printf("%5s %8s %6s %8s %8s %8s %8s %10s\n", "sec", "connects", "errors", "old", "new", "gateway", "gw-load", "p99(ms)");
+for ($sec = 0; $sec < (int)ceil($duration); $sec++) {
+    $ok = $errors = $old = $new = $gateway = 0;
+    $latencies = array();
+    foreach ($records as $r) {
+        if ($r[0] < $sec || $r[0] >= $sec + 1) {
+            continue;
+        }
+        $latencies[] = $r[2];
+        if (!$r[1]) {
+            $errors++;
+            continue;
+        }
+        $ok++;
+        if ($r[3] == $old_port) {
+            $old++;
+        } else if ($r[3] == $new_port) {
+            $new++;
+        } else {
+            $gateway++;
+        }
+    }
+    $load = storm_gateway_accepted_at($gateway_samples, $sec + 1) - storm_gateway_accepted_at($gateway_samples, $sec);
+    printf("%5d %8d %6d %8d %8d %8d %8d %10.2f%s\n", $sec, $ok, $errors, $old, $new, $gateway, $load,
+        storm_percentile($latencies, 0.99) * 1000, $sec == (int)floor($switch_at) ? "  <- switch" : "");
+}
+
+//time to recovery: from the switch until a worker's first successful connect to the new backend
+$recovered = array();
+$errors_after = 0;
+$last_error = NULL;
+foreach ($records as $r) {
+    if ($r[0] + $r[2] < $switch_at) {
+        continue;
+    }
+    if (!$r[1]) {
+        $errors_after++;
+        $last_error = $r[0] + $r[2];
+    } else if ($r[3] == $new_port && !isset($recovered[(int)$r[5]])) {
+        $recovered[(int)$r[5]] = $r[0] + $r[2] - $switch_at;
+    }
+}
+$ttr = array_values($recovered);
+$before_load = (storm_gateway_accepted_at($gateway_samples, $switch_at) - storm_gateway_accepted_at($gateway_samples, 1.0)) / max(0.1, $switch_at - 1.0);
+$after_load = storm_gateway_accepted_at($gateway_samples, $switch_at + 1.0) - storm_gateway_accepted_at($gateway_samples, $switch_at);
+
+printf("\nerrors after switch:   %d%s\n", $errors_after, $last_error !== NULL ? sprintf(" (last at +%.3fs)", $last_error - $switch_at) : "");
+printf("workers recovered:     %d/%d\n", count($recovered), count($pids));
+printf("time to recovery (ms): p50 %.2f  p99 %.2f  max %.2f\n",
+    storm_percentile($ttr, 0.50) * 1000, storm_percentile($ttr, 0.99) * 1000, $ttr ? max($ttr) * 1000 : 0);
+printf("gateway accepts/s:     %.1f before switch, %d in the second after it, %d in total\n",
+    $before_load, $after_load, storm_gateway_accepted_at($gateway_samples, $duration + 1));
+
+array_map("unlink", glob("$tmp/*"));
+@rmdir($tmp);
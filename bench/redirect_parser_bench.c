@@ -0,0 +1,77 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+/*
+  Micro-benchmark for mysqlnd_azure_parse_redirect(), no PHP needed:
+      make -C bench redirect_parser_bench && ./bench/redirect_parser_bench [iterations]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../redirect_parser.h"
+
+static const char* const samples[] = {
+    "Location: mysql://myserver-shard1.westus.cloudapp.azure.com:16001/user=admin@myserver",
+    "Location: mysql://myserver-shard1.westus.cloudapp.azure.com:16001/user=admin@myserver&ttl=300",
+    "Location: mysql://[myserver-shard1.westus.cloudapp.azure.com]:16001/?user=admin@myserver&ttl=300\n",
+    "Location: mysql://[2001:db8::1]:3306/?user=admin&ttl=60&zone=2\n",
+    "Location: mysql://10.0.0.1:3306/user=",
+    "Welcome to MySQL, this is no redirect message at all"
+};
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+int main(int argc, char** argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+    size_t n = sizeof(samples) / sizeof(samples[0]);
+    size_t i;
+    volatile int sink = 0;
+
+    if (iterations <= 0) {
+        iterations = 2000000;
+    }
+
+    printf("%-8s %-10s %10s  %s\n", "result", "format", "ns/parse", "message");
+    for (i = 0; i < n; i++) {
+        MYSQLND_AZURE_REDIRECT_LOCATION location;
+        size_t len = strlen(samples[i]);
+        int ok = mysqlnd_azure_parse_redirect(samples[i], len, &location);
+        long it;
+        double start, elapsed;
+
+        start = now_ns();
+        for (it = 0; it < iterations; it++) {
+            sink += mysqlnd_azure_parse_redirect(samples[i], len, &location);
+        }
+        elapsed = now_ns() - start;
+
+        printf("%-8s %-10s %10.1f  %.60s\n", ok ? "ok" : "reject", ok ? location.format->name : "-",
+            elapsed / (double)iterations, samples[i]);
+    }
+
+    return sink == 42 ? 1 : 0;
+}
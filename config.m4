@@ -5,10 +5,21 @@ dnl config.m4 for extension mysqlnd_azure
 PHP_ARG_ENABLE(mysqlnd_azure, whether to enable mysqlnd_azure support for redirection,
 [  --enable-mysqlnd_azure           Enable mysqlnd_azure support for redirection])
 
+PHP_ARG_ENABLE(mysqlnd-azure-usdt, whether to enable USDT probes in mysqlnd_azure,
+[  --enable-mysqlnd-azure-usdt      mysqlnd_azure: Enable USDT probes for perf/bpftrace/systemtap (needs sys/sdt.h)], no, no)
+
 if test "$PHP_MYSQLND_AZURE" != "no"; then
   PHP_SUBST(mysqlnd_azure_SHARED_LIBADD)
 
-  mysqlnd_azure_sources="php_mysqlnd_azure.c mysqlnd_azure.c redirect_cache.c"
+  if test "$PHP_MYSQLND_AZURE_USDT" != "no"; then
+    AC_CHECK_HEADER([sys/sdt.h], [
+      AC_DEFINE(HAVE_MYSQLND_AZURE_USDT, 1, [Whether mysqlnd_azure has USDT probes])
+    ], [
+      AC_MSG_ERROR([sys/sdt.h not found, install systemtap-sdt-dev (Debian/Ubuntu) or systemtap-sdt-devel (RHEL/Fedora)])
+    ])
+  fi
+
+  mysqlnd_azure_sources="php_mysqlnd_azure.c mysqlnd_azure.c redirect_cache.c redirect_parser.c connect_event.c mysqlnd_azure_shm.c redirect_lease.c connect_admission.c replica_router.c redirect_probe.c connect_metrics.c connect_trace.c redirect_policy.c mysqlnd_azure_mem.c"
 
   PHP_ADD_EXTENSION_DEP(mysqlnd_azure, mysqlnd)
 
@@ -0,0 +1,189 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php_mysqlnd_azure.h"
+#include "mysqlnd_azure.h"
+#include "utils.h"
+
+/*
+  Connect admission control, see mysqlnd_azure.connectRate. Every server (host, port) the
+  application connects to has a token bucket in a shared region, so all workers of a master
+  process draw from the same one: it holds up to mysqlnd_azure.connectBurst tokens and gains
+  mysqlnd_azure.connectRate tokens per second. Each new connect takes one token.
+
+  When the bucket is empty, a caller allowed to wait (mysqlnd_azure.connectWaitMs) reserves the
+  next token which becomes free within its deadline: the balance goes below zero and the caller
+  sleeps until its token is due, without polling the table again. Callers whose token would not
+  be due within their deadline are rejected and take nothing. Waiting callers are so served in
+  the order they came, at the configured rate, however many there are.
+
+  Without a shared region (Windows) the buckets are per process. A full table, or a host name
+  too long for a slot, admits the connect.
+*/
+
+#define ADMISSION_SLOTS     256
+#define ADMISSION_TOKEN     1000000     /* tokens are counted in millionths, one per us at 1/s */
+#define ADMISSION_MAX_RATE  1000000
+#define ADMISSION_MAX_WAIT_US ((uint64_t)60 * 1000000)
+
+typedef struct st_mysqlnd_azure_admission_slot {
+    uint32_t hash;
+    unsigned int port;
+    int64_t tokens;                 /* balance at last_us, below 0 while tokens are reserved */
+    uint64_t last_us;
+    uint64_t full_us;               /* time the bucket is full again, the slot can be reused from then on */
+    char host[MAX_REDIRECT_HOST_LEN + 1];
+} MYSQLND_AZURE_ADMISSION_SLOT;
+
+typedef struct st_mysqlnd_azure_admission_table {
+    volatile uint32_t lock;
+    MYSQLND_AZURE_ADMISSION_SLOT slots[ADMISSION_SLOTS];
+} MYSQLND_AZURE_ADMISSION_TABLE;
+
+static MYSQLND_AZURE_ADMISSION_TABLE* admission_table = NULL;
+static zend_bool admission_table_shared = FALSE;
+
+/* {{{ admission_hash, FNV-1a */
+static uint32_t admission_hash(const char* host, unsigned int port)
+{
+    uint32_t hash = 2166136261u;
+    const unsigned char* p;
+
+    for (p = (const unsigned char*)host; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    hash = (hash ^ port) * 16777619u;
+
+    return hash ? hash : 1;
+}
+/* }}} */
+
+/* {{{ admission_find, slot of the server, or a reusable one; called with the lock held */
+static MYSQLND_AZURE_ADMISSION_SLOT* admission_find(uint32_t hash, const char* host, unsigned int port, uint64_t now)
+{
+    MYSQLND_AZURE_ADMISSION_SLOT* reusable = NULL;
+    uint32_t i, n;
+
+    /* slots keep their key after use, so a probe runs until a never used slot */
+    for (n = 0, i = hash % ADMISSION_SLOTS; n < ADMISSION_SLOTS; n++, i = (i + 1) % ADMISSION_SLOTS) {
+        MYSQLND_AZURE_ADMISSION_SLOT* slot = &admission_table->slots[i];
+        if (slot->hash == 0) {
+            return reusable ? reusable : slot;
+        }
+        if (slot->hash == hash && slot->port == port && strcmp(slot->host, host) == 0) {
+            return slot;
+        }
+        if (reusable == NULL && slot->full_us <= now) {
+            reusable = slot;
+        }
+    }
+
+    return reusable;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_admission_startup, called at MINIT */
+void mysqlnd_azure_admission_startup()
+{
+    admission_table = mysqlnd_azure_shm_alloc(sizeof(MYSQLND_AZURE_ADMISSION_TABLE));
+    admission_table_shared = admission_table != NULL;
+    if (admission_table == NULL) {
+        //no shared region, the buckets only cover this process
+        admission_table = AZURE_PECALLOC(1, sizeof(MYSQLND_AZURE_ADMISSION_TABLE), 1, AZURE_MEM_TABLES);
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_admission_shutdown, called at MSHUTDOWN before the shared regions are unmapped */
+void mysqlnd_azure_admission_shutdown()
+{
+    if (admission_table != NULL && !admission_table_shared) {
+        AZURE_PEFREE(admission_table, sizeof(MYSQLND_AZURE_ADMISSION_TABLE), 1, AZURE_MEM_TABLES);
+    }
+    admission_table = NULL;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_admission_acquire
+  Take a token of the bucket of host:port, rate tokens per second up to burst.
+  Returns FALSE when no token is free within max_wait_us. Else TRUE, and wait_us tells how
+  long the caller has to sleep before its token is due, 0 when it can connect right away.
+*/
+zend_bool mysqlnd_azure_admission_acquire(const char* host, unsigned int port, zend_long rate, zend_long burst, uint64_t max_wait_us, uint64_t* wait_us)
+{
+    MYSQLND_AZURE_ADMISSION_SLOT* slot;
+    uint32_t hash;
+    uint64_t now = mysqlnd_azure_now_us();
+    uint64_t due;
+    int64_t capacity;
+    zend_bool admitted = TRUE;
+
+    *wait_us = 0;
+    if (admission_table == NULL || rate <= 0 || strlen(host) > MAX_REDIRECT_HOST_LEN) {
+        return TRUE;
+    }
+    //bounds keep the balance far from overflowing
+    rate = MIN(rate, ADMISSION_MAX_RATE);
+    burst = burst > 0 ? MIN(burst, ADMISSION_MAX_RATE) : rate;  //0: one second worth of connects
+    max_wait_us = MIN(max_wait_us, ADMISSION_MAX_WAIT_US);
+    capacity = (int64_t)burst * ADMISSION_TOKEN;
+    hash = admission_hash(host, port);
+
+    mysqlnd_azure_shm_lock(&admission_table->lock);
+    slot = admission_find(hash, host, port, now);
+    if (slot == NULL) {
+        //table full of busy servers, do not hold up connects to the ones without a slot
+        mysqlnd_azure_shm_unlock(&admission_table->lock);
+        return TRUE;
+    }
+    if (slot->hash != hash || slot->port != port || strcmp(slot->host, host) != 0) {
+        //first connect to this server, or the slot of an idle one is reused
+        slot->hash = hash;
+        slot->port = port;
+        strcpy(slot->host, host);
+        slot->tokens = capacity;
+        slot->last_us = now;
+    } else if (now > slot->last_us) {
+        uint64_t elapsed = now - slot->last_us;
+        if (slot->tokens >= capacity || elapsed >= (uint64_t)(capacity - slot->tokens) / (uint64_t)rate) {
+            slot->tokens = capacity;
+        } else {
+            slot->tokens += (int64_t)elapsed * rate;
+        }
+        slot->last_us = now;
+    }
+
+    if (slot->tokens >= ADMISSION_TOKEN) {
+        slot->tokens -= ADMISSION_TOKEN;
+    } else if ((due = (uint64_t)(ADMISSION_TOKEN - slot->tokens + rate - 1) / (uint64_t)rate) <= max_wait_us) {
+        //reserve the next token due within the deadline
+        *wait_us = due;
+        slot->tokens -= ADMISSION_TOKEN;
+    } else {
+        admitted = FALSE;
+    }
+    slot->full_us = now + (uint64_t)(capacity - slot->tokens) / (uint64_t)rate;
+    mysqlnd_azure_shm_unlock(&admission_table->lock);
+
+    return admitted;
+}
+/* }}} */
@@ -0,0 +1,326 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php_mysqlnd_azure.h"
+#include "mysqlnd_azure.h"
+#include "zend_smart_str.h"
+#include "ext/mysqlnd/mysqlnd_structs.h"
+
+#ifdef PHP_WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "utils.h"
+
+static const char* const phase_names[AZURE_PHASE_COUNT] = {
+    "cache_lookup",
+    "cache_connect",
+    "gateway_handshake",
+    "redirect_parse",
+    "redirect_handshake",
+    "proxy_close",
+    "init_commands",
+    "discovery_wait",
+    "admission_wait"
+};
+
+static const char* const path_names[] = {
+    "none",
+    "gateway",
+    "cache",
+    "redirect",
+    "fallback"
+};
+
+/* {{{ mysqlnd_azure_event_sampled */
+static zend_bool
+mysqlnd_azure_event_sampled(double rate)
+{
+    /* private xorshift state, so sampling never disturbs the userland mt_rand() sequence */
+    static uint32_t seed = 0;
+
+    if (rate <= 0.0) {
+        return FALSE;
+    }
+    if (rate >= 1.0) {
+        return TRUE;
+    }
+
+    if (seed == 0) {
+        seed = (uint32_t)mysqlnd_azure_now_us() ^ ((uint32_t)getpid() << 16);
+        if (seed == 0) {
+            seed = 1;
+        }
+    }
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    return ((double)seed / 4294967296.0) < rate;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_event_phase_name */
+const char* mysqlnd_azure_event_phase_name(mysqlnd_azure_connect_phase phase)
+{
+    return phase_names[phase];
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_event_path_name */
+const char* mysqlnd_azure_event_path_name(mysqlnd_azure_connect_path path)
+{
+    return path_names[path];
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_event_append_json_string, also used for the trace spans */
+void
+mysqlnd_azure_event_append_json_string(smart_str* buf, const char* str)
+{
+    const char* p;
+
+    if (str == NULL) {
+        smart_str_appendl(buf, "null", 4);
+        return;
+    }
+
+    smart_str_appendc(buf, '"');
+    for (p = str; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        switch (c) {
+            case '"':  smart_str_appendl(buf, "\\\"", 2); break;
+            case '\\': smart_str_appendl(buf, "\\\\", 2); break;
+            case '\n': smart_str_appendl(buf, "\\n", 2); break;
+            case '\r': smart_str_appendl(buf, "\\r", 2); break;
+            case '\t': smart_str_appendl(buf, "\\t", 2); break;
+            default:
+                if (c < 0x20) {
+                    char esc[7];
+                    snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    smart_str_appendl(buf, esc, 6);
+                } else {
+                    smart_str_appendc(buf, c);
+                }
+        }
+    }
+    smart_str_appendc(buf, '"');
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_event_write */
+static void
+mysqlnd_azure_event_write(const MYSQLND_AZURE_CONNECT_EVENT* event, enum_func_status ret, zend_bool sampled)
+{
+    /**
+    * One record per connect, fixed schema:
+    * {"time":"...","event":"connect","outcome":"success|failure","path":"gateway|cache|redirect|fallback",
+    *  "sampled":true|false,"host":"...","user":"...","port":N,"cache":"hit|miss|stale",
+    *  "target":{"host":"...","user":"...","port":N}|null,
+    *  "durations_us":{"total":N,"cache_lookup":N,...},"error":{"errno":N,"sqlstate":"..."}|null,
+    *  "redirect_errno":N}
+    */
+    smart_str buf = {0};
+    char tmp[64];
+    struct timeval tv;
+    time_t now;
+    int i;
+
+    gettimeofday(&tv, NULL);
+    now = tv.tv_sec;
+    strftime(tmp, sizeof(tmp), "%Y-%m-%dT%H:%M:%S", gmtime(&now));
+
+    smart_str_appends(&buf, "{\"time\":\"");
+    smart_str_appends(&buf, tmp);
+    snprintf(tmp, sizeof(tmp), ".%03dZ\"", (int)(tv.tv_usec / 1000));
+    smart_str_appends(&buf, tmp);
+
+    smart_str_appends(&buf, ",\"event\":\"connect\",\"outcome\":");
+    smart_str_appends(&buf, ret == PASS ? "\"success\"" : "\"failure\"");
+    smart_str_appends(&buf, ",\"path\":\"");
+    smart_str_appends(&buf, path_names[event->path]);
+    smart_str_appends(&buf, "\",\"sampled\":");
+    smart_str_appends(&buf, sampled ? "true" : "false");
+
+    smart_str_appends(&buf, ",\"host\":");
+    mysqlnd_azure_event_append_json_string(&buf, event->host);
+    smart_str_appends(&buf, ",\"user\":");
+    mysqlnd_azure_event_append_json_string(&buf, event->user);
+    smart_str_appends(&buf, ",\"port\":");
+    smart_str_append_unsigned(&buf, event->port);
+
+    smart_str_appends(&buf, ",\"cache\":");
+    smart_str_appends(&buf, !event->cache_found ? "\"miss\"" : (event->cache_failed ? "\"stale\"" : "\"hit\""));
+
+    smart_str_appends(&buf, ",\"target\":");
+    if (event->target_host[0]) {
+        smart_str_appends(&buf, "{\"host\":");
+        mysqlnd_azure_event_append_json_string(&buf, event->target_host);
+        smart_str_appends(&buf, ",\"user\":");
+        mysqlnd_azure_event_append_json_string(&buf, event->target_user);
+        smart_str_appends(&buf, ",\"port\":");
+        smart_str_append_unsigned(&buf, event->target_port);
+        smart_str_appendc(&buf, '}');
+    } else {
+        smart_str_appends(&buf, "null");
+    }
+
+    smart_str_appends(&buf, ",\"durations_us\":{\"total\":");
+    smart_str_append_unsigned(&buf, (zend_ulong)event->total_us);
+    for (i = 0; i < AZURE_PHASE_COUNT; i++) {
+        smart_str_appends(&buf, ",\"");
+        smart_str_appends(&buf, phase_names[i]);
+        smart_str_appends(&buf, "\":");
+        smart_str_append_unsigned(&buf, (zend_ulong)event->phase_us[i]);
+    }
+    smart_str_appendc(&buf, '}');
+
+    smart_str_appends(&buf, ",\"error\":");
+    if (event->error_no) {
+        smart_str_appends(&buf, "{\"errno\":");
+        smart_str_append_unsigned(&buf, event->error_no);
+        smart_str_appends(&buf, ",\"sqlstate\":");
+        mysqlnd_azure_event_append_json_string(&buf, event->sqlstate);
+        smart_str_appendc(&buf, '}');
+    } else {
+        smart_str_appends(&buf, "null");
+    }
+
+    smart_str_appends(&buf, ",\"redirect_errno\":");
+    smart_str_append_unsigned(&buf, event->redirect_error_no);
+    smart_str_appendc(&buf, '}');
+    smart_str_0(&buf);
+
+    //same destination as AZURE_LOG, but no text prefix so every line is one JSON document
+    if ((MYSQLND_AZURE_G(logOutput) & ALOG_TYPE_FILE) && logfile) {
+        fprintf(logfile, "%s\n", ZSTR_VAL(buf.s));
+        fflush(logfile);
+    }
+    else if (MYSQLND_AZURE_G(logOutput) & ALOG_TYPE_STDERR) {
+        fprintf(stderr, "%s\n", ZSTR_VAL(buf.s));
+        fflush(stderr);
+    }
+
+    smart_str_free(&buf);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_event_begin */
+void mysqlnd_azure_event_begin(MYSQLND_AZURE_CONNECT_EVENT* event, const char* host, const char* user, unsigned int port)
+{
+    memset(event, 0, sizeof(MYSQLND_AZURE_CONNECT_EVENT));
+    event->start_us = mysqlnd_azure_now_us();
+    event->host = host;
+    event->user = user;
+    event->port = port;
+
+    MYSQLND_AZURE_G(connectEvent) = event;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_event_end */
+void mysqlnd_azure_event_end(MYSQLND_AZURE_CONNECT_EVENT* event, enum_func_status ret, const MYSQLND_ERROR_INFO* error_info)
+{
+    zend_bool sampled = FALSE;
+
+    MYSQLND_AZURE_G(connectEvent) = NULL;
+
+    event->total_us = mysqlnd_azure_now_us() - event->start_us;
+    if (ret == FAIL && error_info) {
+        event->error_no = error_info->error_no;
+        strlcpy(event->sqlstate, error_info->sqlstate, sizeof(event->sqlstate));
+    }
+    mysqlnd_azure_metrics_connect(event, ret);
+    mysqlnd_azure_trace_connect(event, ret);
+
+    if (!MYSQLND_AZURE_G(logOutput)) {
+        return;
+    }
+
+    sampled = mysqlnd_azure_event_sampled(MYSQLND_AZURE_G(logEventSampleRate));
+    if (sampled || (ret == FAIL && MYSQLND_AZURE_G(logEventOnError))) {
+        mysqlnd_azure_event_write(event, ret, sampled);
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_event_phase_begin */
+void mysqlnd_azure_event_phase_begin(mysqlnd_azure_connect_phase phase)
+{
+    MYSQLND_AZURE_CONNECT_EVENT* event = MYSQLND_AZURE_G(connectEvent);
+    if (event) {
+        event->phase_start_us[phase] = mysqlnd_azure_now_us();
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_event_phase_end */
+void mysqlnd_azure_event_phase_end(mysqlnd_azure_connect_phase phase)
+{
+    MYSQLND_AZURE_CONNECT_EVENT* event = MYSQLND_AZURE_G(connectEvent);
+    if (event && event->phase_start_us[phase]) {
+        uint64_t now = mysqlnd_azure_now_us();
+        //a phase may run more than once (e.g. cached target, then full round), durations add up
+        event->phase_us[phase] += now - event->phase_start_us[phase];
+        //and every run is a span of its own
+        if (event->span_count < MAX_CONNECT_SPANS) {
+            event->spans[event->span_count].phase = phase;
+            event->spans[event->span_count].start_us = event->phase_start_us[phase];
+            event->spans[event->span_count].end_us = now;
+            event->span_count++;
+        }
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_event_set_path */
+void mysqlnd_azure_event_set_path(mysqlnd_azure_connect_path path)
+{
+    if (MYSQLND_AZURE_G(connectEvent)) {
+        MYSQLND_AZURE_G(connectEvent)->path = path;
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_event_set_target */
+void mysqlnd_azure_event_set_target(const char* host, const char* user, unsigned int port)
+{
+    MYSQLND_AZURE_CONNECT_EVENT* event = MYSQLND_AZURE_G(connectEvent);
+    if (event) {
+        strlcpy(event->target_host, host ? host : "", sizeof(event->target_host));
+        strlcpy(event->target_user, user ? user : "", sizeof(event->target_user));
+        event->target_port = port;
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_event_set_redirect_error */
+void mysqlnd_azure_event_set_redirect_error(unsigned int error_no)
+{
+    if (MYSQLND_AZURE_G(connectEvent)) {
+        MYSQLND_AZURE_G(connectEvent)->redirect_error_no = error_no;
+    }
+}
+/* }}} */
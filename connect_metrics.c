@@ -0,0 +1,436 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php_mysqlnd_azure.h"
+#include "mysqlnd_azure.h"
+#include "zend_smart_str.h"
+#include "ext/mysqlnd/mysqlnd_structs.h"
+#include "utils.h"
+#ifndef PHP_WIN32
+#include <sched.h>
+#endif
+
+/*
+  Connect counters of the plugin, rendered in the Prometheus text exposition format by
+  mysqlnd_azure_metrics(). They are kept in a shared region where there is one (see
+  mysqlnd_azure_shm.c), so every worker of an FPM pool adds to the same numbers and one
+  scrape of any worker shows the whole pool. Otherwise they count for the current process.
+
+  All counters are monotonic, updated with relaxed atomic adds; a scrape running
+  concurrently with connects may see a histogram bucket one ahead of its _count.
+
+  The connects and durations are also counted per server, the (host, port) the application
+  connected to. The first METRIC_HOSTS servers seen get a slot for good, every later one is
+  counted in the slot labelled host="other", so the number of series stays bounded.
+*/
+
+/* upper bounds of the connect duration buckets, in microseconds and as le label; +Inf is implicit */
+static const uint64_t duration_buckets_us[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000
+};
+static const char* const duration_labels[] = {
+    "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1", "2.5", "5", "+Inf"
+};
+#define DURATION_BUCKETS (sizeof(duration_buckets_us) / sizeof(duration_buckets_us[0]))
+
+#define METRIC_PATHS        (AZURE_PATH_FALLBACK + 1)
+#define METRIC_HOSTS        16
+#define METRIC_HOST_OTHER   METRIC_HOSTS
+
+#define HOST_SLOT_FREE      0
+#define HOST_SLOT_CLAIMING  1
+#define HOST_SLOT_READY     2
+#define HOST_SLOT_SPINS     100     /* yields to wait for another worker filling in a slot, then count in other */
+
+typedef enum _mysqlnd_azure_cache_result {
+    CACHE_RESULT_HIT = 0,
+    CACHE_RESULT_MISS,
+    CACHE_RESULT_STALE,
+    CACHE_RESULT_COUNT
+} mysqlnd_azure_cache_result;
+
+typedef enum _mysqlnd_azure_failure_reason {
+    FAILURE_NETWORK = 0,
+    FAILURE_AUTH,
+    FAILURE_TLS,
+    FAILURE_TOO_MANY_CONNECTIONS,
+    FAILURE_OTHER,
+    FAILURE_COUNT
+} mysqlnd_azure_failure_reason;
+
+/* per server counters; host and port are written once, before state turns HOST_SLOT_READY */
+typedef struct st_mysqlnd_azure_host_metrics {
+    volatile uint32_t state;
+    unsigned int port;
+    char host[MAX_REDIRECT_HOST_LEN + 1];
+    volatile uint64_t connects[METRIC_PATHS][2];            /* [path][success] */
+    volatile uint64_t duration[DURATION_BUCKETS + 1];
+    volatile uint64_t duration_sum_us;
+} MYSQLND_AZURE_HOST_METRICS;
+
+typedef struct st_mysqlnd_azure_metrics {
+    volatile uint64_t connects[METRIC_PATHS][2];            /* [path][success] */
+    volatile uint64_t cache_lookups[CACHE_RESULT_COUNT];
+    volatile uint64_t failures[FAILURE_COUNT];
+    volatile uint64_t duration[METRIC_PATHS][DURATION_BUCKETS + 1];
+    volatile uint64_t duration_sum_us[METRIC_PATHS];
+    volatile uint64_t counters[AZURE_METRIC_COUNT];
+    MYSQLND_AZURE_HOST_METRICS hosts[METRIC_HOSTS + 1];     /* the last one is other */
+} MYSQLND_AZURE_METRICS;
+
+static const char* const path_labels[METRIC_PATHS] = { "none", "gateway", "cache", "redirect", "fallback" };
+static const char* const cache_labels[CACHE_RESULT_COUNT] = { "hit", "miss", "stale" };
+static const char* const failure_labels[FAILURE_COUNT] = { "network", "auth", "tls", "too_many_connections", "other" };
+
+static MYSQLND_AZURE_METRICS* metrics = NULL;
+static zend_bool metrics_shared = FALSE;
+
+/* {{{ metrics_failure_reason */
+static mysqlnd_azure_failure_reason metrics_failure_reason(unsigned int error_no)
+{
+    switch (error_no) {
+        case 2002: /* CR_CONNECTION_ERROR */
+        case 2003: /* CR_CONN_HOST_ERROR */
+        case 2005: /* CR_UNKNOWN_HOST */
+        case 2006: /* CR_SERVER_GONE_ERROR */
+        case 2013: /* CR_SERVER_LOST */
+        case 2055: /* CR_SERVER_LOST_EXTENDED */
+            return FAILURE_NETWORK;
+        case 1044: /* ER_DBACCESS_DENIED_ERROR */
+        case 1045: /* ER_ACCESS_DENIED_ERROR */
+        case 1698: /* ER_ACCESS_DENIED_NO_PASSWORD_ERROR */
+            return FAILURE_AUTH;
+        case 2026: /* CR_SSL_CONNECTION_ERROR */
+            return FAILURE_TLS;
+        case 1040: /* ER_CON_COUNT_ERROR */
+        case 1203: /* ER_TOO_MANY_USER_CONNECTIONS */
+            return FAILURE_TOO_MANY_CONNECTIONS;
+        default:
+            return FAILURE_OTHER;
+    }
+}
+/* }}} */
+
+/* {{{ metrics_host_slot, the slot of host:port, claiming a free one for a new server */
+static MYSQLND_AZURE_HOST_METRICS* metrics_host_slot(const char* host, unsigned int port)
+{
+    int i, spins;
+
+    if (host == NULL || strlen(host) > MAX_REDIRECT_HOST_LEN) {
+        return &metrics->hosts[METRIC_HOST_OTHER];
+    }
+    for (i = 0; i < METRIC_HOSTS; i++) {
+        MYSQLND_AZURE_HOST_METRICS* slot = &metrics->hosts[i];
+        uint32_t state = mysqlnd_azure_atomic_load_u32(&slot->state);
+
+        if (state == HOST_SLOT_FREE && mysqlnd_azure_atomic_cas_u32(&slot->state, HOST_SLOT_FREE, HOST_SLOT_CLAIMING)) {
+            strcpy(slot->host, host);
+            slot->port = port;
+            mysqlnd_azure_atomic_store_u32(&slot->state, HOST_SLOT_READY);
+            return slot;
+        }
+        //the slot may be filled in with this very server, wait for it rather than take a second slot
+        for (spins = 0; (state = mysqlnd_azure_atomic_load_u32(&slot->state)) == HOST_SLOT_CLAIMING && spins < HOST_SLOT_SPINS; spins++) {
+#ifndef PHP_WIN32
+            sched_yield();
+#else
+            SwitchToThread();
+#endif
+        }
+        if (state != HOST_SLOT_READY) {
+            break;
+        }
+        if (slot->port == port && strcmp(slot->host, host) == 0) {
+            return slot;
+        }
+    }
+    return &metrics->hosts[METRIC_HOST_OTHER];
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_metrics_connect, account one finished connect, called from mysqlnd_azure_event_end */
+void mysqlnd_azure_metrics_connect(const MYSQLND_AZURE_CONNECT_EVENT* event, enum_func_status ret)
+{
+    MYSQLND_AZURE_HOST_METRICS* host;
+    unsigned int bucket = 0;
+
+    if (metrics == NULL) {
+        return;
+    }
+
+    mysqlnd_azure_atomic_inc_u64(&metrics->connects[event->path][ret == PASS ? 1 : 0]);
+    //a cache lookup only happens when redirect is enabled for the connect
+    if (event->phase_start_us[AZURE_PHASE_CACHE_LOOKUP]) {
+        mysqlnd_azure_atomic_inc_u64(&metrics->cache_lookups[!event->cache_found ? CACHE_RESULT_MISS : (event->cache_failed ? CACHE_RESULT_STALE : CACHE_RESULT_HIT)]);
+    }
+    if (ret == FAIL) {
+        mysqlnd_azure_atomic_inc_u64(&metrics->failures[metrics_failure_reason(event->error_no)]);
+    }
+
+    while (bucket < DURATION_BUCKETS && event->total_us > duration_buckets_us[bucket]) {
+        bucket++;
+    }
+    mysqlnd_azure_atomic_inc_u64(&metrics->duration[event->path][bucket]);
+    mysqlnd_azure_atomic_add_u64(&metrics->duration_sum_us[event->path], event->total_us);
+
+    host = metrics_host_slot(event->host, event->port);
+    mysqlnd_azure_atomic_inc_u64(&host->connects[event->path][ret == PASS ? 1 : 0]);
+    mysqlnd_azure_atomic_inc_u64(&host->duration[bucket]);
+    mysqlnd_azure_atomic_add_u64(&host->duration_sum_us, event->total_us);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_metrics_add */
+void mysqlnd_azure_metrics_add(mysqlnd_azure_metric counter, uint64_t n)
+{
+    if (metrics != NULL && n) {
+        mysqlnd_azure_atomic_add_u64(&metrics->counters[counter], n);
+    }
+}
+/* }}} */
+
+/* {{{ metrics_header */
+static void metrics_header(smart_str* buf, const char* name, const char* type, const char* help)
+{
+    smart_str_appends(buf, "# HELP ");
+    smart_str_appends(buf, name);
+    smart_str_appendc(buf, ' ');
+    smart_str_appends(buf, help);
+    smart_str_appends(buf, "\n# TYPE ");
+    smart_str_appends(buf, name);
+    smart_str_appendc(buf, ' ');
+    smart_str_appends(buf, type);
+    smart_str_appendc(buf, '\n');
+}
+/* }}} */
+
+/* {{{ metrics_sample, one line: name{label="value"[,label2="value2"]} n */
+static void metrics_sample(smart_str* buf, const char* name, const char* label, const char* value, const char* label2, const char* value2, uint64_t n)
+{
+    smart_str_appends(buf, name);
+    if (label) {
+        smart_str_appendc(buf, '{');
+        smart_str_appends(buf, label);
+        smart_str_appends(buf, "=\"");
+        smart_str_appends(buf, value);
+        smart_str_appendc(buf, '"');
+        if (label2) {
+            smart_str_appendc(buf, ',');
+            smart_str_appends(buf, label2);
+            smart_str_appends(buf, "=\"");
+            smart_str_appends(buf, value2);
+            smart_str_appendc(buf, '"');
+        }
+        smart_str_appendc(buf, '}');
+    }
+    smart_str_appendc(buf, ' ');
+    smart_str_append_unsigned(buf, (zend_ulong)n);
+    smart_str_appendc(buf, '\n');
+}
+/* }}} */
+
+/* {{{ metrics_host_labels, host="..",port=".." of a slot, with \\ and " escaped as the text format wants */
+static void metrics_host_labels(smart_str* buf, const MYSQLND_AZURE_HOST_METRICS* slot, zend_bool other)
+{
+    const char* p;
+
+    smart_str_appends(buf, "host=\"");
+    if (other) {
+        smart_str_appends(buf, "other\",port=\"\"");
+        return;
+    }
+    for (p = slot->host; *p; p++) {
+        if (*p == '\\' || *p == '"') {
+            smart_str_appendc(buf, '\\');
+        }
+        smart_str_appendc(buf, *p);
+    }
+    smart_str_appends(buf, "\",port=\"");
+    smart_str_append_unsigned(buf, (zend_ulong)slot->port);
+    smart_str_appendc(buf, '"');
+}
+/* }}} */
+
+/* {{{ metrics_host_sample, one line: name{host="h",port="p"[,label="value"][,label2="value2"]} n */
+static void metrics_host_sample(smart_str* buf, const char* name, const smart_str* host_labels, const char* label, const char* value, const char* label2, const char* value2, uint64_t n)
+{
+    smart_str_appends(buf, name);
+    smart_str_appendc(buf, '{');
+    smart_str_append_smart_str(buf, host_labels);
+    if (label) {
+        smart_str_appendc(buf, ',');
+        smart_str_appends(buf, label);
+        smart_str_appends(buf, "=\"");
+        smart_str_appends(buf, value);
+        smart_str_appendc(buf, '"');
+    }
+    if (label2) {
+        smart_str_appendc(buf, ',');
+        smart_str_appends(buf, label2);
+        smart_str_appends(buf, "=\"");
+        smart_str_appends(buf, value2);
+        smart_str_appendc(buf, '"');
+    }
+    smart_str_appends(buf, "} ");
+    smart_str_append_unsigned(buf, (zend_ulong)n);
+    smart_str_appendc(buf, '\n');
+}
+/* }}} */
+
+/* {{{ metrics_render_hosts, the per server counters of the slots in use and of other */
+static void metrics_render_hosts(smart_str* buf, const MYSQLND_AZURE_METRICS* snapshot)
+{
+    smart_str labels[METRIC_HOSTS + 1];
+    char sum[48];
+    int slot, path, i;
+
+    //host and port do not change once the slot is ready, so they are read from the live slot
+    for (slot = 0; slot <= METRIC_HOSTS; slot++) {
+        memset(&labels[slot], 0, sizeof(smart_str));
+        if (slot == METRIC_HOST_OTHER || mysqlnd_azure_atomic_load_u32(&metrics->hosts[slot].state) == HOST_SLOT_READY) {
+            metrics_host_labels(&labels[slot], &metrics->hosts[slot], slot == METRIC_HOST_OTHER);
+            smart_str_0(&labels[slot]);
+        }
+    }
+
+    metrics_header(buf, "mysqlnd_azure_host_connects_total", "counter", "Connects by the server (host, port) connected to, path and outcome; servers beyond the first 16 are counted as host=\"other\".");
+    for (slot = 0; slot <= METRIC_HOSTS; slot++) {
+        if (labels[slot].s == NULL) {
+            continue;
+        }
+        for (path = 0; path < METRIC_PATHS; path++) {
+            metrics_host_sample(buf, "mysqlnd_azure_host_connects_total", &labels[slot], "path", path_labels[path], "outcome", "success", snapshot->hosts[slot].connects[path][1]);
+            metrics_host_sample(buf, "mysqlnd_azure_host_connects_total", &labels[slot], "path", path_labels[path], "outcome", "failure", snapshot->hosts[slot].connects[path][0]);
+        }
+    }
+
+    metrics_header(buf, "mysqlnd_azure_host_connect_duration_seconds", "histogram", "Duration of connects by the server (host, port) connected to.");
+    for (slot = 0; slot <= METRIC_HOSTS; slot++) {
+        uint64_t cumulative = 0;
+        if (labels[slot].s == NULL) {
+            continue;
+        }
+        for (i = 0; i <= (int)DURATION_BUCKETS; i++) {
+            cumulative += snapshot->hosts[slot].duration[i];
+            metrics_host_sample(buf, "mysqlnd_azure_host_connect_duration_seconds_bucket", &labels[slot], "le", duration_labels[i], NULL, NULL, cumulative);
+        }
+        snprintf(sum, sizeof(sum), "%llu.%06llu\n", (unsigned long long)(snapshot->hosts[slot].duration_sum_us / 1000000), (unsigned long long)(snapshot->hosts[slot].duration_sum_us % 1000000));
+        smart_str_appends(buf, "mysqlnd_azure_host_connect_duration_seconds_sum{");
+        smart_str_append_smart_str(buf, &labels[slot]);
+        smart_str_appends(buf, "} ");
+        smart_str_appends(buf, sum);
+        metrics_host_sample(buf, "mysqlnd_azure_host_connect_duration_seconds_count", &labels[slot], NULL, NULL, NULL, NULL, cumulative);
+        smart_str_free(&labels[slot]);
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_metrics_render, all counters in Prometheus text format */
+void mysqlnd_azure_metrics_render(smart_str* buf)
+{
+    MYSQLND_AZURE_METRICS snapshot;
+    char sum[48];
+    int path, i;
+
+    if (metrics == NULL) {
+        return;
+    }
+    memcpy(&snapshot, (const void*)metrics, sizeof(snapshot));
+
+    metrics_header(buf, "mysqlnd_azure_connects_total", "counter", "Connects by the path they took and their outcome.");
+    for (path = 0; path < METRIC_PATHS; path++) {
+        metrics_sample(buf, "mysqlnd_azure_connects_total", "path", path_labels[path], "outcome", "success", snapshot.connects[path][1]);
+        metrics_sample(buf, "mysqlnd_azure_connects_total", "path", path_labels[path], "outcome", "failure", snapshot.connects[path][0]);
+    }
+
+    metrics_header(buf, "mysqlnd_azure_redirect_cache_lookups_total", "counter", "Redirect cache lookups; stale is a hit whose target could not be connected.");
+    for (i = 0; i < CACHE_RESULT_COUNT; i++) {
+        metrics_sample(buf, "mysqlnd_azure_redirect_cache_lookups_total", "result", cache_labels[i], NULL, NULL, snapshot.cache_lookups[i]);
+    }
+
+    metrics_header(buf, "mysqlnd_azure_connect_failures_total", "counter", "Failed connects by the reason of the error returned.");
+    for (i = 0; i < FAILURE_COUNT; i++) {
+        metrics_sample(buf, "mysqlnd_azure_connect_failures_total", "reason", failure_labels[i], NULL, NULL, snapshot.failures[i]);
+    }
+
+    metrics_header(buf, "mysqlnd_azure_connect_duration_seconds", "histogram", "Duration of connects by path.");
+    for (path = 0; path < METRIC_PATHS; path++) {
+        uint64_t cumulative = 0;
+        for (i = 0; i <= (int)DURATION_BUCKETS; i++) {
+            cumulative += snapshot.duration[path][i];
+            metrics_sample(buf, "mysqlnd_azure_connect_duration_seconds_bucket", "path", path_labels[path], "le", duration_labels[i], cumulative);
+        }
+        //no %f, the decimal point would follow the locale
+        snprintf(sum, sizeof(sum), "%llu.%06llu\n", (unsigned long long)(snapshot.duration_sum_us[path] / 1000000), (unsigned long long)(snapshot.duration_sum_us[path] % 1000000));
+        smart_str_appends(buf, "mysqlnd_azure_connect_duration_seconds_sum{path=\"");
+        smart_str_appends(buf, path_labels[path]);
+        smart_str_appends(buf, "\"} ");
+        smart_str_appends(buf, sum);
+        metrics_sample(buf, "mysqlnd_azure_connect_duration_seconds_count", "path", path_labels[path], NULL, NULL, cumulative);
+    }
+
+    metrics_render_hosts(buf, &snapshot);
+
+    metrics_header(buf, "mysqlnd_azure_reconnects_total", "counter", "In place reconnects of lost connections (mysqlnd_azure.autoReconnect).");
+    metrics_sample(buf, "mysqlnd_azure_reconnects_total", "outcome", "success", NULL, NULL, snapshot.counters[AZURE_METRIC_RECONNECT_OK]);
+    metrics_sample(buf, "mysqlnd_azure_reconnects_total", "outcome", "failure", NULL, NULL, snapshot.counters[AZURE_METRIC_RECONNECT_FAILED]);
+
+    metrics_header(buf, "mysqlnd_azure_rotations_total", "counter", "Connections reopened on reuse after mysqlnd_azure.maxConnectionLifetime.");
+    metrics_sample(buf, "mysqlnd_azure_rotations_total", "outcome", "success", NULL, NULL, snapshot.counters[AZURE_METRIC_ROTATE_OK]);
+    metrics_sample(buf, "mysqlnd_azure_rotations_total", "outcome", "failure", NULL, NULL, snapshot.counters[AZURE_METRIC_ROTATE_FAILED]);
+
+    metrics_header(buf, "mysqlnd_azure_inferred_connects_total", "counter", "Connects of users not cached yet straight to the target inferred from other users of the server.");
+    metrics_sample(buf, "mysqlnd_azure_inferred_connects_total", "outcome", "success", NULL, NULL, snapshot.counters[AZURE_METRIC_INFER_OK]);
+    metrics_sample(buf, "mysqlnd_azure_inferred_connects_total", "outcome", "failure", NULL, NULL, snapshot.counters[AZURE_METRIC_INFER_FAILED]);
+
+    metrics_header(buf, "mysqlnd_azure_admission_total", "counter", "New connects held back by mysqlnd_azure.connectRate: delayed until a token was due, or rejected.");
+    metrics_sample(buf, "mysqlnd_azure_admission_total", "outcome", "delayed", NULL, NULL, snapshot.counters[AZURE_METRIC_ADMISSION_DELAYED]);
+    metrics_sample(buf, "mysqlnd_azure_admission_total", "outcome", "rejected", NULL, NULL, snapshot.counters[AZURE_METRIC_ADMISSION_REJECTED]);
+
+    metrics_header(buf, "mysqlnd_azure_probe_dropped_entries_total", "counter", "Redirect cache entries which lost a target because it failed a health probe.");
+    metrics_sample(buf, "mysqlnd_azure_probe_dropped_entries_total", NULL, NULL, NULL, NULL, snapshot.counters[AZURE_METRIC_PROBE_DROPPED]);
+
+    metrics_header(buf, "mysqlnd_azure_metrics_shared", "gauge", "1 when the counters are shared by all workers of the master process, 0 when they are per process.");
+    metrics_sample(buf, "mysqlnd_azure_metrics_shared", NULL, NULL, NULL, NULL, metrics_shared ? 1 : 0);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_metrics_startup, called at MINIT */
+void mysqlnd_azure_metrics_startup()
+{
+    metrics = mysqlnd_azure_shm_alloc(sizeof(MYSQLND_AZURE_METRICS));
+    metrics_shared = metrics != NULL;
+    if (metrics == NULL) {
+        metrics = AZURE_PECALLOC(1, sizeof(MYSQLND_AZURE_METRICS), 1, AZURE_MEM_TABLES);
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_metrics_shutdown, called at MSHUTDOWN before the shared regions are unmapped */
+void mysqlnd_azure_metrics_shutdown()
+{
+    if (metrics != NULL && !metrics_shared) {
+        AZURE_PEFREE(metrics, sizeof(MYSQLND_AZURE_METRICS), 1, AZURE_MEM_TABLES);
+    }
+    metrics = NULL;
+}
+/* }}} */
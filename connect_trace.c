@@ -0,0 +1,284 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php_mysqlnd_azure.h"
+#include "mysqlnd_azure.h"
+#include "SAPI.h"
+#include "zend_smart_str.h"
+#include "ext/standard/php_random.h"
+#include "ext/mysqlnd/mysqlnd_structs.h"
+
+#ifdef PHP_WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "utils.h"
+
+/*
+  Trace spans of mysqlnd_azure::connect, written to mysqlnd_azure.traceFile as OTLP-JSON
+  (one ExportTraceServiceRequest per line, the OpenTelemetry file exporter format), for a
+  collector's filelog/otlpjsonfile receiver to pick up. The extension itself never talks to
+  the network for this.
+
+  Every connect is one client span "mysqlnd_azure.connect" with a child span per timed phase
+  (see connect_event.c), so a phase run twice, like the redirect handshake after a failed
+  cached target, shows up twice. The trace id is the one set with
+  mysqlnd_azure_set_trace_parent() in the current request, else a new one per connect.
+
+  Spans are buffered per process and written in batches of mysqlnd_azure.traceBatchSize
+  connects, and at the end of every request.
+*/
+
+/* {{{ trace_random_hex */
+static void trace_random_hex(char* out, size_t bytes)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char raw[16];
+    size_t i;
+
+    if (php_random_bytes_silent(raw, bytes) == FAILURE) {
+        //no CSPRNG at hand, uniqueness is all a span id needs
+        uint64_t seed = mysqlnd_azure_now_us() ^ ((uint64_t)getpid() << 32);
+        for (i = 0; i < bytes; i++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            raw[i] = (unsigned char)(seed >> 56);
+        }
+    }
+    for (i = 0; i < bytes; i++) {
+        out[2 * i] = hex[raw[i] >> 4];
+        out[2 * i + 1] = hex[raw[i] & 0xf];
+    }
+    out[2 * bytes] = '\0';
+}
+/* }}} */
+
+/* {{{ trace_hex_digit, W3C trace context only allows lowercase */
+static zend_bool trace_hex_digit(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+}
+/* }}} */
+
+/* {{{ trace_is_hex, exactly len lowercase hex digits, not all zero */
+static zend_bool trace_is_hex(const char* str, size_t len)
+{
+    zend_bool nonzero = FALSE;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (!trace_hex_digit(str[i])) {
+            return FALSE;
+        }
+        nonzero |= str[i] != '0';
+    }
+    return nonzero;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_trace_set_parent
+  Parent context for the connects of the current request, from a W3C traceparent header
+  "00-<32 hex trace id>-<16 hex parent span id>-<2 hex flags>". Returns FAIL when it does not parse.
+*/
+enum_func_status mysqlnd_azure_trace_set_parent(const char* traceparent, size_t len)
+{
+    unsigned int flags;
+
+    //version 00 is 55 characters, later versions may append fields after another '-'
+    if (len < 55 || (len > 55 && traceparent[55] != '-')
+        || traceparent[2] != '-' || traceparent[35] != '-' || traceparent[52] != '-'
+        || !trace_hex_digit(traceparent[0]) || !trace_hex_digit(traceparent[1])
+        || strncmp(traceparent, "ff", 2) == 0 || (strncmp(traceparent, "00", 2) == 0 && len != 55)
+        || !trace_is_hex(traceparent + 3, 32) || !trace_is_hex(traceparent + 36, 16)
+        || !trace_hex_digit(traceparent[53]) || !trace_hex_digit(traceparent[54])) {
+        return FAIL;
+    }
+
+    memcpy(MYSQLND_AZURE_G(traceId), traceparent + 3, 32);
+    MYSQLND_AZURE_G(traceId)[32] = '\0';
+    memcpy(MYSQLND_AZURE_G(traceParentSpanId), traceparent + 36, 16);
+    MYSQLND_AZURE_G(traceParentSpanId)[16] = '\0';
+    sscanf(traceparent + 53, "%2x", &flags);
+    MYSQLND_AZURE_G(traceSampled) = (flags & 0x01) != 0;
+
+    return PASS;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_trace_reset_parent, called at request start */
+void mysqlnd_azure_trace_reset_parent()
+{
+    MYSQLND_AZURE_G(traceId)[0] = '\0';
+    MYSQLND_AZURE_G(traceParentSpanId)[0] = '\0';
+    MYSQLND_AZURE_G(traceSampled) = TRUE;
+}
+/* }}} */
+
+/* {{{ trace_append_attr */
+static void trace_append_attr(smart_str* buf, zend_bool first, const char* key, const char* str_value, zend_long int_value)
+{
+    if (!first) {
+        smart_str_appendc(buf, ',');
+    }
+    smart_str_appends(buf, "{\"key\":\"");
+    smart_str_appends(buf, key);
+    if (str_value) {
+        smart_str_appends(buf, "\",\"value\":{\"stringValue\":");
+        mysqlnd_azure_event_append_json_string(buf, str_value);
+        smart_str_appends(buf, "}}");
+    } else {
+        //OTLP-JSON carries 64 bit integers as strings
+        smart_str_appends(buf, "\",\"value\":{\"intValue\":\"");
+        smart_str_append_long(buf, int_value);
+        smart_str_appends(buf, "\"}}");
+    }
+}
+/* }}} */
+
+/* {{{ trace_append_span */
+static void trace_append_span(smart_str* buf, const char* trace_id, const char* span_id, const char* parent_id,
+                              const char* name, int kind, uint64_t start_us, uint64_t end_us)
+{
+    char nanos[32];
+
+    smart_str_appends(buf, "{\"traceId\":\"");
+    smart_str_appends(buf, trace_id);
+    smart_str_appends(buf, "\",\"spanId\":\"");
+    smart_str_appends(buf, span_id);
+    smart_str_appends(buf, "\",\"parentSpanId\":\"");
+    smart_str_appends(buf, parent_id);
+    smart_str_appends(buf, "\",\"name\":\"");
+    smart_str_appends(buf, name);
+    smart_str_appends(buf, "\",\"kind\":");
+    smart_str_append_long(buf, kind);
+    snprintf(nanos, sizeof(nanos), "%llu000", (unsigned long long)start_us);
+    smart_str_appends(buf, ",\"startTimeUnixNano\":\"");
+    smart_str_appends(buf, nanos);
+    snprintf(nanos, sizeof(nanos), "%llu000", (unsigned long long)end_us);
+    smart_str_appends(buf, "\",\"endTimeUnixNano\":\"");
+    smart_str_appends(buf, nanos);
+    smart_str_appendc(buf, '"');
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_trace_connect, buffer the spans of one finished connect */
+void mysqlnd_azure_trace_connect(const MYSQLND_AZURE_CONNECT_EVENT* event, enum_func_status ret)
+{
+    smart_str* buf = &MYSQLND_AZURE_G(traceBuffer);
+    char trace_id[33], root_id[17], span_id[17];
+    unsigned int i;
+
+    if (!MYSQLND_AZURE_G(traceFile) || !MYSQLND_AZURE_G(traceFile)[0] || !MYSQLND_AZURE_G(traceSampled)) {
+        return;
+    }
+
+    if (MYSQLND_AZURE_G(traceId)[0]) {
+        strcpy(trace_id, MYSQLND_AZURE_G(traceId));
+    } else {
+        trace_random_hex(trace_id, 16);
+    }
+    trace_random_hex(root_id, 8);
+
+    if (MYSQLND_AZURE_G(traceBuffered) > 0) {
+        smart_str_appendc(buf, ',');
+    }
+
+    //SPAN_KIND_CLIENT for the connect, SPAN_KIND_INTERNAL for its phases
+    trace_append_span(buf, trace_id, root_id, MYSQLND_AZURE_G(traceParentSpanId), "mysqlnd_azure.connect", 3,
+                      event->start_us, event->start_us + event->total_us);
+    smart_str_appends(buf, ",\"attributes\":[");
+    trace_append_attr(buf, TRUE, "db.system", "mysql", 0);
+    trace_append_attr(buf, FALSE, "server.address", event->host ? event->host : "", 0);
+    trace_append_attr(buf, FALSE, "server.port", NULL, event->port);
+    trace_append_attr(buf, FALSE, "db.user", event->user ? event->user : "", 0);
+    trace_append_attr(buf, FALSE, "mysqlnd_azure.path", mysqlnd_azure_event_path_name(event->path), 0);
+    trace_append_attr(buf, FALSE, "mysqlnd_azure.cache", !event->cache_found ? "miss" : (event->cache_failed ? "stale" : "hit"), 0);
+    if (event->target_host[0]) {
+        trace_append_attr(buf, FALSE, "mysqlnd_azure.target.address", event->target_host, 0);
+        trace_append_attr(buf, FALSE, "mysqlnd_azure.target.port", NULL, event->target_port);
+    }
+    if (event->redirect_error_no) {
+        trace_append_attr(buf, FALSE, "mysqlnd_azure.redirect_errno", NULL, event->redirect_error_no);
+    }
+    if (event->error_no) {
+        trace_append_attr(buf, FALSE, "error.type", NULL, event->error_no);
+    }
+    smart_str_appends(buf, "],\"status\":{\"code\":");
+    //STATUS_CODE_OK / STATUS_CODE_ERROR
+    smart_str_appends(buf, ret == PASS ? "1}}" : "2}}");
+
+    for (i = 0; i < event->span_count; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "mysqlnd_azure.%s", mysqlnd_azure_event_phase_name(event->spans[i].phase));
+        trace_random_hex(span_id, 8);
+        smart_str_appendc(buf, ',');
+        trace_append_span(buf, trace_id, span_id, root_id, name, 1, event->spans[i].start_us, event->spans[i].end_us);
+        smart_str_appendc(buf, '}');
+    }
+
+    if (++MYSQLND_AZURE_G(traceBuffered) >= MYSQLND_AZURE_G(traceBatchSize)) {
+        mysqlnd_azure_trace_flush();
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_trace_flush, write the buffered spans as one OTLP-JSON line */
+void mysqlnd_azure_trace_flush()
+{
+    smart_str* buf = &MYSQLND_AZURE_G(traceBuffer);
+    smart_str line = {0};
+    FILE* file;
+
+    if (MYSQLND_AZURE_G(traceBuffered) == 0) {
+        return;
+    }
+    if (!MYSQLND_AZURE_G(traceFile) || !MYSQLND_AZURE_G(traceFile)[0]) {
+        //traceFile was cleared with connects still buffered
+        smart_str_free(buf);
+        MYSQLND_AZURE_G(traceBuffered) = 0;
+        return;
+    }
+
+    smart_str_appends(&line, "{\"resourceSpans\":[{\"resource\":{\"attributes\":[");
+    trace_append_attr(&line, TRUE, "service.name", sapi_module.name ? sapi_module.name : "php", 0);
+    trace_append_attr(&line, FALSE, "process.pid", NULL, (zend_long)getpid());
+    smart_str_appends(&line, "]},\"scopeSpans\":[{\"scope\":{\"name\":\"mysqlnd_azure\",\"version\":\"" PHP_MYSQLND_AZURE_VERSION "\"},\"spans\":[");
+    smart_str_append(&line, buf->s);
+    smart_str_appends(&line, "]}]}]}\n");
+    smart_str_0(&line);
+
+    //one fwrite of a whole line to an append mode file, so lines of several workers do not interleave
+    file = fopen(MYSQLND_AZURE_G(traceFile), "a");
+    if (file != NULL) {
+        setvbuf(file, NULL, _IONBF, 0);
+        fwrite(ZSTR_VAL(line.s), 1, ZSTR_LEN(line.s), file);
+        fclose(file);
+    } else {
+        AZURE_LOG(ALOG_LEVEL_ERR, "cannot open mysqlnd_azure.traceFile %s, %d connect traces dropped", MYSQLND_AZURE_G(traceFile), MYSQLND_AZURE_G(traceBuffered));
+    }
+
+    smart_str_free(&line);
+    smart_str_free(buf);
+    MYSQLND_AZURE_G(traceBuffered) = 0;
+}
+/* }}} */
@@ -0,0 +1,86 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+/*
+  libFuzzer target for mysqlnd_azure_parse_redirect() and mysqlnd_azure_parse_redirect_list():
+      make -C fuzz && ./fuzz/redirect_parser_fuzz fuzz/corpus
+  Without clang, "make -C fuzz replay" builds a driver that runs the corpus files
+  once under ASan/UBSan.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../redirect_parser.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    MYSQLND_AZURE_REDIRECT_LOCATION location;
+    MYSQLND_AZURE_REDIRECT_LOCATION locations[3];
+    /* copy to an exactly sized heap block, so ASan reports any read past len */
+    char* msg = malloc(size ? size : 1);
+    int consumed;
+
+    if (msg == NULL) {
+        return 0;
+    }
+    memcpy(msg, data, size);
+
+    consumed = mysqlnd_azure_parse_redirect(msg, size, &location);
+    if (consumed > 0) {
+        if ((size_t)consumed > size
+            || strlen(location.host) == 0 || strlen(location.host) > MAX_REDIRECT_HOST_LEN
+            || strlen(location.user) == 0 || strlen(location.user) > MAX_REDIRECT_USER_LEN
+            || location.port == 0 || location.port > 65535
+            || location.ext_count > MAX_REDIRECT_EXTENSIONS
+            || location.format == NULL) {
+            abort();
+        }
+    }
+    if (mysqlnd_azure_parse_redirect_list(msg, size, locations, 3) > 3) {
+        abort();
+    }
+
+    free(msg);
+    return 0;
+}
+
+#ifdef REDIRECT_PARSER_FUZZ_REPLAY
+int main(int argc, char** argv)
+{
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        FILE* f = fopen(argv[i], "rb");
+        uint8_t buf[65536];
+        size_t len;
+
+        if (f == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        len = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    printf("replayed %d inputs\n", argc - 1);
+    return 0;
+}
+#endif
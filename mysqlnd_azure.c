@@ -30,6 +30,15 @@
 #include "ext/mysqlnd/mysqlnd_connection.h"
 
 #include "utils.h"
+#include "ext/standard/php_random.h"
+#include "main/php_network.h"
+#include <ctype.h>
+#ifdef PHP_WIN32
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
 
 unsigned int mysqlnd_azure_plugin_id;
 struct st_mysqlnd_conn_data_methods org_conn_d_m;
@@ -39,6 +48,63 @@ struct st_mysqlnd_conn_methods* conn_m;
 
 FILE *logfile = NULL;
 
+/* {{{ mysqlnd_azure_conn_socket, socket of a connected conn.
+  The openssl stream refuses PHP_STREAM_AS_SOCKETD once TLS is on, which covers every redirected conn.
+  PHP_STREAM_AS_FD_FOR_SELECT hands out the same socket for plain and TLS streams.
+*/
+static zend_bool
+mysqlnd_azure_conn_socket(MYSQLND_CONN_DATA * const conn, php_socket_t* fd)
+{
+    php_stream* stream = conn->vio ? conn->vio->data->stream : NULL;
+
+    return stream && php_stream_cast(stream, PHP_STREAM_AS_FD_FOR_SELECT, (void*)fd, 0) == SUCCESS;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_tune_socket
+  TCP keepalive timing of a connected conn, from mysqlnd_azure.redirectPolicy or mysqlnd_azure.keepalive*.
+  mysqlnd already sets TCP_NODELAY and SO_KEEPALIVE on every TCP conn, but leaves the keepalive timing at
+  the system default, often 2 hours until the first probe. Options the platform lacks are skipped.
+*/
+static void
+mysqlnd_azure_tune_socket(MYSQLND_CONN_DATA * const conn, const char* host)
+{
+    unsigned int idle, interval, count;
+    php_socket_t fd;
+    int value;
+
+    mysqlnd_azure_policy_keepalive(host, &idle, &interval, &count);
+    if ((!idle && !interval && !count) || !mysqlnd_azure_conn_socket(conn, &fd)) {
+        return;
+    }
+
+    //unix sockets and named pipes refuse these, which is fine. SO_KEEPALIVE again in case the stream was opened without it
+    value = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (const char*)&value, sizeof(value));
+    if (idle) {
+        value = (int)idle;
+#if defined(TCP_KEEPIDLE)
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, (const char*)&value, sizeof(value));
+#elif defined(TCP_KEEPALIVE)
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, (const char*)&value, sizeof(value));
+#endif
+    }
+#ifdef TCP_KEEPINTVL
+    if (interval) {
+        value = (int)interval;
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, (const char*)&value, sizeof(value));
+    }
+#endif
+#ifdef TCP_KEEPCNT
+    if (count) {
+        value = (int)count;
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, (const char*)&value, sizeof(value));
+    }
+#endif
+    AZURE_LOG(ALOG_LEVEL_DBG, "keepalive for %s: idle=%us interval=%us count=%u", host ? host : "", idle, interval, count);
+}
+/* }}} */
+
 /* {{{ set_redirect_client_options */
 static enum_func_status
 set_redirect_client_options(MYSQLND_CONN_DATA * const conn, MYSQLND_CONN_DATA * const redirectConn)
@@ -85,6 +151,9 @@ set_redirect_client_options(MYSQLND_CONN_DATA * const conn, MYSQLND_CONN_DATA *
         redirectConn->protocol_frame_codec->data->flags &= ~MYSQLND_PROTOCOL_FLAG_USE_COMPRESSION;
     }
 
+    //only used by sha256_password/caching_sha2_password without TLS. Redirection always runs over TLS,
+    //where the full authentication sends the password inside the TLS session and never asks for the RSA
+    //key, so there is no public key round trip on redirect targets to save by caching fetched keys.
     ret = redirectConn->protocol_frame_codec->data->m.set_client_option(redirectConn->protocol_frame_codec, MYSQL_SERVER_PUBLIC_KEY, conn->protocol_frame_codec->data->sha256_server_public_key);
     if (ret == FAIL) goto copyFailed;
 
@@ -115,6 +184,7 @@ set_redirect_client_options(MYSQLND_CONN_DATA * const conn, MYSQLND_CONN_DATA *
                 goto copyFailed;
             }
             redirectConn->options->init_commands = new_init_commands;
+            mysqlnd_azure_mem_count(AZURE_MEM_CONN_OPTIONS, sizeof(char *) * (conn->options->num_commands));
             unsigned int i;
             char * new_command;
             for (i = 0; i < conn->options->num_commands; i++) {
@@ -125,6 +195,7 @@ set_redirect_client_options(MYSQLND_CONN_DATA * const conn, MYSQLND_CONN_DATA *
                 }
                 redirectConn->options->init_commands[i] = new_command;
                 ++redirectConn->options->num_commands;
+                mysqlnd_azure_mem_count(AZURE_MEM_CONN_OPTIONS, strlen(new_command) + 1);
             }
         }
     }
@@ -152,6 +223,7 @@ set_redirect_client_options(MYSQLND_CONN_DATA * const conn, MYSQLND_CONN_DATA *
         ZEND_HASH_FOREACH_STR_KEY_VAL(conn->options->connect_attr, key, entry_value) {
             ret = redirectConn->m->set_client_option_2d(redirectConn, MYSQL_OPT_CONNECT_ATTR_ADD, ZSTR_VAL(key), Z_STRVAL_P(entry_value));
             if (ret == FAIL) goto copyFailed;
+            mysqlnd_azure_mem_count(AZURE_MEM_CONN_OPTIONS, ZSTR_LEN(key) + Z_STRLEN_P(entry_value));
         } ZEND_HASH_FOREACH_END();
     }
 
@@ -162,226 +234,326 @@ copyFailed:
 }
 /* }}} */
 
-static int 
-mysqlnd_azure_strtoi(const char* const begin, unsigned int len)
+/* {{{ mysqlnd_azure_adapt_compression, turn on protocol compression for a conn to a cached target whose connects are slow,
+  see mysqlnd_azure.compressionThresholdMs. The connect time of the target stands in for its distance: a target in another
+  region takes several round trips longer for the TCP, TLS and auth handshake than one in the same zone */
+static void
+mysqlnd_azure_adapt_compression(MYSQLND_CONN_DATA * const redirectConn, const MYSQLND_AZURE_REDIRECT_INFO* target)
 {
-    //max length INT_MAX's char length cannot be greater than 32
-    if(len > 32) {
-        return -1;
-    }
-
-    char  str[33] = { 0 };
-    memcpy(str, begin, len);
+    zend_long threshold_ms = MYSQLND_AZURE_G(compressionThresholdMs);
 
-    //value 0
-    if(strcmp(str, "0") == 0)
-        return 0;
-
-    char *endptr;
-    long long_var = strtol(str, &endptr, 0);
-
-    //out of long range or invalid
-    if (long_var == LONG_MAX || long_var == LONG_MIN || *endptr != '\0' || long_var == 0 ) {
-        return -1;
+    //off, not measured yet, or the application asked for compression anyway
+    if (threshold_ms <= 0 || target->srtt_us == 0
+        || (redirectConn->protocol_frame_codec->data->flags & MYSQLND_PROTOCOL_FLAG_USE_COMPRESSION)) {
+        return;
     }
-
-    //out of int range
-    if (long_var < INT_MIN || long_var > INT_MAX) {
-        return -1;
+    if ((uint64_t)target->srtt_us >= (uint64_t)threshold_ms * 1000) {
+        //mysqlnd adds CLIENT_COMPRESS to the connect flags for it, or drops it when built without zlib
+        redirectConn->protocol_frame_codec->data->flags |= MYSQLND_PROTOCOL_FLAG_USE_COMPRESSION;
+        AZURE_LOG(ALOG_LEVEL_DBG, "Compression on for %s:%u, connect time %u us", target->redirect_host, target->redirect_port, target->srtt_us);
     }
-
-    return (int) long_var;
 }
+/* }}} */
 
-static zend_bool
-parse_azure_protocol(const MYSQLND_STRING * const last_message, char* redirect_host, char* redirect_user, unsigned int* p_ui_redirect_port, unsigned int* p_ui_redirect_ttl)
+/* {{{ mysqlnd_azure_unusable_ssl_file, the first of the CA/capath/cert/key files set on conn that cannot be found, NULL if all are there.
+  mysqlnd hands the paths to the stream layer, which builds a new TLS context and loads them on every connect. A missing file makes the
+  TLS setup fail for every target alike, so the caller need not repeat the attempt (and the load) against another server.
+  The stat is quiet, open_basedir must not add warnings of its own on the connect path */
+static const char*
+mysqlnd_azure_unusable_ssl_file(const MYSQLND_CONN_DATA * const conn)
 {
-    /**
-    * Azure protocol:
-    * Location: mysql://redirectedHostName:redirectedPort/user=redirectedUser&ttl=%d (where ttl is optional)
-    */
-    const char* msg_header = "Location: mysql://";
-    int msg_header_len = strlen(msg_header);
-    char* cur_pos = last_message->s + msg_header_len;
-    char* end = last_message->s + last_message->l;
-
-    char* host_begin = cur_pos, * host_end = NULL,
-        * port_begin = NULL, * port_end = NULL,
-        * user_begin = NULL, * user_end = NULL,
-        * ttl_begin = NULL, * ttl_end = NULL;
-
-    host_end = strchr(cur_pos, ':');
-    if (host_end == NULL) return FALSE;
-
-    cur_pos = host_end + 1;
-    if (cur_pos == end) return FALSE;
-
-    port_begin = cur_pos;
-    port_end = strchr(cur_pos, '/');
-    if (port_end == NULL) return FALSE;
-
-    cur_pos = port_end + 1;
-    if (cur_pos == end) return FALSE;
-
-    int user_delimiter_len = strlen("user=");
-    if (end - cur_pos <= user_delimiter_len || strncmp(cur_pos, "user=", user_delimiter_len) != 0) return FALSE;
-
-    user_begin = cur_pos + user_delimiter_len;
-    char* optional_ttl_pos = strchr(cur_pos, '&');
-    if (optional_ttl_pos == NULL) {
-        user_end = end;
+    const char* files[] = {
+        conn->vio->data->options.ssl_ca,
+        conn->vio->data->options.ssl_capath,
+        conn->vio->data->options.ssl_cert,
+        conn->vio->data->options.ssl_key,
+    };
+    php_stream_statbuf ssb;
+    size_t i;
+
+    if (!conn->vio->data->ssl) {
+        return NULL;
     }
-    else {
-        user_end = optional_ttl_pos;
-        cur_pos = user_end + 1;
-        int ttl_delimiter_len = strlen("ttl=");
-        if (end - cur_pos <= ttl_delimiter_len || strncmp(cur_pos, "ttl=", ttl_delimiter_len) != 0) return FALSE;
-
-        ttl_begin = cur_pos + ttl_delimiter_len;
-        ttl_end = end;
+    for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        if (files[i] && *files[i] && php_stream_stat_path_ex(files[i], PHP_STREAM_URL_STAT_QUIET, &ssb, NULL) != 0) {
+            return files[i];
+        }
     }
+    return NULL;
+}
+/* }}} */
 
-    if (host_end == NULL || port_end == NULL || user_end == NULL) {
-        return FALSE;
+/* {{{ mysqlnd_azure_drop_proxy_conn, close a queued gateway conn without waiting on the network: no COM_QUIT, and
+  the stream goes non-blocking first, so the TLS close_notify is only sent when it fits into the socket buffer */
+static void
+mysqlnd_azure_drop_proxy_conn(MYSQLND_CONN_DATA * conn)
+{
+    if (conn->vio && conn->vio->data->stream) {
+        php_stream_set_option(conn->vio->data->stream, PHP_STREAM_OPTION_BLOCKING, 0, NULL);
     }
+    SET_CONNECTION_STATE(&conn->state, CONN_QUIT_SENT);
+    conn->m->send_close(conn);
+    conn->m->dtor(conn);
+}
+/* }}} */
 
-    int host_len = host_end - host_begin;
-    int port_len = port_end - port_begin;
-    int user_len = user_end - user_begin;
-    int ttl_len = ttl_end == NULL ? 0 : (ttl_end - ttl_begin);
+/* {{{ mysqlnd_azure_close_proxy_conn, close the gateway conn after the redirect target took over.
+  With mysqlnd_azure.deferProxyClose > 0 it is queued instead, and dropped without waiting at request end, see
+  mysqlnd_azure_drop_proxy_conn(). A full queue drops its oldest conn first */
+static void
+mysqlnd_azure_close_proxy_conn(MYSQLND_CONN_DATA * conn)
+{
+    zend_long limit = MYSQLND_AZURE_G(deferProxyClose);
 
-    if (host_len <= 0 || port_len <= 0 || user_len <= 0 || host_len > MAX_REDIRECT_HOST_LEN || port_len > 8 || user_len > MAX_REDIRECT_USER_LEN || ttl_len > 8) {
-        return FALSE;
+    if (limit <= 0) {
+        conn->m->send_close(conn);
+        conn->m->dtor(conn);
+        return;
     }
 
-    int port = mysqlnd_azure_strtoi(port_begin, port_len);
-    if (port <= 0) {
-        return FALSE;
+    while (MYSQLND_AZURE_G(deferredCloseCount) > 0 && MYSQLND_AZURE_G(deferredCloseCount) >= limit) {
+        MYSQLND_CONN_DATA* oldest = MYSQLND_AZURE_G(deferredClose)[0];
+        MYSQLND_AZURE_G(deferredCloseCount)--;
+        memmove(MYSQLND_AZURE_G(deferredClose), MYSQLND_AZURE_G(deferredClose) + 1, MYSQLND_AZURE_G(deferredCloseCount) * sizeof(MYSQLND_CONN_DATA*));
+        mysqlnd_azure_drop_proxy_conn(oldest);
     }
-
-    if (ttl_len > 0) {
-        int ttl = mysqlnd_azure_strtoi(ttl_begin, ttl_len);
-        if (ttl < 0) {
-            return FALSE;
+    if (MYSQLND_AZURE_G(deferredCloseSize) < limit) {
+        //request memory, mysqlnd_azure_close_deferred() frees it at request end
+        MYSQLND_AZURE_G(deferredClose) = safe_erealloc(MYSQLND_AZURE_G(deferredClose), limit, sizeof(MYSQLND_CONN_DATA*), 0);
+        if (MYSQLND_AZURE_G(deferredCloseSize) > 0) {
+            mysqlnd_azure_mem_free(AZURE_MEM_DEFERRED_CLOSE, 0, MYSQLND_AZURE_G(deferredCloseSize) * sizeof(MYSQLND_CONN_DATA*));
         }
-        *p_ui_redirect_ttl = ttl;
+        mysqlnd_azure_mem_alloc(AZURE_MEM_DEFERRED_CLOSE, 0, limit * sizeof(MYSQLND_CONN_DATA*));
+        MYSQLND_AZURE_G(deferredCloseSize) = (int)limit;
     }
+    MYSQLND_AZURE_G(deferredClose)[MYSQLND_AZURE_G(deferredCloseCount)++] = conn;
+    AZURE_LOG(ALOG_LEVEL_DBG, "Proxy conn queued for close at request end, %d queued", MYSQLND_AZURE_G(deferredCloseCount));
+}
+/* }}} */
 
-    //setback the value when everything is settled
-    *p_ui_redirect_port = port;
-    memcpy(redirect_host, host_begin, host_len);
-    memcpy(redirect_user, user_begin, user_len);
+/* {{{ mysqlnd_azure_close_deferred, drop the proxy conns queued by mysqlnd_azure_close_proxy_conn */
+void
+mysqlnd_azure_close_deferred()
+{
+    int i;
 
-    return TRUE;
+    for (i = 0; i < MYSQLND_AZURE_G(deferredCloseCount); i++) {
+        mysqlnd_azure_drop_proxy_conn(MYSQLND_AZURE_G(deferredClose)[i]);
+    }
+    if (MYSQLND_AZURE_G(deferredClose)) {
+        mysqlnd_azure_mem_free(AZURE_MEM_DEFERRED_CLOSE, 0, MYSQLND_AZURE_G(deferredCloseSize) * sizeof(MYSQLND_CONN_DATA*));
+        efree(MYSQLND_AZURE_G(deferredClose));
+    }
+    MYSQLND_AZURE_G(deferredClose) = NULL;
+    MYSQLND_AZURE_G(deferredCloseCount) = 0;
+    MYSQLND_AZURE_G(deferredCloseSize) = 0;
 }
+/* }}} */
 
-static zend_bool
-parse_community_protocol(const MYSQLND_STRING * const last_message, char* redirect_host, char* redirect_user, unsigned int* p_ui_redirect_port, unsigned int* p_ui_redirect_ttl)
+/* {{{ get_redirect_info, number of redirect targets found, at most max, 0 if there is no redirect message */
+static int
+get_redirect_info(const MYSQLND_CONN_DATA * const conn, MYSQLND_AZURE_REDIRECT_LOCATION* locations, int max)
 {
     /**
+    * Get redirected server information contained in OK packet.
+    * Redirection string support following two formats (see redirect_parser.c for the registry):
+    * Azure protocol:
+    * Location: mysql://redirectedHostName:redirectedPort/user=redirectedUser&ttl=%d (where ttl is optional)
     * Community protocol:
     * Location: mysql://[redirectedHostName]:redirectedPort/?user=redirectedUser&ttl=%d\n
+    * Further targets may follow, one Location line each.
     */
-    const char* msg_header = "Location: mysql://[";
-    int msg_header_len = strlen(msg_header);
-    char* cur_pos = last_message->s + msg_header_len;
-    char* end = last_message->s + last_message->l;
 
-    char* host_begin = cur_pos, * host_end = NULL,
-        * port_begin = NULL, * port_end = NULL,
-        * user_begin = NULL, * user_end = NULL,
-        * ttl_begin = NULL, * ttl_end = NULL;
+    AZURE_LOG(ALOG_LEVEL_DBG, "mysqlnd_azure.c: get_redirect_info()");
+    if (conn->last_message.s == NULL) {
+        return 0;
+    }
+    AZURE_LOG(ALOG_LEVEL_DBG, "last message in ok packet: %.*s", (int)conn->last_message.l, conn->last_message.s);
 
-    host_end = strchr(cur_pos, ']');
-    if (host_end == NULL) return FALSE;
+    return mysqlnd_azure_parse_redirect_list(conn->last_message.s, conn->last_message.l, locations, max);
+}
+/* }}} */
 
-    cur_pos = host_end + 1;
-    if (cur_pos == end || *cur_pos != ':' || ++cur_pos == end) return FALSE;
+/* {{{ redirect_targets_from_locations, the parsed targets as cache entries want them */
+static int
+redirect_targets_from_locations(const MYSQLND_AZURE_REDIRECT_LOCATION* locations, int count, MYSQLND_AZURE_REDIRECT_INFO* targets)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        strcpy(targets[i].redirect_user, locations[i].user);
+        strcpy(targets[i].redirect_host, locations[i].host);
+        targets[i].redirect_port = locations[i].port;
+        targets[i].ttl = 0;
+        targets[i].srtt_us = 0;
+    }
+    return count;
+}
+/* }}} */
 
-    port_begin = cur_pos;
-    port_end = strchr(cur_pos, '/');
-    if (port_end == NULL) return FALSE;
+/* {{{ mysqlnd_azure_get_conn_data */
+static MYSQLND_AZURE_CONN_DATA**
+mysqlnd_azure_get_conn_data(const MYSQLND_CONN_DATA * const conn)
+{
+    return (MYSQLND_AZURE_CONN_DATA**)mysqlnd_plugin_get_plugin_connection_data_data(conn, mysqlnd_azure_plugin_id);
+}
+/* }}} */
 
-    cur_pos = port_end + 1;
-    if (cur_pos == end || *cur_pos != '?' || ++cur_pos == end) return FALSE;
+/* {{{ mysqlnd_azure_route_drop_replica, close the read replica of a primary */
+static void
+mysqlnd_azure_route_drop_replica(MYSQLND_AZURE_CONN_DATA* data)
+{
+    MYSQLND* replica = data->replica;
+    MYSQLND_AZURE_CONN_DATA** replica_data;
 
-    int user_delimiter_len = strlen("user=");
-    if (end - cur_pos <= user_delimiter_len || strncmp(cur_pos, "user=", user_delimiter_len) != 0) return FALSE;
+    if (!replica) {
+        return;
+    }
+    data->replica = NULL;
+    mysqlnd_azure_replica_release(data->replica_slot);
+    data->replica_slot = -1;
+
+    //a result set may keep the replica conn alive, it must not point to the primary any more
+    replica_data = mysqlnd_azure_get_conn_data(replica->data);
+    if (replica_data && *replica_data) {
+        (*replica_data)->primary = NULL;
+    }
+    replica->m->close(replica, MYSQLND_CLOSE_IMPLICIT);
+}
+/* }}} */
 
-    user_begin = cur_pos + user_delimiter_len;
-    user_end = strchr(cur_pos, '&');
-    if (user_end == NULL) return FALSE;
+/* {{{ mysqlnd_azure_free_conn_data */
+static void
+mysqlnd_azure_free_conn_data(const MYSQLND_CONN_DATA * const conn)
+{
+    MYSQLND_AZURE_CONN_DATA** conn_data = mysqlnd_azure_get_conn_data(conn);
 
-    cur_pos = user_end + 1;
-    if (cur_pos == end) return FALSE;
+    if (conn_data && *conn_data) {
+        MYSQLND_AZURE_CONN_DATA* data = *conn_data;
+        mysqlnd_azure_route_drop_replica(data);
+        if (data->host) {
+            AZURE_MND_PEFREE(data->host, strlen(data->host) + 1, data->persistent, AZURE_MEM_CONN_DATA);
+        }
+        if (data->user) {
+            AZURE_MND_PEFREE(data->user, strlen(data->user) + 1, data->persistent, AZURE_MEM_CONN_DATA);
+        }
+        if (data->password) {
+            ZEND_SECURE_ZERO(data->password, data->password_len);
+            AZURE_MND_PEFREE(data->password, data->password_len + 1, data->persistent, AZURE_MEM_CONN_DATA);
+        }
+        if (data->database) {
+            AZURE_MND_PEFREE(data->database, data->database_len + 1, data->persistent, AZURE_MEM_CONN_DATA);
+        }
+        if (data->socket_or_pipe) {
+            AZURE_MND_PEFREE(data->socket_or_pipe, strlen(data->socket_or_pipe) + 1, data->persistent, AZURE_MEM_CONN_DATA);
+        }
+        AZURE_MND_PEFREE(data, sizeof(MYSQLND_AZURE_CONN_DATA), data->persistent, AZURE_MEM_CONN_DATA);
+        *conn_data = NULL;
+    }
+}
+/* }}} */
 
-    int ttl_delimiter_len = strlen("ttl=");
-    if (end - cur_pos <= ttl_delimiter_len || strncmp(cur_pos, "ttl=", ttl_delimiter_len) != 0) return FALSE;
+/* {{{ mysqlnd_azure_set_expiry, when a conn opened now is reopened on reuse, up to mysqlnd_azure.connectionLifetimeJitter
+  earlier so conns opened together, e.g. by the workers of a pool after a restart, do not all rotate in the same second */
+static void
+mysqlnd_azure_set_expiry(MYSQLND_AZURE_CONN_DATA* data)
+{
+    zend_long lifetime = MYSQLND_AZURE_G(maxConnectionLifetime);
+    zend_long jitter = MYSQLND_AZURE_G(connectionLifetimeJitter);
+    zend_long offset = 0;
 
-    ttl_begin = cur_pos + ttl_delimiter_len;
-    ttl_end = strchr(cur_pos, '\n');
-    if (ttl_end == NULL) return FALSE;
+    if (lifetime <= 0) {
+        data->expires_us = 0;
+        return;
+    }
+    jitter = MIN(MAX(jitter, 0), lifetime / 2);
+    if (jitter > 0 && php_random_int_silent(0, jitter, &offset) == FAILURE) {
+        offset = 0;
+    }
+    data->expires_us = mysqlnd_azure_now_us() + (uint64_t)(lifetime - offset) * 1000000;
+}
+/* }}} */
 
-    int host_len = host_end - host_begin;
-    int port_len = port_end - port_begin;
-    int user_len = user_end - user_begin;
-    int ttl_len = ttl_end - ttl_begin;
+/* {{{ mysqlnd_azure_set_conn_data, remember the connect arguments so a lost conn can be reconnected through the gateway */
+static void
+mysqlnd_azure_set_conn_data(const MYSQLND_CONN_DATA * const conn,
+                        const MYSQLND_CSTRING hostname,
+                        const MYSQLND_CSTRING username,
+                        const MYSQLND_CSTRING password,
+                        const MYSQLND_CSTRING database,
+                        unsigned int port,
+                        const MYSQLND_CSTRING socket_or_pipe,
+                        unsigned int mysql_flags)
+{
+    MYSQLND_AZURE_CONN_DATA** conn_data = mysqlnd_azure_get_conn_data(conn);
+    MYSQLND_AZURE_CONN_DATA* data;
 
-    if (host_len <= 0 || port_len <= 0 || user_len <= 0 || ttl_len <= 0 || host_len > MAX_REDIRECT_HOST_LEN || user_len > MAX_REDIRECT_USER_LEN) {
-        return FALSE;
+    if (!conn_data) {
+        return;
     }
+    mysqlnd_azure_free_conn_data(conn);
 
-    int port = mysqlnd_azure_strtoi(port_begin, port_len);
-    if (port <= 0) {
-        return FALSE;
+    data = AZURE_MND_PECALLOC(1, sizeof(MYSQLND_AZURE_CONN_DATA), conn->persistent, AZURE_MEM_CONN_DATA);
+    if (!data) {
+        return;
     }
-
-    int ttl = mysqlnd_azure_strtoi(ttl_begin, ttl_len);
-    if (ttl < 0) {
-        return FALSE;
+    *conn_data = data;
+    data->persistent = conn->persistent;
+    data->host = AZURE_MND_PESTRNDUP(hostname.s ? hostname.s : "", hostname.s ? hostname.l : 0, conn->persistent, AZURE_MEM_CONN_DATA);
+    data->user = AZURE_MND_PESTRNDUP(username.s ? username.s : "", username.s ? username.l : 0, conn->persistent, AZURE_MEM_CONN_DATA);
+    data->password_len = password.s ? password.l : 0;
+    data->password = AZURE_MND_PESTRNDUP(password.s ? password.s : "", data->password_len, conn->persistent, AZURE_MEM_CONN_DATA);
+    data->database_len = database.s ? database.l : 0;
+    data->database = AZURE_MND_PESTRNDUP(database.s ? database.s : "", data->database_len, conn->persistent, AZURE_MEM_CONN_DATA);
+    data->socket_or_pipe = AZURE_MND_PESTRNDUP(socket_or_pipe.s ? socket_or_pipe.s : "", socket_or_pipe.s ? socket_or_pipe.l : 0, conn->persistent, AZURE_MEM_CONN_DATA);
+    data->port = port;
+    data->mysql_flags = mysql_flags;
+    data->replica_slot = -1;
+    data->last_used_us = mysqlnd_azure_now_us();
+    mysqlnd_azure_set_expiry(data);
+
+    if (!data->host || !data->user || !data->password || !data->database || !data->socket_or_pipe) {
+        mysqlnd_azure_free_conn_data(conn);
     }
-
-    //setback the value when everything is settled
-    *p_ui_redirect_port = port;
-    *p_ui_redirect_ttl = ttl;
-    memcpy(redirect_host, host_begin, host_len);
-    memcpy(redirect_user, user_begin, user_len);
-
-    return TRUE;
 }
+/* }}} */
 
-/* {{{ get_redirect_info */
-static zend_bool
-get_redirect_info(const MYSQLND_CONN_DATA * const conn, char* redirect_host, char* redirect_user, unsigned int* p_ui_redirect_port, unsigned int* p_ui_redirect_ttl)
+/* {{{ mysqlnd_azure_set_conn_login, the login of a conn after change_user, reconnects and its replica use it from now on.
+  Returns FAIL when out of memory, the conn data then still holds the old login */
+static enum_func_status
+mysqlnd_azure_set_conn_login(MYSQLND_AZURE_CONN_DATA* data, const char* user, const char* passwd, size_t passwd_len, const char* db)
 {
-    /**
-    * Get redirected server information contained in OK packet.
-    * Redirection string support following two formats:
-    * Azure protocol:
-    * Location: mysql://redirectedHostName:redirectedPort/user=redirectedUser&ttl=%d (where ttl is optional)
-    * Community protocol:
-    * Location: mysql://[redirectedHostName]:redirectedPort/?user=redirectedUser&ttl=%d\n
-    * the minimal len is 28 bytes
-    */
-
-    AZURE_LOG(ALOG_LEVEL_DBG, "mysqlnd_azure.c: get_redirect_info()");
-    AZURE_LOG(ALOG_LEVEL_DBG, "last message in ok packet: %s", conn->last_message.s);
-    const char * msg_header = "Location: mysql://";
-    int msg_header_len = strlen(msg_header);
-
-    if (conn->last_message.l < 28 || (strncmp(conn->last_message.s, msg_header, msg_header_len) != 0)) {
-        return FALSE;
-    }   
-
-    char *cur_pos = conn->last_message.s + msg_header_len;
-    if (*cur_pos == '[') {
-        return parse_community_protocol(&conn->last_message, redirect_host, redirect_user, p_ui_redirect_port, p_ui_redirect_ttl);
-    }
-    else {
-        return parse_azure_protocol(&conn->last_message, redirect_host, redirect_user, p_ui_redirect_port, p_ui_redirect_ttl);
+    size_t password_len = passwd ? passwd_len : 0;
+    size_t database_len = db ? strlen(db) : 0;
+    char* new_user = AZURE_MND_PESTRNDUP(user ? user : "", user ? strlen(user) : 0, data->persistent, AZURE_MEM_CONN_DATA);
+    char* new_password = AZURE_MND_PESTRNDUP(passwd ? passwd : "", password_len, data->persistent, AZURE_MEM_CONN_DATA);
+    char* new_database = AZURE_MND_PESTRNDUP(db ? db : "", database_len, data->persistent, AZURE_MEM_CONN_DATA);
+
+    if (!new_user || !new_password || !new_database) {
+        if (new_user) {
+            AZURE_MND_PEFREE(new_user, strlen(new_user) + 1, data->persistent, AZURE_MEM_CONN_DATA);
+        }
+        if (new_password) {
+            ZEND_SECURE_ZERO(new_password, password_len);
+            AZURE_MND_PEFREE(new_password, password_len + 1, data->persistent, AZURE_MEM_CONN_DATA);
+        }
+        if (new_database) {
+            AZURE_MND_PEFREE(new_database, database_len + 1, data->persistent, AZURE_MEM_CONN_DATA);
+        }
+        return FAIL;
     }
-   
+    AZURE_MND_PEFREE(data->user, strlen(data->user) + 1, data->persistent, AZURE_MEM_CONN_DATA);
+    ZEND_SECURE_ZERO(data->password, data->password_len);
+    AZURE_MND_PEFREE(data->password, data->password_len + 1, data->persistent, AZURE_MEM_CONN_DATA);
+    AZURE_MND_PEFREE(data->database, data->database_len + 1, data->persistent, AZURE_MEM_CONN_DATA);
+    data->user = new_user;
+    data->password = new_password;
+    data->password_len = password_len;
+    data->database = new_database;
+    data->database_len = database_len;
+    return PASS;
 }
+/* }}} */
 
 /* {{{ mysqlnd_azure_data::connect */
 MYSQLND_METHOD(mysqlnd_azure_data, connect)(MYSQLND_CONN_DATA ** pconn,
@@ -405,6 +577,8 @@ MYSQLND_METHOD(mysqlnd_azure_data, connect)(MYSQLND_CONN_DATA ** pconn,
     zend_bool local_tx_started = FALSE;
     MYSQLND_PFC * pfc = conn->protocol_frame_codec;
     MYSQLND_STRING transport = { NULL, 0 };
+    const mysqlnd_azure_redirect_mode redirect_mode = mysqlnd_azure_redirect_mode_for(hostname.s);
+    const uint64_t connect_start_us = AZURE_PROBE_NOW();
 
     DBG_ENTER("mysqlnd_conn_data::connect");
     DBG_INF_FMT("conn=%p", conn);
@@ -482,7 +656,14 @@ MYSQLND_METHOD(mysqlnd_azure_data, connect)(MYSQLND_CONN_DATA ** pconn,
 
     {
         const MYSQLND_CSTRING scheme = { transport.s, transport.l };
-        if (FAIL == conn->m->connect_handshake(conn, &scheme, &username, &password, &database, mysql_flags)) {
+        mysqlnd_azure_event_set_path(AZURE_PATH_GATEWAY);
+        mysqlnd_azure_event_phase_begin(AZURE_PHASE_GATEWAY_HANDSHAKE);
+        AZURE_PROBE2(gateway_start, hostname.s, port);
+        uint64_t gateway_start_us = AZURE_PROBE_NOW();
+        enum_func_status gatewayState = conn->m->connect_handshake(conn, &scheme, &username, &password, &database, mysql_flags);
+        AZURE_PROBE4(gateway_done, hostname.s, port, (unsigned int)(gatewayState == PASS), AZURE_PROBE_NOW() - gateway_start_us);
+        mysqlnd_azure_event_phase_end(AZURE_PHASE_GATEWAY_HANDSHAKE);
+        if (FAIL == gatewayState) {
             AZURE_LOG(ALOG_LEVEL_ERR, "First connect_handshake failed.");
             goto err;
         }
@@ -495,15 +676,23 @@ MYSQLND_METHOD(mysqlnd_azure_data, connect)(MYSQLND_CONN_DATA ** pconn,
         SET_CONNECTION_STATE(&conn->state, CONN_READY); //set ready status so the connection can be closed correctly later if redirect succeeds
 
         DBG_ENTER("[redirect]: mysqlnd_azure_data::connect::redirect");
-        char redirect_host[MAX_REDIRECT_HOST_LEN] = { 0 };
-        char redirect_user[MAX_REDIRECT_USER_LEN] = { 0 };
-        unsigned int ui_redirect_port = 0;
-        unsigned int ui_redirect_ttl = 0;
-        zend_bool serverSupportRedirect = get_redirect_info(conn, redirect_host, redirect_user, &ui_redirect_port, &ui_redirect_ttl);
+        MYSQLND_AZURE_REDIRECT_LOCATION locations[MAX_REDIRECT_TARGETS];
+        const MYSQLND_AZURE_REDIRECT_LOCATION* location = &locations[0];
+        locations[0].host[0] = locations[0].user[0] = '\0';
+        locations[0].port = 0;
+        mysqlnd_azure_event_phase_begin(AZURE_PHASE_REDIRECT_PARSE);
+        uint64_t parse_start_us = AZURE_PROBE_NOW();
+        int location_count = get_redirect_info(conn, locations, MAX_REDIRECT_TARGETS);
+        zend_bool serverSupportRedirect = location_count > 0;
+        AZURE_PROBE4(redirect_parse, hostname.s, port, (unsigned int)location_count, AZURE_PROBE_NOW() - parse_start_us);
+        mysqlnd_azure_event_phase_end(AZURE_PHASE_REDIRECT_PARSE);
+        const char* redirect_host = location->host;
+        const char* redirect_user = location->user;
+        unsigned int ui_redirect_port = location->port;
         if (!serverSupportRedirect) {
             AZURE_LOG(ALOG_LEVEL_ERR, "get_redirect_info return FALSE, please check whether your MySQL server support redirection and redirection has been turned on.");
             DBG_ENTER("[redirect]: Server does not support redirection.");
-            if(MYSQLND_AZURE_G(enableRedirect) == REDIRECT_ON) {
+            if(redirect_mode == REDIRECT_ON) {
                 //REDIRECT_ON, if redirection is not supported, abort the original connection and return error
                 conn->m->send_close(conn);
                 AZURE_LOG(ALOG_LEVEL_ERR, "mysqlnd_azure.enableRedirect: ON. Connection aborted because redirection is not enabled on the MySQL server or the network package doesn't meet meet redirection protocol.");
@@ -512,6 +701,8 @@ MYSQLND_METHOD(mysqlnd_azure_data, connect)(MYSQLND_CONN_DATA ** pconn,
             } else {
                 AZURE_LOG(ALOG_LEVEL_INFO, "mysqlnd_zaure.enableRedirect: PREFERRED. MySQL server does not support REDIRECTION, conn falls back to classical one.");
                 //REDIRECT_PREFERRED, do nothing else for redirection, just use the previous connection
+                mysqlnd_azure_event_set_path(AZURE_PATH_FALLBACK);
+                AZURE_PROBE3(fallback, hostname.s, port, AZURE_PROBE_NOW() - connect_start_us);
                 goto after_conn;
             }
         }
@@ -523,6 +714,7 @@ MYSQLND_METHOD(mysqlnd_azure_data, connect)(MYSQLND_CONN_DATA ** pconn,
         if (strcmp(redirect_host, hostname.s) == 0 && strcmp(redirect_user, username.s) == 0 && ui_redirect_port == port) {
             DBG_ENTER("[redirect]: Is using redirection, or redirection info are equal to origin, no need to redirect");
             AZURE_LOG(ALOG_LEVEL_DBG, "Is using redirection, or redirection info are equal to origin, no need to redirect.");
+            mysqlnd_azure_event_set_path(AZURE_PATH_GATEWAY);
             goto after_conn;
         }
 
@@ -533,7 +725,7 @@ MYSQLND_METHOD(mysqlnd_azure_data, connect)(MYSQLND_CONN_DATA ** pconn,
             MYSQLND* redirect_conneHandle = mysqlnd_init(MYSQLND_CLIENT_KNOWS_RSET_COPY_DATA, conn->persistent); //init MYSQLND but only need only MYSQLND_CONN_DATA here
             if(!redirect_conneHandle) {
                 DBG_ENTER("[redirect]: init redirect_conneHandle failed");
-                if(MYSQLND_AZURE_G(enableRedirect) == REDIRECT_ON) {
+                if(redirect_mode == REDIRECT_ON) {
                     //REDIRECT_ON, abort the original connection and return error
                     conn->m->send_close(conn);
                     SET_CLIENT_ERROR(conn->error_info, MYSQLND_AZURE_ENFORCE_REDIRECT_ERROR_NO, UNKNOWN_SQLSTATE, "Connection aborted because init redirection failed.");
@@ -542,11 +734,14 @@ MYSQLND_METHOD(mysqlnd_azure_data, connect)(MYSQLND_CONN_DATA ** pconn,
                 } else {
                     AZURE_LOG(ALOG_LEVEL_INFO, "mysqlnd_azure.enableRedirect: PREFERRED. redirect_connHandle init failed, conn falls back to classical one.");
                     //REDIRECT_PREFERRED, do nothing else for redirection, just use the previous connection
+                    mysqlnd_azure_event_set_path(AZURE_PATH_FALLBACK);
+                    AZURE_PROBE3(fallback, hostname.s, port, AZURE_PROBE_NOW() - connect_start_us);
                     goto after_conn;
                 }
             }
 
             MYSQLND_CONN_DATA* redirect_conn = redirect_conneHandle->data;
+            mysqlnd_azure_mem_count(AZURE_MEM_CONN_HANDLES, sizeof(MYSQLND));
             redirect_conneHandle->data = NULL;
             mnd_pefree(redirect_conneHandle, redirect_conneHandle->persistent);
             redirect_conneHandle = NULL;
@@ -559,7 +754,7 @@ MYSQLND_METHOD(mysqlnd_azure_data, connect)(MYSQLND_CONN_DATA ** pconn,
                 redirect_conn->m->dtor(redirect_conn); //release created resource
                 redirect_conn = NULL;
 
-                if(MYSQLND_AZURE_G(enableRedirect) == REDIRECT_ON) {
+                if(redirect_mode == REDIRECT_ON) {
                     //REDIRECT_ON, abort the original connection
                     conn->m->send_close(conn);
                     SET_CLIENT_ERROR(conn->error_info, MYSQLND_AZURE_ENFORCE_REDIRECT_ERROR_NO, UNKNOWN_SQLSTATE, "Connection aborted because init redirection failed.");
@@ -568,6 +763,8 @@ MYSQLND_METHOD(mysqlnd_azure_data, connect)(MYSQLND_CONN_DATA ** pconn,
                 } else {
                     AZURE_LOG(ALOG_LEVEL_INFO, "mysqlnd_azure.enableRedirect: PREFERRED. set_redirect_client_options() failed, conn falls back to classical one.");
                     //REDIRECT_PREFERRED, do nothing else for redirection, just use the previous connection
+                    mysqlnd_azure_event_set_path(AZURE_PATH_FALLBACK);
+                    AZURE_PROBE3(fallback, hostname.s, port, AZURE_PROBE_NOW() - connect_start_us);
                     goto after_conn;
                 }
             }
@@ -583,19 +780,34 @@ MYSQLND_METHOD(mysqlnd_azure_data, connect)(MYSQLND_CONN_DATA ** pconn,
 
             const MYSQLND_CSTRING redirect_scheme = { redirect_transport.s, redirect_transport.l };
 
+            mysqlnd_azure_event_set_target(redirect_host, redirect_user, ui_redirect_port);
+            mysqlnd_azure_event_phase_begin(AZURE_PHASE_REDIRECT_HANDSHAKE);
+            AZURE_PROBE2(redirect_start, redirect_host, ui_redirect_port);
+            uint64_t redirect_start_us = mysqlnd_azure_now_us();
             enum_func_status redirectState = redirect_conn->m->connect_handshake(redirect_conn, &redirect_scheme, &redirect_username, &password, &database, mysql_flags);
+            uint64_t redirect_elapsed_us = mysqlnd_azure_now_us() - redirect_start_us;
+            AZURE_PROBE4(redirect_done, redirect_host, ui_redirect_port, (unsigned int)(redirectState == PASS), redirect_elapsed_us);
+            mysqlnd_azure_event_phase_end(AZURE_PHASE_REDIRECT_HANDSHAKE);
 
             if (redirectState == PASS) { //handshake with redirect_conn succeeded, replace original connection info with redirect_conn and add the redirect info into cache table
 
                 AZURE_LOG(ALOG_LEVEL_DBG, "Redirect connection established.");
                 DBG_ENTER("[redirect]: mysql redirect handshake succeeded.");
 
-                //add the redirect info into cache table
-                mysqlnd_azure_add_redirect_cache(username.s, hostname.s, port, redirect_username.s, redirect_hostname.s, ui_redirect_port);
+                //add the redirect info into cache table, with the further targets the server offered, if any
+                {
+                    MYSQLND_AZURE_REDIRECT_INFO targets[MAX_REDIRECT_TARGETS];
+                    redirect_targets_from_locations(locations, location_count, targets);
+                    mysqlnd_azure_add_redirect_cache_targets(username.s, hostname.s, port, targets, location_count, location->has_ttl ? location->ttl : 0);
+                    mysqlnd_azure_learn_redirect_cache_host(username.s, hostname.s, port, targets, location_count, location->has_ttl ? location->ttl : 0);
+                    mysqlnd_azure_redirect_cache_report(username.s, hostname.s, port, &targets[0], redirect_elapsed_us, TRUE);
+                }
 
                 //close previous proxy connection
-                conn->m->send_close(conn);
-                conn->m->dtor(conn);
+                mysqlnd_azure_event_phase_begin(AZURE_PHASE_PROXY_CLOSE);
+                mysqlnd_azure_close_proxy_conn(conn);
+                mysqlnd_azure_event_phase_end(AZURE_PHASE_PROXY_CLOSE);
+                mysqlnd_azure_event_set_path(AZURE_PATH_REDIRECT);
                 if (transport.s) {
                     mnd_sprintf_free(transport.s);
                     transport.s = NULL;
@@ -615,16 +827,19 @@ MYSQLND_METHOD(mysqlnd_azure_data, connect)(MYSQLND_CONN_DATA ** pconn,
 
             } else { //redirect failed. if REDIRECT_ON, also abort the original conn, if REDIRECT_PREFERRED, use original connection
                 DBG_ENTER("[redirect]: mysql redirect handshake fails");
+                mysqlnd_azure_event_set_redirect_error(redirect_conn->error_info->error_no);
                 //need free in both cases
                 if (redirect_transport.s) {
                     mnd_sprintf_free(redirect_transport.s);
                     redirect_transport.s = NULL;
                 }
 
-                if (MYSQLND_AZURE_G(enableRedirect) == REDIRECT_PREFERRED) {
+                if (redirect_mode == REDIRECT_PREFERRED) {
                     AZURE_LOG(ALOG_LEVEL_INFO, "mysqlnd_azure.enableRedirect: PREFERRED. redirect_conn handshake failed, conn falls back to classical one.");
                     //free object and use original connection
                     redirect_conn->m->dtor(redirect_conn);
+                    mysqlnd_azure_event_set_path(AZURE_PATH_FALLBACK);
+                    AZURE_PROBE3(fallback, hostname.s, port, AZURE_PROBE_NOW() - connect_start_us);
                     goto after_conn;
 
                 } else { //REDIRECT_ON, free original connect, and use redirect_conn to handle error
@@ -638,6 +853,7 @@ MYSQLND_METHOD(mysqlnd_azure_data, connect)(MYSQLND_CONN_DATA ** pconn,
                     *pconn = redirect_conn;
                     pfc = redirect_conn->protocol_frame_codec;
                     redirect_conn = NULL;
+                    mysqlnd_azure_event_set_path(AZURE_PATH_REDIRECT);
                     goto err;
                 }
             }
@@ -738,7 +954,10 @@ after_conn:
 
         mysqlnd_local_infile_default(conn);
 
-        if (FAIL == conn->m->execute_init_commands(conn)) {
+        mysqlnd_azure_event_phase_begin(AZURE_PHASE_INIT_COMMANDS);
+        enum_func_status initState = conn->m->execute_init_commands(conn);
+        mysqlnd_azure_event_phase_end(AZURE_PHASE_INIT_COMMANDS);
+        if (FAIL == initState) {
             goto err;
         }
 
@@ -777,6 +996,265 @@ err:
 }
 /* }}} */
 
+/* {{{ mysqlnd_azure_route_primary
+  After a routed read the handle's data is the replica conn until the application took the result from it.
+  Returns the primary to run anything else on, and puts it back into the handle. A replica conn which is
+  not in its primary's handle is used internally, or holds an unbuffered result, and stays what it is.
+*/
+static MYSQLND_CONN_DATA*
+mysqlnd_azure_route_primary(MYSQLND_CONN_DATA * conn)
+{
+    MYSQLND_AZURE_CONN_DATA** conn_data = mysqlnd_azure_get_conn_data(conn);
+    MYSQLND_AZURE_CONN_DATA** primary_data;
+    MYSQLND_CONN_DATA* primary;
+
+    if (!conn_data || !*conn_data || !(*conn_data)->primary) {
+        return conn;
+    }
+    primary = (*conn_data)->primary;
+    primary_data = mysqlnd_azure_get_conn_data(primary);
+    if (!primary_data || !*primary_data || !(*primary_data)->handle || (*primary_data)->handle->data != conn) {
+        return conn;
+    }
+    (*primary_data)->handle->data = primary;
+    return primary;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_route_complete
+  The result of a routed read was taken from the replica conn, or there is none. The primary goes back into the
+  handle with the outcome of the read, so the methods not hooked here, thread_id, kill, get_server_info and the
+  like, run on the primary again. Its server status stays its own, the routing decisions are based on it.
+*/
+static void
+mysqlnd_azure_route_complete(MYSQLND_CONN_DATA * replica)
+{
+    MYSQLND_CONN_DATA* primary = mysqlnd_azure_route_primary(replica);
+
+    if (primary == replica) {
+        return;
+    }
+    primary->upsert_status->warning_count = replica->upsert_status->warning_count;
+    primary->upsert_status->affected_rows = replica->upsert_status->affected_rows;
+    primary->upsert_status->last_insert_id = replica->upsert_status->last_insert_id;
+    primary->field_count = replica->field_count;
+    SET_CLIENT_ERROR(primary->error_info, replica->error_info->error_no, replica->error_info->sqlstate, replica->error_info->error);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_route_restore, put the primary back into a handle before the handle itself is used */
+static void
+mysqlnd_azure_route_restore(MYSQLND * conn_handle)
+{
+    if (conn_handle->data) {
+        mysqlnd_azure_route_primary(conn_handle->data);
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_connect_cached, connect to a known redirect target with a new conn, *pconn is only replaced on success
+  tried tells whether the target was actually tried, and not just the new conn object failed to init */
+static enum_func_status
+mysqlnd_azure_connect_cached(MYSQLND_CONN_DATA ** pconn,
+                        const MYSQLND_CSTRING hostname,
+                        const MYSQLND_CSTRING username,
+                        unsigned int port,
+                        const MYSQLND_AZURE_REDIRECT_INFO* redirect_info,
+                        const MYSQLND_CSTRING password,
+                        const MYSQLND_CSTRING database,
+                        const MYSQLND_CSTRING socket_or_pipe,
+                        unsigned int mysql_flags,
+                        zend_bool* tried)
+{
+    enum_func_status ret;
+    *tried = FALSE;
+
+    //init a new connection obj in order not to affect any field of pconn if cached connection failed.
+    MYSQLND* redirect_cache_conneHandle = mysqlnd_init(MYSQLND_CLIENT_KNOWS_RSET_COPY_DATA, (*pconn)->persistent); //init MYSQLND but only need only MYSQLND_CONN_DATA here
+    MYSQLND_CONN_DATA* redirect_cache_conn = NULL;
+    if (!redirect_cache_conneHandle) {
+        return FAIL;
+    }
+    redirect_cache_conn = redirect_cache_conneHandle->data;
+    mysqlnd_azure_mem_count(AZURE_MEM_CONN_HANDLES, sizeof(MYSQLND));
+    redirect_cache_conneHandle->data = NULL;
+    mnd_pefree(redirect_cache_conneHandle, redirect_cache_conneHandle->persistent);
+    redirect_cache_conneHandle = NULL;
+
+    if (FAIL == set_redirect_client_options(*pconn, redirect_cache_conn)) {
+        redirect_cache_conn->m->dtor(redirect_cache_conn);
+        return FAIL;
+    }
+    mysqlnd_azure_adapt_compression(redirect_cache_conn, redirect_info);
+
+    AZURE_LOG(ALOG_LEVEL_INFO, "Find cache. mysqlnd_azure::connect try the cached info first");
+    AZURE_LOG(ALOG_LEVEL_DBG, "cached host : %s, cached user : %s, cached port : %u", redirect_info->redirect_host, redirect_info->redirect_user, redirect_info->redirect_port);
+
+    const MYSQLND_CSTRING redirect_host = { redirect_info->redirect_host, strlen(redirect_info->redirect_host) };
+    const MYSQLND_CSTRING redirect_user = { redirect_info->redirect_user, strlen(redirect_info->redirect_user) };
+    *tried = TRUE;
+    mysqlnd_azure_event_set_target(redirect_info->redirect_host, redirect_info->redirect_user, redirect_info->redirect_port);
+    mysqlnd_azure_event_phase_begin(AZURE_PHASE_CACHE_CONNECT);
+    AZURE_PROBE2(cache_connect_start, redirect_info->redirect_host, redirect_info->redirect_port);
+    uint64_t start_us = mysqlnd_azure_now_us();
+    ret = org_conn_d_m.connect(redirect_cache_conn, redirect_host, redirect_user, password, database, redirect_info->redirect_port, socket_or_pipe, mysql_flags);
+    uint64_t elapsed_us = mysqlnd_azure_now_us() - start_us;
+    AZURE_PROBE4(cache_connect_done, redirect_info->redirect_host, redirect_info->redirect_port, (unsigned int)(ret == PASS), elapsed_us);
+    mysqlnd_azure_redirect_cache_report(username.s, hostname.s, port, redirect_info, elapsed_us, ret == PASS);
+    mysqlnd_azure_event_phase_end(AZURE_PHASE_CACHE_CONNECT);
+    if (ret == FAIL) {
+        mysqlnd_azure_event_set_redirect_error(redirect_cache_conn->error_info->error_no);
+        mysqlnd_azure_event_set_target(NULL, NULL, 0);
+        //keep the error for the caller in case no further attempt is made, a new round of connection resets it
+        SET_CLIENT_ERROR((*pconn)->error_info, redirect_cache_conn->error_info->error_no, redirect_cache_conn->error_info->sqlstate, redirect_cache_conn->error_info->error);
+        redirect_cache_conn->m->dtor(redirect_cache_conn);
+        return FAIL;
+    }
+
+    AZURE_LOG(ALOG_LEVEL_INFO, "Use cache sccuceeded.");
+    mysqlnd_azure_event_set_path(AZURE_PATH_CACHE);
+    (*pconn)->m->dtor(*pconn);
+    *pconn = redirect_cache_conn;
+    return PASS;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_connect_inferred, connect a user not cached yet straight to the target other users of the server were
+  redirected to, see mysqlnd_azure.inferTargets. The targets are only cached for the user once the connect worked */
+static enum_func_status
+mysqlnd_azure_connect_inferred(MYSQLND_CONN_DATA ** pconn,
+                        const MYSQLND_CSTRING hostname,
+                        const MYSQLND_CSTRING username,
+                        const MYSQLND_CSTRING password,
+                        const MYSQLND_CSTRING database,
+                        unsigned int port,
+                        const MYSQLND_CSTRING socket_or_pipe,
+                        unsigned int mysql_flags)
+{
+    MYSQLND_AZURE_REDIRECT_INFO targets[MAX_REDIRECT_TARGETS];
+    int count = mysqlnd_azure_infer_redirect_cache_targets(username.s, hostname.s, port, targets, MAX_REDIRECT_TARGETS);
+    zend_bool tried;
+
+    if (count <= 0) {
+        return FAIL;
+    }
+    AZURE_LOG(ALOG_LEVEL_INFO, "No cache found, try the target inferred from other users %s@%s:%u", targets[0].redirect_user, targets[0].redirect_host, targets[0].redirect_port);
+    if (PASS == mysqlnd_azure_connect_cached(pconn, hostname, username, port, &targets[0], password, database, socket_or_pipe, mysql_flags, &tried)) {
+        mysqlnd_azure_metrics_add(AZURE_METRIC_INFER_OK, 1);
+        mysqlnd_azure_add_redirect_cache_targets(username.s, hostname.s, port, targets, count, targets[0].ttl);
+        return PASS;
+    }
+    if (tried) {
+        //the user has the form the rule was learned from: a refused login means the rule is wrong as much as an
+        //unreachable target means the target is. Forget both, the next redirect through the gateway learns again
+        AZURE_LOG(ALOG_LEVEL_INFO, "Inferred target failed with %u, connection will go through gateway.", (*pconn)->error_info->error_no);
+        mysqlnd_azure_metrics_add(AZURE_METRIC_INFER_FAILED, 1);
+        mysqlnd_azure_remove_redirect_cache(MYSQLND_AZURE_HOST_USER, hostname.s, port);
+    }
+    return FAIL;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_connect_discover, full round of connection with the redirect discovery shared between workers
+  stale is the cached target that just failed, or NULL on a cache miss. See redirect_lease.c */
+static enum_func_status
+mysqlnd_azure_connect_discover(MYSQLND_CONN_DATA ** pconn,
+                        const MYSQLND_CSTRING hostname,
+                        const MYSQLND_CSTRING username,
+                        const MYSQLND_CSTRING password,
+                        const MYSQLND_CSTRING database,
+                        unsigned int port,
+                        const MYSQLND_CSTRING socket_or_pipe,
+                        unsigned int mysql_flags,
+                        const MYSQLND_AZURE_REDIRECT_INFO* stale)
+{
+    MYSQLND_AZURE_REDIRECT_INFO shared_info;
+    const mysqlnd_azure_redirect_mode redirect_mode = mysqlnd_azure_redirect_mode_for(hostname.s);
+    mysqlnd_azure_lease_state lease = AZURE_LEASE_NONE;
+    uint32_t ticket = 0;
+    uint64_t discover_start_us = AZURE_PROBE_NOW();
+    enum_func_status ret;
+
+    if (MYSQLND_AZURE_G(discoveryWaitMs) > 0) {
+        lease = mysqlnd_azure_lease_acquire(username.s, hostname.s, port, stale, &ticket, &shared_info);
+        if (lease == AZURE_LEASE_BUSY) {
+            uint64_t deadline = mysqlnd_azure_now_us() + (uint64_t)MYSQLND_AZURE_G(discoveryWaitMs) * 1000;
+            uint64_t now, backoff_us = 1000;
+            AZURE_LOG(ALOG_LEVEL_INFO, "Redirect discovery running in another worker, wait for its result");
+            mysqlnd_azure_event_phase_begin(AZURE_PHASE_DISCOVERY_WAIT);
+            //each poll takes the shm lock, so back off from 1 ms to DISCOVERY_POLL_MAX_US between them
+            while (lease == AZURE_LEASE_BUSY && (now = mysqlnd_azure_now_us()) < deadline) {
+                usleep((unsigned int)MIN(backoff_us, deadline - now));
+                backoff_us = MIN(backoff_us * 2, DISCOVERY_POLL_MAX_US);
+                lease = mysqlnd_azure_lease_acquire(username.s, hostname.s, port, stale, &ticket, &shared_info);
+            }
+            mysqlnd_azure_event_phase_end(AZURE_PHASE_DISCOVERY_WAIT);
+        }
+    }
+
+    if (lease == AZURE_LEASE_RESULT && shared_info.redirect_host[0] != '\0') {
+        zend_bool tried;
+        AZURE_LOG(ALOG_LEVEL_INFO, "Use the redirect target discovered by another worker");
+        mysqlnd_azure_add_redirect_cache(username.s, hostname.s, port, shared_info.redirect_user, shared_info.redirect_host, shared_info.redirect_port, shared_info.ttl);
+        mysqlnd_azure_learn_redirect_cache_host(username.s, hostname.s, port, &shared_info, 1, shared_info.ttl);
+        if (PASS == mysqlnd_azure_connect_cached(pconn, hostname, username, port, &shared_info, password, database, socket_or_pipe, mysql_flags, &tried)) {
+            return PASS;
+        }
+        if (tried) {
+            mysqlnd_azure_remove_redirect_cache(username.s, hostname.s, port);
+        }
+    }
+    else if (lease == AZURE_LEASE_BUSY && redirect_mode == REDIRECT_PREFERRED) {
+        //do not add to the storm on the gateway, keep this connection on it
+        AZURE_LOG(ALOG_LEVEL_INFO, "Redirect discovery still running after mysqlnd_azure.discoveryWaitMs, connection will go through gateway.");
+        mysqlnd_azure_event_set_path(AZURE_PATH_FALLBACK);
+        AZURE_PROBE3(fallback, hostname.s, port, AZURE_PROBE_NOW() - discover_start_us);
+        return org_conn_d_m.connect(*pconn, hostname, username, password, database, port, socket_or_pipe, mysql_flags);
+    }
+
+    ret = (*pconn)->m->connect(pconn, hostname, username, password, database, port, socket_or_pipe, mysql_flags);
+
+    if (lease == AZURE_LEASE_OWNER) {
+        zend_bool found = ret == PASS && PASS == mysqlnd_azure_find_redirect_cache(username.s, hostname.s, port, &shared_info);
+        mysqlnd_azure_lease_release(username.s, hostname.s, port, ticket, found ? &shared_info : NULL);
+    }
+
+    return ret;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_admit, take a token of mysqlnd_azure.connectRate for a new connect to host:port,
+  waiting for it up to mysqlnd_azure.connectWaitMs. See connect_admission.c */
+static enum_func_status
+mysqlnd_azure_admit(MYSQLND_CONN_DATA * conn, const char* host, unsigned int port)
+{
+    uint64_t wait_us, now, deadline;
+
+    if (MYSQLND_AZURE_G(connectRate) <= 0) {
+        return PASS;
+    }
+    if (!mysqlnd_azure_admission_acquire(host ? host : "", port, MYSQLND_AZURE_G(connectRate), MYSQLND_AZURE_G(connectBurst),
+        (uint64_t)MAX(MYSQLND_AZURE_G(connectWaitMs), 0) * 1000, &wait_us)) {
+        AZURE_LOG(ALOG_LEVEL_ERR, "Connect to %s:%u rejected, more new connects than mysqlnd_azure.connectRate allows", host ? host : "", port);
+        mysqlnd_azure_metrics_add(AZURE_METRIC_ADMISSION_REJECTED, 1);
+        SET_CLIENT_ERROR(conn->error_info, MYSQLND_AZURE_ADMISSION_ERROR_NO, UNKNOWN_SQLSTATE, "Connection rejected by mysqlnd_azure.connectRate, too many new connections to the server. Try again later.");
+        return FAIL;
+    }
+    if (wait_us > 0) {
+        AZURE_LOG(ALOG_LEVEL_INFO, "Connect to %s:%u waits %llu us for mysqlnd_azure.connectRate", host ? host : "", port, (unsigned long long)wait_us);
+        mysqlnd_azure_metrics_add(AZURE_METRIC_ADMISSION_DELAYED, 1);
+        mysqlnd_azure_event_phase_begin(AZURE_PHASE_ADMISSION_WAIT);
+        //the token is reserved, sleep until it is due; usleep() may refuse a second or more
+        deadline = mysqlnd_azure_now_us() + wait_us;
+        while ((now = mysqlnd_azure_now_us()) < deadline) {
+            usleep((unsigned int)MIN(deadline - now, 100000));
+        }
+        mysqlnd_azure_event_phase_end(AZURE_PHASE_ADMISSION_WAIT);
+    }
+    return PASS;
+}
+/* }}} */
+
 /* {{{ mysqlnd_azure::connect */
 static enum_func_status
 MYSQLND_METHOD(mysqlnd_azure, connect)(MYSQLND * conn_handle,
@@ -793,9 +1271,16 @@ MYSQLND_METHOD(mysqlnd_azure, connect)(MYSQLND * conn_handle,
     const size_t this_func = STRUCT_OFFSET(MYSQLND_CLASS_METHODS_TYPE(mysqlnd_conn_data), connect);
     enum_func_status ret = FAIL;
     MYSQLND_CONN_DATA ** pconn = &conn_handle->data;
+    //per host policy from mysqlnd_azure.redirectPolicy, else mysqlnd_azure.enableRedirect
+    const mysqlnd_azure_redirect_mode redirect_mode = mysqlnd_azure_redirect_mode_for(hostname.s);
+
+    MYSQLND_AZURE_CONNECT_EVENT event;
 
     DBG_ENTER("mysqlnd_azure::connect");
-    AZURE_LOG(ALOG_LEVEL_INFO, "mysqlnd_azure.enableRedirect = %s", MYSQLND_AZURE_G(enableRedirect) == REDIRECT_OFF ? "off" : (MYSQLND_AZURE_G(enableRedirect) == REDIRECT_ON ? "on" : "preferred"));
+    //a routed read may have left the replica conn in the handle
+    mysqlnd_azure_route_restore(conn_handle);
+    mysqlnd_azure_event_begin(&event, hostname.s, username.s, port);
+    AZURE_LOG(ALOG_LEVEL_INFO, "mysqlnd_azure.enableRedirect = %s", redirect_mode == REDIRECT_OFF ? "off" : (redirect_mode == REDIRECT_ON ? "on" : "preferred"));
 
     if (PASS == (*pconn)->m->local_tx_start(*pconn, this_func)) {
         mysqlnd_options4(conn_handle, MYSQL_OPT_CONNECT_ATTR_ADD, "_client_name", "mysqlnd");
@@ -804,8 +1289,17 @@ MYSQLND_METHOD(mysqlnd_azure, connect)(MYSQLND * conn_handle,
             mysqlnd_options4(conn_handle, MYSQL_OPT_CONNECT_ATTR_ADD, "_server_host", hostname.s);
         }
 
-        if (MYSQLND_AZURE_G(enableRedirect) == REDIRECT_OFF) {
+        if (FAIL == mysqlnd_azure_admit(*pconn, hostname.s, port)) {
+            (*pconn)->m->local_tx_end(*pconn, this_func, FAIL);
+            (*pconn)->m->free_contents(*pconn);
+
+            mysqlnd_azure_event_end(&event, FAIL, (*pconn)->error_info);
+            DBG_RETURN(FAIL);
+        }
+
+        if (redirect_mode == REDIRECT_OFF) {
             DBG_ENTER("mysqlnd_azure::connect redirect disabled");
+            mysqlnd_azure_event_set_path(AZURE_PATH_GATEWAY);
             ret = org_conn_d_m.connect(*pconn, hostname, username, password, database, port, socket_or_pipe, mysql_flags);
         }
         else {
@@ -815,73 +1309,72 @@ MYSQLND_METHOD(mysqlnd_azure, connect)(MYSQLND * conn_handle,
             unsigned int temp_flags = (*pconn)->m->get_updated_connect_flags(*pconn, mysql_flags);
             if (!(temp_flags & CLIENT_SSL)) {
                 //REDIRECT_ON, no ssl, return error
-                if((MYSQLND_AZURE_G(enableRedirect) == REDIRECT_ON)) {
+                if((redirect_mode == REDIRECT_ON)) {
                     AZURE_LOG(ALOG_LEVEL_ERR, "CLIENT_SSL is not set when mysqlnd_azure.enableRedirect is ON");
                     SET_CLIENT_ERROR((*pconn)->error_info, MYSQLND_AZURE_ENFORCE_REDIRECT_ERROR_NO, UNKNOWN_SQLSTATE, "mysqlnd_azure.enableRedirect is on, but SSL option is not set in connection string. Redirection is only possible with SSL.");
                     (*pconn)->m->local_tx_end(*pconn, this_func, FAIL);
                     (*pconn)->m->free_contents(*pconn);
 
+                    mysqlnd_azure_event_end(&event, FAIL, (*pconn)->error_info);
                     DBG_RETURN(FAIL);
                 }
                 else { //REDIRECT_PREFERRED, no ssl, do not redirect
                     AZURE_LOG(ALOG_LEVEL_INFO, "CLIENT_SSL is not set and mysqlnd_zaure.enableRedirect is PREFERRED, connection will go through gateway.");
+                    mysqlnd_azure_event_set_path(AZURE_PATH_GATEWAY);
                     ret = org_conn_d_m.connect(*pconn, hostname, username, password, database, port, socket_or_pipe, mysql_flags);
                 }
             }
             else { //SSL is enabled
 
-                //first check whether the redirect info already cached
-                MYSQLND_AZURE_REDIRECT_INFO* redirect_info = mysqlnd_azure_find_redirect_cache(username.s, hostname.s, port);
-                if (redirect_info != NULL) {
+                //first check whether the redirect info already cached, the targets come best first
+                mysqlnd_azure_event_phase_begin(AZURE_PHASE_CACHE_LOOKUP);
+                uint64_t lookup_start_us = AZURE_PROBE_NOW();
+                MYSQLND_AZURE_REDIRECT_INFO cached_targets[MAX_REDIRECT_TARGETS];
+                int cached_count = mysqlnd_azure_find_redirect_cache_targets(username.s, hostname.s, port, cached_targets, MAX_REDIRECT_TARGETS);
+                if (cached_count > 0) {
+                    AZURE_PROBE4(cache_hit, hostname.s, port, (unsigned int)cached_count, AZURE_PROBE_NOW() - lookup_start_us);
+                } else {
+                    AZURE_PROBE3(cache_miss, hostname.s, port, AZURE_PROBE_NOW() - lookup_start_us);
+                }
+                mysqlnd_azure_event_phase_end(AZURE_PHASE_CACHE_LOOKUP);
+                if (cached_count > 0) {
                     DBG_ENTER("mysqlnd_azure::connect try the cached info first");
-
-                    //init a new connection obj in order not to affect any field of pconn if cached connection failed.
-                    enum_func_status init_cache_obj_res = PASS;
-                    MYSQLND* redirect_cache_conneHandle = mysqlnd_init(MYSQLND_CLIENT_KNOWS_RSET_COPY_DATA, (*pconn)->persistent); //init MYSQLND but only need only MYSQLND_CONN_DATA here
-                    MYSQLND_CONN_DATA* redirect_cache_conn = NULL;
-                    if (!redirect_cache_conneHandle) {
-                        init_cache_obj_res = FAIL;
+                    event.cache_found = TRUE;
+
+                    zend_bool cache_tried = FALSE;
+                    int target = 0;
+                    ret = mysqlnd_azure_connect_cached(pconn, hostname, username, port, &cached_targets[0], password, database, socket_or_pipe, mysql_flags, &cache_tried);
+                    //the further targets the server offered come before the gateway
+                    while (ret == FAIL && cache_tried && ++target < cached_count && mysqlnd_azure_unusable_ssl_file(*pconn) == NULL) {
+                        AZURE_LOG(ALOG_LEVEL_INFO, "Cached target failed, try the next one %s:%u", cached_targets[target].redirect_host, cached_targets[target].redirect_port);
+                        ret = mysqlnd_azure_connect_cached(pconn, hostname, username, port, &cached_targets[target], password, database, socket_or_pipe, mysql_flags, &cache_tried);
                     }
-                    else {
-                        redirect_cache_conn = redirect_cache_conneHandle->data;
-                        redirect_cache_conneHandle->data = NULL;
-                        mnd_pefree(redirect_cache_conneHandle, redirect_cache_conneHandle->persistent);
-                        redirect_cache_conneHandle = NULL;
-
-                        init_cache_obj_res = set_redirect_client_options(*pconn, redirect_cache_conn);
+                    const char* bad_ssl_file = NULL;
+                    if (ret == FAIL && cache_tried && (bad_ssl_file = mysqlnd_azure_unusable_ssl_file(*pconn)) != NULL) {
+                        //the TLS setup failed on our side, the gateway would fail the same way after loading the same files again.
+                        //keep the cache entry, the target is not to blame
+                        AZURE_LOG(ALOG_LEVEL_INFO, "Use cache failed, ssl file %s cannot be loaded. Skip the full round of connection", bad_ssl_file);
+                        event.cache_failed = TRUE;
                     }
-
-                    //init redirect_conn options failed
-                    if (init_cache_obj_res == FAIL) {
-                        AZURE_LOG(ALOG_LEVEL_INFO, "Init redirection cache obj failed. Simply ignore the error and try the full round of connection");
+                    else if (ret == FAIL && cache_tried) {
+                        AZURE_LOG(ALOG_LEVEL_INFO, "Use cache failed.");
+                        event.cache_failed = TRUE;
+                        //remove invalid cache, then a new full round of connection
+                        mysqlnd_azure_remove_redirect_cache(username.s, hostname.s, port);
+                        ret = mysqlnd_azure_connect_discover(pconn, hostname, username, password, database, port, socket_or_pipe, mysql_flags, &cached_targets[0]);
                     }
-                    else {
-                        AZURE_LOG(ALOG_LEVEL_INFO, "Find cache. mysqlnd_azure::connect try the cached info first");
-                        AZURE_LOG(ALOG_LEVEL_DBG, "cached host : %s, cached user : %s, cached port : %u", redirect_info->redirect_host, redirect_info->redirect_user, redirect_info->redirect_port);
-
-                        const MYSQLND_CSTRING redirect_host = { redirect_info->redirect_host, strlen(redirect_info->redirect_host) };
-                        const MYSQLND_CSTRING redirect_user = { redirect_info->redirect_user, strlen(redirect_info->redirect_user) };
-                        ret = org_conn_d_m.connect(redirect_cache_conn, redirect_host, redirect_user, password, database, redirect_info->redirect_port, socket_or_pipe, mysql_flags);
-                        if (ret == FAIL) {
-                            AZURE_LOG(ALOG_LEVEL_INFO, "Use cache failed.");
-                            //remove invalid cache and free redirect_cache_conn
-                            mysqlnd_azure_remove_redirect_cache(username.s, hostname.s, port);
-                            redirect_cache_conn->m->dtor(redirect_cache_conn);
-                            redirect_cache_conn = NULL;
-                            //Init a new full round of connection
-                            ret = (*pconn)->m->connect(pconn, hostname, username, password, database, port, socket_or_pipe, mysql_flags);
-                        }
-                        else {
-                            AZURE_LOG(ALOG_LEVEL_INFO, "Use cache sccuceeded.");
-                            (*pconn)->m->dtor(*pconn);
-                            *pconn = redirect_cache_conn;
-                            ret = PASS;
-                        }
+                    else if (ret == FAIL) {
+                        AZURE_LOG(ALOG_LEVEL_INFO, "Init redirection cache obj failed. Simply ignore the error and try the full round of connection");
+                        ret = (*pconn)->m->connect(pconn, hostname, username, password, database, port, socket_or_pipe, mysql_flags);
                     }
                 }
+                else if (MYSQLND_AZURE_G(inferTargets)
+                    && PASS == (ret = mysqlnd_azure_connect_inferred(pconn, hostname, username, password, database, port, socket_or_pipe, mysql_flags))) {
+                    event.cache_found = TRUE;
+                }
                 else {
                     AZURE_LOG(ALOG_LEVEL_INFO, "No cache found");
-                    ret = (*pconn)->m->connect(pconn, hostname, username, password, database, port, socket_or_pipe, mysql_flags);
+                    ret = mysqlnd_azure_connect_discover(pconn, hostname, username, password, database, port, socket_or_pipe, mysql_flags, NULL);
                 }
 
             }
@@ -889,11 +1382,806 @@ MYSQLND_METHOD(mysqlnd_azure, connect)(MYSQLND * conn_handle,
 
         (*pconn)->m->local_tx_end(*pconn, this_func, FAIL);
 
+        if (ret == PASS) {
+            //the conn kept may be the redirect target or the gateway, the policy of the host asked for applies to both
+            mysqlnd_azure_tune_socket(*pconn, hostname.s);
+        }
+        if (ret == PASS && (MYSQLND_AZURE_G(autoReconnect) != RECONNECT_OFF || MYSQLND_AZURE_G(maxConnectionLifetime) > 0
+            || MYSQLND_AZURE_G(livenessCheck) || mysqlnd_azure_replica_list(hostname.s, port, NULL, 0) > 0)) {
+            mysqlnd_azure_set_conn_data(*pconn, hostname, username, password, database, port, socket_or_pipe, mysql_flags);
+            MYSQLND_AZURE_CONN_DATA** conn_data = mysqlnd_azure_get_conn_data(*pconn);
+            if (conn_data && *conn_data) {
+                (*conn_data)->handle = conn_handle;
+            }
+        }
     }
+    mysqlnd_azure_event_end(&event, ret, (*pconn)->error_info);
     DBG_RETURN(ret);
 }
 /* }}} */
 
+/* {{{ mysqlnd_azure_reconnect_session, open a new session on a conn: gateway handshake, then the redirect target it names */
+static enum_func_status
+mysqlnd_azure_reconnect_session(MYSQLND_CONN_DATA * conn, const MYSQLND_AZURE_CONN_DATA * const data, zend_bool drop_cache)
+{
+    const MYSQLND_CSTRING hostname = { data->host, strlen(data->host) };
+    const MYSQLND_CSTRING username = { data->user, strlen(data->user) };
+    const MYSQLND_CSTRING password = { data->password, data->password_len };
+    const MYSQLND_CSTRING database = { data->database, data->database_len };
+    const MYSQLND_CSTRING socket_or_pipe = { data->socket_or_pipe, strlen(data->socket_or_pipe) };
+    MYSQLND_AZURE_REDIRECT_LOCATION locations[MAX_REDIRECT_TARGETS];
+    const MYSQLND_AZURE_REDIRECT_LOCATION* location = &locations[0];
+    int location_count;
+    const mysqlnd_azure_redirect_mode redirect_mode = mysqlnd_azure_redirect_mode_for(data->host);
+    unsigned int num_commands;
+    enum_func_status ret;
+
+    DBG_ENTER("mysqlnd_azure_reconnect_session");
+    AZURE_LOG(ALOG_LEVEL_INFO, "Reconnect through %s:%u", data->host, data->port);
+
+    if (drop_cache) {
+        mysqlnd_azure_remove_redirect_cache(data->user, data->host, data->port);
+    }
+    if (FAIL == mysqlnd_azure_admit(conn, data->host, data->port)) {
+        DBG_RETURN(FAIL);
+    }
+
+    //init commands only run on the conn that is kept, and would overwrite the Location message
+    num_commands = conn->options->num_commands;
+    conn->options->num_commands = 0;
+    ret = org_conn_d_m.connect(conn, hostname, username, password, database, data->port, socket_or_pipe, data->mysql_flags);
+    conn->options->num_commands = num_commands;
+    if (ret == FAIL) {
+        DBG_RETURN(FAIL);
+    }
+
+    locations[0].host[0] = locations[0].user[0] = '\0';
+    locations[0].port = 0;
+    if (redirect_mode == REDIRECT_OFF || (location_count = get_redirect_info(conn, locations, MAX_REDIRECT_TARGETS)) == 0) {
+        if (redirect_mode == REDIRECT_ON) {
+            conn->m->send_close(conn);
+            SET_CLIENT_ERROR(conn->error_info, MYSQLND_AZURE_ENFORCE_REDIRECT_ERROR_NO, UNKNOWN_SQLSTATE, "Connection aborted because redirection is not enabled on the MySQL server or the network package doesn't meet meet redirection protocol.");
+            DBG_RETURN(FAIL);
+        }
+        DBG_RETURN(conn->m->execute_init_commands(conn));
+    }
+    if (strcmp(location->host, data->host) == 0 && strcmp(location->user, data->user) == 0 && location->port == data->port) {
+        DBG_RETURN(conn->m->execute_init_commands(conn));
+    }
+
+    {
+        const MYSQLND_CSTRING redirect_host = { location->host, strlen(location->host) };
+        const MYSQLND_CSTRING redirect_user = { location->user, strlen(location->user) };
+        ret = org_conn_d_m.connect(conn, redirect_host, redirect_user, password, database, location->port, socket_or_pipe, data->mysql_flags);
+    }
+    if (ret == PASS) {
+        MYSQLND_AZURE_REDIRECT_INFO targets[MAX_REDIRECT_TARGETS];
+        AZURE_LOG(ALOG_LEVEL_INFO, "Reconnected to redirect target %s:%u", location->host, location->port);
+        redirect_targets_from_locations(locations, location_count, targets);
+        mysqlnd_azure_add_redirect_cache_targets(data->user, data->host, data->port, targets, location_count, location->has_ttl ? location->ttl : 0);
+        mysqlnd_azure_learn_redirect_cache_host(data->user, data->host, data->port, targets, location_count, location->has_ttl ? location->ttl : 0);
+    } else if (redirect_mode == REDIRECT_PREFERRED) {
+        AZURE_LOG(ALOG_LEVEL_INFO, "mysqlnd_azure.enableRedirect: PREFERRED. Redirect target failed on reconnect, conn falls back to the gateway.");
+        ret = org_conn_d_m.connect(conn, hostname, username, password, database, data->port, socket_or_pipe, data->mysql_flags);
+    }
+
+    DBG_RETURN(ret);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_reconnect, reopen a conn in place, see mysqlnd_azure_reconnect_session.
+  drop_cache when the cached target is what just died. The charset chosen with set_charset is set again,
+  the new session starts with the one of the connect options. Anything else of the old session is lost */
+static enum_func_status
+mysqlnd_azure_reconnect(MYSQLND_CONN_DATA * conn, MYSQLND_AZURE_CONN_DATA* data, zend_bool drop_cache)
+{
+    const MYSQLND_CHARSET* charset = conn->charset;
+    enum_func_status ret = mysqlnd_azure_reconnect_session(conn, data, drop_cache);
+
+    if (ret == PASS && charset && conn->charset != charset && FAIL == org_conn_d_m.set_charset(conn, charset->name)) {
+        //escaping would follow a charset the server does not use
+        AZURE_LOG(ALOG_LEVEL_ERR, "Reconnected, but cannot set the charset %s again", charset->name);
+        conn->m->send_close(conn);
+        ret = FAIL;
+    }
+    if (ret == PASS) {
+        data->session_state = 0;
+    }
+    return ret;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_match_word, case insensitive keyword at p, not followed by an identifier character */
+static size_t
+mysqlnd_azure_match_word(const char* p, const char* end, const char* word)
+{
+    size_t len = strlen(word);
+    if ((size_t)(end - p) < len || strncasecmp(p, word, len) != 0) {
+        return 0;
+    }
+    if (p + len < end && (isalnum((unsigned char)p[len]) || p[len] == '_' || p[len] == '$')) {
+        return 0;
+    }
+    return len;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_skip_blank, skip white space, comments and opening parentheses before the first word of a statement */
+static const char*
+mysqlnd_azure_skip_blank(const char* p, const char* end)
+{
+    while (p < end) {
+        if (isspace((unsigned char)*p) || *p == '(') {
+            p++;
+        } else if (*p == '#' || (*p == '-' && p + 2 < end && p[1] == '-' && isspace((unsigned char)p[2]))) {
+            while (p < end && *p != '\n') p++;
+        } else if (*p == '/' && p + 1 < end && p[1] == '*') {
+            p += 2;
+            while (p + 1 < end && !(p[0] == '*' && p[1] == '/')) p++;
+            p += 2;
+        } else {
+            break;
+        }
+    }
+    return p < end ? p : end;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_is_idempotent_read
+  Conservative check whether running a statement twice is harmless: SELECT/SHOW/DESCRIBE/EXPLAIN,
+  a single statement, and no locking reads, SELECT ... INTO or lock functions anywhere in it.
+  Stored functions called by a read are not looked into, one which writes runs twice on a replay.
+*/
+static zend_bool
+mysqlnd_azure_is_idempotent_read(const char* query, size_t query_len)
+{
+    static const char* const read_words[] = { "SELECT", "SHOW", "DESCRIBE", "DESC", "EXPLAIN", NULL };
+    static const char* const unsafe_words[] = { "INTO", "UPDATE", "SHARE", "GET_LOCK", "RELEASE_LOCK", "RELEASE_ALL_LOCKS", NULL };
+    const char* end = query + query_len;
+    const char* p = mysqlnd_azure_skip_blank(query, end);
+    int i;
+    zend_bool read = FALSE;
+
+    for (i = 0; read_words[i] && !read; i++) {
+        read = mysqlnd_azure_match_word(p, end, read_words[i]) > 0;
+    }
+    if (!read) {
+        return FALSE;
+    }
+
+    for (; p < end; p++) {
+        if (*p == ';') {
+            const char* q = p + 1;
+            while (q < end && isspace((unsigned char)*q)) q++;
+            if (q < end) {
+                return FALSE; //multi statement
+            }
+        }
+        if (p == query || !(isalnum((unsigned char)p[-1]) || p[-1] == '_' || p[-1] == '$')) {
+            for (i = 0; unsafe_words[i]; i++) {
+                if (mysqlnd_azure_match_word(p, end, unsafe_words[i])) {
+                    return FALSE;
+                }
+            }
+        }
+    }
+
+    return TRUE;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_skip_quoted, p at a quote: the last character of the string or quoted identifier */
+static const char*
+mysqlnd_azure_skip_quoted(const char* p, const char* end)
+{
+    const char quote = *p;
+
+    for (p++; p < end && *p != quote; p++) {
+        if (*p == '\\' && quote != '`') {
+            p++;
+        }
+    }
+    return p;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_changes_session
+  Conservative check whether a statement leaves session state behind which a reconnect loses: SET of any
+  variable or of the names, USE, LOCK TABLES, PREPARE, CALL, HANDLER, temporary tables, user variables and
+  named locks. Quoted strings and identifiers are skipped, so an '@' in a literal does not count.
+*/
+static zend_bool
+mysqlnd_azure_changes_session(const char* query, size_t query_len)
+{
+    static const char* const first_words[] = { "SET", "USE", "LOCK", "PREPARE", "CALL", "HANDLER", NULL };
+    static const char* const state_words[] = { "TEMPORARY", "GET_LOCK", NULL };
+    const char* end = query + query_len;
+    const char* p = mysqlnd_azure_skip_blank(query, end);
+    int i;
+
+    for (i = 0; first_words[i]; i++) {
+        if (mysqlnd_azure_match_word(p, end, first_words[i])) {
+            return TRUE;
+        }
+    }
+    for (; p < end; p++) {
+        if (*p == '\'' || *p == '"' || *p == '`') {
+            p = mysqlnd_azure_skip_quoted(p, end);
+            continue;
+        }
+        //a user variable, @@ names a system variable which is only read here
+        if (*p == '@') {
+            if (p + 1 < end && p[1] == '@') {
+                p++;
+                continue;
+            }
+            return TRUE;
+        }
+        if (p == query || !(isalnum((unsigned char)p[-1]) || p[-1] == '_' || p[-1] == '$')) {
+            for (i = 0; state_words[i]; i++) {
+                if (mysqlnd_azure_match_word(p, end, state_words[i])) {
+                    return TRUE;
+                }
+            }
+        }
+    }
+
+    return FALSE;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_reads_session
+  Whether a read depends on the session it runs in, so a replica session would answer it differently:
+  user and system variables, and the functions returning what the session did before.
+*/
+static zend_bool
+mysqlnd_azure_reads_session(const char* query, size_t query_len)
+{
+    static const char* const session_words[] = { "LAST_INSERT_ID", "FOUND_ROWS", "ROW_COUNT", "CONNECTION_ID", NULL };
+    const char* end = query + query_len;
+    const char* p;
+    int i;
+
+    for (p = query; p < end; p++) {
+        if (*p == '\'' || *p == '"' || *p == '`') {
+            p = mysqlnd_azure_skip_quoted(p, end);
+            continue;
+        }
+        if (*p == '@') {
+            return TRUE;
+        }
+        if (p == query || !(isalnum((unsigned char)p[-1]) || p[-1] == '_' || p[-1] == '$')) {
+            for (i = 0; session_words[i]; i++) {
+                if (mysqlnd_azure_match_word(p, end, session_words[i])) {
+                    return TRUE;
+                }
+            }
+        }
+    }
+
+    return FALSE;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_route_replica, the read replica conn of a primary, connected on first use */
+static MYSQLND_CONN_DATA*
+mysqlnd_azure_route_replica(MYSQLND_CONN_DATA * conn, MYSQLND_AZURE_CONN_DATA* data)
+{
+    MYSQLND_AZURE_REPLICA replicas[MAX_READ_REPLICAS];
+    char replica_user[MAX_REDIRECT_USER_LEN + 1];
+    MYSQLND_AZURE_CONN_DATA** replica_data;
+    MYSQLND* handle;
+    int count, chosen, slot;
+
+    if (data->replica) {
+        return data->replica->data;
+    }
+    count = mysqlnd_azure_replica_list(data->host, data->port, replicas, MAX_READ_REPLICAS);
+    if (count == 0) {
+        return NULL;
+    }
+    chosen = mysqlnd_azure_replica_choose(replicas, count, &slot);
+    if (chosen < 0) {
+        return NULL;
+    }
+
+    handle = mysqlnd_init(MYSQLND_CLIENT_KNOWS_RSET_COPY_DATA, conn->persistent);
+    if (!handle) {
+        mysqlnd_azure_replica_release(slot);
+        return NULL;
+    }
+    mysqlnd_azure_mem_count(AZURE_MEM_CONN_HANDLES, sizeof(MYSQLND));
+    if (FAIL == set_redirect_client_options(conn, handle->data)) {
+        mysqlnd_azure_replica_release(slot);
+        handle->m->dtor(handle);
+        return NULL;
+    }
+
+    //same gateway, redirect and cache handling as any other connect
+    mysqlnd_azure_replica_user(data->user, data->host, replicas[chosen].host, replica_user, sizeof(replica_user));
+    {
+        const MYSQLND_CSTRING hostname = { replicas[chosen].host, strlen(replicas[chosen].host) };
+        const MYSQLND_CSTRING username = { replica_user, strlen(replica_user) };
+        const MYSQLND_CSTRING password = { data->password, data->password_len };
+        const MYSQLND_CSTRING database = { data->database, data->database_len };
+        const MYSQLND_CSTRING socket_or_pipe = { data->socket_or_pipe, strlen(data->socket_or_pipe) };
+
+        AZURE_LOG(ALOG_LEVEL_INFO, "Connect to read replica %s:%u", replicas[chosen].host, replicas[chosen].port);
+        if (FAIL == handle->m->connect(handle, hostname, username, password, database, replicas[chosen].port, socket_or_pipe, data->mysql_flags)) {
+            AZURE_LOG(ALOG_LEVEL_ERR, "Connect to read replica %s:%u failed [%u] %s, reads stay on the primary",
+                replicas[chosen].host, replicas[chosen].port, handle->data->error_info->error_no, handle->data->error_info->error);
+            mysqlnd_azure_replica_report(slot, 0, FALSE);
+            mysqlnd_azure_replica_release(slot);
+            handle->m->dtor(handle);
+            return NULL;
+        }
+        mysqlnd_azure_set_conn_data(handle->data, hostname, username, password, database, replicas[chosen].port, socket_or_pipe, data->mysql_flags);
+    }
+
+    replica_data = mysqlnd_azure_get_conn_data(handle->data);
+    if (!replica_data || !*replica_data
+        || (conn->charset && handle->data->charset != conn->charset && FAIL == org_conn_d_m.set_charset(handle->data, conn->charset->name))) {
+        mysqlnd_azure_replica_release(slot);
+        handle->m->close(handle, MYSQLND_CLOSE_IMPLICIT);
+        return NULL;
+    }
+    (*replica_data)->primary = conn;
+    data->replica = handle;
+    data->replica_slot = slot;
+
+    return handle->data;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_route_read
+  Runs a read on the read replica of the conn, see mysqlnd_azure.readReplicas. Returns FALSE when the statement
+  has to run on the primary: not an auto-committed single read, a read after a write or a transaction of this
+  request on the conn, a read of session state or on a session which holds some, or no replica configured or reachable.
+*/
+static zend_bool
+mysqlnd_azure_route_read(MYSQLND_CONN_DATA * conn, const char * const query, const size_t query_len, enum_func_status* ret)
+{
+    MYSQLND_AZURE_CONN_DATA** conn_data = mysqlnd_azure_get_conn_data(conn);
+    MYSQLND_AZURE_CONN_DATA* data;
+    unsigned int server_status = conn->upsert_status->server_status;
+    MYSQLND_CONN_DATA* replica;
+    uint64_t start;
+
+    if (!conn_data || !*conn_data || !(*conn_data)->handle || (*conn_data)->reconnecting) {
+        return FALSE;
+    }
+    data = *conn_data;
+    if (!(server_status & SERVER_STATUS_AUTOCOMMIT) || (server_status & SERVER_STATUS_IN_TRANS)
+        || !mysqlnd_azure_is_idempotent_read(query, query_len)) {
+        data->sticky_request = MYSQLND_AZURE_G(requestCount);
+        return FALSE;
+    }
+    if (data->sticky_request == MYSQLND_AZURE_G(requestCount)) {
+        return FALSE; //read your writes
+    }
+    //the replica session lacks what this one set, also in an earlier request of a persistent conn
+    if ((data->session_state & AZURE_SESSION_VARIABLES) || mysqlnd_azure_reads_session(query, query_len)) {
+        return FALSE;
+    }
+    replica = mysqlnd_azure_route_replica(conn, data);
+    if (!replica || GET_CONNECTION_STATE(&replica->state) != CONN_READY) {
+        return FALSE; //none, or an unbuffered result of an earlier read is still open on it
+    }
+
+    start = mysqlnd_azure_now_us();
+    *ret = org_conn_d_m.query(replica, query, query_len);
+    if (*ret == FAIL && replica->error_info->error_no >= CR_UNKNOWN_ERROR && replica->error_info->error_no < 3000) {
+        //client side error, the replica conn is gone: the primary serves the read
+        AZURE_LOG(ALOG_LEVEL_INFO, "Read replica failed with error %u, drop it and run the read on the primary", replica->error_info->error_no);
+        mysqlnd_azure_replica_report(data->replica_slot, 0, FALSE);
+        mysqlnd_azure_route_drop_replica(data);
+        return FALSE;
+    }
+    mysqlnd_azure_replica_report(data->replica_slot, mysqlnd_azure_now_us() - start, TRUE);
+
+    //the application takes the result through the handle, a failed read has none to take
+    data->handle->data = replica;
+    if (*ret == FAIL || !replica->field_count) {
+        mysqlnd_azure_route_complete(replica);
+    }
+    return TRUE;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_route_mark_write, reads of this request stay on the primary from now on */
+static void
+mysqlnd_azure_route_mark_write(MYSQLND_CONN_DATA * conn)
+{
+    MYSQLND_AZURE_CONN_DATA** conn_data = mysqlnd_azure_get_conn_data(conn);
+
+    if (conn_data && *conn_data && (*conn_data)->handle) {
+        (*conn_data)->sticky_request = MYSQLND_AZURE_G(requestCount);
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_rotate, reopen a conn reused after its lifetime, so it follows the redirect the gateway gives now.
+  Called where a conn is taken up again: change_user of a mysqli persistent conn, ping of a PDO persistent conn */
+static void
+mysqlnd_azure_rotate(MYSQLND_CONN_DATA * conn)
+{
+    MYSQLND_AZURE_CONN_DATA** conn_data = mysqlnd_azure_get_conn_data(conn);
+    MYSQLND_AZURE_CONN_DATA* data;
+    enum_func_status ret;
+
+    if (!conn_data || !(data = *conn_data) || !data->expires_us || data->reconnecting
+        || mysqlnd_azure_now_us() < data->expires_us) {
+        return;
+    }
+    //an open transaction would be lost silently, try again on the next reuse
+    if (GET_CONNECTION_STATE(&conn->state) != CONN_READY || (conn->upsert_status->server_status & SERVER_STATUS_IN_TRANS)) {
+        return;
+    }
+
+    DBG_ENTER("mysqlnd_azure_rotate");
+    AZURE_LOG(ALOG_LEVEL_INFO, "Connection reused after mysqlnd_azure.maxConnectionLifetime, reopen it");
+    data->reconnecting = TRUE;
+    //the cached target is still good, the reconnect replaces it with what the gateway names now
+    ret = mysqlnd_azure_reconnect(conn, data, FALSE);
+    data->reconnecting = FALSE;
+    mysqlnd_azure_metrics_add(ret == PASS ? AZURE_METRIC_ROTATE_OK : AZURE_METRIC_ROTATE_FAILED, 1);
+    if (ret == PASS) {
+        mysqlnd_azure_tune_socket(conn, data->host);
+        mysqlnd_azure_set_expiry(data);
+        data->last_used_us = mysqlnd_azure_now_us();
+    } else {
+        //the caller's command fails on the closed conn, mysqli and PDO then open a new one
+        AZURE_LOG(ALOG_LEVEL_INFO, "Reopen after maxConnectionLifetime failed: [%u] %s", conn->error_info->error_no, conn->error_info->error);
+    }
+    DBG_VOID_RETURN;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_mark_used, remember when a conn last ran a command, so a reuse right after needs no check */
+static void
+mysqlnd_azure_mark_used(const MYSQLND_CONN_DATA * const conn)
+{
+    MYSQLND_AZURE_CONN_DATA** conn_data;
+
+    if (MYSQLND_AZURE_G(livenessCheck) && (conn_data = mysqlnd_azure_get_conn_data(conn)) && *conn_data) {
+        (*conn_data)->last_used_us = mysqlnd_azure_now_us();
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_liveness_check, whether a conn about to be reused is still there, without a round trip */
+static mysqlnd_azure_liveness
+mysqlnd_azure_liveness_check(MYSQLND_CONN_DATA * const conn, const MYSQLND_AZURE_CONN_DATA * const data)
+{
+    php_socket_t fd;
+    int ready;
+
+    if (GET_CONNECTION_STATE(&conn->state) != CONN_READY) {
+        return AZURE_LIVENESS_UNKNOWN; //the ping reports the state
+    }
+    if (mysqlnd_azure_now_us() - data->last_used_us < (uint64_t)MAX(MYSQLND_AZURE_G(livenessSkipMs), 0) * 1000) {
+        return AZURE_LIVENESS_ALIVE;
+    }
+
+    if (!mysqlnd_azure_conn_socket(conn, &fd)) {
+        return AZURE_LIVENESS_UNKNOWN;
+    }
+    //an idle conn has nothing to read, a FIN or RST of the peer makes the socket readable
+    ready = php_pollfd_for_ms(fd, PHP_POLLREADABLE, 0);
+    if (ready == 0) {
+        return AZURE_LIVENESS_ALIVE;
+    }
+    //peeks at the socket, or the TLS record on it, and tells EOF from pending bytes
+    if (ready > 0 && php_stream_set_option(conn->vio->data->stream, PHP_STREAM_OPTION_CHECK_LIVENESS, 0, NULL) == PHP_STREAM_OPTION_RETURN_ERR) {
+        return AZURE_LIVENESS_DEAD;
+    }
+    return AZURE_LIVENESS_UNKNOWN;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_mark_session, remember that the conn ran a statement which leaves session state behind */
+static void
+mysqlnd_azure_mark_session(MYSQLND_CONN_DATA * conn, const char * const query, const size_t query_len)
+{
+    MYSQLND_AZURE_CONN_DATA** conn_data = mysqlnd_azure_get_conn_data(conn);
+
+    //init commands are run again by every reconnect
+    if (conn_data && *conn_data && !((*conn_data)->session_state & AZURE_SESSION_VARIABLES) && !(*conn_data)->reconnecting
+        && mysqlnd_azure_changes_session(query, query_len)) {
+        (*conn_data)->session_state |= AZURE_SESSION_VARIABLES;
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_data::query */
+static enum_func_status
+MYSQLND_METHOD(mysqlnd_azure_data, query)(MYSQLND_CONN_DATA * conn, const char * const query, const size_t query_len)
+{
+    unsigned int server_status;
+    enum_func_status ret;
+    MYSQLND_AZURE_CONN_DATA** conn_data;
+    unsigned int error_no;
+    char sqlstate[MYSQLND_SQLSTATE_LENGTH + 1];
+    char error[MYSQLND_ERRMSG_SIZE + 1];
+    enum_func_status reconnected;
+    zend_bool replay;
+
+    conn = mysqlnd_azure_route_primary(conn);
+    if (mysqlnd_azure_route_read(conn, query, query_len, &ret)) {
+        return ret;
+    }
+
+    mysqlnd_azure_mark_used(conn);
+    mysqlnd_azure_mark_session(conn, query, query_len);
+    server_status = conn->upsert_status->server_status;
+    ret = org_conn_d_m.query(conn, query, query_len);
+    if (ret == PASS || MYSQLND_AZURE_G(autoReconnect) == RECONNECT_OFF) {
+        return ret;
+    }
+    error_no = conn->error_info->error_no;
+    if (error_no != CR_SERVER_GONE_ERROR && error_no != CR_SERVER_LOST) {
+        return ret;
+    }
+    conn_data = mysqlnd_azure_get_conn_data(conn);
+    if (!conn_data || !*conn_data || (*conn_data)->reconnecting) {
+        return ret;
+    }
+
+    DBG_ENTER("mysqlnd_azure_data::query");
+    strncpy(sqlstate, conn->error_info->sqlstate, MYSQLND_SQLSTATE_LENGTH);
+    sqlstate[MYSQLND_SQLSTATE_LENGTH] = '\0';
+    strncpy(error, conn->error_info->error, MYSQLND_ERRMSG_SIZE);
+    error[MYSQLND_ERRMSG_SIZE] = '\0';
+
+    //decided on the session state from before the failed statement, a read may depend on state the new session lacks
+    replay = MYSQLND_AZURE_G(autoReconnect) == RECONNECT_REPLAY
+        && (server_status & SERVER_STATUS_AUTOCOMMIT) && !(server_status & SERVER_STATUS_IN_TRANS)
+        && !(*conn_data)->session_state && mysqlnd_azure_is_idempotent_read(query, query_len);
+
+    (*conn_data)->reconnecting = TRUE;
+    reconnected = mysqlnd_azure_reconnect(conn, *conn_data, TRUE);
+    (*conn_data)->reconnecting = FALSE;
+    mysqlnd_azure_metrics_add(reconnected == PASS ? AZURE_METRIC_RECONNECT_OK : AZURE_METRIC_RECONNECT_FAILED, 1);
+    if (reconnected == PASS) {
+        mysqlnd_azure_tune_socket(conn, (*conn_data)->host);
+        mysqlnd_azure_set_expiry(*conn_data);
+    }
+    if (reconnected == PASS && replay) {
+        AZURE_LOG(ALOG_LEVEL_INFO, "Reconnected after error %u, replay the read statement", error_no);
+        DBG_RETURN(org_conn_d_m.query(conn, query, query_len));
+    }
+
+    //the statement itself still failed, report what happened to it
+    AZURE_LOG(ALOG_LEVEL_INFO, "Connection lost with error %u, statement not replayed", error_no);
+    SET_CLIENT_ERROR(conn->error_info, error_no, sqlstate, error);
+    DBG_RETURN(FAIL);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_data::send_query, asynchronous queries always run on the primary */
+static enum_func_status
+MYSQLND_METHOD(mysqlnd_azure_data, send_query)(MYSQLND_CONN_DATA * conn, const char * query, const size_t query_len,
+                        enum_mysqlnd_send_query_type type, zval *read_cb, zval *err_cb)
+{
+    conn = mysqlnd_azure_route_primary(conn);
+    if (type == MYSQLND_SEND_QUERY_EXPLICIT && !mysqlnd_azure_is_idempotent_read(query, query_len)) {
+        mysqlnd_azure_route_mark_write(conn);
+    }
+    mysqlnd_azure_mark_used(conn);
+    mysqlnd_azure_mark_session(conn, query, query_len);
+    return org_conn_d_m.send_query(conn, query, query_len, type, read_cb, err_cb);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_data::stmt_init, prepared statements run on the primary and count as writes */
+static MYSQLND_STMT *
+MYSQLND_METHOD(mysqlnd_azure_data, stmt_init)(MYSQLND_CONN_DATA * const conn)
+{
+    MYSQLND_CONN_DATA* primary = mysqlnd_azure_route_primary(conn);
+    MYSQLND_AZURE_CONN_DATA** conn_data = mysqlnd_azure_get_conn_data(primary);
+
+    mysqlnd_azure_route_mark_write(primary);
+    //the statements prepared on the server are gone after a reconnect
+    if (conn_data && *conn_data && !(*conn_data)->reconnecting) {
+        (*conn_data)->session_state |= AZURE_SESSION_STATEMENTS;
+    }
+    return org_conn_d_m.stmt_init(primary);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_data::select_db, the replica follows the primary */
+static enum_func_status
+MYSQLND_METHOD(mysqlnd_azure_data, select_db)(MYSQLND_CONN_DATA * const conn, const char * const db, const size_t db_len)
+{
+    MYSQLND_CONN_DATA* primary = mysqlnd_azure_route_primary(conn);
+    MYSQLND_AZURE_CONN_DATA** conn_data;
+    enum_func_status ret = org_conn_d_m.select_db(primary, db, db_len);
+
+    conn_data = mysqlnd_azure_get_conn_data(primary);
+    if (ret == PASS && conn_data && *conn_data) {
+        MYSQLND_AZURE_CONN_DATA* data = *conn_data;
+        char* database = AZURE_MND_PESTRNDUP(db, db_len, data->persistent, AZURE_MEM_CONN_DATA);
+        if (database) {
+            AZURE_MND_PEFREE(data->database, data->database_len + 1, data->persistent, AZURE_MEM_CONN_DATA);
+            data->database = database;
+            data->database_len = db_len;
+        }
+        if (data->replica && (!database || FAIL == org_conn_d_m.select_db(data->replica->data, db, db_len))) {
+            mysqlnd_azure_route_drop_replica(data);
+        }
+    }
+    return ret;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_data::set_charset, the replica follows the primary */
+static enum_func_status
+MYSQLND_METHOD(mysqlnd_azure_data, set_charset)(MYSQLND_CONN_DATA * const conn, const char * const charset)
+{
+    MYSQLND_CONN_DATA* primary = mysqlnd_azure_route_primary(conn);
+    MYSQLND_AZURE_CONN_DATA** conn_data = mysqlnd_azure_get_conn_data(primary);
+    unsigned char session_state = conn_data && *conn_data ? (*conn_data)->session_state : 0;
+    enum_func_status ret;
+
+    //the SET NAMES it sends goes through the query hook, a reconnect sets the charset again itself
+    ret = org_conn_d_m.set_charset(primary, charset);
+    if (conn_data && *conn_data) {
+        (*conn_data)->session_state = session_state;
+    }
+    if (ret == PASS && conn_data && *conn_data && (*conn_data)->replica
+        && FAIL == org_conn_d_m.set_charset((*conn_data)->replica->data, charset)) {
+        mysqlnd_azure_route_drop_replica(*conn_data);
+    }
+    return ret;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_data::change_user, the replica was logged in as the old user */
+static enum_func_status
+MYSQLND_METHOD(mysqlnd_azure_data, change_user)(MYSQLND_CONN_DATA * const conn, const char * user, const char * passwd, const char * db, zend_bool silent, size_t passwd_len)
+{
+    MYSQLND_CONN_DATA* primary = mysqlnd_azure_route_primary(conn);
+    MYSQLND_AZURE_CONN_DATA** conn_data = mysqlnd_azure_get_conn_data(primary);
+    enum_func_status ret;
+
+    mysqlnd_azure_rotate(primary);
+    if (conn_data && *conn_data) {
+        mysqlnd_azure_route_drop_replica(*conn_data);
+    }
+    ret = org_conn_d_m.change_user(primary, user, passwd, db, silent, passwd_len);
+    if (ret == PASS && conn_data && *conn_data) {
+        (*conn_data)->session_state = 0; //COM_CHANGE_USER resets the session
+    }
+    //the handle stays bound, the next replica and reconnects log in as the new user, never again as the old one
+    if (ret == PASS && conn_data && *conn_data && FAIL == mysqlnd_azure_set_conn_login(*conn_data, user, passwd, passwd_len, db)) {
+        mysqlnd_azure_free_conn_data(primary);
+    }
+    return ret;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_data::store_result, the result of a routed read is complete once stored */
+static MYSQLND_RES *
+MYSQLND_METHOD(mysqlnd_azure_data, store_result)(MYSQLND_CONN_DATA * const conn, const unsigned int flags)
+{
+    MYSQLND_RES* result = org_conn_d_m.store_result(conn, flags);
+
+    mysqlnd_azure_route_complete(conn);
+    return result;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_data::use_result, an unbuffered result keeps its own reference to the replica conn it is read from */
+static MYSQLND_RES *
+MYSQLND_METHOD(mysqlnd_azure_data, use_result)(MYSQLND_CONN_DATA * const conn, const unsigned int flags)
+{
+    MYSQLND_RES* result = org_conn_d_m.use_result(conn, flags);
+
+    mysqlnd_azure_route_complete(conn);
+    return result;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_data::ping, PDO checks a persistent conn with it before reuse.
+  With mysqlnd_azure.livenessCheck the COM_PING is only sent when the socket alone does not tell */
+static enum_func_status
+MYSQLND_METHOD(mysqlnd_azure_data, ping)(MYSQLND_CONN_DATA * const conn)
+{
+    MYSQLND_CONN_DATA* primary = mysqlnd_azure_route_primary(conn);
+    MYSQLND_AZURE_CONN_DATA** conn_data;
+    MYSQLND_AZURE_CONN_DATA* data;
+    mysqlnd_azure_liveness liveness;
+    enum_func_status ret;
+
+    mysqlnd_azure_rotate(primary);
+    conn_data = mysqlnd_azure_get_conn_data(primary);
+    if (!MYSQLND_AZURE_G(livenessCheck) || !conn_data || !(data = *conn_data) || data->reconnecting) {
+        return org_conn_d_m.ping(primary);
+    }
+
+    liveness = mysqlnd_azure_liveness_check(primary, data);
+    if (liveness == AZURE_LIVENESS_ALIVE) {
+        SET_EMPTY_ERROR(primary->error_info);
+        return PASS;
+    }
+    if (liveness == AZURE_LIVENESS_UNKNOWN) {
+        ret = org_conn_d_m.ping(primary);
+        if (ret == PASS) {
+            data->last_used_us = mysqlnd_azure_now_us();
+            return PASS;
+        }
+        if (primary->error_info->error_no != CR_SERVER_GONE_ERROR && primary->error_info->error_no != CR_SERVER_LOST) {
+            return FAIL;
+        }
+    } else {
+        AZURE_LOG(ALOG_LEVEL_INFO, "Connection to %s:%u closed by the server while idle", data->host, data->port);
+        //no COM_QUIT on a closed socket, just close it
+        SET_CONNECTION_STATE(&primary->state, CONN_QUIT_SENT);
+        primary->m->send_close(primary);
+        SET_CLIENT_ERROR(primary->error_info, CR_SERVER_GONE_ERROR, UNKNOWN_SQLSTATE, "MySQL server has gone away");
+    }
+
+    //the target the profile is redirected to may be what went away, the next connect asks the gateway
+    mysqlnd_azure_remove_redirect_cache(data->user, data->host, data->port);
+    if (MYSQLND_AZURE_G(autoReconnect) == RECONNECT_OFF) {
+        return FAIL;
+    }
+
+    data->reconnecting = TRUE;
+    ret = mysqlnd_azure_reconnect(primary, data, FALSE);
+    data->reconnecting = FALSE;
+    mysqlnd_azure_metrics_add(ret == PASS ? AZURE_METRIC_RECONNECT_OK : AZURE_METRIC_RECONNECT_FAILED, 1);
+    if (ret == PASS) {
+        mysqlnd_azure_tune_socket(primary, data->host);
+        mysqlnd_azure_set_expiry(data);
+        data->last_used_us = mysqlnd_azure_now_us();
+    }
+    return ret;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_data::end_psession, a persistent conn starts the next request on the primary */
+static enum_func_status
+MYSQLND_METHOD(mysqlnd_azure_data, end_psession)(MYSQLND_CONN_DATA * conn)
+{
+    return org_conn_d_m.end_psession(mysqlnd_azure_route_primary(conn));
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure::close */
+static enum_func_status
+MYSQLND_METHOD(mysqlnd_azure, close)(MYSQLND * conn_handle, const enum_connection_close_type close_type)
+{
+    mysqlnd_azure_route_restore(conn_handle);
+    return org_conn_m.close(conn_handle, close_type);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure::dtor */
+static void
+MYSQLND_METHOD(mysqlnd_azure, dtor)(MYSQLND * conn_handle)
+{
+    MYSQLND_AZURE_CONN_DATA** conn_data;
+
+    mysqlnd_azure_route_restore(conn_handle);
+    //the primary conn may outlive the handle in a result set
+    conn_data = conn_handle->data ? mysqlnd_azure_get_conn_data(conn_handle->data) : NULL;
+    if (conn_data && *conn_data && (*conn_data)->handle == conn_handle) {
+        (*conn_data)->handle = NULL;
+    }
+    org_conn_m.dtor(conn_handle);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_data::dtor */
+static void
+MYSQLND_METHOD(mysqlnd_azure_data, dtor)(MYSQLND_CONN_DATA * conn)
+{
+    mysqlnd_azure_free_conn_data(conn);
+    org_conn_d_m.dtor(conn);
+}
+/* }}} */
+
 /* {{{ mysqlnd_azure_apply_resources, do resource apply works when module init */
 int mysqlnd_azure_apply_resources() {
     /*
@@ -951,7 +2239,20 @@ void mysqlnd_azure_minit_register_hooks()
     memcpy(&org_conn_d_m, conn_d_m, sizeof(struct st_mysqlnd_conn_data_methods));
 
     conn_m->connect = MYSQLND_METHOD(mysqlnd_azure, connect);
+    conn_m->close = MYSQLND_METHOD(mysqlnd_azure, close);
+    conn_m->dtor = MYSQLND_METHOD(mysqlnd_azure, dtor);
     conn_d_m->connect = MYSQLND_METHOD(mysqlnd_azure_data, connect);
+    conn_d_m->query = MYSQLND_METHOD(mysqlnd_azure_data, query);
+    conn_d_m->dtor = MYSQLND_METHOD(mysqlnd_azure_data, dtor);
+    conn_d_m->send_query = MYSQLND_METHOD(mysqlnd_azure_data, send_query);
+    conn_d_m->stmt_init = MYSQLND_METHOD(mysqlnd_azure_data, stmt_init);
+    conn_d_m->select_db = MYSQLND_METHOD(mysqlnd_azure_data, select_db);
+    conn_d_m->set_charset = MYSQLND_METHOD(mysqlnd_azure_data, set_charset);
+    conn_d_m->change_user = MYSQLND_METHOD(mysqlnd_azure_data, change_user);
+    conn_d_m->store_result = MYSQLND_METHOD(mysqlnd_azure_data, store_result);
+    conn_d_m->use_result = MYSQLND_METHOD(mysqlnd_azure_data, use_result);
+    conn_d_m->end_psession = MYSQLND_METHOD(mysqlnd_azure_data, end_psession);
+    conn_d_m->ping = MYSQLND_METHOD(mysqlnd_azure_data, ping);
 }
 
 /* }}} */
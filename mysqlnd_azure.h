@@ -25,29 +25,285 @@
 
 #include "ext/mysqlnd/mysqlnd.h"
 #include "ext/mysqlnd/mysqlnd_debug.h"
+#include "zend_smart_str.h"
+#include "php_mysqlnd_azure.h"
+#include "redirect_parser.h"
 
 #define MYSQLND_AZURE_VERSION "mysqlnd_azure-1.1.1"
 
-/*struct to store redirection chache info in hash table*/
+/*targets kept per redirect cache entry, the server may offer several Location lines*/
+#define MAX_REDIRECT_TARGETS 3
+
+/*cache user of the host entries of mysqlnd_azure.inferTargets, no login name starts with a control character*/
+#define MYSQLND_AZURE_HOST_USER "\001"
+
+/*redirection info stored in the redirect cache, strings are inlined*/
 typedef struct st_mysqlnd_azure_redirect_info {
-    char* redirect_user;
-    char* redirect_host;
+    char redirect_user[MAX_REDIRECT_USER_LEN + 1];
+    char redirect_host[MAX_REDIRECT_HOST_LEN + 1];
     unsigned int redirect_port;
+    unsigned int ttl;               /* seconds the entry has left, filled in by find */
+    unsigned int srtt_us;           /* smoothed connect time of the target, filled in by find, 0: not measured yet */
 } MYSQLND_AZURE_REDIRECT_INFO;
 
-#define MAX_REDIRECT_HOST_LEN 128
-#define MAX_REDIRECT_USER_LEN 128
+/*slab + open addressing index, see redirect_cache.c*/
+typedef struct st_mysqlnd_azure_redirect_cache MYSQLND_AZURE_REDIRECT_CACHE;
+
+/*redirect cache usage, shown in phpinfo()*/
+typedef struct st_mysqlnd_azure_redirect_cache_stats {
+    size_t entries;
+    size_t max_entries;
+    size_t allocated;       /* records currently allocated in the slab */
+    size_t memory;          /* bytes of the whole cache block */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t expirations;
+} MYSQLND_AZURE_REDIRECT_CACHE_STATS;
+
+/*memory of one category, see mysqlnd_azure_mem.c*/
+typedef struct st_mysqlnd_azure_mem_stats {
+    uint64_t persistent;        /* bytes held now, all threads of the process */
+    uint64_t persistent_peak;
+    uint64_t request;           /* bytes held now by the current request */
+    uint64_t request_peak;      /* highest value of request since the request started */
+    uint64_t allocations;       /* since process start, all threads */
+    uint64_t frees;
+    uint64_t allocated;         /* bytes of all allocations since process start */
+} MYSQLND_AZURE_MEM_STATS;
+
+/*
+  Tagged allocations, counted in the category's MYSQLND_AZURE_MEM_STATS. The size given to
+  AZURE_MND_PEFREE has to be the one of the allocation.
+*/
+#define AZURE_MND_PEMALLOC(size, persistent, category) \
+    mysqlnd_azure_mem_tag(mnd_pemalloc((size), (persistent)), (size), (persistent), (category))
+#define AZURE_MND_PECALLOC(nmemb, size, persistent, category) \
+    mysqlnd_azure_mem_tag(mnd_pecalloc((nmemb), (size), (persistent)), (nmemb) * (size), (persistent), (category))
+#define AZURE_MND_PESTRNDUP(str, len, persistent, category) \
+    ((char*)mysqlnd_azure_mem_tag(mnd_pestrndup((str), (len), (persistent)), (len) + 1, (persistent), (category)))
+#define AZURE_MND_PEFREE(ptr, size, persistent, category) \
+    do { mysqlnd_azure_mem_free((category), (persistent), (size)); mnd_pefree((ptr), (persistent)); } while (0)
+#define AZURE_PEMALLOC(size, persistent, category) \
+    mysqlnd_azure_mem_tag(pemalloc((size), (persistent)), (size), (persistent), (category))
+#define AZURE_PECALLOC(nmemb, size, persistent, category) \
+    mysqlnd_azure_mem_tag(pecalloc((nmemb), (size), (persistent)), (nmemb) * (size), (persistent), (category))
+#define AZURE_PEFREE(ptr, size, persistent, category) \
+    do { mysqlnd_azure_mem_free((category), (persistent), (size)); pefree((ptr), (persistent)); } while (0)
 
 #define MYSQLND_AZURE_ENFORCE_REDIRECT_ERROR_NO CR_NOT_IMPLEMENTED
+#define MYSQLND_AZURE_ADMISSION_ERROR_NO 2500   /* connect rejected by mysqlnd_azure.connectRate, above the CR_* codes of the client libraries */
+
+/*per connection plugin data: what the application passed to connect, needed to reconnect through the gateway*/
+typedef struct st_mysqlnd_azure_conn_data {
+    char* host;
+    char* user;
+    char* password;
+    size_t password_len;
+    char* database;
+    size_t database_len;
+    char* socket_or_pipe;
+    unsigned int port;
+    unsigned int mysql_flags;
+    zend_bool persistent;
+    zend_bool reconnecting;         /* init commands of the reconnect go through the query hook too */
+    unsigned char session_state;    /* AZURE_SESSION_* left by the statements run, a reconnect loses it: no replay from then on */
+    uint64_t expires_us;            /* reopened when reused after this, see mysqlnd_azure.maxConnectionLifetime. 0: never */
+    uint64_t last_used_us;          /* last command, only kept with mysqlnd_azure.livenessCheck */
+    MYSQLND* handle;                /* primary: handle it belongs to, its data is the replica until a routed result is taken */
+    MYSQLND* replica;               /* primary: connected read replica, or NULL */
+    int replica_slot;               /* primary: replica stats slot of that replica */
+    uint64_t sticky_request;        /* primary: request in which it ran a write or a transaction, reads stay on it */
+    MYSQLND_CONN_DATA* primary;     /* replica: the primary it serves reads for */
+} MYSQLND_AZURE_CONN_DATA;
+
+#define AZURE_SESSION_VARIABLES     0x01    /* variables, temporary tables, locks: reads may depend on it, they stay on the primary */
+#define AZURE_SESSION_STATEMENTS    0x02    /* statements prepared on the server */
+
+#define MAX_READ_REPLICAS 8
+
+/*read replica endpoint from mysqlnd_azure.readReplicas*/
+typedef struct st_mysqlnd_azure_replica {
+    char host[MAX_REDIRECT_HOST_LEN + 1];
+    unsigned int port;
+} MYSQLND_AZURE_REPLICA;
+
+/*redirect settings of the hosts matching one mysqlnd_azure.redirectPolicy pattern*/
+typedef struct st_mysqlnd_azure_host_policy {
+    mysqlnd_azure_redirect_mode mode;
+    unsigned int cache_ttl;             /* cap for the ttl of cache entries, 0: none */
+    unsigned int keepalive_idle;        /* 0: mysqlnd_azure.keepaliveIdle, same for the next two */
+    unsigned int keepalive_interval;
+    unsigned int keepalive_count;
+} MYSQLND_AZURE_HOST_POLICY;
+
+/*path a connect finally took, reported in the structured connect event*/
+typedef enum _mysqlnd_azure_connect_path {
+    AZURE_PATH_NONE = 0,
+    AZURE_PATH_GATEWAY,     /* redirect disabled/not applicable, conn stays on the gateway */
+    AZURE_PATH_CACHE,       /* conn established with cached redirect info */
+    AZURE_PATH_REDIRECT,    /* gateway handshake, then redirect handshake */
+    AZURE_PATH_FALLBACK     /* redirect expected but failed, conn falls back to the gateway one */
+} mysqlnd_azure_connect_path;
+
+/*timed phases of one connect*/
+typedef enum _mysqlnd_azure_connect_phase {
+    AZURE_PHASE_CACHE_LOOKUP = 0,
+    AZURE_PHASE_CACHE_CONNECT,
+    AZURE_PHASE_GATEWAY_HANDSHAKE,
+    AZURE_PHASE_REDIRECT_PARSE,
+    AZURE_PHASE_REDIRECT_HANDSHAKE,
+    AZURE_PHASE_PROXY_CLOSE,
+    AZURE_PHASE_INIT_COMMANDS,
+    AZURE_PHASE_DISCOVERY_WAIT,     /* waiting for another worker's redirect discovery */
+    AZURE_PHASE_ADMISSION_WAIT,     /* waiting for a token of mysqlnd_azure.connectRate */
+    AZURE_PHASE_COUNT
+} mysqlnd_azure_connect_phase;
+
+/*plain counters of connect_metrics.c, besides the ones taken from the connect event*/
+typedef enum _mysqlnd_azure_metric {
+    AZURE_METRIC_RECONNECT_OK = 0,
+    AZURE_METRIC_RECONNECT_FAILED,
+    AZURE_METRIC_PROBE_DROPPED,     /* cache entries dropped by the health probe */
+    AZURE_METRIC_ROTATE_OK,         /* conns reopened after mysqlnd_azure.maxConnectionLifetime */
+    AZURE_METRIC_ROTATE_FAILED,
+    AZURE_METRIC_INFER_OK,          /* new users connected to a target inferred from other users, see mysqlnd_azure.inferTargets */
+    AZURE_METRIC_INFER_FAILED,
+    AZURE_METRIC_ADMISSION_DELAYED, /* connects which waited for a token of mysqlnd_azure.connectRate */
+    AZURE_METRIC_ADMISSION_REJECTED,
+    AZURE_METRIC_COUNT
+} mysqlnd_azure_metric;
+
+/*what the socket of a conn about to be reused tells without a round trip, see mysqlnd_azure.livenessCheck*/
+typedef enum _mysqlnd_azure_liveness {
+    AZURE_LIVENESS_ALIVE = 0,   /* used recently, or nothing to read: the peer neither closed nor reset it */
+    AZURE_LIVENESS_DEAD,        /* EOF or error on the socket */
+    AZURE_LIVENESS_UNKNOWN      /* bytes the server sent unasked, or no socket to look at: ping */
+} mysqlnd_azure_liveness;
+
+/*answer of mysqlnd_azure_lease_acquire, see redirect_lease.c*/
+typedef enum _mysqlnd_azure_lease_state {
+    AZURE_LEASE_NONE = 0,   /* no shared lease table, discover without coordination */
+    AZURE_LEASE_OWNER,      /* caller does the discovery and has to release the lease */
+    AZURE_LEASE_RESULT,     /* another worker discovered the target, it is returned */
+    AZURE_LEASE_BUSY        /* another worker is discovering, poll again */
+} mysqlnd_azure_lease_state;
+#define DISCOVERY_POLL_MAX_US 20000  /* the wait for a busy lease polls after 1 ms, doubling up to this */
+
+/*one run of a phase, exported as a trace span*/
+#define MAX_CONNECT_SPANS 16
+typedef struct st_mysqlnd_azure_connect_span {
+    mysqlnd_azure_connect_phase phase;
+    uint64_t start_us;
+    uint64_t end_us;
+} MYSQLND_AZURE_CONNECT_SPAN;
+
+/*struct to collect what happened during one mysqlnd_azure::connect*/
+typedef struct st_mysqlnd_azure_connect_event {
+    uint64_t start_us;
+    uint64_t total_us;
+    uint64_t phase_start_us[AZURE_PHASE_COUNT];
+    uint64_t phase_us[AZURE_PHASE_COUNT];
+    const char* host;
+    const char* user;
+    unsigned int port;
+    char target_host[MAX_REDIRECT_HOST_LEN + 1];
+    char target_user[MAX_REDIRECT_USER_LEN + 1];
+    unsigned int target_port;
+    mysqlnd_azure_connect_path path;
+    zend_bool cache_found;
+    zend_bool cache_failed;
+    unsigned int error_no;
+    char sqlstate[MYSQLND_SQLSTATE_LENGTH + 1];
+    unsigned int redirect_error_no;
+    MYSQLND_AZURE_CONNECT_SPAN spans[MAX_CONNECT_SPANS];
+    unsigned int span_count;
+} MYSQLND_AZURE_CONNECT_EVENT;
 
 void mysqlnd_azure_minit_register_hooks();
+void mysqlnd_azure_close_deferred();
 
 int mysqlnd_azure_apply_resources();
 int mysqlnd_azure_release_resources();
 
-enum_func_status mysqlnd_azure_add_redirect_cache(const char* user, const char* host, int port, const char* redirect_user, const char* redirect_host, int redirect_port);
+enum_func_status mysqlnd_azure_add_redirect_cache(const char* user, const char* host, int port, const char* redirect_user, const char* redirect_host, int redirect_port, unsigned int ttl);
+enum_func_status mysqlnd_azure_add_redirect_cache_targets(const char* user, const char* host, int port, const MYSQLND_AZURE_REDIRECT_INFO* targets, int count, unsigned int ttl);
 enum_func_status mysqlnd_azure_remove_redirect_cache(const char* user, const char* host, int port);
-MYSQLND_AZURE_REDIRECT_INFO* mysqlnd_azure_find_redirect_cache(const char* user, const char* host, int port);
+enum_func_status mysqlnd_azure_find_redirect_cache(const char* user, const char* host, int port, MYSQLND_AZURE_REDIRECT_INFO* redirect_info);
+int mysqlnd_azure_find_redirect_cache_targets(const char* user, const char* host, int port, MYSQLND_AZURE_REDIRECT_INFO* targets, int max);
+void mysqlnd_azure_learn_redirect_cache_host(const char* user, const char* host, int port, const MYSQLND_AZURE_REDIRECT_INFO* targets, int count, unsigned int ttl);
+int mysqlnd_azure_infer_redirect_cache_targets(const char* user, const char* host, int port, MYSQLND_AZURE_REDIRECT_INFO* targets, int max);
+void mysqlnd_azure_redirect_cache_report(const char* user, const char* host, int port, const MYSQLND_AZURE_REDIRECT_INFO* target, uint64_t elapsed_us, zend_bool ok);
+int mysqlnd_azure_redirect_cache_targets(MYSQLND_AZURE_REDIRECT_INFO* targets, int max);
+unsigned int mysqlnd_azure_remove_redirect_cache_target(const char* redirect_host, unsigned int redirect_port);
+void mysqlnd_azure_redirect_cache_stats(MYSQLND_AZURE_REDIRECT_CACHE_STATS* stats);
+void mysqlnd_azure_free_redirect_cache(MYSQLND_AZURE_REDIRECT_CACHE* cache);
+void mysqlnd_azure_redirect_cache_startup();
+void mysqlnd_azure_redirect_cache_shutdown();
+
+void* mysqlnd_azure_shm_alloc(size_t size);
+void mysqlnd_azure_shm_free_all();
+void mysqlnd_azure_shm_lock(volatile uint32_t* lock);
+void mysqlnd_azure_shm_unlock(volatile uint32_t* lock);
+
+void mysqlnd_azure_lease_startup();
+void mysqlnd_azure_lease_shutdown();
+mysqlnd_azure_lease_state mysqlnd_azure_lease_acquire(const char* user, const char* host, unsigned int port,
+    const MYSQLND_AZURE_REDIRECT_INFO* stale, uint32_t* ticket, MYSQLND_AZURE_REDIRECT_INFO* result);
+void mysqlnd_azure_lease_release(const char* user, const char* host, unsigned int port, uint32_t ticket, const MYSQLND_AZURE_REDIRECT_INFO* result);
+
+void mysqlnd_azure_admission_startup();
+void mysqlnd_azure_admission_shutdown();
+zend_bool mysqlnd_azure_admission_acquire(const char* host, unsigned int port, zend_long rate, zend_long burst, uint64_t max_wait_us, uint64_t* wait_us);
+
+void mysqlnd_azure_replica_startup();
+void mysqlnd_azure_replica_shutdown();
+int mysqlnd_azure_replica_list(const char* host, unsigned int port, MYSQLND_AZURE_REPLICA* replicas, int max);
+void mysqlnd_azure_replica_user(const char* user, const char* primary_host, const char* replica_host, char* out, size_t out_len);
+int mysqlnd_azure_replica_choose(const MYSQLND_AZURE_REPLICA* replicas, int count, int* slot);
+void mysqlnd_azure_replica_report(int slot, uint64_t elapsed_us, zend_bool ok);
+void mysqlnd_azure_replica_release(int slot);
+
+void mysqlnd_azure_policy_startup();
+void mysqlnd_azure_policy_shutdown();
+const MYSQLND_AZURE_HOST_POLICY* mysqlnd_azure_policy_find(const char* host);
+mysqlnd_azure_redirect_mode mysqlnd_azure_redirect_mode_for(const char* host);
+unsigned int mysqlnd_azure_policy_cache_ttl(const char* host, unsigned int ttl);
+void mysqlnd_azure_policy_keepalive(const char* host, unsigned int* idle, unsigned int* interval, unsigned int* count);
+
+void mysqlnd_azure_probe_startup();
+void mysqlnd_azure_probe_shutdown();
+unsigned int mysqlnd_azure_probe_targets(zend_bool force);
+
+void mysqlnd_azure_metrics_startup();
+void mysqlnd_azure_metrics_shutdown();
+void mysqlnd_azure_metrics_connect(const MYSQLND_AZURE_CONNECT_EVENT* event, enum_func_status ret);
+void mysqlnd_azure_metrics_add(mysqlnd_azure_metric counter, uint64_t n);
+void mysqlnd_azure_metrics_render(smart_str* buf);
+
+void* mysqlnd_azure_mem_tag(void* ptr, size_t size, zend_bool persistent, mysqlnd_azure_mem_category category);
+void mysqlnd_azure_mem_alloc(mysqlnd_azure_mem_category category, zend_bool persistent, size_t size);
+void mysqlnd_azure_mem_free(mysqlnd_azure_mem_category category, zend_bool persistent, size_t size);
+void mysqlnd_azure_mem_count(mysqlnd_azure_mem_category category, size_t size);
+void mysqlnd_azure_mem_request_startup();
+void mysqlnd_azure_mem_stats(mysqlnd_azure_mem_category category, MYSQLND_AZURE_MEM_STATS* stats);
+const char* mysqlnd_azure_mem_category_name(mysqlnd_azure_mem_category category);
+
+enum_func_status mysqlnd_azure_trace_set_parent(const char* traceparent, size_t len);
+void mysqlnd_azure_trace_reset_parent();
+void mysqlnd_azure_trace_connect(const MYSQLND_AZURE_CONNECT_EVENT* event, enum_func_status ret);
+void mysqlnd_azure_trace_flush();
+
+void mysqlnd_azure_event_begin(MYSQLND_AZURE_CONNECT_EVENT* event, const char* host, const char* user, unsigned int port);
+void mysqlnd_azure_event_end(MYSQLND_AZURE_CONNECT_EVENT* event, enum_func_status ret, const MYSQLND_ERROR_INFO* error_info);
+void mysqlnd_azure_event_phase_begin(mysqlnd_azure_connect_phase phase);
+void mysqlnd_azure_event_phase_end(mysqlnd_azure_connect_phase phase);
+const char* mysqlnd_azure_event_phase_name(mysqlnd_azure_connect_phase phase);
+const char* mysqlnd_azure_event_path_name(mysqlnd_azure_connect_path path);
+void mysqlnd_azure_event_append_json_string(smart_str* buf, const char* str);
+void mysqlnd_azure_event_set_path(mysqlnd_azure_connect_path path);
+void mysqlnd_azure_event_set_target(const char* host, const char* user, unsigned int port);
+void mysqlnd_azure_event_set_redirect_error(unsigned int error_no);
 
 #if defined(ZTS) && defined(COMPILE_DL_MYSQLND_AZURE)
 ZEND_TSRMLS_CACHE_EXTERN()
@@ -0,0 +1,159 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php_mysqlnd_azure.h"
+#include "mysqlnd_azure.h"
+#include "utils.h"
+
+/*
+  Memory accounting of the plugin, shown in phpinfo() and by mysqlnd_azure_memory_stats().
+
+  Allocations go through the AZURE_MND_* / AZURE_PE* macros of mysqlnd_azure.h with a category.
+  Persistent memory is counted for the whole process with relaxed atomics, since the redirect
+  cache and persistent conns of ZTS builds are shared by threads. Request memory is counted in
+  the module globals of the request and starts from zero at every RINIT, the memory manager
+  releases whatever is left at request end anyway.
+
+  Memory the plugin allocates on behalf of mysqlnd (copied init commands and connect attributes,
+  the conn objects of the redirect and cache connects) is handed over and freed by mysqlnd. It
+  is only counted in allocations/allocated; mysqlnd.collect_memory_statistics shows its bytes.
+
+  Shared regions (mysqlnd_azure_shm.c) are mapped once at MINIT and not counted here.
+*/
+
+/* index AZURE_MEM_COUNT holds the totals over all categories */
+static volatile uint64_t mem_persistent[AZURE_MEM_COUNT + 1];
+static volatile uint64_t mem_persistent_peak[AZURE_MEM_COUNT + 1];
+static volatile uint64_t mem_allocations[AZURE_MEM_COUNT + 1];
+static volatile uint64_t mem_frees[AZURE_MEM_COUNT + 1];
+static volatile uint64_t mem_allocated[AZURE_MEM_COUNT + 1];
+
+static const char* const mem_category_names[AZURE_MEM_COUNT + 1] = {
+    "redirect_cache",
+    "conn_data",
+    "conn_options",
+    "conn_handles",
+    "deferred_close",
+    "tables",
+    "total"
+};
+
+/* {{{ mem_request_add, request counters of a category and of the total */
+static void mem_request_add(int index, uint64_t size)
+{
+    MYSQLND_AZURE_G(memRequest)[index] += size;
+    if (MYSQLND_AZURE_G(memRequest)[index] > MYSQLND_AZURE_G(memRequestPeak)[index]) {
+        MYSQLND_AZURE_G(memRequestPeak)[index] = MYSQLND_AZURE_G(memRequest)[index];
+    }
+}
+/* }}} */
+
+/* {{{ mem_request_sub */
+static void mem_request_sub(int index, uint64_t size)
+{
+    //request memory of an earlier request was not counted in this one
+    MYSQLND_AZURE_G(memRequest)[index] -= MIN(size, MYSQLND_AZURE_G(memRequest)[index]);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_mem_alloc, count an allocation of size bytes */
+void mysqlnd_azure_mem_alloc(mysqlnd_azure_mem_category category, zend_bool persistent, size_t size)
+{
+    int i, index[2] = { category, AZURE_MEM_COUNT };
+
+    for (i = 0; i < 2; i++) {
+        mysqlnd_azure_atomic_inc_u64(&mem_allocations[index[i]]);
+        mysqlnd_azure_atomic_add_u64(&mem_allocated[index[i]], size);
+        if (persistent) {
+            mysqlnd_azure_atomic_max_u64(&mem_persistent_peak[index[i]], mysqlnd_azure_atomic_add_fetch_u64(&mem_persistent[index[i]], size));
+        } else {
+            mem_request_add(index[i], size);
+        }
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_mem_free, count the free of an allocation of size bytes */
+void mysqlnd_azure_mem_free(mysqlnd_azure_mem_category category, zend_bool persistent, size_t size)
+{
+    int i, index[2] = { category, AZURE_MEM_COUNT };
+
+    for (i = 0; i < 2; i++) {
+        mysqlnd_azure_atomic_inc_u64(&mem_frees[index[i]]);
+        if (persistent) {
+            mysqlnd_azure_atomic_add_u64(&mem_persistent[index[i]], (uint64_t)0 - size);
+        } else {
+            mem_request_sub(index[i], size);
+        }
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_mem_tag, count ptr if the allocation succeeded and return it */
+void* mysqlnd_azure_mem_tag(void* ptr, size_t size, zend_bool persistent, mysqlnd_azure_mem_category category)
+{
+    if (ptr != NULL) {
+        mysqlnd_azure_mem_alloc(category, persistent, size);
+    }
+    return ptr;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_mem_count, count an allocation handed over to mysqlnd, which also frees it */
+void mysqlnd_azure_mem_count(mysqlnd_azure_mem_category category, size_t size)
+{
+    int i, index[2] = { category, AZURE_MEM_COUNT };
+
+    for (i = 0; i < 2; i++) {
+        mysqlnd_azure_atomic_inc_u64(&mem_allocations[index[i]]);
+        mysqlnd_azure_atomic_add_u64(&mem_allocated[index[i]], size);
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_mem_request_startup, called at RINIT */
+void mysqlnd_azure_mem_request_startup()
+{
+    memset(MYSQLND_AZURE_G(memRequest), 0, sizeof(MYSQLND_AZURE_G(memRequest)));
+    memset(MYSQLND_AZURE_G(memRequestPeak), 0, sizeof(MYSQLND_AZURE_G(memRequestPeak)));
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_mem_stats, usage of a category, AZURE_MEM_COUNT for the total */
+void mysqlnd_azure_mem_stats(mysqlnd_azure_mem_category category, MYSQLND_AZURE_MEM_STATS* stats)
+{
+    stats->persistent = mysqlnd_azure_atomic_load_u64(&mem_persistent[category]);
+    stats->persistent_peak = mysqlnd_azure_atomic_load_u64(&mem_persistent_peak[category]);
+    stats->request = MYSQLND_AZURE_G(memRequest)[category];
+    stats->request_peak = MYSQLND_AZURE_G(memRequestPeak)[category];
+    stats->allocations = mysqlnd_azure_atomic_load_u64(&mem_allocations[category]);
+    stats->frees = mysqlnd_azure_atomic_load_u64(&mem_frees[category]);
+    stats->allocated = mysqlnd_azure_atomic_load_u64(&mem_allocated[category]);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_mem_category_name, key in mysqlnd_azure_memory_stats(), AZURE_MEM_COUNT: "total" */
+const char* mysqlnd_azure_mem_category_name(mysqlnd_azure_mem_category category)
+{
+    return mem_category_names[category];
+}
+/* }}} */
@@ -0,0 +1,162 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php_mysqlnd_azure.h"
+#include "mysqlnd_azure.h"
+#include "utils.h"
+
+#ifndef PHP_WIN32
+#include <sys/mman.h>
+#include <sched.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+/*
+  Shared memory regions for state that has to be seen by all workers of a server, e.g. all
+  children of one FPM pool. A region is an anonymous MAP_SHARED mapping made at MINIT,
+  before the master process forks, so every child inherits the same pages. There is no
+  allocator inside a region, each user lays out its own fixed size structures.
+
+  Windows has no fork model and no such mapping here: mysqlnd_azure_shm_alloc() returns
+  NULL there, and every user of a region has to work without it.
+*/
+
+#define MYSQLND_AZURE_SHM_MAX_REGIONS 8
+/* how long a waiter spins before it checks whether the holder of a lock is still alive, and between checks */
+#define MYSQLND_AZURE_SHM_LOCK_CHECK_US 100000
+
+static struct {
+    void* addr;
+    size_t size;
+} shm_regions[MYSQLND_AZURE_SHM_MAX_REGIONS];
+static int shm_region_count = 0;
+
+/* {{{ mysqlnd_azure_shm_alloc, zero filled shared region, only to be called at MINIT */
+void* mysqlnd_azure_shm_alloc(size_t size)
+{
+#ifndef PHP_WIN32
+    void* addr;
+
+    if (shm_region_count == MYSQLND_AZURE_SHM_MAX_REGIONS) {
+        return NULL;
+    }
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    shm_regions[shm_region_count].addr = addr;
+    shm_regions[shm_region_count].size = size;
+    shm_region_count++;
+    return addr;
+#else
+    return NULL;
+#endif
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_shm_free_all, called at MSHUTDOWN */
+void mysqlnd_azure_shm_free_all()
+{
+#ifndef PHP_WIN32
+    int i;
+    for (i = 0; i < shm_region_count; i++) {
+        munmap(shm_regions[i].addr, shm_regions[i].size);
+        shm_regions[i].addr = NULL;
+    }
+#endif
+    shm_region_count = 0;
+}
+/* }}} */
+
+/* {{{ shm_lock_owner, value a lock word holds while this process has the lock */
+static uint32_t shm_lock_owner()
+{
+#ifndef PHP_WIN32
+    return (uint32_t)getpid();
+#else
+    return (uint32_t)GetCurrentProcessId();
+#endif
+}
+/* }}} */
+
+/* {{{ shm_lock_owner_gone, whether the process holding a lock died without releasing it */
+static zend_bool shm_lock_owner_gone(uint32_t owner)
+{
+#ifndef PHP_WIN32
+    //EPERM: alive, only owned by another user
+    return owner != 0 && kill((pid_t)owner, 0) == -1 && errno == ESRCH;
+#else
+    //no shared regions on Windows, a lock is only shared by the threads of one process
+    return FALSE;
+#endif
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_shm_lock, spin lock inside a shared region, only for a handful of memory operations.
+  The lock word holds the pid of the holder. A waiter takes over a lock only when that process is gone,
+  however long it is held: a holder which is merely preempted or slow keeps it.
+*/
+void mysqlnd_azure_shm_lock(volatile uint32_t* lock)
+{
+    const uint32_t self = shm_lock_owner();
+    uint64_t next_check = 0;
+    unsigned int spins = 0;
+    uint32_t owner;
+
+    while (!mysqlnd_azure_atomic_cas_u32(lock, 0, self)) {
+        if (++spins < 64) {
+            continue;
+        }
+        spins = 0;
+        if (next_check == 0) {
+            next_check = mysqlnd_azure_now_us() + MYSQLND_AZURE_SHM_LOCK_CHECK_US;
+        } else if (mysqlnd_azure_now_us() >= next_check) {
+            owner = mysqlnd_azure_atomic_load_u32(lock);
+            //the compare and swap lets only one waiter take over from the dead holder
+            if (shm_lock_owner_gone(owner) && mysqlnd_azure_atomic_cas_u32(lock, owner, self)) {
+                return;
+            }
+            next_check = mysqlnd_azure_now_us() + MYSQLND_AZURE_SHM_LOCK_CHECK_US;
+        }
+#ifndef PHP_WIN32
+        sched_yield();
+#else
+        SwitchToThread();
+#endif
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_shm_unlock */
+void mysqlnd_azure_shm_unlock(volatile uint32_t* lock)
+{
+    //a lock taken over from this process is not released by it
+    if (mysqlnd_azure_atomic_load_u32(lock) == shm_lock_owner()) {
+        mysqlnd_azure_atomic_store_u32(lock, 0);
+    }
+}
+/* }}} */
@@ -54,6 +54,44 @@ static ZEND_INI_MH(OnUpdateEnableRedirect)
 
 }
 
+/* {{{ OnUpdateAutoReconnect */
+static ZEND_INI_MH(OnUpdateAutoReconnect)
+{
+    if (STRING_EQUALS(new_value, "replay")
+        || STRING_EQUALS(new_value, "2")) {
+
+        MYSQLND_AZURE_G(autoReconnect) = RECONNECT_REPLAY;
+
+    } else if (STRING_EQUALS(new_value, "on")
+        || STRING_EQUALS(new_value, "yes")
+        || STRING_EQUALS(new_value, "true")
+        || STRING_EQUALS(new_value, "1")) {
+
+        MYSQLND_AZURE_G(autoReconnect) = RECONNECT_ON;
+
+    } else {
+
+        MYSQLND_AZURE_G(autoReconnect) = RECONNECT_OFF;
+
+    }
+
+    return SUCCESS;
+}
+/* }}} */
+
+/* {{{ OnUpdateReadReplicaPolicy */
+static ZEND_INI_MH(OnUpdateReadReplicaPolicy)
+{
+    if (STRING_EQUALS(new_value, "latency")) {
+        MYSQLND_AZURE_G(readReplicaPolicy) = REPLICA_POLICY_LATENCY;
+    } else {
+        MYSQLND_AZURE_G(readReplicaPolicy) = REPLICA_POLICY_LEAST_OUTSTANDING;
+    }
+
+    return SUCCESS;
+}
+/* }}} */
+
 static ZEND_INI_MH(OnUpdateEnableLogfile) {
   MYSQLND_AZURE_G(logfilePath) = new_value;
   return SUCCESS;
@@ -88,9 +126,34 @@ static ZEND_INI_MH(OnUpdateEnableLogOutput) {
 /* {{{ PHP_INI */
 PHP_INI_BEGIN()
 STD_PHP_INI_ENTRY("mysqlnd_azure.enableRedirect", "preferred", PHP_INI_ALL, OnUpdateEnableRedirect, enableRedirect, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.autoReconnect", "off", PHP_INI_ALL, OnUpdateAutoReconnect, autoReconnect, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.redirectCacheSize", "1024", PHP_INI_SYSTEM, OnUpdateLong, redirectCacheSize, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.redirectPolicy", "", PHP_INI_SYSTEM, OnUpdateString, redirectPolicy, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.keepaliveIdle", "0", PHP_INI_ALL, OnUpdateLong, keepaliveIdle, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.keepaliveInterval", "0", PHP_INI_ALL, OnUpdateLong, keepaliveInterval, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.keepaliveCount", "0", PHP_INI_ALL, OnUpdateLong, keepaliveCount, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.discoveryWaitMs", "200", PHP_INI_ALL, OnUpdateLong, discoveryWaitMs, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.deferProxyClose", "0", PHP_INI_ALL, OnUpdateLong, deferProxyClose, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.maxConnectionLifetime", "0", PHP_INI_ALL, OnUpdateLong, maxConnectionLifetime, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.connectionLifetimeJitter", "60", PHP_INI_ALL, OnUpdateLong, connectionLifetimeJitter, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_BOOLEAN("mysqlnd_azure.livenessCheck", "0", PHP_INI_ALL, OnUpdateBool, livenessCheck, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.livenessSkipMs", "1000", PHP_INI_ALL, OnUpdateLong, livenessSkipMs, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.compressionThresholdMs", "0", PHP_INI_ALL, OnUpdateLong, compressionThresholdMs, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_BOOLEAN("mysqlnd_azure.inferTargets", "0", PHP_INI_ALL, OnUpdateBool, inferTargets, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.connectRate", "0", PHP_INI_ALL, OnUpdateLong, connectRate, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.connectBurst", "0", PHP_INI_ALL, OnUpdateLong, connectBurst, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.connectWaitMs", "0", PHP_INI_ALL, OnUpdateLong, connectWaitMs, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.readReplicas", "", PHP_INI_ALL, OnUpdateString, readReplicas, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.probeInterval", "0", PHP_INI_ALL, OnUpdateLong, probeInterval, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.probeTimeoutMs", "200", PHP_INI_ALL, OnUpdateLong, probeTimeoutMs, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.traceFile", "", PHP_INI_SYSTEM, OnUpdateString, traceFile, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.traceBatchSize", "16", PHP_INI_ALL, OnUpdateLong, traceBatchSize, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.readReplicaPolicy", "least_outstanding", PHP_INI_ALL, OnUpdateReadReplicaPolicy, readReplicaPolicy, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
 STD_PHP_INI_ENTRY("mysqlnd_azure.logfilePath", "", PHP_INI_SYSTEM, OnUpdateEnableLogfile, logfilePath, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
 STD_PHP_INI_ENTRY("mysqlnd_azure.logLevel", "0", PHP_INI_ALL, OnUpdateEnableLogLevel, logLevel, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
 STD_PHP_INI_ENTRY("mysqlnd_azure.logOutput", "0", PHP_INI_SYSTEM, OnUpdateEnableLogOutput, logOutput, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_ENTRY("mysqlnd_azure.logEventSampleRate", "0", PHP_INI_ALL, OnUpdateReal, logEventSampleRate, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
+STD_PHP_INI_BOOLEAN("mysqlnd_azure.logEventOnError", "0", PHP_INI_ALL, OnUpdateBool, logEventOnError, zend_mysqlnd_azure_globals, mysqlnd_azure_globals)
 PHP_INI_END()
 /* }}} */
 
@@ -101,10 +164,48 @@ static PHP_GINIT_FUNCTION(mysqlnd_azure)
     ZEND_TSRMLS_CACHE_UPDATE();
 #endif
     mysqlnd_azure_globals->enableRedirect = REDIRECT_PREFERRED;
+    mysqlnd_azure_globals->autoReconnect = RECONNECT_OFF;
     mysqlnd_azure_globals->redirectCache = NULL;
+    mysqlnd_azure_globals->redirectCacheSize = 1024;
+    mysqlnd_azure_globals->discoveryWaitMs = 200;
+    mysqlnd_azure_globals->redirectPolicy = NULL;
+    mysqlnd_azure_globals->keepaliveIdle = 0;
+    mysqlnd_azure_globals->keepaliveInterval = 0;
+    mysqlnd_azure_globals->keepaliveCount = 0;
+    mysqlnd_azure_globals->deferProxyClose = 0;
+    mysqlnd_azure_globals->deferredClose = NULL;
+    mysqlnd_azure_globals->deferredCloseCount = 0;
+    mysqlnd_azure_globals->deferredCloseSize = 0;
+    memset(mysqlnd_azure_globals->memRequest, 0, sizeof(mysqlnd_azure_globals->memRequest));
+    memset(mysqlnd_azure_globals->memRequestPeak, 0, sizeof(mysqlnd_azure_globals->memRequestPeak));
+    mysqlnd_azure_globals->maxConnectionLifetime = 0;
+    mysqlnd_azure_globals->connectionLifetimeJitter = 60;
+    mysqlnd_azure_globals->livenessCheck = FALSE;
+    mysqlnd_azure_globals->livenessSkipMs = 1000;
+    mysqlnd_azure_globals->compressionThresholdMs = 0;
+    mysqlnd_azure_globals->inferTargets = FALSE;
+    mysqlnd_azure_globals->connectRate = 0;
+    mysqlnd_azure_globals->connectBurst = 0;
+    mysqlnd_azure_globals->connectWaitMs = 0;
+    mysqlnd_azure_globals->readReplicas = NULL;
+    mysqlnd_azure_globals->readReplicaPolicy = REPLICA_POLICY_LEAST_OUTSTANDING;
+    mysqlnd_azure_globals->requestCount = 0;
+    mysqlnd_azure_globals->probeInterval = 0;
+    mysqlnd_azure_globals->probeTimeoutMs = 200;
+    mysqlnd_azure_globals->probeLastMs = 0;
+    mysqlnd_azure_globals->traceFile = NULL;
+    mysqlnd_azure_globals->traceBatchSize = 16;
+    mysqlnd_azure_globals->traceId[0] = '\0';
+    mysqlnd_azure_globals->traceParentSpanId[0] = '\0';
+    mysqlnd_azure_globals->traceSampled = TRUE;
+    memset(&mysqlnd_azure_globals->traceBuffer, 0, sizeof(smart_str));
+    mysqlnd_azure_globals->traceBuffered = 0;
     mysqlnd_azure_globals->logLevel = 0;
 	mysqlnd_azure_globals->logOutput = 0;
 	mysqlnd_azure_globals->logfilePath = "";
+    mysqlnd_azure_globals->logEventSampleRate = 0;
+    mysqlnd_azure_globals->logEventOnError = 0;
+    mysqlnd_azure_globals->connectEvent = NULL;
 }
 /* }}} */
 
@@ -112,8 +213,7 @@ static PHP_GINIT_FUNCTION(mysqlnd_azure)
 static PHP_GSHUTDOWN_FUNCTION(mysqlnd_azure)
 {
     if (mysqlnd_azure_globals->redirectCache) {
-        zend_hash_destroy(mysqlnd_azure_globals->redirectCache);
-        mnd_pefree(mysqlnd_azure_globals->redirectCache, 1);
+        mysqlnd_azure_free_redirect_cache(mysqlnd_azure_globals->redirectCache);
         mysqlnd_azure_globals->redirectCache = NULL;
     }
 }
@@ -128,7 +228,16 @@ static PHP_MINIT_FUNCTION(mysqlnd_azure)
   /* register mysqlnd plugin */
   mysqlnd_azure_minit_register_hooks();
 
+  mysqlnd_azure_redirect_cache_startup();
+  mysqlnd_azure_lease_startup();
+  mysqlnd_azure_admission_startup();
+  mysqlnd_azure_replica_startup();
+  mysqlnd_azure_probe_startup();
+  mysqlnd_azure_metrics_startup();
+
   mysqlnd_azure_apply_resources();
+  //after the log file is open, parse errors are logged
+  mysqlnd_azure_policy_startup();
 
   return SUCCESS;
 }
@@ -137,13 +246,129 @@ static PHP_MINIT_FUNCTION(mysqlnd_azure)
  */
 static PHP_MSHUTDOWN_FUNCTION(mysqlnd_azure)
 {
+    mysqlnd_azure_policy_shutdown();
     mysqlnd_azure_release_resources();
 
+    mysqlnd_azure_redirect_cache_shutdown();
+    mysqlnd_azure_lease_shutdown();
+    mysqlnd_azure_admission_shutdown();
+    mysqlnd_azure_replica_shutdown();
+    mysqlnd_azure_probe_shutdown();
+    mysqlnd_azure_metrics_shutdown();
+    mysqlnd_azure_shm_free_all();
+
     UNREGISTER_INI_ENTRIES();
 
     return SUCCESS;
 }
 
+/* {{{ PHP_RINIT_FUNCTION
+ */
+static PHP_RINIT_FUNCTION(mysqlnd_azure)
+{
+#if defined(COMPILE_DL_MYSQLND_AZURE) && defined(ZTS)
+    ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+    MYSQLND_AZURE_G(requestCount)++;
+    mysqlnd_azure_mem_request_startup();
+    mysqlnd_azure_trace_reset_parent();
+
+    return SUCCESS;
+}
+/* }}} */
+
+/* {{{ PHP_RSHUTDOWN_FUNCTION
+ */
+static PHP_RSHUTDOWN_FUNCTION(mysqlnd_azure)
+{
+    //queued proxy conns and the queue itself are request memory
+    mysqlnd_azure_close_deferred();
+
+    //the trace buffer is request memory
+    mysqlnd_azure_trace_flush();
+
+    //at most one probe round per probeInterval, bounded as it still adds to this request's time
+    mysqlnd_azure_probe_targets(FALSE);
+
+    return SUCCESS;
+}
+/* }}} */
+
+/* {{{ proto int mysqlnd_azure_probe()
+   Probe the cached redirect targets now, returns the number of cache entries which lost a target */
+static PHP_FUNCTION(mysqlnd_azure_probe)
+{
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+
+    RETURN_LONG(mysqlnd_azure_probe_targets(TRUE));
+}
+/* }}} */
+
+/* {{{ proto bool mysqlnd_azure_set_trace_parent(string traceparent)
+   Parent context (W3C traceparent) for the connect spans of the rest of the request */
+static PHP_FUNCTION(mysqlnd_azure_set_trace_parent)
+{
+    char* traceparent;
+    size_t traceparent_len;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "s", &traceparent, &traceparent_len) == FAILURE) {
+        return;
+    }
+
+    RETURN_BOOL(mysqlnd_azure_trace_set_parent(traceparent, traceparent_len) == PASS);
+}
+/* }}} */
+
+/* {{{ proto string mysqlnd_azure_metrics()
+   Connect counters of all workers in the Prometheus text exposition format */
+static PHP_FUNCTION(mysqlnd_azure_metrics)
+{
+    smart_str buf = {0};
+
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+
+    mysqlnd_azure_metrics_render(&buf);
+    smart_str_0(&buf);
+    if (buf.s == NULL) {
+        RETURN_EMPTY_STRING();
+    }
+    RETURN_NEW_STR(buf.s);
+}
+/* }}} */
+
+/* {{{ proto array mysqlnd_azure_memory_stats()
+   Memory held by the plugin per category and in total, persistent for the process and request for the current request */
+static PHP_FUNCTION(mysqlnd_azure_memory_stats)
+{
+    int category;
+
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+
+    array_init(return_value);
+    for (category = 0; category <= AZURE_MEM_COUNT; category++) {
+        MYSQLND_AZURE_MEM_STATS stats;
+        zval row;
+
+        mysqlnd_azure_mem_stats((mysqlnd_azure_mem_category)category, &stats);
+        array_init(&row);
+        add_assoc_long(&row, "persistent", (zend_long)stats.persistent);
+        add_assoc_long(&row, "persistent_peak", (zend_long)stats.persistent_peak);
+        add_assoc_long(&row, "request", (zend_long)stats.request);
+        add_assoc_long(&row, "request_peak", (zend_long)stats.request_peak);
+        add_assoc_long(&row, "allocations", (zend_long)stats.allocations);
+        add_assoc_long(&row, "frees", (zend_long)stats.frees);
+        add_assoc_long(&row, "allocated", (zend_long)stats.allocated);
+        add_assoc_zval(return_value, mysqlnd_azure_mem_category_name((mysqlnd_azure_mem_category)category), &row);
+    }
+}
+/* }}} */
+
 /* {{{ PHP_MINFO_FUNCTION
  */
 PHP_MINFO_FUNCTION(mysqlnd_azure)
@@ -152,16 +377,87 @@ PHP_MINFO_FUNCTION(mysqlnd_azure)
     php_info_print_table_start();
     php_info_print_table_header(2, "mysqlnd_azure", "enableRedirect");
     php_info_print_table_row(2, "enableRedirect", MYSQLND_AZURE_G(enableRedirect) == REDIRECT_OFF ? "off" : (MYSQLND_AZURE_G(enableRedirect) == REDIRECT_ON ? "on" : "preferred"));
+    php_info_print_table_row(2, "autoReconnect", MYSQLND_AZURE_G(autoReconnect) == RECONNECT_OFF ? "off" : (MYSQLND_AZURE_G(autoReconnect) == RECONNECT_ON ? "on" : "replay"));
     php_info_print_table_row(2, "logfilePath", ZSTR_VAL(MYSQLND_AZURE_G(logfilePath)));
     char tmp[2];
     snprintf(tmp, 2, "%d", MYSQLND_AZURE_G(logLevel));
     php_info_print_table_row(2, "logLevel", tmp);
     snprintf(tmp, 2, "%d", MYSQLND_AZURE_G(logOutput));
     php_info_print_table_row(2, "logOutput", tmp);
+    char rate[32];
+    snprintf(rate, sizeof(rate), "%g", MYSQLND_AZURE_G(logEventSampleRate));
+    php_info_print_table_row(2, "logEventSampleRate", rate);
+    php_info_print_table_row(2, "logEventOnError", MYSQLND_AZURE_G(logEventOnError) ? "1" : "0");
+    MYSQLND_AZURE_REDIRECT_CACHE_STATS cache_stats;
+    mysqlnd_azure_redirect_cache_stats(&cache_stats);
+    char cache_info[64];
+    snprintf(cache_info, sizeof(cache_info), "%zu", cache_stats.max_entries);
+    php_info_print_table_row(2, "redirectCacheSize", cache_info);
+    snprintf(cache_info, sizeof(cache_info), "%zu", cache_stats.entries);
+    php_info_print_table_row(2, "redirectCache entries", cache_info);
+    snprintf(cache_info, sizeof(cache_info), "%zu bytes", cache_stats.memory);
+    php_info_print_table_row(2, "redirectCache memory", cache_info);
+    snprintf(cache_info, sizeof(cache_info), ZEND_LONG_FMT, MYSQLND_AZURE_G(discoveryWaitMs));
+    php_info_print_table_row(2, "discoveryWaitMs", cache_info);
+    php_info_print_table_row(2, "redirectPolicy", MYSQLND_AZURE_G(redirectPolicy) ? MYSQLND_AZURE_G(redirectPolicy) : "");
+    snprintf(cache_info, sizeof(cache_info), ZEND_LONG_FMT "s / " ZEND_LONG_FMT "s / " ZEND_LONG_FMT, MYSQLND_AZURE_G(keepaliveIdle), MYSQLND_AZURE_G(keepaliveInterval), MYSQLND_AZURE_G(keepaliveCount));
+    php_info_print_table_row(2, "keepaliveIdle / Interval / Count", cache_info);
+    snprintf(cache_info, sizeof(cache_info), ZEND_LONG_FMT, MYSQLND_AZURE_G(deferProxyClose));
+    php_info_print_table_row(2, "deferProxyClose", cache_info);
+    snprintf(cache_info, sizeof(cache_info), ZEND_LONG_FMT "s / " ZEND_LONG_FMT "s", MYSQLND_AZURE_G(maxConnectionLifetime), MYSQLND_AZURE_G(connectionLifetimeJitter));
+    php_info_print_table_row(2, "maxConnectionLifetime / Jitter", cache_info);
+    php_info_print_table_row(2, "livenessCheck", MYSQLND_AZURE_G(livenessCheck) ? "1" : "0");
+    snprintf(cache_info, sizeof(cache_info), ZEND_LONG_FMT, MYSQLND_AZURE_G(livenessSkipMs));
+    php_info_print_table_row(2, "livenessSkipMs", cache_info);
+    snprintf(cache_info, sizeof(cache_info), ZEND_LONG_FMT, MYSQLND_AZURE_G(compressionThresholdMs));
+    php_info_print_table_row(2, "compressionThresholdMs", cache_info);
+    php_info_print_table_row(2, "inferTargets", MYSQLND_AZURE_G(inferTargets) ? "1" : "0");
+    snprintf(cache_info, sizeof(cache_info), ZEND_LONG_FMT "/s / " ZEND_LONG_FMT " / " ZEND_LONG_FMT "ms", MYSQLND_AZURE_G(connectRate), MYSQLND_AZURE_G(connectBurst), MYSQLND_AZURE_G(connectWaitMs));
+    php_info_print_table_row(2, "connectRate / Burst / WaitMs", cache_info);
+    php_info_print_table_row(2, "readReplicas", MYSQLND_AZURE_G(readReplicas) ? MYSQLND_AZURE_G(readReplicas) : "");
+    php_info_print_table_row(2, "readReplicaPolicy", MYSQLND_AZURE_G(readReplicaPolicy) == REPLICA_POLICY_LATENCY ? "latency" : "least_outstanding");
+    snprintf(cache_info, sizeof(cache_info), ZEND_LONG_FMT, MYSQLND_AZURE_G(probeInterval));
+    php_info_print_table_row(2, "probeInterval", cache_info);
+    snprintf(cache_info, sizeof(cache_info), ZEND_LONG_FMT, MYSQLND_AZURE_G(probeTimeoutMs));
+    php_info_print_table_row(2, "probeTimeoutMs", cache_info);
+    php_info_print_table_row(2, "traceFile", MYSQLND_AZURE_G(traceFile) ? MYSQLND_AZURE_G(traceFile) : "");
+    snprintf(cache_info, sizeof(cache_info), ZEND_LONG_FMT, MYSQLND_AZURE_G(traceBatchSize));
+    php_info_print_table_row(2, "traceBatchSize", cache_info);
+    MYSQLND_AZURE_MEM_STATS mem_stats;
+    mysqlnd_azure_mem_stats(AZURE_MEM_COUNT, &mem_stats);
+    snprintf(cache_info, sizeof(cache_info), "%llu / %llu bytes", (unsigned long long)mem_stats.persistent, (unsigned long long)mem_stats.persistent_peak);
+    php_info_print_table_row(2, "memory persistent / peak", cache_info);
+    snprintf(cache_info, sizeof(cache_info), "%llu / %llu bytes", (unsigned long long)mem_stats.request, (unsigned long long)mem_stats.request_peak);
+    php_info_print_table_row(2, "memory request / peak", cache_info);
+    snprintf(cache_info, sizeof(cache_info), "%llu / %llu", (unsigned long long)mem_stats.allocations, (unsigned long long)mem_stats.frees);
+    php_info_print_table_row(2, "memory allocations / frees", cache_info);
     php_info_print_table_end();
 }
 /* }}} */
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_mysqlnd_azure_probe, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_mysqlnd_azure_metrics, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_mysqlnd_azure_memory_stats, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_mysqlnd_azure_set_trace_parent, 0, 0, 1)
+    ZEND_ARG_INFO(0, traceparent)
+ZEND_END_ARG_INFO()
+
+/* {{{ mysqlnd_azure_functions[] */
+static const zend_function_entry mysqlnd_azure_functions[] = {
+    PHP_FE(mysqlnd_azure_probe, arginfo_mysqlnd_azure_probe)
+    PHP_FE(mysqlnd_azure_metrics, arginfo_mysqlnd_azure_metrics)
+    PHP_FE(mysqlnd_azure_memory_stats, arginfo_mysqlnd_azure_memory_stats)
+    PHP_FE(mysqlnd_azure_set_trace_parent, arginfo_mysqlnd_azure_set_trace_parent)
+    PHP_FE_END
+};
+/* }}} */
+
 static const zend_module_dep mysqlnd_azure_deps[] = {
     ZEND_MOD_REQUIRED("mysqlnd")
     ZEND_MOD_END
@@ -173,11 +469,11 @@ zend_module_entry mysqlnd_azure_module_entry = {
     NULL,
     mysqlnd_azure_deps,
     PHP_MYSQLND_AZURE_NAME,
-    NULL,
+    mysqlnd_azure_functions,
     PHP_MINIT(mysqlnd_azure),
     PHP_MSHUTDOWN(mysqlnd_azure),
-    NULL,
-    NULL,
+    PHP_RINIT(mysqlnd_azure),
+    PHP_RSHUTDOWN(mysqlnd_azure),
     PHP_MINFO(mysqlnd_azure),
     PHP_MYSQLND_AZURE_VERSION,
     PHP_MODULE_GLOBALS(mysqlnd_azure),
@@ -24,6 +24,7 @@
 #endif
 
 #include "php.h"
+#include "zend_smart_str.h"
 
 extern zend_module_entry mysqlnd_azure_module_entry;
 #define phpext_mysqlnd_azure_ptr &mysqlnd_azure_module_entry
@@ -39,12 +40,74 @@ typedef enum _mysqlnd_azure_redirect_mode {
     REDIRECT_PREFERRED = 2  /* enabled with fallback */
 } mysqlnd_azure_redirect_mode;
 
+typedef enum _mysqlnd_azure_reconnect_mode {
+    RECONNECT_OFF = 0,      /* connection lost errors are returned as they are */
+    RECONNECT_ON = 1,       /* reconnect through gateway and redirect, the failed statement still reports its error */
+    RECONNECT_REPLAY = 2    /* reconnect, and run the failed statement again when it is a read outside a transaction */
+} mysqlnd_azure_reconnect_mode;
+
+typedef enum _mysqlnd_azure_replica_policy {
+    REPLICA_POLICY_LEAST_OUTSTANDING = 0,   /* replica with the fewest replica conns open over all workers */
+    REPLICA_POLICY_LATENCY = 1              /* replica with the lowest smoothed read time */
+} mysqlnd_azure_replica_policy;
+
+typedef enum _mysqlnd_azure_mem_category {
+    AZURE_MEM_REDIRECT_CACHE = 0,   /* redirect cache blocks */
+    AZURE_MEM_CONN_DATA,            /* per connection data with its copies of the connect arguments */
+    AZURE_MEM_CONN_OPTIONS,         /* init commands and connect attributes copied to redirect conns, owned by mysqlnd */
+    AZURE_MEM_CONN_HANDLES,         /* duplicate conn objects of the redirect, cache and replica connects, owned by mysqlnd */
+    AZURE_MEM_DEFERRED_CLOSE,       /* queue of mysqlnd_azure.deferProxyClose */
+    AZURE_MEM_TABLES,               /* policy, replica, probe and metrics tables outside the shared region */
+    AZURE_MEM_COUNT
+} mysqlnd_azure_mem_category;
+
+struct st_mysqlnd_azure_connect_event;
+struct st_mysqlnd_azure_redirect_cache;
+
 ZEND_BEGIN_MODULE_GLOBALS(mysqlnd_azure)
     mysqlnd_azure_redirect_mode     enableRedirect;
-    HashTable*                      redirectCache;
+    mysqlnd_azure_reconnect_mode    autoReconnect;
+    struct st_mysqlnd_azure_redirect_cache* redirectCache;
+    zend_long                       redirectCacheSize;
+    zend_long                       discoveryWaitMs;
+    char*                           redirectPolicy;
+    zend_long                       keepaliveIdle;
+    zend_long                       keepaliveInterval;
+    zend_long                       keepaliveCount;
+    zend_long                       deferProxyClose;
+    struct st_mysqlnd_connection_data** deferredClose; /* proxy conns closed at request end */
+    int                             deferredCloseCount;
+    int                             deferredCloseSize;
+    uint64_t                        memRequest[AZURE_MEM_COUNT + 1];     /* request memory held per category, last: total */
+    uint64_t                        memRequestPeak[AZURE_MEM_COUNT + 1]; /* highest memRequest of the current request */
+    zend_long                       maxConnectionLifetime;
+    zend_long                       connectionLifetimeJitter;
+    zend_bool                       livenessCheck;
+    zend_long                       livenessSkipMs;
+    zend_long                       compressionThresholdMs;
+    zend_bool                       inferTargets;
+    zend_long                       connectRate;
+    zend_long                       connectBurst;
+    zend_long                       connectWaitMs;
+    char*                           readReplicas;
+    mysqlnd_azure_replica_policy    readReplicaPolicy;
+    uint64_t                        requestCount;   /* number of the current request, for read-your-writes */
+    zend_long                       probeInterval;
+    zend_long                       probeTimeoutMs;
+    uint64_t                        probeLastMs;    /* start of the last probe round of this process */
+    char*                           traceFile;
+    zend_long                       traceBatchSize;
+    char                            traceId[33];    /* from mysqlnd_azure_set_trace_parent(), empty: new trace per connect */
+    char                            traceParentSpanId[17];
+    zend_bool                       traceSampled;
+    smart_str                       traceBuffer;    /* spans not written yet */
+    int                             traceBuffered;  /* connects in traceBuffer */
     zend_string*                    logfilePath;
     int                             logLevel;
     int                             logOutput;
+    double                          logEventSampleRate;
+    zend_bool                       logEventOnError;
+    struct st_mysqlnd_azure_connect_event* connectEvent;
 ZEND_END_MODULE_GLOBALS(mysqlnd_azure)
 
 PHPAPI ZEND_EXTERN_MODULE_GLOBALS(mysqlnd_azure)
@@ -28,101 +28,922 @@
 #include "ext/mysqlnd/mysqlnd_structs.h"
 #include "ext/mysqlnd/mysqlnd_statistics.h"
 #include "ext/mysqlnd/mysqlnd_connection.h"
+#include "utils.h"
+#include <time.h>
+#if defined(ZTS) && !defined(PHP_WIN32)
+#include <sched.h>
+#endif
+
+/*
+  The redirect cache is one contiguous block: a header, a slab of fixed-size records with
+  key and redirect target inlined, and an open-addressing (linear probing) index over the
+  slab. The block holds no pointers, records are addressed by number, so it can be moved,
+  grown by copying, snapshotted or placed into shared memory as is.
+
+  The slab starts small and doubles up to mysqlnd_azure.redirectCacheSize records, after
+  that the CLOCK hand evicts an entry which has not been hit since the last sweep.
+  Entries expire after the ttl the server sent with the redirect message, if any.
+
+  An entry keeps up to MAX_REDIRECT_TARGETS targets, in the order the server listed them,
+  each with a smoothed connect time and failure rate fed by mysqlnd_azure_redirect_cache_report().
+  Lookups hand them out best first: targets which did not fail recently before the others,
+  then targets not measured yet, then the fastest. A target which failed gets another chance
+  REDIRECT_TARGET_RETRY_SECONDS after its last failure.
+
+  With mysqlnd_azure.inferTargets, the targets of a successful redirect are also kept under
+  the user MYSQLND_AZURE_HOST_USER of the same host and port, with the redirect user replaced by
+  the rule it follows from the login name: unchanged, the base (the part before '@') alone, or
+  the base plus a suffix. A user not seen yet, whose name has the form of the one the rule was
+  learned from, then gets its targets from that host entry, see mysqlnd_azure_infer_redirect_cache_targets().
+
+  Non-ZTS builds keep the cache in the module globals. ZTS builds keep one cache for the
+  whole process, so a redirect learned by one thread is used by all of them: writers are
+  serialized by a mutex and bump the block's sequence number around every change, readers
+  take no lock, they copy the entry out and retry when the sequence number moved (seqlock).
+  A block replaced by a bigger one is retired, as readers may still be on it. Readers count
+  themselves in cache_readers while they use a block, a writer frees the retired blocks as
+  soon as it sees that count at zero after the replacement was published.
+*/
+
+#define REDIRECT_CACHE_MIN_ENTRIES 16
+
+#define REDIRECT_TARGET_FAILURE_ONE 1024    /* fixed point 1.0 of the failure rate */
+#define REDIRECT_TARGET_UNHEALTHY 512       /* failure rate from which a target goes behind the healthy ones */
+#define REDIRECT_TARGET_RETRY_SECONDS 10
+
+/*one redirect target of an entry with its connect statistics*/
+typedef struct st_mysqlnd_azure_redirect_cache_target {
+    MYSQLND_AZURE_REDIRECT_INFO info;
+    uint32_t srtt_us;                   /* smoothed connect time, 0: not measured yet */
+    uint32_t failures;                  /* smoothed failure rate, 0..REDIRECT_TARGET_FAILURE_ONE */
+    time_t failed_at;                   /* last failed connect, 0: never */
+} MYSQLND_AZURE_REDIRECT_CACHE_TARGET;
+
+/*one slab record*/
+typedef struct st_mysqlnd_azure_redirect_cache_entry {
+    char user[MAX_REDIRECT_USER_LEN + 1];
+    char host[MAX_REDIRECT_HOST_LEN + 1];
+    unsigned int port;
+    uint32_t hash;
+    uint32_t next_free;                 /* free list link, record number + 1 */
+    zend_bool in_use;
+    zend_bool referenced;               /* CLOCK bit, set by a hit, cleared by the sweep */
+    time_t expires;                     /* 0: no ttl */
+    uint32_t target_count;
+    MYSQLND_AZURE_REDIRECT_CACHE_TARGET targets[MAX_REDIRECT_TARGETS];
+} MYSQLND_AZURE_REDIRECT_CACHE_ENTRY;
+
+/*index slot, the hash is kept here so probing does not touch the records*/
+typedef struct st_mysqlnd_azure_redirect_cache_slot {
+    uint32_t hash;
+    uint32_t entry;                     /* record number + 1, 0: empty slot */
+} MYSQLND_AZURE_REDIRECT_CACHE_SLOT;
+
+struct st_mysqlnd_azure_redirect_cache {
+    volatile uint32_t seq;              /* odd while a writer changes the block */
+    size_t size;                        /* bytes of the whole block */
+    uint32_t allocated;                 /* records in the slab */
+    uint32_t used;                      /* records [used, allocated) were never handed out */
+    uint32_t count;                     /* live entries */
+    uint32_t free_head;                 /* record number + 1, 0: empty free list */
+    uint32_t clock_hand;
+    uint32_t slot_mask;                 /* slots - 1, slots is a power of two >= 2 * allocated */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t expirations;
+};
+
+#define REDIRECT_CACHE_ENTRIES(cache) \
+    ((MYSQLND_AZURE_REDIRECT_CACHE_ENTRY*)((char*)(cache) + ZEND_MM_ALIGNED_SIZE(sizeof(MYSQLND_AZURE_REDIRECT_CACHE))))
+#define REDIRECT_CACHE_SLOTS(cache) \
+    ((MYSQLND_AZURE_REDIRECT_CACHE_SLOT*)(REDIRECT_CACHE_ENTRIES(cache) + (cache)->allocated))
+
+#ifdef ZTS
+#define REDIRECT_CACHE_MAX_RETIRED 32
+static MYSQLND_AZURE_REDIRECT_CACHE* process_cache = NULL;
+static MUTEX_T process_cache_mutex = NULL;
+static MYSQLND_AZURE_REDIRECT_CACHE* retired_caches[REDIRECT_CACHE_MAX_RETIRED];
+static int retired_count = 0;
+static volatile uint32_t cache_readers = 0;    /* lock free readers inside any block */
+
+#define REDIRECT_CACHE_CURRENT()    ((MYSQLND_AZURE_REDIRECT_CACHE*)mysqlnd_azure_atomic_load_ptr((void* volatile*)&process_cache))
+#define REDIRECT_CACHE_PUBLISH(c)   mysqlnd_azure_atomic_store_ptr((void* volatile*)&process_cache, (c))
+#define REDIRECT_CACHE_LOCK()       tsrm_mutex_lock(process_cache_mutex)
+#define REDIRECT_CACHE_UNLOCK()     tsrm_mutex_unlock(process_cache_mutex)
+//a reader counts itself before it loads the block, the fence pairs with the one of redirect_cache_reclaim()
+#define REDIRECT_CACHE_READ_BEGIN() do { mysqlnd_azure_atomic_inc_u32(&cache_readers); mysqlnd_azure_atomic_fence(); } while (0)
+#define REDIRECT_CACHE_READ_END()   mysqlnd_azure_atomic_dec_u32(&cache_readers)
+#else
+#define REDIRECT_CACHE_CURRENT()    MYSQLND_AZURE_G(redirectCache)
+#define REDIRECT_CACHE_PUBLISH(c)   (MYSQLND_AZURE_G(redirectCache) = (c))
+#define REDIRECT_CACHE_LOCK()
+#define REDIRECT_CACHE_UNLOCK()
+#define REDIRECT_CACHE_READ_BEGIN()
+#define REDIRECT_CACHE_READ_END()
+#endif
+
+#ifdef ZTS
+/* {{{ redirect_cache_reclaim, free the retired blocks once no lock free reader is inside a block, called with the lock held.
+  Every retired block was replaced by a published one, readers counted from now on load that one, so with the count at
+  zero none can still be on a retired block. With wait the caller spins until the readers left, they never take the lock */
+static void redirect_cache_reclaim(zend_bool wait)
+{
+    int i;
+
+    if (retired_count == 0) {
+        return;
+    }
+    mysqlnd_azure_atomic_fence();
+    while (mysqlnd_azure_atomic_load_u32(&cache_readers) != 0) {
+        if (!wait) {
+            return;
+        }
+#ifndef PHP_WIN32
+        sched_yield();
+#else
+        SwitchToThread();
+#endif
+    }
+    AZURE_LOG(ALOG_LEVEL_DBG, "redirect cache frees %d retired blocks", retired_count);
+    for (i = 0; i < retired_count; i++) {
+        mysqlnd_azure_free_redirect_cache(retired_caches[i]);
+        retired_caches[i] = NULL;
+    }
+    retired_count = 0;
+}
+/* }}} */
+#endif
 
-/* {{{ mysqlnd_azure_redirect_info_dtor */
-static void mysqlnd_azure_redirect_info_dtor(zval *zv)
+/* {{{ redirect_cache_write_begin */
+static void redirect_cache_write_begin(MYSQLND_AZURE_REDIRECT_CACHE* cache)
 {
-    MYSQLND_AZURE_REDIRECT_INFO *redirect_info = (MYSQLND_AZURE_REDIRECT_INFO*)Z_PTR_P(zv);
+    mysqlnd_azure_atomic_store_u32(&cache->seq, cache->seq + 1);
+    mysqlnd_azure_atomic_fence();
+}
+/* }}} */
+
+/* {{{ redirect_cache_write_end */
+static void redirect_cache_write_end(MYSQLND_AZURE_REDIRECT_CACHE* cache)
+{
+    mysqlnd_azure_atomic_store_u32(&cache->seq, cache->seq + 1);
+}
+/* }}} */
 
-    if (redirect_info != NULL) {
+/* {{{ redirect_cache_hash, FNV-1a over user, host and port */
+static uint32_t redirect_cache_hash(const char* user, const char* host, unsigned int port)
+{
+    uint32_t hash = 2166136261u;
+    const unsigned char* p;
 
-        if (redirect_info->redirect_user) {
-            mnd_pefree(redirect_info->redirect_user, 1);
-            redirect_info->redirect_user = NULL;
+    for (p = (const unsigned char*)user; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    hash = (hash ^ 0xff) * 16777619u;
+    for (p = (const unsigned char*)host; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    hash = (hash ^ (port & 0xff)) * 16777619u;
+    hash = (hash ^ ((port >> 8) & 0xff)) * 16777619u;
+
+    return hash;
+}
+/* }}} */
+
+/* {{{ redirect_cache_key_fits */
+static zend_bool redirect_cache_key_fits(const char* user, const char* host)
+{
+    return user != NULL && host != NULL
+        && strlen(user) <= MAX_REDIRECT_USER_LEN && strlen(host) <= MAX_REDIRECT_HOST_LEN;
+}
+/* }}} */
+
+/* {{{ redirect_cache_same_target */
+static zend_bool redirect_cache_same_target(const MYSQLND_AZURE_REDIRECT_INFO* a, const MYSQLND_AZURE_REDIRECT_INFO* b)
+{
+    return a->redirect_port == b->redirect_port && strcmp(a->redirect_host, b->redirect_host) == 0
+        && strcmp(a->redirect_user, b->redirect_user) == 0;
+}
+/* }}} */
+
+/* {{{ redirect_cache_target_healthy */
+static zend_bool redirect_cache_target_healthy(const MYSQLND_AZURE_REDIRECT_CACHE_TARGET* target, time_t now)
+{
+    return target->failures < REDIRECT_TARGET_UNHEALTHY || target->failed_at + REDIRECT_TARGET_RETRY_SECONDS <= now;
+}
+/* }}} */
+
+/* {{{ redirect_cache_target_before, whether a is to be tried before b */
+static zend_bool redirect_cache_target_before(const MYSQLND_AZURE_REDIRECT_CACHE_TARGET* a, const MYSQLND_AZURE_REDIRECT_CACHE_TARGET* b, time_t now)
+{
+    zend_bool a_healthy = redirect_cache_target_healthy(a, now);
+    zend_bool b_healthy = redirect_cache_target_healthy(b, now);
+
+    if (a_healthy != b_healthy) {
+        return a_healthy;
+    }
+    if (!a_healthy) {
+        return a->failures < b->failures;
+    }
+    //0 is not measured yet, so every target gets a sample before the fastest one takes over
+    return a->srtt_us < b->srtt_us;
+}
+/* }}} */
+
+/* {{{ redirect_cache_block_size */
+static size_t redirect_cache_block_size(uint32_t allocated, uint32_t* slots)
+{
+    uint32_t n = 1;
+    while (n < 2 * allocated) {
+        n <<= 1;
+    }
+    *slots = n;
+    return ZEND_MM_ALIGNED_SIZE(sizeof(MYSQLND_AZURE_REDIRECT_CACHE))
+        + allocated * sizeof(MYSQLND_AZURE_REDIRECT_CACHE_ENTRY)
+        + n * sizeof(MYSQLND_AZURE_REDIRECT_CACHE_SLOT);
+}
+/* }}} */
+
+/* {{{ redirect_cache_resize, copy the used records into a block of the new size and rebuild the index */
+static MYSQLND_AZURE_REDIRECT_CACHE* redirect_cache_resize(MYSQLND_AZURE_REDIRECT_CACHE* old, uint32_t allocated)
+{
+    uint32_t slots;
+    size_t size = redirect_cache_block_size(allocated, &slots);
+    MYSQLND_AZURE_REDIRECT_CACHE* cache = AZURE_MND_PEMALLOC(size, 1, AZURE_MEM_REDIRECT_CACHE);
+    MYSQLND_AZURE_REDIRECT_CACHE_ENTRY* entries;
+    MYSQLND_AZURE_REDIRECT_CACHE_SLOT* index;
+    uint32_t n;
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    if (old != NULL) {
+        *cache = *old;
+    } else {
+        memset(cache, 0, sizeof(MYSQLND_AZURE_REDIRECT_CACHE));
+    }
+    cache->size = size;
+    cache->allocated = allocated;
+    cache->slot_mask = slots - 1;
+
+    entries = REDIRECT_CACHE_ENTRIES(cache);
+    index = REDIRECT_CACHE_SLOTS(cache);
+    memset(index, 0, slots * sizeof(MYSQLND_AZURE_REDIRECT_CACHE_SLOT));
+    if (old != NULL) {
+        memcpy(entries, REDIRECT_CACHE_ENTRIES(old), old->used * sizeof(MYSQLND_AZURE_REDIRECT_CACHE_ENTRY));
+        for (n = 0; n < cache->used; n++) {
+            if (entries[n].in_use) {
+                uint32_t i = entries[n].hash & cache->slot_mask;
+                while (index[i].entry) {
+                    i = (i + 1) & cache->slot_mask;
+                }
+                index[i].hash = entries[n].hash;
+                index[i].entry = n + 1;
+            }
         }
-        if (redirect_info->redirect_host) {
-            mnd_pefree(redirect_info->redirect_host, 1);
-            redirect_info->redirect_host = NULL;
+#ifdef ZTS
+        //old is still published, only the blocks retired before it can go
+        if (retired_count == REDIRECT_CACHE_MAX_RETIRED) {
+            redirect_cache_reclaim(TRUE);
         }
+        retired_caches[retired_count++] = old;
+#else
+        AZURE_MND_PEFREE(old, old->size, 1, AZURE_MEM_REDIRECT_CACHE);
+#endif
+    }
+
+    return cache;
+}
+/* }}} */
 
-        mnd_pefree(redirect_info, 1);
-        redirect_info = NULL;
-      
+/* {{{ redirect_cache_lookup, slot of the key or -1 */
+static int redirect_cache_lookup(const MYSQLND_AZURE_REDIRECT_CACHE* cache, uint32_t hash, const char* user, const char* host, unsigned int port)
+{
+    const MYSQLND_AZURE_REDIRECT_CACHE_SLOT* index = REDIRECT_CACHE_SLOTS(cache);
+    const MYSQLND_AZURE_REDIRECT_CACHE_ENTRY* entries = REDIRECT_CACHE_ENTRIES(cache);
+    uint32_t i = hash & cache->slot_mask;
+    uint32_t probes;
+
+    /* bounded, a lock free reader may look at a block a writer is changing */
+    for (probes = 0; probes <= cache->slot_mask && index[i].entry; probes++) {
+        if (index[i].hash == hash && index[i].entry <= cache->used) {
+            const MYSQLND_AZURE_REDIRECT_CACHE_ENTRY* entry = &entries[index[i].entry - 1];
+            if (entry->port == port && strncmp(entry->user, user, MAX_REDIRECT_USER_LEN + 1) == 0
+                && strncmp(entry->host, host, MAX_REDIRECT_HOST_LEN + 1) == 0) {
+                return (int)i;
+            }
+        }
+        i = (i + 1) & cache->slot_mask;
     }
 
+    return -1;
 }
 /* }}} */
 
-/* {{{ mysqlnd_azure_add_redirect_cache */
-enum_func_status mysqlnd_azure_add_redirect_cache(const char* user, const char* host, int port, const char* redirect_user, const char* redirect_host, int redirect_port)
+/* {{{ redirect_cache_unlink, drop the entry of a slot, backward shift keeps the probe sequences intact */
+static void redirect_cache_unlink(MYSQLND_AZURE_REDIRECT_CACHE* cache, uint32_t slot)
 {
-    if (MYSQLND_AZURE_G(redirectCache) == NULL) {
-        MYSQLND_AZURE_G(redirectCache) = mnd_pemalloc(sizeof(HashTable), 1);
-        if(MYSQLND_AZURE_G(redirectCache) == NULL) {
+    MYSQLND_AZURE_REDIRECT_CACHE_SLOT* index = REDIRECT_CACHE_SLOTS(cache);
+    MYSQLND_AZURE_REDIRECT_CACHE_ENTRY* entry = &REDIRECT_CACHE_ENTRIES(cache)[index[slot].entry - 1];
+    uint32_t i = slot, j = slot;
+
+    entry->in_use = FALSE;
+    entry->next_free = cache->free_head;
+    cache->free_head = index[slot].entry;
+    cache->count--;
+
+    for (;;) {
+        uint32_t home;
+        j = (j + 1) & cache->slot_mask;
+        if (!index[j].entry) {
+            break;
+        }
+        home = index[j].hash & cache->slot_mask;
+        /* leave j alone if its home lies cyclically in (i, j] */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+            continue;
+        }
+        index[i] = index[j];
+        i = j;
+    }
+    index[i].hash = 0;
+    index[i].entry = 0;
+}
+/* }}} */
+
+/* {{{ redirect_cache_evict, CLOCK sweep until an expired or not recently hit entry is found */
+static void redirect_cache_evict(MYSQLND_AZURE_REDIRECT_CACHE* cache, time_t now)
+{
+    MYSQLND_AZURE_REDIRECT_CACHE_ENTRY* entries = REDIRECT_CACHE_ENTRIES(cache);
+
+    while (cache->count > 0) {
+        MYSQLND_AZURE_REDIRECT_CACHE_ENTRY* entry = &entries[cache->clock_hand];
+        cache->clock_hand = (cache->clock_hand + 1) % cache->used;
+        if (!entry->in_use) {
+            continue;
+        }
+        if (entry->referenced && !(entry->expires && entry->expires <= now)) {
+            entry->referenced = FALSE;
+            continue;
+        }
+        AZURE_LOG(ALOG_LEVEL_DBG, "redirect cache full, evict %s_%s_%u", entry->user, entry->host, entry->port);
+        redirect_cache_unlink(cache, (uint32_t)redirect_cache_lookup(cache, entry->hash, entry->user, entry->host, entry->port));
+        cache->evictions++;
+        return;
+    }
+}
+/* }}} */
+
+/* {{{ redirect_cache_insert, called with the cache lock held */
+static enum_func_status redirect_cache_insert(MYSQLND_AZURE_REDIRECT_CACHE* cache, uint32_t max_entries, const char* user, const char* host, unsigned int port, const MYSQLND_AZURE_REDIRECT_INFO* targets, int count, unsigned int ttl)
+{
+    MYSQLND_AZURE_REDIRECT_CACHE_ENTRY* entry;
+    MYSQLND_AZURE_REDIRECT_CACHE_SLOT* index;
+    MYSQLND_AZURE_REDIRECT_CACHE_TARGET new_targets[MAX_REDIRECT_TARGETS];
+    uint32_t hash, n, i, new_count = 0;
+    int slot, t;
+
+    //grow before the write starts, readers keep using the old block until the new one is published
+    if (redirect_cache_lookup(cache, redirect_cache_hash(user, host, port), user, host, port) < 0
+        && !cache->free_head && cache->used == cache->allocated && cache->allocated < max_entries) {
+        MYSQLND_AZURE_REDIRECT_CACHE* grown = redirect_cache_resize(cache, MIN(max_entries, 2 * cache->allocated));
+        if (grown == NULL) {
             return FAIL;
         }
-        zend_hash_init(MYSQLND_AZURE_G(redirectCache), 0, NULL, mysqlnd_azure_redirect_info_dtor, 1);
+        cache = grown;
+        REDIRECT_CACHE_PUBLISH(cache);
     }
 
-    char* key = NULL;
-    mnd_sprintf(&key, MAX_REDIRECT_HOST_LEN+ MAX_REDIRECT_USER_LEN+8, "%s_%s_%d", user, host, port);
-    if(!key) {
-        return FAIL;
+    redirect_cache_write_begin(cache);
+    hash = redirect_cache_hash(user, host, port);
+    slot = redirect_cache_lookup(cache, hash, user, host, port);
+    if (slot >= 0) {
+        entry = &REDIRECT_CACHE_ENTRIES(cache)[REDIRECT_CACHE_SLOTS(cache)[slot].entry - 1];
+    } else {
+        entry = NULL;
+    }
+
+    //the targets just learned replace the old ones, a target which stays keeps its statistics
+    for (t = 0; t < count && new_count < MAX_REDIRECT_TARGETS; t++) {
+        MYSQLND_AZURE_REDIRECT_CACHE_TARGET* target = &new_targets[new_count];
+        for (i = 0; i < new_count && !redirect_cache_same_target(&new_targets[i].info, &targets[t]); i++);
+        if (i < new_count) {
+            continue;
+        }
+        memset(target, 0, sizeof(MYSQLND_AZURE_REDIRECT_CACHE_TARGET));
+        for (i = 0; entry != NULL && i < entry->target_count; i++) {
+            if (redirect_cache_same_target(&entry->targets[i].info, &targets[t])) {
+                *target = entry->targets[i];
+                break;
+            }
+        }
+        target->info = targets[t];
+        target->info.ttl = 0;
+        target->info.srtt_us = 0;
+        new_count++;
+    }
+
+    if (entry == NULL) {
+        //take a record: free list, untouched tail, or evict
+        if (!cache->free_head && cache->used == cache->allocated) {
+            redirect_cache_evict(cache, time(NULL));
+            if (!cache->free_head) {
+                redirect_cache_write_end(cache);
+                return FAIL;
+            }
+        }
+        if (cache->free_head) {
+            n = cache->free_head - 1;
+            cache->free_head = REDIRECT_CACHE_ENTRIES(cache)[n].next_free;
+        } else {
+            n = cache->used++;
+        }
+
+        entry = &REDIRECT_CACHE_ENTRIES(cache)[n];
+        strcpy(entry->user, user);
+        strcpy(entry->host, host);
+        entry->port = port;
+        entry->hash = hash;
+        entry->next_free = 0;
+        entry->in_use = TRUE;
+        entry->referenced = FALSE;
+        cache->count++;
+
+        index = REDIRECT_CACHE_SLOTS(cache);
+        i = hash & cache->slot_mask;
+        while (index[i].entry) {
+            i = (i + 1) & cache->slot_mask;
+        }
+        index[i].hash = hash;
+        index[i].entry = n + 1;
     }
 
-    MYSQLND_AZURE_REDIRECT_INFO* redirect_info = mnd_pemalloc(sizeof(MYSQLND_AZURE_REDIRECT_INFO), 1);
-    if(redirect_info == NULL) {
+    memcpy(entry->targets, new_targets, new_count * sizeof(MYSQLND_AZURE_REDIRECT_CACHE_TARGET));
+    entry->target_count = new_count;
+    entry->expires = ttl ? time(NULL) + ttl : 0;
+    redirect_cache_write_end(cache);
+
+    return PASS;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_add_redirect_cache */
+enum_func_status mysqlnd_azure_add_redirect_cache(const char* user, const char* host, int port, const char* redirect_user, const char* redirect_host, int redirect_port, unsigned int ttl)
+{
+    MYSQLND_AZURE_REDIRECT_INFO target;
+
+    if (!redirect_cache_key_fits(redirect_user, redirect_host)) {
+        AZURE_LOG(ALOG_LEVEL_DBG, "redirect cache: user or host too long, not cached");
         return FAIL;
     }
-    redirect_info->redirect_user = mnd_pestrndup(redirect_user, strlen(redirect_user), 1);
-    redirect_info->redirect_host = mnd_pestrndup(redirect_host, strlen(redirect_host), 1);
-    if(redirect_info->redirect_user == NULL || redirect_info->redirect_host == NULL) {
+    strcpy(target.redirect_user, redirect_user);
+    strcpy(target.redirect_host, redirect_host);
+    target.redirect_port = redirect_port;
+    target.ttl = 0;
+    target.srtt_us = 0;
+
+    return mysqlnd_azure_add_redirect_cache_targets(user, host, port, &target, 1, ttl);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_add_redirect_cache_targets, targets in the order the server gave them, the one connected to first */
+enum_func_status mysqlnd_azure_add_redirect_cache_targets(const char* user, const char* host, int port, const MYSQLND_AZURE_REDIRECT_INFO* targets, int count, unsigned int ttl)
+{
+    MYSQLND_AZURE_REDIRECT_CACHE* cache;
+    enum_func_status ret;
+    zend_long max_entries = MYSQLND_AZURE_G(redirectCacheSize);
+
+    if (max_entries <= 0) {
+        return PASS; //cache disabled
+    }
+    if (!redirect_cache_key_fits(user, host) || count <= 0) {
+        AZURE_LOG(ALOG_LEVEL_DBG, "redirect cache: user or host too long, not cached");
         return FAIL;
     }
-    redirect_info->redirect_port = redirect_port;
+    if (max_entries > UINT32_MAX / 4) {
+        max_entries = UINT32_MAX / 4;
+    }
+    ttl = mysqlnd_azure_policy_cache_ttl(host, ttl);
 
-    zend_hash_str_update_ptr(MYSQLND_AZURE_G(redirectCache), key, strlen(key), redirect_info);
+    uint64_t start_us = AZURE_PROBE_NOW();
+    REDIRECT_CACHE_LOCK();
+    cache = REDIRECT_CACHE_CURRENT();
+    if (cache == NULL) {
+        cache = redirect_cache_resize(NULL, (uint32_t)MIN(max_entries, REDIRECT_CACHE_MIN_ENTRIES));
+        if (cache != NULL) {
+            REDIRECT_CACHE_PUBLISH(cache);
+        }
+    }
+    ret = cache != NULL ? redirect_cache_insert(cache, (uint32_t)max_entries, user, host, port, targets, count, ttl) : FAIL;
+#ifdef ZTS
+    redirect_cache_reclaim(FALSE);
+#endif
+    REDIRECT_CACHE_UNLOCK();
+    AZURE_PROBE4(cache_add, host, (unsigned int)port, (unsigned int)count, AZURE_PROBE_NOW() - start_us);
 
-    mnd_sprintf_free(key);
+    return ret;
+}
+/* }}} */
 
-    return PASS;
+/* {{{ redirect_user_base, length of the part of a user name before the first '@', e.g. the bob of bob@server */
+static size_t redirect_user_base(const char* user)
+{
+    const char* at = strchr(user, '@');
+    return at != NULL ? (size_t)(at - user) : strlen(user);
+}
+/* }}} */
+
+/* {{{ redirect_user_form, how a user name is written: with an '@' (bob@gateway) or without (bob) */
+static char redirect_user_form(const char* user)
+{
+    return strchr(user, '@') != NULL ? '@' : '-';
+}
+/* }}} */
+
+/*
+  The host entry keeps as redirect user of each target the rule it was learned with: the form of the
+  login name it was learned from, then REDIRECT_RULE_UNCHANGED, an empty string for the base alone,
+  or the suffix which follows the base, e.g. "@@server" for bob@gateway -> bob@server.
+*/
+#define REDIRECT_RULE_UNCHANGED "="
+
+/* {{{ mysqlnd_azure_learn_redirect_cache_host, keep the targets user was redirected to as the host entry of host and port,
+  for mysqlnd_azure.inferTargets. Only learned when every redirect user is the base of user plus a suffix */
+void mysqlnd_azure_learn_redirect_cache_host(const char* user, const char* host, int port, const MYSQLND_AZURE_REDIRECT_INFO* targets, int count, unsigned int ttl)
+{
+    MYSQLND_AZURE_REDIRECT_INFO host_targets[MAX_REDIRECT_TARGETS];
+    size_t base;
+    int i;
+
+    if (!MYSQLND_AZURE_G(inferTargets) || user == NULL || strcmp(user, MYSQLND_AZURE_HOST_USER) == 0) {
+        return;
+    }
+    base = redirect_user_base(user);
+    count = MIN(count, MAX_REDIRECT_TARGETS);
+    for (i = 0; i < count; i++) {
+        const char* redirect_user = targets[i].redirect_user;
+        const char* rule;
+        //bob@gateway -> bob@gateway: unchanged, bob@gateway -> bob: base alone, bob -> bob@server: suffix "@server",
+        //bob -> bobby@server teaches nothing
+        if (strcmp(redirect_user, user) == 0) {
+            rule = REDIRECT_RULE_UNCHANGED;
+        } else if (strncmp(redirect_user, user, base) == 0 && (redirect_user[base] == '\0'
+            || (redirect_user[base] == '@' && redirect_user[base + 1] != '\0'))) {
+            rule = redirect_user + base;
+        } else {
+            AZURE_LOG(ALOG_LEVEL_DBG, "redirect cache: redirect user of %s:%d not derived from the user name, host entry not learned", host, port);
+            return;
+        }
+        if (strlen(rule) + 1 > MAX_REDIRECT_USER_LEN) {
+            return;
+        }
+        host_targets[i] = targets[i];
+        host_targets[i].redirect_user[0] = redirect_user_form(user);
+        strcpy(host_targets[i].redirect_user + 1, rule);
+    }
+    mysqlnd_azure_add_redirect_cache_targets(MYSQLND_AZURE_HOST_USER, host, port, host_targets, count, ttl);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_infer_redirect_cache_targets, targets of the host entry of host and port with the redirect user user
+  would get, best first, 0 when nothing was learned for the host. Rules learned from login names of the other form
+  are skipped, whether the server treats bob and bob@gateway alike is not known */
+int mysqlnd_azure_infer_redirect_cache_targets(const char* user, const char* host, int port, MYSQLND_AZURE_REDIRECT_INFO* targets, int max)
+{
+    char redirect_user[MAX_REDIRECT_USER_LEN + 1];
+    size_t base = redirect_user_base(user);
+    const char form = redirect_user_form(user);
+    int count, i, n = 0;
+
+    count = mysqlnd_azure_find_redirect_cache_targets(MYSQLND_AZURE_HOST_USER, host, port, targets, max);
+    for (i = 0; i < count; i++) {
+        const char* rule = targets[i].redirect_user + 1;
+        int len;
+        if (targets[i].redirect_user[0] != form) {
+            continue;
+        }
+        if (strcmp(rule, REDIRECT_RULE_UNCHANGED) == 0) {
+            len = snprintf(redirect_user, sizeof(redirect_user), "%s", user);
+        } else {
+            len = snprintf(redirect_user, sizeof(redirect_user), "%.*s%s", (int)base, user, rule);
+        }
+        if (len < 0 || (size_t)len > MAX_REDIRECT_USER_LEN) {
+            continue;
+        }
+        targets[n] = targets[i];
+        strcpy(targets[n].redirect_user, redirect_user);
+        n++;
+    }
+    return n;
 }
 /* }}} */
 
 /* {{{ mysqlnd_azure_remove_redirect_cache */
 enum_func_status mysqlnd_azure_remove_redirect_cache(const char* user, const char* host, int port)
 {
-    if (MYSQLND_AZURE_G(redirectCache) != NULL) {
-        char *key = NULL;
-        mnd_sprintf(&key, MAX_REDIRECT_HOST_LEN + MAX_REDIRECT_USER_LEN + 8, "%s_%s_%d", user, host, port);
-        if(!key) {
-            return FAIL;
-        }
-        zend_hash_str_del(MYSQLND_AZURE_G(redirectCache), key, strlen(key));
+    MYSQLND_AZURE_REDIRECT_CACHE* cache;
 
-        mnd_sprintf_free(key);
+    if (!redirect_cache_key_fits(user, host)) {
+        return PASS;
     }
 
+    uint64_t start_us = AZURE_PROBE_NOW();
+    REDIRECT_CACHE_LOCK();
+    cache = REDIRECT_CACHE_CURRENT();
+    if (cache != NULL) {
+        int slot = redirect_cache_lookup(cache, redirect_cache_hash(user, host, port), user, host, port);
+        if (slot >= 0) {
+            redirect_cache_write_begin(cache);
+            redirect_cache_unlink(cache, (uint32_t)slot);
+            redirect_cache_write_end(cache);
+        }
+    }
+    REDIRECT_CACHE_UNLOCK();
+    AZURE_PROBE3(cache_remove, host, (unsigned int)port, AZURE_PROBE_NOW() - start_us);
+
     return PASS;
 }
 /* }}} */
 
-/* {{{ mysqlnd_azure_find_redirect_cache */
-MYSQLND_AZURE_REDIRECT_INFO* mysqlnd_azure_find_redirect_cache(const char* user, const char* host, int port)
+/* {{{ mysqlnd_azure_redirect_cache_targets, distinct redirect targets of the live entries, at most max */
+int mysqlnd_azure_redirect_cache_targets(MYSQLND_AZURE_REDIRECT_INFO* targets, int max)
+{
+    MYSQLND_AZURE_REDIRECT_CACHE* cache;
+    time_t now = time(NULL);
+    int count = 0;
+
+    REDIRECT_CACHE_LOCK();
+    cache = REDIRECT_CACHE_CURRENT();
+    if (cache != NULL) {
+        const MYSQLND_AZURE_REDIRECT_CACHE_ENTRY* entries = REDIRECT_CACHE_ENTRIES(cache);
+        uint32_t n;
+        for (n = 0; n < cache->used && count < max; n++) {
+            uint32_t t;
+            if (!entries[n].in_use || (entries[n].expires && entries[n].expires <= now)) {
+                continue;
+            }
+            for (t = 0; t < entries[n].target_count && count < max; t++) {
+                const MYSQLND_AZURE_REDIRECT_INFO* info = &entries[n].targets[t].info;
+                int i;
+                for (i = 0; i < count; i++) {
+                    if (targets[i].redirect_port == info->redirect_port && strcmp(targets[i].redirect_host, info->redirect_host) == 0) {
+                        break;
+                    }
+                }
+                if (i == count) {
+                    targets[count++] = *info;
+                }
+            }
+        }
+    }
+    REDIRECT_CACHE_UNLOCK();
+
+    return count;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_remove_redirect_cache_target, drop a target from every entry, an entry left without targets goes.
+  Returns the number of entries changed */
+unsigned int mysqlnd_azure_remove_redirect_cache_target(const char* redirect_host, unsigned int redirect_port)
 {
-    if (MYSQLND_AZURE_G(redirectCache) != NULL) {
-        char *key = NULL;
-        mnd_sprintf(&key, MAX_REDIRECT_HOST_LEN + MAX_REDIRECT_USER_LEN + 8, "%s_%s_%d", user, host, port);
-        if(!key) {
-            return NULL;
+    MYSQLND_AZURE_REDIRECT_CACHE* cache;
+    unsigned int removed = 0;
+
+    REDIRECT_CACHE_LOCK();
+    cache = REDIRECT_CACHE_CURRENT();
+    if (cache != NULL) {
+        MYSQLND_AZURE_REDIRECT_CACHE_ENTRY* entries = REDIRECT_CACHE_ENTRIES(cache);
+        uint32_t n;
+        redirect_cache_write_begin(cache);
+        for (n = 0; n < cache->used; n++) {
+            MYSQLND_AZURE_REDIRECT_CACHE_ENTRY* entry = &entries[n];
+            uint32_t t, kept = 0;
+            if (!entry->in_use) {
+                continue;
+            }
+            for (t = 0; t < entry->target_count; t++) {
+                if (entry->targets[t].info.redirect_port != redirect_port || strcmp(entry->targets[t].info.redirect_host, redirect_host) != 0) {
+                    entry->targets[kept++] = entry->targets[t];
+                }
+            }
+            if (kept == entry->target_count) {
+                continue;
+            }
+            entry->target_count = kept;
+            removed++;
+            if (kept == 0) {
+                int slot = redirect_cache_lookup(cache, entry->hash, entry->user, entry->host, entry->port);
+                if (slot >= 0) {
+                    redirect_cache_unlink(cache, (uint32_t)slot);
+                }
+            }
         }
+        redirect_cache_write_end(cache);
+    }
+    REDIRECT_CACHE_UNLOCK();
+
+    return removed;
+}
+/* }}} */
 
-        void* zv_dest = zend_hash_str_find_ptr(MYSQLND_AZURE_G(redirectCache), key, strlen(key));
-        mnd_sprintf_free(key);
+/* {{{ mysqlnd_azure_find_redirect_cache, copies the best cached redirect target out */
+enum_func_status mysqlnd_azure_find_redirect_cache(const char* user, const char* host, int port, MYSQLND_AZURE_REDIRECT_INFO* redirect_info)
+{
+    return mysqlnd_azure_find_redirect_cache_targets(user, host, port, redirect_info, 1) > 0 ? PASS : FAIL;
+}
+/* }}} */
 
-        return (MYSQLND_AZURE_REDIRECT_INFO*)zv_dest;
+/* {{{ mysqlnd_azure_find_redirect_cache_targets, copies at most max cached redirect targets out, best first. Returns how many */
+int mysqlnd_azure_find_redirect_cache_targets(const char* user, const char* host, int port, MYSQLND_AZURE_REDIRECT_INFO* targets, int max)
+{
+    MYSQLND_AZURE_REDIRECT_CACHE* cache;
+    MYSQLND_AZURE_REDIRECT_CACHE_ENTRY* entry = NULL;
+    MYSQLND_AZURE_REDIRECT_CACHE_TARGET copy[MAX_REDIRECT_TARGETS];
+    const MYSQLND_AZURE_REDIRECT_CACHE_TARGET* order[MAX_REDIRECT_TARGETS];
+    uint32_t hash, seq, copy_count = 0, i, j;
+    time_t expires = 0, now;
+    int count;
+
+    if (!redirect_cache_key_fits(user, host) || max <= 0) {
+        return 0;
+    }
+    REDIRECT_CACHE_READ_BEGIN();
+    cache = REDIRECT_CACHE_CURRENT();
+    if (cache == NULL) {
+        REDIRECT_CACHE_READ_END();
+        return 0;
     }
 
-    return NULL;
+    hash = redirect_cache_hash(user, host, port);
+    do {
+        int slot;
+        seq = mysqlnd_azure_atomic_load_u32(&cache->seq);
+        if (seq & 1) {
+            continue; //a writer is busy with this block
+        }
+        entry = NULL;
+        slot = redirect_cache_lookup(cache, hash, user, host, port);
+        if (slot >= 0) {
+            entry = &REDIRECT_CACHE_ENTRIES(cache)[REDIRECT_CACHE_SLOTS(cache)[slot].entry - 1];
+            copy_count = MIN(entry->target_count, MAX_REDIRECT_TARGETS);
+            memcpy(copy, entry->targets, copy_count * sizeof(MYSQLND_AZURE_REDIRECT_CACHE_TARGET));
+            expires = entry->expires;
+        }
+        mysqlnd_azure_atomic_fence();
+    } while ((seq & 1) || mysqlnd_azure_atomic_load_u32(&cache->seq) != seq);
+
+    if (entry == NULL || copy_count == 0) {
+        mysqlnd_azure_atomic_inc_u64(&cache->misses);
+        REDIRECT_CACHE_READ_END();
+        return 0;
+    }
+
+    now = time(NULL);
+    if (expires && expires <= now) {
+        //leave the block before the lock, a writer holding it may wait for the readers
+        REDIRECT_CACHE_READ_END();
+        AZURE_LOG(ALOG_LEVEL_DBG, "redirect cache entry expired");
+        REDIRECT_CACHE_LOCK();
+        cache = REDIRECT_CACHE_CURRENT();
+        if (cache != NULL) {
+            int slot = redirect_cache_lookup(cache, hash, user, host, port);
+            if (slot >= 0) {
+                entry = &REDIRECT_CACHE_ENTRIES(cache)[REDIRECT_CACHE_SLOTS(cache)[slot].entry - 1];
+                if (entry->expires && entry->expires <= time(NULL)) {
+                    redirect_cache_write_begin(cache);
+                    redirect_cache_unlink(cache, (uint32_t)slot);
+                    redirect_cache_write_end(cache);
+                    cache->expirations++;
+                }
+            }
+            mysqlnd_azure_atomic_inc_u64(&cache->misses);
+        }
+        REDIRECT_CACHE_UNLOCK();
+        return 0;
+    }
+
+    //insertion sort, stable so equal targets keep the order of the server
+    for (i = 0; i < copy_count; i++) {
+        for (j = i; j > 0 && redirect_cache_target_before(&copy[i], order[j - 1], now); j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = &copy[i];
+    }
+    count = MIN((int)copy_count, max);
+    for (i = 0; i < (uint32_t)count; i++) {
+        targets[i] = order[i]->info;
+        targets[i].ttl = expires ? (unsigned int)(expires - now) : 0;
+        targets[i].srtt_us = order[i]->srtt_us;
+    }
+
+    //CLOCK bit, only written when not yet set so hits on a hot entry stay read only
+    if (!entry->referenced) {
+        entry->referenced = TRUE;
+    }
+    mysqlnd_azure_atomic_inc_u64(&cache->hits);
+    REDIRECT_CACHE_READ_END();
+
+    return count;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_redirect_cache_report, feed the outcome and duration of a connect to a cached target into its statistics */
+void mysqlnd_azure_redirect_cache_report(const char* user, const char* host, int port, const MYSQLND_AZURE_REDIRECT_INFO* target, uint64_t elapsed_us, zend_bool ok)
+{
+    MYSQLND_AZURE_REDIRECT_CACHE* cache;
+
+    if (!redirect_cache_key_fits(user, host)) {
+        return;
+    }
+
+    REDIRECT_CACHE_LOCK();
+    cache = REDIRECT_CACHE_CURRENT();
+    if (cache != NULL) {
+        int slot = redirect_cache_lookup(cache, redirect_cache_hash(user, host, port), user, host, port);
+        if (slot >= 0) {
+            MYSQLND_AZURE_REDIRECT_CACHE_ENTRY* entry = &REDIRECT_CACHE_ENTRIES(cache)[REDIRECT_CACHE_SLOTS(cache)[slot].entry - 1];
+            uint32_t t;
+            for (t = 0; t < entry->target_count; t++) {
+                MYSQLND_AZURE_REDIRECT_CACHE_TARGET* stats = &entry->targets[t];
+                if (!redirect_cache_same_target(&stats->info, target)) {
+                    continue;
+                }
+                redirect_cache_write_begin(cache);
+                //gain 1/8 for the connect time as TCP does for the RTT, 1/2 for failures so one failure puts the target behind
+                if (ok) {
+                    uint32_t sample = elapsed_us > UINT32_MAX ? UINT32_MAX : (elapsed_us ? (uint32_t)elapsed_us : 1);
+                    stats->srtt_us = stats->srtt_us ? (uint32_t)((int64_t)stats->srtt_us + ((int64_t)sample - stats->srtt_us) / 8) : sample;
+                    stats->failures /= 2;
+                } else {
+                    stats->failures = (stats->failures + REDIRECT_TARGET_FAILURE_ONE) / 2;
+                    stats->failed_at = time(NULL);
+                }
+                redirect_cache_write_end(cache);
+                break;
+            }
+        }
+    }
+    REDIRECT_CACHE_UNLOCK();
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_redirect_cache_stats */
+void mysqlnd_azure_redirect_cache_stats(MYSQLND_AZURE_REDIRECT_CACHE_STATS* stats)
+{
+    const MYSQLND_AZURE_REDIRECT_CACHE* cache;
+
+    memset(stats, 0, sizeof(MYSQLND_AZURE_REDIRECT_CACHE_STATS));
+    stats->max_entries = MYSQLND_AZURE_G(redirectCacheSize) > 0 ? (size_t)MYSQLND_AZURE_G(redirectCacheSize) : 0;
+    REDIRECT_CACHE_READ_BEGIN();
+    cache = REDIRECT_CACHE_CURRENT();
+    if (cache != NULL) {
+        stats->entries = cache->count;
+        stats->allocated = cache->allocated;
+        stats->memory = cache->size;
+        stats->hits = cache->hits;
+        stats->misses = cache->misses;
+        stats->evictions = cache->evictions;
+        stats->expirations = cache->expirations;
+    }
+    REDIRECT_CACHE_READ_END();
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_free_redirect_cache */
+void mysqlnd_azure_free_redirect_cache(MYSQLND_AZURE_REDIRECT_CACHE* cache)
+{
+    if (cache != NULL) {
+        AZURE_MND_PEFREE(cache, cache->size, 1, AZURE_MEM_REDIRECT_CACHE);
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_redirect_cache_startup, called at MINIT */
+void mysqlnd_azure_redirect_cache_startup()
+{
+#ifdef ZTS
+    process_cache_mutex = tsrm_mutex_alloc();
+#endif
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_redirect_cache_shutdown, called at MSHUTDOWN, the per thread caches of non-ZTS builds go with GSHUTDOWN */
+void mysqlnd_azure_redirect_cache_shutdown()
+{
+#ifdef ZTS
+    int i;
+    mysqlnd_azure_free_redirect_cache(process_cache);
+    process_cache = NULL;
+    for (i = 0; i < retired_count; i++) {
+        mysqlnd_azure_free_redirect_cache(retired_caches[i]);
+        retired_caches[i] = NULL;
+    }
+    retired_count = 0;
+    if (process_cache_mutex) {
+        tsrm_mutex_free(process_cache_mutex);
+        process_cache_mutex = NULL;
+    }
+#endif
 }
 /* }}} */
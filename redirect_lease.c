@@ -0,0 +1,229 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php_mysqlnd_azure.h"
+#include "mysqlnd_azure.h"
+#include "utils.h"
+
+/*
+  Single flight redirect discovery. When the redirect target of a profile (user, host, port)
+  is unknown or stale, the first worker takes a lease on the profile in a shared region and
+  does the gateway + redirect round. Workers missing the same profile meanwhile wait for the
+  target it publishes instead of hitting the gateway at the same moment.
+
+  A published target is handed to the workers which waited for it, and to workers whose
+  cached target just failed if it names a different target and is younger than
+  REDIRECT_LEASE_RESULT_MS. A discovery which found no target (failed, or the gateway did
+  not redirect) publishes an empty one, its waiters then connect on their own as before.
+  A lease not released within REDIRECT_LEASE_MS (its owner died or hangs) is taken over
+  by the next worker.
+*/
+
+#define REDIRECT_LEASE_SLOTS        256
+#define REDIRECT_LEASE_MS           10000
+#define REDIRECT_LEASE_RESULT_MS    2000
+
+typedef enum _mysqlnd_azure_lease_slot_state {
+    LEASE_SLOT_FREE = 0,
+    LEASE_SLOT_DISCOVERING,
+    LEASE_SLOT_DONE
+} mysqlnd_azure_lease_slot_state;
+
+typedef struct st_mysqlnd_azure_lease_slot {
+    uint32_t hash;
+    uint32_t state;
+    uint32_t generation;                /* bumped whenever a lease ends, never 0 */
+    uint32_t owner;                     /* token of the worker holding the lease */
+    uint64_t until_ms;                  /* DISCOVERING: lease expiry, DONE: publish time */
+    unsigned int port;
+    char user[MAX_REDIRECT_USER_LEN + 1];
+    char host[MAX_REDIRECT_HOST_LEN + 1];
+    MYSQLND_AZURE_REDIRECT_INFO result;
+} MYSQLND_AZURE_LEASE_SLOT;
+
+typedef struct st_mysqlnd_azure_lease_table {
+    volatile uint32_t lock;
+    uint32_t next_owner;
+    MYSQLND_AZURE_LEASE_SLOT slots[REDIRECT_LEASE_SLOTS];
+} MYSQLND_AZURE_LEASE_TABLE;
+
+static MYSQLND_AZURE_LEASE_TABLE* lease_table = NULL;
+
+/* {{{ lease_hash, FNV-1a */
+static uint32_t lease_hash(const char* user, const char* host, unsigned int port)
+{
+    uint32_t hash = 2166136261u;
+    const unsigned char* p;
+
+    for (p = (const unsigned char*)user; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    hash = (hash ^ 0xff) * 16777619u;
+    for (p = (const unsigned char*)host; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    hash = (hash ^ port) * 16777619u;
+
+    return hash ? hash : 1;
+}
+/* }}} */
+
+/* {{{ lease_slot_matches */
+static zend_bool lease_slot_matches(const MYSQLND_AZURE_LEASE_SLOT* slot, uint32_t hash, const char* user, const char* host, unsigned int port)
+{
+    return slot->hash == hash && slot->port == port && strcmp(slot->user, user) == 0 && strcmp(slot->host, host) == 0;
+}
+/* }}} */
+
+/* {{{ lease_find, slot of the profile, or a reusable one when reuse is set; called with the lock held */
+static MYSQLND_AZURE_LEASE_SLOT* lease_find(uint32_t hash, const char* user, const char* host, unsigned int port, uint64_t now, zend_bool reuse)
+{
+    MYSQLND_AZURE_LEASE_SLOT* reusable = NULL;
+    uint32_t i, n;
+
+    /* slots keep their key after use, so a probe runs until a never used slot */
+    for (n = 0, i = hash % REDIRECT_LEASE_SLOTS; n < REDIRECT_LEASE_SLOTS; n++, i = (i + 1) % REDIRECT_LEASE_SLOTS) {
+        MYSQLND_AZURE_LEASE_SLOT* slot = &lease_table->slots[i];
+        if (slot->hash == 0) {
+            return reuse ? (reusable ? reusable : slot) : NULL;
+        }
+        if (lease_slot_matches(slot, hash, user, host, port)) {
+            return slot;
+        }
+        if (reusable == NULL
+            && (slot->state == LEASE_SLOT_FREE
+                || (slot->state == LEASE_SLOT_DISCOVERING && slot->until_ms <= now)
+                || (slot->state == LEASE_SLOT_DONE && slot->until_ms + REDIRECT_LEASE_RESULT_MS <= now))) {
+            reusable = slot;
+        }
+    }
+
+    return reuse ? reusable : NULL;
+}
+/* }}} */
+
+/* {{{ lease_same_target */
+static zend_bool lease_same_target(const MYSQLND_AZURE_REDIRECT_INFO* a, const MYSQLND_AZURE_REDIRECT_INFO* b)
+{
+    return a->redirect_port == b->redirect_port && strcmp(a->redirect_host, b->redirect_host) == 0
+        && strcmp(a->redirect_user, b->redirect_user) == 0;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_lease_startup, called at MINIT */
+void mysqlnd_azure_lease_startup()
+{
+    lease_table = mysqlnd_azure_shm_alloc(sizeof(MYSQLND_AZURE_LEASE_TABLE));
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_lease_shutdown, called at MSHUTDOWN before the shared regions are unmapped */
+void mysqlnd_azure_lease_shutdown()
+{
+    lease_table = NULL;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_lease_acquire
+  stale: the cached target that just failed, or NULL.
+  ticket: 0 on the first call. BUSY stores the generation to wait for in it, pass it back
+  unchanged while polling. OWNER stores the token to pass to mysqlnd_azure_lease_release().
+*/
+mysqlnd_azure_lease_state mysqlnd_azure_lease_acquire(const char* user, const char* host, unsigned int port,
+    const MYSQLND_AZURE_REDIRECT_INFO* stale, uint32_t* ticket, MYSQLND_AZURE_REDIRECT_INFO* result)
+{
+    MYSQLND_AZURE_LEASE_SLOT* slot;
+    mysqlnd_azure_lease_state state;
+    uint32_t hash;
+    uint64_t now = mysqlnd_azure_now_us() / 1000;
+
+    if (lease_table == NULL || strlen(user) > MAX_REDIRECT_USER_LEN || strlen(host) > MAX_REDIRECT_HOST_LEN) {
+        return AZURE_LEASE_NONE;
+    }
+    hash = lease_hash(user, host, port);
+
+    mysqlnd_azure_shm_lock(&lease_table->lock);
+    slot = lease_find(hash, user, host, port, now, TRUE);
+    if (slot == NULL) {
+        state = AZURE_LEASE_NONE; //table full of running leases
+    } else if (!lease_slot_matches(slot, hash, user, host, port)) {
+        //first discovery of this profile, or the slot of an old one is reused
+        slot->hash = hash;
+        slot->port = port;
+        strcpy(slot->user, user);
+        strcpy(slot->host, host);
+        slot->generation = 1;
+        state = AZURE_LEASE_OWNER;
+    } else if (slot->state == LEASE_SLOT_DISCOVERING && slot->until_ms > now) {
+        *ticket = slot->generation;
+        state = AZURE_LEASE_BUSY;
+    } else if (slot->state == LEASE_SLOT_DONE
+        && ((*ticket != 0 && slot->generation != *ticket)
+            || (stale != NULL && slot->result.redirect_host[0] != '\0' && slot->until_ms + REDIRECT_LEASE_RESULT_MS > now
+                && !lease_same_target(&slot->result, stale)))) {
+        *result = slot->result;
+        state = AZURE_LEASE_RESULT;
+    } else {
+        state = AZURE_LEASE_OWNER;
+    }
+
+    if (state == AZURE_LEASE_OWNER) {
+        if (++lease_table->next_owner == 0) {
+            lease_table->next_owner = 1;
+        }
+        slot->owner = lease_table->next_owner;
+        slot->state = LEASE_SLOT_DISCOVERING;
+        slot->until_ms = now + REDIRECT_LEASE_MS;
+        *ticket = slot->owner;
+    }
+    mysqlnd_azure_shm_unlock(&lease_table->lock);
+
+    return state;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_lease_release, publish the discovered target, result NULL when none was found */
+void mysqlnd_azure_lease_release(const char* user, const char* host, unsigned int port, uint32_t ticket, const MYSQLND_AZURE_REDIRECT_INFO* result)
+{
+    MYSQLND_AZURE_LEASE_SLOT* slot;
+
+    if (lease_table == NULL) {
+        return;
+    }
+
+    mysqlnd_azure_shm_lock(&lease_table->lock);
+    slot = lease_find(lease_hash(user, host, port), user, host, port, 0, FALSE);
+    if (slot != NULL && slot->state == LEASE_SLOT_DISCOVERING && slot->owner == ticket) {
+        if (result != NULL) {
+            slot->result = *result;
+        } else {
+            memset(&slot->result, 0, sizeof(slot->result));
+        }
+        slot->state = LEASE_SLOT_DONE;
+        slot->until_ms = mysqlnd_azure_now_us() / 1000;
+        if (++slot->generation == 0) {
+            slot->generation = 1;
+        }
+    }
+    mysqlnd_azure_shm_unlock(&lease_table->lock);
+}
+/* }}} */
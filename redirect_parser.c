@@ -0,0 +1,233 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+#include <string.h>
+
+#include "redirect_parser.h"
+
+/**
+* Azure protocol:
+* Location: mysql://redirectedHostName:redirectedPort/user=redirectedUser&ttl=%d (where ttl is optional)
+*/
+static const MYSQLND_AZURE_REDIRECT_FORMAT azure_format = {
+    "azure", 0, '\0', 0
+};
+
+/**
+* Community protocol:
+* Location: mysql://[redirectedHostName]:redirectedPort/?user=redirectedUser&ttl=%d\n
+*/
+static const MYSQLND_AZURE_REDIRECT_FORMAT community_format = {
+    "community", 1, '?', REDIRECT_FORMAT_REQUIRE_TTL | REDIRECT_FORMAT_REQUIRE_EOL
+};
+
+static const MYSQLND_AZURE_REDIRECT_FORMAT* formats[MAX_REDIRECT_FORMATS] = {
+    &azure_format,
+    &community_format
+};
+static unsigned int format_count = 2;
+
+#define REDIRECT_MSG_HEADER "Location: mysql://"
+#define REDIRECT_MSG_HEADER_LEN (sizeof(REDIRECT_MSG_HEADER) - 1)
+
+/* {{{ mysqlnd_azure_register_redirect_format */
+int mysqlnd_azure_register_redirect_format(const MYSQLND_AZURE_REDIRECT_FORMAT* format)
+{
+    /* not locked, register at module startup only */
+    if (format == NULL || format_count >= MAX_REDIRECT_FORMATS) {
+        return 0;
+    }
+    formats[format_count++] = format;
+    return 1;
+}
+/* }}} */
+
+/* {{{ parse_decimal, digits only, at most max_digits */
+static int
+parse_decimal(const char* begin, const char* end, size_t max_digits, unsigned int* value)
+{
+    unsigned int v = 0;
+    const char* p;
+
+    if (begin == end || (size_t)(end - begin) > max_digits) {
+        return 0;
+    }
+    for (p = begin; p < end; p++) {
+        if (*p < '0' || *p > '9') {
+            return 0;
+        }
+        v = v * 10 + (unsigned int)(*p - '0');
+    }
+    *value = v;
+    return 1;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_parse_redirect */
+/*
+  Parse a redirect message in one pass, never reading past msg + len. All registered
+  formats share the grammar
+      Location: mysql://<host>:<port>/[<query_mark>]<key>=<value>[&<key>=<value>...][\n]
+  where <host> is either plain or [bracketed]; the format is picked from the shape that
+  was seen. Returns the number of bytes consumed on success, 0 if the message is not a
+  valid redirect message. Output is only written on success.
+*/
+int mysqlnd_azure_parse_redirect(const char* msg, size_t len, MYSQLND_AZURE_REDIRECT_LOCATION* location)
+{
+    const char* p;
+    const char* end;
+    const char* host_begin;
+    const char* host_end;
+    const char* user_begin = NULL;
+    const char* user_end = NULL;
+    const char* port_begin;
+    unsigned int port = 0, ttl = 0;
+    int bracketed = 0, has_ttl = 0, eol = 0;
+    char query_mark = '\0';
+    unsigned int ext_count = 0, i;
+    MYSQLND_AZURE_REDIRECT_EXT ext[MAX_REDIRECT_EXTENSIONS];
+    const MYSQLND_AZURE_REDIRECT_FORMAT* format = NULL;
+
+    if (msg == NULL || len <= REDIRECT_MSG_HEADER_LEN || memcmp(msg, REDIRECT_MSG_HEADER, REDIRECT_MSG_HEADER_LEN) != 0) {
+        return 0;
+    }
+    p = msg + REDIRECT_MSG_HEADER_LEN;
+    end = msg + len;
+
+    /* host */
+    if (*p == '[') {
+        bracketed = 1;
+        host_begin = ++p;
+        while (p < end && *p != ']' && *p != '\n' && *p != '\0') p++;
+        if (p == end || *p != ']') return 0;
+        host_end = p++;
+    } else {
+        host_begin = p;
+        while (p < end && *p != ':' && *p != '/' && *p != '\n' && *p != '\0') p++;
+        host_end = p;
+    }
+    if (host_end == host_begin || host_end - host_begin > MAX_REDIRECT_HOST_LEN) return 0;
+    if (p == end || *p != ':') return 0;
+    p++;
+
+    /* port */
+    port_begin = p;
+    while (p < end && *p >= '0' && *p <= '9') p++;
+    if (!parse_decimal(port_begin, p, 5, &port) || port == 0 || port > 65535) return 0;
+    if (p == end || *p != '/') return 0;
+    p++;
+
+    if (p < end && (*p == '?' || *p == ';')) {
+        query_mark = *p++;
+    }
+
+    /* key=value[&key=value...] */
+    while (p < end && *p != '\n') {
+        const char* key = p;
+        const char* key_end;
+        const char* value;
+        const char* value_end;
+
+        while (p < end && *p != '=' && *p != '&' && *p != '\n' && *p != '\0') p++;
+        if (p == end || *p != '=' || p == key) return 0;
+        key_end = p++;
+
+        value = p;
+        while (p < end && *p != '&' && *p != '\n' && *p != '\0') p++;
+        if (p < end && *p == '\0') return 0;
+        value_end = p;
+        if (value_end > value && value_end[-1] == '\r') value_end--;
+
+        if (key_end - key == 4 && memcmp(key, "user", 4) == 0) {
+            if (user_begin != NULL) return 0;
+            user_begin = value;
+            user_end = value_end;
+        } else if (key_end - key == 3 && memcmp(key, "ttl", 3) == 0) {
+            if (has_ttl || !parse_decimal(value, value_end, 9, &ttl)) return 0;
+            has_ttl = 1;
+        } else if (ext_count < MAX_REDIRECT_EXTENSIONS) {
+            ext[ext_count].key = key;
+            ext[ext_count].key_len = (size_t)(key_end - key);
+            ext[ext_count].value = value;
+            ext[ext_count].value_len = (size_t)(value_end - value);
+            ext_count++;
+        }
+
+        if (p < end && *p == '&') {
+            p++;
+            if (p == end || *p == '\n') return 0;
+        }
+    }
+    if (p < end && *p == '\n') {
+        eol = 1;
+        p++;
+    }
+
+    if (user_begin == NULL || user_end == user_begin || user_end - user_begin > MAX_REDIRECT_USER_LEN) return 0;
+
+    for (i = 0; i < format_count; i++) {
+        if (formats[i]->host_bracketed == bracketed && formats[i]->query_mark == query_mark) {
+            format = formats[i];
+            break;
+        }
+    }
+    if (format == NULL) return 0;
+    if ((format->flags & REDIRECT_FORMAT_REQUIRE_TTL) && !has_ttl) return 0;
+    if ((format->flags & REDIRECT_FORMAT_REQUIRE_EOL) && !eol) return 0;
+
+    //setback the value when everything is settled
+    memcpy(location->host, host_begin, host_end - host_begin);
+    location->host[host_end - host_begin] = '\0';
+    memcpy(location->user, user_begin, user_end - user_begin);
+    location->user[user_end - user_begin] = '\0';
+    location->port = port;
+    location->ttl = ttl;
+    location->has_ttl = has_ttl;
+    location->format = format;
+    location->ext_count = ext_count;
+    memcpy(location->ext, ext, sizeof(MYSQLND_AZURE_REDIRECT_EXT) * ext_count);
+
+    return (int)(p - msg);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_parse_redirect_list */
+/*
+  A server may offer more than one target, one redirect message per line:
+      Location: mysql://host1:port1/user=...\nLocation: mysql://host2:port2/user=...
+  Parses the messages one after the other into locations, in the order given, and stops
+  at max or at the first one which is not a valid redirect message. Returns the number
+  of locations written, 0 if the first message is not valid.
+*/
+int mysqlnd_azure_parse_redirect_list(const char* msg, size_t len, MYSQLND_AZURE_REDIRECT_LOCATION* locations, int max)
+{
+    size_t offset = 0;
+    int count = 0;
+
+    while (count < max && offset < len) {
+        int consumed = mysqlnd_azure_parse_redirect(msg + offset, len - offset, &locations[count]);
+        if (consumed <= 0) {
+            break;
+        }
+        offset += (size_t)consumed;
+        count++;
+    }
+
+    return count;
+}
+/* }}} */
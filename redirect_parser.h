@@ -0,0 +1,68 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef MYSQLND_AZURE_REDIRECT_PARSER_H
+#define MYSQLND_AZURE_REDIRECT_PARSER_H
+
+/*
+  No PHP dependency on purpose: the parser is also linked into the standalone
+  micro-benchmark (bench/) and fuzz target (fuzz/).
+*/
+#include <stddef.h>
+
+#define MAX_REDIRECT_HOST_LEN 128
+#define MAX_REDIRECT_USER_LEN 128
+#define MAX_REDIRECT_EXTENSIONS 8
+#define MAX_REDIRECT_FORMATS 8
+
+#define REDIRECT_FORMAT_REQUIRE_TTL 0x1  /* ttl=%d must be present */
+#define REDIRECT_FORMAT_REQUIRE_EOL 0x2  /* message must be terminated with \n */
+
+/*description of one "Location: mysql://..." variant*/
+typedef struct st_mysqlnd_azure_redirect_format {
+    const char* name;
+    int host_bracketed;     /* host is written as [host], which also allows IPv6 literals */
+    char query_mark;        /* character expected right after "port/", '\0' for none */
+    unsigned int flags;     /* REDIRECT_FORMAT_xx */
+} MYSQLND_AZURE_REDIRECT_FORMAT;
+
+/*key=value pair the parser does not know, points into the parsed message*/
+typedef struct st_mysqlnd_azure_redirect_ext {
+    const char* key;
+    size_t key_len;
+    const char* value;
+    size_t value_len;
+} MYSQLND_AZURE_REDIRECT_EXT;
+
+/*result of parsing one redirect message*/
+typedef struct st_mysqlnd_azure_redirect_location {
+    char host[MAX_REDIRECT_HOST_LEN + 1];
+    char user[MAX_REDIRECT_USER_LEN + 1];
+    unsigned int port;
+    unsigned int ttl;
+    int has_ttl;
+    const MYSQLND_AZURE_REDIRECT_FORMAT* format;
+    unsigned int ext_count;
+    MYSQLND_AZURE_REDIRECT_EXT ext[MAX_REDIRECT_EXTENSIONS];
+} MYSQLND_AZURE_REDIRECT_LOCATION;
+
+int mysqlnd_azure_register_redirect_format(const MYSQLND_AZURE_REDIRECT_FORMAT* format);
+int mysqlnd_azure_parse_redirect(const char* msg, size_t len, MYSQLND_AZURE_REDIRECT_LOCATION* location);
+int mysqlnd_azure_parse_redirect_list(const char* msg, size_t len, MYSQLND_AZURE_REDIRECT_LOCATION* locations, int max);
+
+#endif  /* MYSQLND_AZURE_REDIRECT_PARSER_H */
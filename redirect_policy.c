@@ -0,0 +1,277 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php_mysqlnd_azure.h"
+#include "mysqlnd_azure.h"
+#include "utils.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stddef.h>
+
+/*
+  Per host redirect policy, from mysqlnd_azure.redirectPolicy:
+      pattern=mode[,option=N...][;pattern=mode[,option=N...]...]
+  pattern is a host name, "*.domain" for every host below domain, or "*" for every host.
+  mode is off/on/preferred as for mysqlnd_azure.enableRedirect. Options:
+      cacheTtl            cap for the time a redirect learned for the host stays in the
+                          cache (0: no cap, the server's ttl applies)
+      keepaliveIdle, keepaliveInterval, keepaliveCount
+                          TCP keepalive of the conns to the host and its redirect targets,
+                          override mysqlnd_azure.keepalive* (0: take the ini value)
+
+  The table is parsed once at MINIT into an exact match hash and a hash of the wildcard
+  suffixes, so a connect finds its policy with one lookup per label of its host name.
+  An exact pattern wins over a wildcard, a longer wildcard over a shorter one. Hosts no
+  pattern matches use mysqlnd_azure.enableRedirect.
+*/
+
+static HashTable policy_exact;
+static HashTable policy_suffix;                 /* keyed by ".domain" */
+static MYSQLND_AZURE_HOST_POLICY* policy_any = NULL;
+static zend_bool policy_loaded = FALSE;
+
+/* {{{ policy_dtor */
+static void policy_dtor(zval* zv)
+{
+    AZURE_PEFREE(Z_PTR_P(zv), sizeof(MYSQLND_AZURE_HOST_POLICY), 1, AZURE_MEM_TABLES);
+}
+/* }}} */
+
+/* {{{ policy_trim */
+static void policy_trim(const char** p, const char** end)
+{
+    while (*p < *end && isspace((unsigned char)**p)) (*p)++;
+    while (*end > *p && isspace((unsigned char)(*end)[-1])) (*end)--;
+}
+/* }}} */
+
+/* {{{ policy_option_field, the unsigned field an option key sets, NULL for an unknown key */
+static unsigned int* policy_option_field(const char* key, size_t len, MYSQLND_AZURE_HOST_POLICY* policy)
+{
+    static const struct {
+        const char* name;
+        size_t offset;
+    } options[] = {
+        { "cacheTtl",           offsetof(MYSQLND_AZURE_HOST_POLICY, cache_ttl) },
+        { "keepaliveIdle",      offsetof(MYSQLND_AZURE_HOST_POLICY, keepalive_idle) },
+        { "keepaliveInterval",  offsetof(MYSQLND_AZURE_HOST_POLICY, keepalive_interval) },
+        { "keepaliveCount",     offsetof(MYSQLND_AZURE_HOST_POLICY, keepalive_count) }
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+        if (strlen(options[i].name) == len && strncasecmp(key, options[i].name, len) == 0) {
+            return (unsigned int*)((char*)policy + options[i].offset);
+        }
+    }
+    return NULL;
+}
+/* }}} */
+
+/* {{{ policy_parse_options, "mode[,option=N...]" between p and end */
+static zend_bool policy_parse_options(const char* p, const char* end, MYSQLND_AZURE_HOST_POLICY* policy)
+{
+    const char* comma = memchr(p, ',', end - p);
+    const char* mode_end = comma ? comma : end;
+    const char* mode = p;
+
+    policy_trim(&mode, &mode_end);
+    if (mode_end - mode == 3 && strncasecmp(mode, "off", 3) == 0) {
+        policy->mode = REDIRECT_OFF;
+    } else if (mode_end - mode == 2 && strncasecmp(mode, "on", 2) == 0) {
+        policy->mode = REDIRECT_ON;
+    } else if (mode_end - mode == 9 && strncasecmp(mode, "preferred", 9) == 0) {
+        policy->mode = REDIRECT_PREFERRED;
+    } else {
+        return FALSE;
+    }
+    policy->cache_ttl = 0;
+    policy->keepalive_idle = policy->keepalive_interval = policy->keepalive_count = 0;
+
+    while (comma != NULL) {
+        const char* option = comma + 1;
+        const char* option_end;
+        const char* eq;
+        unsigned int* field;
+        comma = memchr(option, ',', end - option);
+        option_end = comma ? comma : end;
+        policy_trim(&option, &option_end);
+        eq = memchr(option, '=', option_end - option);
+        if (eq != NULL && (field = policy_option_field(option, eq - option, policy)) != NULL) {
+            unsigned long value = 0;
+            const char* q;
+            for (q = eq + 1; q < option_end; q++) {
+                if (!isdigit((unsigned char)*q) || (value = value * 10 + (*q - '0')) > UINT_MAX) {
+                    return FALSE;
+                }
+            }
+            if (q == eq + 1) {
+                return FALSE;
+            }
+            *field = (unsigned int)value;
+        } else {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_policy_startup, compile mysqlnd_azure.redirectPolicy, called at MINIT */
+void mysqlnd_azure_policy_startup()
+{
+    const char* p = MYSQLND_AZURE_G(redirectPolicy);
+
+    zend_hash_init(&policy_exact, 8, NULL, policy_dtor, 1);
+    zend_hash_init(&policy_suffix, 8, NULL, policy_dtor, 1);
+    policy_loaded = TRUE;
+
+    while (p != NULL && *p) {
+        const char* entry_end = strchr(p, ';');
+        const char* pattern = p;
+        const char* pattern_end;
+        MYSQLND_AZURE_HOST_POLICY policy;
+        MYSQLND_AZURE_HOST_POLICY* copy;
+        char key[MAX_REDIRECT_HOST_LEN + 2];
+        size_t len, i;
+
+        if (entry_end == NULL) {
+            entry_end = p + strlen(p);
+        }
+        pattern_end = memchr(p, '=', entry_end - p);
+        if (pattern_end != NULL && policy_parse_options(pattern_end + 1, entry_end, &policy)) {
+            policy_trim(&pattern, &pattern_end);
+            len = pattern_end - pattern;
+            if (len == 1 && pattern[0] == '*') {
+                if (policy_any == NULL) {
+                    policy_any = AZURE_PEMALLOC(sizeof(MYSQLND_AZURE_HOST_POLICY), 1, AZURE_MEM_TABLES);
+                    *policy_any = policy;
+                }
+            } else if (len > 0 && len <= MAX_REDIRECT_HOST_LEN + 1 && (pattern[0] != '*' || (len > 2 && pattern[1] == '.'))) {
+                HashTable* table = pattern[0] == '*' ? &policy_suffix : &policy_exact;
+                //"*.domain" is stored as ".domain", the lookup key of every host below domain
+                if (pattern[0] == '*') {
+                    pattern++;
+                    len--;
+                }
+                for (i = 0; i < len; i++) {
+                    key[i] = tolower((unsigned char)pattern[i]);
+                }
+                copy = AZURE_PEMALLOC(sizeof(MYSQLND_AZURE_HOST_POLICY), 1, AZURE_MEM_TABLES);
+                *copy = policy;
+                //the first entry of a pattern wins, like the first match in readReplicas
+                if (zend_hash_str_add_ptr(table, key, len, copy) == NULL) {
+                    AZURE_PEFREE(copy, sizeof(MYSQLND_AZURE_HOST_POLICY), 1, AZURE_MEM_TABLES);
+                }
+            } else {
+                AZURE_LOG(ALOG_LEVEL_ERR, "mysqlnd_azure.redirectPolicy: invalid host pattern %.*s", (int)(entry_end - p), p);
+            }
+        } else if (entry_end > p) {
+            AZURE_LOG(ALOG_LEVEL_ERR, "mysqlnd_azure.redirectPolicy: invalid entry %.*s", (int)(entry_end - p), p);
+        }
+        p = *entry_end ? entry_end + 1 : entry_end;
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_policy_shutdown, called at MSHUTDOWN */
+void mysqlnd_azure_policy_shutdown()
+{
+    if (policy_loaded) {
+        zend_hash_destroy(&policy_exact);
+        zend_hash_destroy(&policy_suffix);
+        policy_loaded = FALSE;
+    }
+    if (policy_any != NULL) {
+        AZURE_PEFREE(policy_any, sizeof(MYSQLND_AZURE_HOST_POLICY), 1, AZURE_MEM_TABLES);
+        policy_any = NULL;
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_policy_find, policy of a host or NULL when no pattern matches */
+const MYSQLND_AZURE_HOST_POLICY* mysqlnd_azure_policy_find(const char* host)
+{
+    char key[MAX_REDIRECT_HOST_LEN + 1];
+    const MYSQLND_AZURE_HOST_POLICY* policy;
+    size_t len, i;
+
+    if (!policy_loaded || host == NULL) {
+        return NULL;
+    }
+    if (zend_hash_num_elements(&policy_exact) == 0 && zend_hash_num_elements(&policy_suffix) == 0) {
+        return policy_any;
+    }
+
+    len = strlen(host);
+    if (len > MAX_REDIRECT_HOST_LEN) {
+        return policy_any;
+    }
+    for (i = 0; i < len; i++) {
+        key[i] = tolower((unsigned char)host[i]);
+    }
+    key[len] = '\0';
+
+    if ((policy = zend_hash_str_find_ptr(&policy_exact, key, len)) != NULL) {
+        return policy;
+    }
+    //longest suffix first: ".a.b.c", then ".b.c", then ".c"
+    for (i = 0; i < len; i++) {
+        if (key[i] == '.' && (policy = zend_hash_str_find_ptr(&policy_suffix, key + i, len - i)) != NULL) {
+            return policy;
+        }
+    }
+
+    return policy_any;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_redirect_mode_for, redirect mode of a connect to host */
+mysqlnd_azure_redirect_mode mysqlnd_azure_redirect_mode_for(const char* host)
+{
+    const MYSQLND_AZURE_HOST_POLICY* policy = mysqlnd_azure_policy_find(host);
+    return policy ? policy->mode : MYSQLND_AZURE_G(enableRedirect);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_policy_keepalive, keepalive idle/interval/count for conns to host, 0 leaves the system default */
+void mysqlnd_azure_policy_keepalive(const char* host, unsigned int* idle, unsigned int* interval, unsigned int* count)
+{
+    const MYSQLND_AZURE_HOST_POLICY* policy = mysqlnd_azure_policy_find(host);
+
+    *idle = policy && policy->keepalive_idle ? policy->keepalive_idle : (unsigned int)MAX(0, MYSQLND_AZURE_G(keepaliveIdle));
+    *interval = policy && policy->keepalive_interval ? policy->keepalive_interval : (unsigned int)MAX(0, MYSQLND_AZURE_G(keepaliveInterval));
+    *count = policy && policy->keepalive_count ? policy->keepalive_count : (unsigned int)MAX(0, MYSQLND_AZURE_G(keepaliveCount));
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_policy_cache_ttl, ttl of a new cache entry for host, the server's ttl capped by the policy */
+unsigned int mysqlnd_azure_policy_cache_ttl(const char* host, unsigned int ttl)
+{
+    const MYSQLND_AZURE_HOST_POLICY* policy = mysqlnd_azure_policy_find(host);
+    if (policy && policy->cache_ttl && (ttl == 0 || ttl > policy->cache_ttl)) {
+        return policy->cache_ttl;
+    }
+    return ttl;
+}
+/* }}} */
@@ -0,0 +1,242 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php_mysqlnd_azure.h"
+#include "mysqlnd_azure.h"
+#include "main/php_network.h"
+#include "utils.h"
+
+/*
+  Health probing of the cached redirect targets, off the connect path. Every
+  mysqlnd_azure.probeInterval seconds a request end (RSHUTDOWN) or a call of
+  mysqlnd_azure_probe() opens a TCP connection to each distinct target in the cache and
+  waits for the server greeting. Cache entries of a target which does not answer are
+  dropped, so the next connect goes through the gateway right away instead of running
+  into the dead target first.
+
+  RSHUTDOWN runs before the SAPI finishes the response, so a round adds to the time of the
+  request which runs it. A round at a request end probes at most PROBE_ROUND_TARGETS targets
+  within one probeTimeoutMs all together, the targets left are claimed by the next rounds,
+  of this worker or of others. The host name lookup of a target is not covered by that time.
+
+  The probe results are kept in a shared region where there is one (see
+  mysqlnd_azure_shm.c): a target is probed by one worker per interval, the others take
+  its result for their own caches.
+*/
+
+#define PROBE_SLOTS         128
+#define PROBE_MAX_TARGETS   64
+#define PROBE_ROUND_TARGETS 4       /* probes of one round at a request end */
+
+typedef struct st_mysqlnd_azure_probe_slot {
+    unsigned int port;
+    char host[MAX_REDIRECT_HOST_LEN + 1];
+    uint64_t probed_ms;                 /* start of the last probe, 0: never */
+    zend_bool done;                     /* the probe started at probed_ms has finished */
+    zend_bool alive;
+} MYSQLND_AZURE_PROBE_SLOT;
+
+typedef struct st_mysqlnd_azure_probe_table {
+    volatile uint32_t lock;
+    MYSQLND_AZURE_PROBE_SLOT slots[PROBE_SLOTS];
+} MYSQLND_AZURE_PROBE_TABLE;
+
+typedef enum _mysqlnd_azure_probe_claim {
+    PROBE_CLAIM_ALIVE = 0,              /* probed recently by someone, answered */
+    PROBE_CLAIM_DEAD,                   /* probed recently by someone, did not answer */
+    PROBE_CLAIM_MINE                    /* the caller probes it now */
+} mysqlnd_azure_probe_claim;
+
+static MYSQLND_AZURE_PROBE_TABLE* probe_table = NULL;
+static zend_bool probe_table_shared = FALSE;
+
+/* {{{ probe_claim, result of a recent probe of the target, or the caller's turn to probe it */
+static mysqlnd_azure_probe_claim probe_claim(const MYSQLND_AZURE_REDIRECT_INFO* target, uint64_t now, uint64_t interval_ms, int* slot)
+{
+    mysqlnd_azure_probe_claim claim = PROBE_CLAIM_MINE;
+    int i, oldest = 0;
+
+    mysqlnd_azure_shm_lock(&probe_table->lock);
+    for (i = 0; i < PROBE_SLOTS; i++) {
+        MYSQLND_AZURE_PROBE_SLOT* s = &probe_table->slots[i];
+        if (s->port == target->redirect_port && strcmp(s->host, target->redirect_host) == 0) {
+            break;
+        }
+        if (s->probed_ms < probe_table->slots[oldest].probed_ms) {
+            oldest = i;
+        }
+    }
+    if (i == PROBE_SLOTS) {
+        i = oldest;
+        strcpy(probe_table->slots[i].host, target->redirect_host);
+        probe_table->slots[i].port = target->redirect_port;
+        probe_table->slots[i].probed_ms = 0;
+    }
+    if (probe_table->slots[i].probed_ms + interval_ms > now) {
+        //a probe still running counts as alive, the next round has its result
+        claim = !probe_table->slots[i].done || probe_table->slots[i].alive ? PROBE_CLAIM_ALIVE : PROBE_CLAIM_DEAD;
+    } else {
+        probe_table->slots[i].probed_ms = now;
+        probe_table->slots[i].done = FALSE;
+    }
+    mysqlnd_azure_shm_unlock(&probe_table->lock);
+
+    *slot = i;
+    return claim;
+}
+/* }}} */
+
+/* {{{ probe_publish */
+static void probe_publish(int slot, const MYSQLND_AZURE_REDIRECT_INFO* target, zend_bool alive)
+{
+    mysqlnd_azure_shm_lock(&probe_table->lock);
+    //the slot may have been taken over by another target meanwhile
+    if (probe_table->slots[slot].port == target->redirect_port && strcmp(probe_table->slots[slot].host, target->redirect_host) == 0) {
+        probe_table->slots[slot].done = TRUE;
+        probe_table->slots[slot].alive = alive;
+    }
+    mysqlnd_azure_shm_unlock(&probe_table->lock);
+}
+/* }}} */
+
+/* {{{ probe_target, TCP connect and read the start of the server greeting */
+static zend_bool probe_target(const char* host, unsigned int port, zend_long timeout_ms)
+{
+    struct timeval timeout;
+    zend_string* error = NULL;
+    int error_code = 0;
+    php_socket_t sock;
+    unsigned char greeting[5];
+    size_t got = 0;
+    uint64_t deadline = mysqlnd_azure_now_us() + (uint64_t)timeout_ms * 1000;
+    zend_bool alive = FALSE;
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    sock = php_network_connect_socket_to_host(host, (unsigned short)port, SOCK_STREAM, 0, &timeout, &error, &error_code, NULL, 0, 0);
+    if (sock == SOCK_ERR) {
+        AZURE_LOG(ALOG_LEVEL_INFO, "probe %s:%u: connect failed: %s", host, port, error ? ZSTR_VAL(error) : "unknown error");
+        if (error) {
+            zend_string_release(error);
+        }
+        return FALSE;
+    }
+
+    //4 bytes packet header, then protocol version 10, or 0xff when the server answers with an error (still alive)
+    while (got < sizeof(greeting)) {
+        uint64_t now = mysqlnd_azure_now_us();
+        ssize_t n;
+        if (now >= deadline || php_pollfd_for_ms(sock, POLLIN, (int)((deadline - now) / 1000) + 1) <= 0) {
+            break;
+        }
+        n = recv(sock, (char*)greeting + got, sizeof(greeting) - got, 0);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    alive = got == sizeof(greeting) && (greeting[4] == 10 || greeting[4] == 0xff);
+    if (!alive) {
+        AZURE_LOG(ALOG_LEVEL_INFO, "probe %s:%u: no server greeting within %ld ms", host, port, (long)timeout_ms);
+    }
+    closesocket(sock);
+
+    return alive;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_probe_targets
+  One probe round over the cached redirect targets when mysqlnd_azure.probeInterval passed since the
+  last round of this process, or right away when forced. An unforced round is bounded, see above, a forced
+  one probes every target. Returns the number of cache entries which lost a target.
+*/
+unsigned int mysqlnd_azure_probe_targets(zend_bool force)
+{
+    MYSQLND_AZURE_REDIRECT_INFO targets[PROBE_MAX_TARGETS];
+    zend_long interval = MYSQLND_AZURE_G(probeInterval);
+    uint64_t now = mysqlnd_azure_now_us() / 1000;
+    uint64_t interval_ms;
+    uint64_t deadline_ms = now + (uint64_t)MAX(MYSQLND_AZURE_G(probeTimeoutMs), 1);
+    unsigned int removed = 0;
+    int count, i, probed = 0;
+
+    if (probe_table == NULL || (!force && (interval <= 0 || now < MYSQLND_AZURE_G(probeLastMs) + (uint64_t)interval * 1000))) {
+        return 0;
+    }
+    MYSQLND_AZURE_G(probeLastMs) = now;
+    //a forced round probes every target itself
+    interval_ms = force ? 0 : (uint64_t)interval * 1000;
+
+    count = mysqlnd_azure_redirect_cache_targets(targets, PROBE_MAX_TARGETS);
+    for (i = 0; i < count; i++) {
+        int slot;
+        zend_bool alive;
+        zend_long timeout_ms = MYSQLND_AZURE_G(probeTimeoutMs);
+        mysqlnd_azure_probe_claim claim;
+        if (!force) {
+            uint64_t now_ms = mysqlnd_azure_now_us() / 1000;
+            if (probed == PROBE_ROUND_TARGETS || now_ms >= deadline_ms) {
+                break; //the rest is not claimed, the next rounds take it
+            }
+            timeout_ms = (zend_long)MIN((uint64_t)timeout_ms, deadline_ms - now_ms);
+        }
+        claim = probe_claim(&targets[i], now, interval_ms, &slot);
+        if (claim == PROBE_CLAIM_MINE) {
+            alive = probe_target(targets[i].redirect_host, targets[i].redirect_port, timeout_ms);
+            probe_publish(slot, &targets[i], alive);
+            probed++;
+        } else {
+            alive = claim == PROBE_CLAIM_ALIVE;
+        }
+        if (!alive) {
+            unsigned int n = mysqlnd_azure_remove_redirect_cache_target(targets[i].redirect_host, targets[i].redirect_port);
+            AZURE_LOG(ALOG_LEVEL_INFO, "redirect target %s:%u is down, removed from %u cache entries", targets[i].redirect_host, targets[i].redirect_port, n);
+            mysqlnd_azure_metrics_add(AZURE_METRIC_PROBE_DROPPED, n);
+            removed += n;
+        }
+    }
+
+    return removed;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_probe_startup, called at MINIT */
+void mysqlnd_azure_probe_startup()
+{
+    probe_table = mysqlnd_azure_shm_alloc(sizeof(MYSQLND_AZURE_PROBE_TABLE));
+    probe_table_shared = probe_table != NULL;
+    if (probe_table == NULL) {
+        //no shared region, every process probes for itself
+        probe_table = AZURE_PECALLOC(1, sizeof(MYSQLND_AZURE_PROBE_TABLE), 1, AZURE_MEM_TABLES);
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_probe_shutdown, called at MSHUTDOWN before the shared regions are unmapped */
+void mysqlnd_azure_probe_shutdown()
+{
+    if (probe_table != NULL && !probe_table_shared) {
+        AZURE_PEFREE(probe_table, sizeof(MYSQLND_AZURE_PROBE_TABLE), 1, AZURE_MEM_TABLES);
+    }
+    probe_table = NULL;
+}
+/* }}} */
@@ -0,0 +1,302 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) The PHP Group                                          |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Qianqian Bu <qianqian.bu@microsoft.com>                     |
+  +----------------------------------------------------------------------+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php_mysqlnd_azure.h"
+#include "mysqlnd_azure.h"
+#include "utils.h"
+#include <ctype.h>
+
+/*
+  Read replica endpoints of a primary, from mysqlnd_azure.readReplicas:
+      primary[:port]=replica[:port][,replica[:port]...][;primary[:port]=...]
+  A port left out on the primary matches every port, left out on a replica it is the
+  port the primary was connected with.
+
+  Each replica endpoint has a stats slot: replica conns open to it over all workers
+  (the slots live in a shared region where there is one, see mysqlnd_azure_shm.c), the
+  smoothed time of the reads routed to it, and a short back off after a failure.
+*/
+
+#define REPLICA_STATS_SLOTS     64
+#define REPLICA_DOWN_MS         5000
+
+typedef struct st_mysqlnd_azure_replica_stats {
+    unsigned int port;
+    char host[MAX_REDIRECT_HOST_LEN + 1];
+    uint32_t outstanding;               /* replica conns open to it */
+    uint32_t srtt_us;                   /* 0: not measured yet */
+    uint64_t down_until_ms;
+} MYSQLND_AZURE_REPLICA_STATS;
+
+typedef struct st_mysqlnd_azure_replica_table {
+    volatile uint32_t lock;
+    uint32_t next;                      /* round robin start between equal candidates */
+    MYSQLND_AZURE_REPLICA_STATS slots[REPLICA_STATS_SLOTS];
+} MYSQLND_AZURE_REPLICA_TABLE;
+
+static MYSQLND_AZURE_REPLICA_TABLE* replica_table = NULL;
+static zend_bool replica_table_shared = FALSE;
+
+/* {{{ replica_parse_endpoint, host[:port] between p and end */
+static zend_bool replica_parse_endpoint(const char* p, const char* end, char* host, unsigned int* port)
+{
+    const char* colon;
+    size_t len;
+
+    while (p < end && isspace((unsigned char)*p)) p++;
+    while (end > p && isspace((unsigned char)end[-1])) end--;
+    for (colon = end; colon > p && colon[-1] != ':'; colon--);
+
+    *port = 0;
+    if (colon > p) {
+        const char* q;
+        unsigned long value = 0;
+        for (q = colon; q < end; q++) {
+            if (!isdigit((unsigned char)*q) || (value = value * 10 + (*q - '0')) > 65535) {
+                return FALSE;
+            }
+        }
+        if (q == colon || value == 0) {
+            return FALSE;
+        }
+        *port = (unsigned int)value;
+        end = colon - 1;
+    }
+
+    len = end - p;
+    if (len == 0 || len > MAX_REDIRECT_HOST_LEN) {
+        return FALSE;
+    }
+    memcpy(host, p, len);
+    host[len] = '\0';
+    return TRUE;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_replica_list, replica endpoints configured for a primary, replicas may be NULL to only count them */
+int mysqlnd_azure_replica_list(const char* host, unsigned int port, MYSQLND_AZURE_REPLICA* replicas, int max)
+{
+    const char* p = MYSQLND_AZURE_G(readReplicas);
+    int count = 0;
+
+    if (p == NULL || host == NULL) {
+        return 0;
+    }
+
+    while (*p) {
+        const char* group_end = strchr(p, ';');
+        const char* eq;
+        char primary_host[MAX_REDIRECT_HOST_LEN + 1];
+        unsigned int primary_port;
+
+        if (group_end == NULL) {
+            group_end = p + strlen(p);
+        }
+        eq = memchr(p, '=', group_end - p);
+        if (eq != NULL && replica_parse_endpoint(p, eq, primary_host, &primary_port)
+            && strcasecmp(primary_host, host) == 0 && (primary_port == 0 || primary_port == port)) {
+            const char* r = eq + 1;
+            while (r < group_end) {
+                const char* r_end = memchr(r, ',', group_end - r);
+                MYSQLND_AZURE_REPLICA replica;
+                if (r_end == NULL) {
+                    r_end = group_end;
+                }
+                if (replica_parse_endpoint(r, r_end, replica.host, &replica.port)) {
+                    if (replica.port == 0) {
+                        replica.port = port;
+                    }
+                    if (replicas == NULL) {
+                        count++;
+                    } else if (count < max) {
+                        replicas[count++] = replica;
+                    }
+                } else {
+                    AZURE_LOG(ALOG_LEVEL_ERR, "mysqlnd_azure.readReplicas: invalid replica endpoint %.*s", (int)(r_end - r), r);
+                }
+                r = r_end + 1;
+            }
+            return count;
+        }
+        p = *group_end ? group_end + 1 : group_end;
+    }
+
+    return 0;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_replica_user
+  Azure user names can carry the server name, user@primary has to log in to a replica as user@replica */
+void mysqlnd_azure_replica_user(const char* user, const char* primary_host, const char* replica_host, char* out, size_t out_len)
+{
+    const char* at = strrchr(user, '@');
+    size_t primary_name_len = strcspn(primary_host, ".");
+    size_t replica_name_len = strcspn(replica_host, ".");
+
+    if (at != NULL && strlen(at + 1) == primary_name_len && strncasecmp(at + 1, primary_host, primary_name_len) == 0
+        && (size_t)(at - user) + 1 + replica_name_len < out_len) {
+        snprintf(out, out_len, "%.*s@%.*s", (int)(at - user), user, (int)replica_name_len, replica_host);
+    } else {
+        snprintf(out, out_len, "%s", user);
+    }
+}
+/* }}} */
+
+/* {{{ replica_stats_slot, called with the lock held */
+static int replica_stats_slot(const MYSQLND_AZURE_REPLICA* replica)
+{
+    int i;
+
+    for (i = 0; i < REPLICA_STATS_SLOTS; i++) {
+        MYSQLND_AZURE_REPLICA_STATS* stats = &replica_table->slots[i];
+        if (stats->port == 0) {
+            strcpy(stats->host, replica->host);
+            stats->port = replica->port;
+            return i;
+        }
+        if (stats->port == replica->port && strcasecmp(stats->host, replica->host) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_replica_choose
+  Picks the replica for a new replica conn by mysqlnd_azure.readReplicaPolicy, skipping replicas which
+  failed in the last REPLICA_DOWN_MS. Returns its index, or -1 when all are down. *slot gets the stats
+  slot, which counts the conn as outstanding until mysqlnd_azure_replica_release().
+*/
+int mysqlnd_azure_replica_choose(const MYSQLND_AZURE_REPLICA* replicas, int count, int* slot)
+{
+    uint64_t now = mysqlnd_azure_now_us() / 1000;
+    int i, start, best = -1, best_slot = -1;
+
+    *slot = -1;
+    if (replica_table == NULL) {
+        return count > 0 ? 0 : -1;
+    }
+
+    mysqlnd_azure_shm_lock(&replica_table->lock);
+    start = count > 0 ? (int)(replica_table->next++ % (uint32_t)count) : 0;
+    for (i = 0; i < count; i++) {
+        int n = (start + i) % count;
+        int s = replica_stats_slot(&replicas[n]);
+        const MYSQLND_AZURE_REPLICA_STATS* stats;
+        const MYSQLND_AZURE_REPLICA_STATS* best_stats;
+
+        if (s < 0) {
+            if (best < 0) {
+                best = n; //stats table full, still usable without stats
+            }
+            continue;
+        }
+        stats = &replica_table->slots[s];
+        if (stats->down_until_ms > now) {
+            continue;
+        }
+        if (best_slot < 0) {
+            best = n;
+            best_slot = s;
+            continue;
+        }
+        best_stats = &replica_table->slots[best_slot];
+        if (MYSQLND_AZURE_G(readReplicaPolicy) == REPLICA_POLICY_LATENCY) {
+            //unmeasured replicas first, so every replica gets a srtt
+            if (stats->srtt_us < best_stats->srtt_us) {
+                best = n;
+                best_slot = s;
+            }
+        } else if (stats->outstanding < best_stats->outstanding) {
+            best = n;
+            best_slot = s;
+        }
+    }
+    if (best_slot >= 0) {
+        replica_table->slots[best_slot].outstanding++;
+        *slot = best_slot;
+    }
+    mysqlnd_azure_shm_unlock(&replica_table->lock);
+
+    return best;
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_replica_report, outcome of a connect to or a read on the replica of a stats slot */
+void mysqlnd_azure_replica_report(int slot, uint64_t elapsed_us, zend_bool ok)
+{
+    MYSQLND_AZURE_REPLICA_STATS* stats;
+
+    if (replica_table == NULL || slot < 0) {
+        return;
+    }
+
+    mysqlnd_azure_shm_lock(&replica_table->lock);
+    stats = &replica_table->slots[slot];
+    if (!ok) {
+        stats->down_until_ms = mysqlnd_azure_now_us() / 1000 + REPLICA_DOWN_MS;
+    } else {
+        uint32_t sample = elapsed_us > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed_us;
+        sample = sample ? sample : 1;
+        stats->srtt_us = stats->srtt_us ? stats->srtt_us - stats->srtt_us / 8 + sample / 8 : sample;
+        stats->down_until_ms = 0;
+    }
+    mysqlnd_azure_shm_unlock(&replica_table->lock);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_replica_release, the replica conn counted in a stats slot is closed */
+void mysqlnd_azure_replica_release(int slot)
+{
+    if (replica_table == NULL || slot < 0) {
+        return;
+    }
+
+    mysqlnd_azure_shm_lock(&replica_table->lock);
+    if (replica_table->slots[slot].outstanding > 0) {
+        replica_table->slots[slot].outstanding--;
+    }
+    mysqlnd_azure_shm_unlock(&replica_table->lock);
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_replica_startup, called at MINIT */
+void mysqlnd_azure_replica_startup()
+{
+    replica_table = mysqlnd_azure_shm_alloc(sizeof(MYSQLND_AZURE_REPLICA_TABLE));
+    replica_table_shared = replica_table != NULL;
+    if (replica_table == NULL) {
+        //no shared region, the stats only cover this process
+        replica_table = AZURE_PECALLOC(1, sizeof(MYSQLND_AZURE_REPLICA_TABLE), 1, AZURE_MEM_TABLES);
+    }
+}
+/* }}} */
+
+/* {{{ mysqlnd_azure_replica_shutdown, called at MSHUTDOWN before the shared regions are unmapped */
+void mysqlnd_azure_replica_shutdown()
+{
+    if (replica_table != NULL && !replica_table_shared) {
+        AZURE_PEFREE(replica_table, sizeof(MYSQLND_AZURE_REPLICA_TABLE), 1, AZURE_MEM_TABLES);
+    }
+    replica_table = NULL;
+}
+/* }}} */
@@ -0,0 +1,24 @@
+<?php
+/*
+    Request script of mysqli_azure_mock_defer_close.phpt, run by the built-in web server. Connects
+    through the gateway once per user in users, and prints after each connect how many gateway
+    connections are still open.
+*/
+require_once(__DIR__ . "/mock_server.inc");
+
+$backend_port = (int)$_GET["backend_port"];
+foreach (explode(",", $_GET["users"]) as $i => $user) {
+    $link = mysqli_init();
+    if (!@mysqli_real_connect($link, MOCK_SERVER_HOST, $user, "", NULL, (int)$_GET["gateway_port"], NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT)) {
+        printf("[%03d] connect failed: [%d] %s\n", $i + 2, mysqli_connect_errno(), mysqli_connect_error());
+        continue;
+    }
+    $port = preg_match('/-(\d+)$/', $link->server_info, $m) ? (int)$m[1] : 0;
+    $query = $link->query("SELECT 1");
+    $link->close();
+    //with a queue of 2, a connect beyond that has the oldest queued gateway conn closed
+    $accepted = mock_server_accepted($_GET["gateway_stats"]);
+    $closed = mock_server_closed($_GET["gateway_closed"], max(0, $accepted - 2));
+    printf("[%03d] ok on %s, query %s, gateway conns open %d\n", $i + 2, $port == $backend_port ? "redirect target" : "gateway",
+        $query ? "ok" : "failed", $accepted - $closed);
+}
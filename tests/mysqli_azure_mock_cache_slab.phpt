@@ -0,0 +1,60 @@
+--TEST--
+Redirect cache against the local mock server, eviction when redirectCacheSize is reached and expiry by the server ttl
+--INI--
+mysqlnd_azure.enableRedirect="preferred"
+mysqlnd_azure.redirectCacheSize=1
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$backend_port = MOCK_SERVER_BASE_PORT + 3;
+$gateway_port = MOCK_SERVER_BASE_PORT + 4;
+$ttl_gateway_port = MOCK_SERVER_BASE_PORT + 5;
+$gateway_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_cache_slab_gateway.json";
+$ttl_gateway_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_cache_slab_ttl_gateway.json";
+
+if (!mock_server_start($backend_port, array("tls" => true))
+    || !mock_server_start($gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $backend_port, "stats-file" => $gateway_stats))
+    || !mock_server_start($ttl_gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $backend_port, "ttl" => 1, "stats-file" => $ttl_gateway_stats))) {
+    die("[001] cannot start mock servers\n");
+}
+
+function mock_cache_test($step, $port, $user, $stats) {
+    $link = mysqli_init();
+    if (!@mysqli_real_connect($link, MOCK_SERVER_HOST, $user, "", NULL, $port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT)) {
+        printf("[%s] connect failed: [%d] %s\n", $step, mysqli_connect_errno(), mysqli_connect_error());
+        return;
+    }
+    printf("[%s] gateway=%d\n", $step, mock_server_accepted($stats));
+    $link->close();
+}
+
+//only one entry fits, the second user evicts the first one
+mock_cache_test("002", $gateway_port, "slab_user1", $gateway_stats);
+mock_cache_test("003", $gateway_port, "slab_user1", $gateway_stats);
+mock_cache_test("004", $gateway_port, "slab_user2", $gateway_stats);
+mock_cache_test("005", $gateway_port, "slab_user1", $gateway_stats);
+mock_cache_test("006", $gateway_port, "slab_user1", $gateway_stats);
+
+//ttl=1 in the redirect message, the entry is gone two seconds later
+mock_cache_test("007", $ttl_gateway_port, "slab_user3", $ttl_gateway_stats);
+mock_cache_test("008", $ttl_gateway_port, "slab_user3", $ttl_gateway_stats);
+sleep(2);
+mock_cache_test("009", $ttl_gateway_port, "slab_user3", $ttl_gateway_stats);
+
+echo "Done\n";
+?>
+--EXPECTF--
+[002] gateway=1
+[003] gateway=1
+[004] gateway=2
+[005] gateway=3
+[006] gateway=3
+[007] gateway=1
+[008] gateway=1
+[009] gateway=2
+Done
@@ -0,0 +1,59 @@
+--TEST--
+mysqlnd_azure.deferProxyClose against the local mock server: the gateway connections stay open until the request ends, beyond the queue size the oldest is closed
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+//without pcntl the mock serves one connection at a time and would wait on the queued gateway connection
+if (!function_exists('pcntl_fork')) {
+    die('skip pcntl needed for a concurrent mock gateway');
+}
+if (!ini_get('allow_url_fopen')) {
+    die('skip allow_url_fopen is off');
+}
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$backend_port = MOCK_SERVER_BASE_PORT + 27;
+$gateway_port = MOCK_SERVER_BASE_PORT + 28;
+$web_port = MOCK_SERVER_BASE_PORT + 50;
+$gateway_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_defer_close_gateway.json";
+$gateway_closed = sys_get_temp_dir() . "/mysqlnd_azure_mock_defer_close_gateway.closed";
+@unlink($gateway_closed);
+
+if (!mock_server_start($backend_port, array("tls" => true))
+    || !mock_server_start($gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $backend_port,
+        "stats-file" => $gateway_stats, "close-file" => $gateway_closed))) {
+    die("[001] cannot start mock servers\n");
+}
+//the request runs in the built-in web server, so the conns can be counted after its end
+if (!mock_php_server_start($web_port, __DIR__ . "/mock_defer_close_router.php", array(
+        "mysqlnd_azure.enableRedirect" => "on",
+        "mysqlnd_azure.deferProxyClose" => 2))) {
+    die("[001] cannot start the web server\n");
+}
+
+//the startup check of mock_server_start() connected once as well
+mock_server_closed($gateway_closed, mock_server_accepted($gateway_stats));
+
+//a new user every time, so each connect does the gateway + redirect round and queues its gateway connection
+echo @file_get_contents("http://" . MOCK_SERVER_HOST . ":{$web_port}/?" . http_build_query(array(
+    "users" => "defer_user_2,defer_user_3,defer_user_4,defer_user_5",
+    "backend_port" => $backend_port, "gateway_port" => $gateway_port,
+    "gateway_stats" => $gateway_stats, "gateway_closed" => $gateway_closed)));
+
+$accepted = mock_server_accepted($gateway_stats);
+printf("[006] after the request, gateway conns open %d\n", $accepted - mock_server_closed($gateway_closed, $accepted));
+
+@unlink($gateway_stats);
+@unlink($gateway_closed);
+echo "Done\n";
+?>
+--EXPECT--
+[002] ok on redirect target, query ok, gateway conns open 1
+[003] ok on redirect target, query ok, gateway conns open 2
+[004] ok on redirect target, query ok, gateway conns open 2
+[005] ok on redirect target, query ok, gateway conns open 2
+[006] after the request, gateway conns open 0
+Done
@@ -0,0 +1,89 @@
+--TEST--
+mysqlnd_azure.inferTargets against the local mock server: a new user goes straight to the target other users were redirected to
+--INI--
+mysqlnd_azure.enableRedirect="preferred"
+mysqlnd_azure.inferTargets=1
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$backend_port = MOCK_SERVER_BASE_PORT + 39;
+$gateway_port = MOCK_SERVER_BASE_PORT + 40;
+//a gateway which logs bob@gw in as bob, and a backend which only takes such names and no deny_* user
+$strip_gateway_port = MOCK_SERVER_BASE_PORT + 45;
+$strip_backend_port = MOCK_SERVER_BASE_PORT + 46;
+$tmp = sys_get_temp_dir();
+$gateway_stats = "$tmp/mysqlnd_azure_mock_infer_gateway.json";
+$strip_gateway_stats = "$tmp/mysqlnd_azure_mock_infer_strip_gateway.json";
+$backend_control = "$tmp/mysqlnd_azure_mock_infer_backend.ctl";
+
+mock_server_control($backend_control, array("fail-rate" => 0));
+if (!mock_server_start($backend_port, array("tls" => true, "control-file" => $backend_control))
+    || !mock_server_start($gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $backend_port, "stats-file" => $gateway_stats))
+    || !mock_server_start($strip_backend_port, array("tls" => true, "allow-user" => "^(?!deny)[^@]*$"))
+    || !mock_server_start($strip_gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $strip_backend_port,
+        "redirect-user" => "%base", "stats-file" => $strip_gateway_stats))) {
+    die("[001] cannot start mock servers\n");
+}
+
+function mock_infer_connect($step, $user, $gateway_port, $gateway_stats, $backend_port) {
+    $link = mysqli_init();
+    if (!@mysqli_real_connect($link, MOCK_SERVER_HOST, $user, "", NULL, $gateway_port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT)) {
+        printf("[%s] connect failed: [%d] %s\n", $step, mysqli_connect_errno(), mysqli_connect_error());
+        return;
+    }
+    printf("[%s] %s on %s, gateway accepted %d\n", $step, $user, preg_match('/-' . $backend_port . '$/', $link->server_info) ? "backend" : "gateway",
+        mock_server_accepted($gateway_stats));
+    $link->close();
+}
+
+function mock_infer_count($outcome) {
+    preg_match('/^mysqlnd_azure_inferred_connects_total\{outcome="' . $outcome . '"\} (\d+)$/m', mysqlnd_azure_metrics(), $m);
+    return isset($m[1]) ? (int)$m[1] : -1;
+}
+
+//the first user learns where the server redirects to
+mock_infer_connect("002", "infer_a", $gateway_port, $gateway_stats, $backend_port);
+
+//users not seen yet skip the gateway, as long as their name has the form of the one the rule was learned from
+mock_infer_connect("003", "infer_b", $gateway_port, $gateway_stats, $backend_port);
+mock_infer_connect("004", "infer_c@server", $gateway_port, $gateway_stats, $backend_port);
+mock_infer_connect("005", "infer_f@server", $gateway_port, $gateway_stats, $backend_port);
+printf("[006] inferred success %d\n", mock_infer_count("success"));
+
+//bob@gw redirected as bob: new users are sent as their base name, not unchanged
+mock_infer_connect("007", "strip_a@gw", $strip_gateway_port, $strip_gateway_stats, $strip_backend_port);
+mock_infer_connect("008", "strip_b@gw", $strip_gateway_port, $strip_gateway_stats, $strip_backend_port);
+
+//a refused inferred login drops the rule, the next user asks the gateway again
+mock_infer_connect("009", "deny_c@gw", $strip_gateway_port, $strip_gateway_stats, $strip_backend_port);
+mock_infer_connect("010", "strip_d@gw", $strip_gateway_port, $strip_gateway_stats, $strip_backend_port);
+printf("[011] inferred success %d failure %d\n", mock_infer_count("success"), mock_infer_count("failure"));
+
+//the target goes away: the inferred attempt fails, the host entry is dropped and the gateway is asked
+mock_server_control($backend_control, array("fail-rate" => 1, "fail-mode" => "close"));
+mock_infer_connect("012", "infer_d@server", $gateway_port, $gateway_stats, $backend_port);
+mock_infer_connect("013", "infer_e@server", $gateway_port, $gateway_stats, $backend_port);
+printf("[014] inferred success %d failure %d\n", mock_infer_count("success"), mock_infer_count("failure"));
+
+echo "Done\n";
+?>
+--EXPECT--
+[002] infer_a on backend, gateway accepted 1
+[003] infer_b on backend, gateway accepted 1
+[004] infer_c@server on backend, gateway accepted 2
+[005] infer_f@server on backend, gateway accepted 2
+[006] inferred success 2
+[007] strip_a@gw on backend, gateway accepted 1
+[008] strip_b@gw on backend, gateway accepted 1
+[009] deny_c@gw on gateway, gateway accepted 2
+[010] strip_d@gw on backend, gateway accepted 3
+[011] inferred success 3 failure 1
+[012] infer_d@server on gateway, gateway accepted 3
+[013] infer_e@server on gateway, gateway accepted 4
+[014] inferred success 3 failure 2
+Done
@@ -0,0 +1,55 @@
+--TEST--
+mysqlnd_azure.keepaliveIdle against the local mock server: the keepalive timing is set on the TLS socket of a redirected conn
+--INI--
+mysqlnd_azure.enableRedirect="on"
+mysqlnd_azure.keepaliveIdle=5
+mysqlnd_azure.keepaliveInterval=2
+mysqlnd_azure.keepaliveCount=3
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+if (PHP_OS != 'Linux') {
+    die('skip needs the keepalive timers Linux ss(8) shows');
+}
+if (!preg_match('/ESTAB|State/', (string)shell_exec('ss -tn 2>/dev/null'))) {
+    die('skip ss(8) not available');
+}
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$backend_port = MOCK_SERVER_BASE_PORT + 43;
+$gateway_port = MOCK_SERVER_BASE_PORT + 44;
+
+if (!mock_server_start($backend_port, array("tls" => true))
+    || !mock_server_start($gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $backend_port))) {
+    die("[001] cannot start mock servers\n");
+}
+
+//keepalive timer of the client socket to port, in seconds, -1 when the socket has none
+function mock_keepalive_timer($port) {
+    $out = (string)shell_exec("ss -tno state established '( dport = :" . (int)$port . " )' 2>/dev/null");
+    if (!preg_match('/timer:\(keepalive,([\d.]+)(ms|sec|min)/', $out, $m)) {
+        return -1;
+    }
+    return (float)$m[1] * ($m[2] == "ms" ? 0.001 : ($m[2] == "min" ? 60 : 1));
+}
+
+$link = mysqli_init();
+if (!@mysqli_real_connect($link, MOCK_SERVER_HOST, "keepalive_user", "", NULL, $gateway_port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT)) {
+    die(sprintf("[002] connect failed: [%d] %s\n", mysqli_connect_errno(), mysqli_connect_error()));
+}
+printf("[003] on %s\n", preg_match('/-' . $backend_port . '$/', $link->server_info) ? "backend" : "gateway");
+
+//the system default would be about 2 hours until the first probe
+$timer = mock_keepalive_timer($backend_port);
+printf("[004] keepalive %s\n", $timer < 0 ? "off" : ($timer <= 5 ? "within keepaliveIdle" : "system default ({$timer}s)"));
+$link->close();
+
+echo "Done\n";
+?>
+--EXPECT--
+[003] on backend
+[004] keepalive within keepaliveIdle
+Done
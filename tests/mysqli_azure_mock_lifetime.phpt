@@ -0,0 +1,75 @@
+--TEST--
+mysqlnd_azure.maxConnectionLifetime against the local mock server: a connection reused after its lifetime follows the new redirect target
+--INI--
+mysqlnd_azure.enableRedirect="on"
+mysqlnd_azure.maxConnectionLifetime=1
+mysqlnd_azure.connectionLifetimeJitter=0
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$old_port     = MOCK_SERVER_BASE_PORT + 32;
+$new_port     = MOCK_SERVER_BASE_PORT + 33;
+$gateway_port = MOCK_SERVER_BASE_PORT + 34;
+$gateway_control = sys_get_temp_dir() . "/mysqlnd_azure_mock_lifetime_gateway.ctl";
+$gateway_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_lifetime_gateway.json";
+
+mock_server_control($gateway_control, array("redirect-port" => $old_port));
+if (!mock_server_start($old_port, array("tls" => true))
+    || !mock_server_start($new_port, array("tls" => true))
+    || !mock_server_start($gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $old_port,
+        "control-file" => $gateway_control, "stats-file" => $gateway_stats))) {
+    die("[001] cannot start mock servers\n");
+}
+
+function mock_lifetime_report($step, $link) {
+    global $old_port, $new_port, $gateway_stats;
+    $port = preg_match('/-(\d+)$/', $link->server_info, $m) ? (int)$m[1] : 0;
+    printf("[%s] on %s, gateway accepted %d\n", $step, $port == $old_port ? "old backend" : ($port == $new_port ? "new backend" : "gateway"),
+        mock_server_accepted($gateway_stats));
+}
+
+$link = mysqli_init();
+if (!@mysqli_real_connect($link, MOCK_SERVER_HOST, "lifetime_user", "", NULL, $gateway_port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT)) {
+    die(sprintf("[002] connect failed: [%d] %s\n", mysqli_connect_errno(), mysqli_connect_error()));
+}
+mock_lifetime_report("002", $link);
+
+//within its lifetime the conn stays where it is
+var_dump($link->ping());
+mock_lifetime_report("003", $link);
+
+//the backend scales out, the gateway now names the new one. Past its lifetime the conn is reopened on reuse
+mock_server_control($gateway_control, array("redirect-port" => $new_port));
+sleep(2);
+var_dump($link->ping());
+mock_lifetime_report("004", $link);
+
+//the rotation refreshed the cache entry, a new connect goes to the new backend directly
+$link2 = mysqli_init();
+if (!@mysqli_real_connect($link2, MOCK_SERVER_HOST, "lifetime_user", "", NULL, $gateway_port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT)) {
+    printf("[005] connect failed: [%d] %s\n", mysqli_connect_errno(), mysqli_connect_error());
+}
+mock_lifetime_report("005", $link2);
+
+preg_match('/^mysqlnd_azure_rotations_total\{outcome="success"\} (\d+)$/m', mysqlnd_azure_metrics(), $m);
+printf("[006] rotations %d\n", $m ? (int)$m[1] : -1);
+
+$link->close();
+$link2->close();
+@unlink($gateway_control);
+echo "Done\n";
+?>
+--EXPECT--
+[002] on old backend, gateway accepted 1
+bool(true)
+[003] on old backend, gateway accepted 1
+bool(true)
+[004] on new backend, gateway accepted 2
+[005] on new backend, gateway accepted 2
+[006] rotations 1
+Done
@@ -0,0 +1,63 @@
+--TEST--
+mysqlnd_azure.livenessCheck against the local mock server: a connection closed by the server while idle fails the ping and drops the cache entry
+--INI--
+mysqlnd_azure.enableRedirect="on"
+mysqlnd_azure.livenessCheck=1
+mysqlnd_azure.livenessSkipMs=500
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$backend_port = MOCK_SERVER_BASE_PORT + 35;
+$gateway_port = MOCK_SERVER_BASE_PORT + 36;
+$gateway_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_liveness_gateway.json";
+$backend_pings = sys_get_temp_dir() . "/mysqlnd_azure_mock_liveness_pings";
+
+@unlink($backend_pings);
+if (!mock_server_start($backend_port, array("tls" => true, "idle-timeout-ms" => 3000, "ping-file" => $backend_pings))
+    || !mock_server_start($gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $backend_port, "stats-file" => $gateway_stats))) {
+    die("[001] cannot start mock servers\n");
+}
+
+function mock_liveness_connect($step) {
+    global $gateway_port, $gateway_stats;
+    $link = mysqli_init();
+    if (!@mysqli_real_connect($link, MOCK_SERVER_HOST, "liveness_user", "", NULL, $gateway_port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT)) {
+        printf("[%s] connect failed: [%d] %s\n", $step, mysqli_connect_errno(), mysqli_connect_error());
+        return NULL;
+    }
+    printf("[%s] connected, gateway accepted %d\n", $step, mock_server_accepted($gateway_stats));
+    return $link;
+}
+
+$link = mock_liveness_connect("002");
+
+//used just now, no check at all
+printf("[003] ping %s, COM_PING sent %d\n", $link->ping() ? "ok" : "failed", mock_server_pings($backend_pings));
+
+//idle for longer than livenessSkipMs, the TLS socket shows nothing to read: still alive
+sleep(1);
+printf("[004] ping %s, COM_PING sent %d\n", $link->ping() ? "ok" : "failed", mock_server_pings($backend_pings));
+
+//the backend closes the idle connection, the socket shows EOF
+sleep(4);
+printf("[005] ping %s errno=%d, COM_PING sent %d\n", @$link->ping() ? "ok" : "failed", $link->errno, mock_server_pings($backend_pings));
+
+//the cache entry went with it, the next connect asks the gateway again
+$link2 = mock_liveness_connect("006");
+$link2->close();
+@unlink($backend_pings);
+
+echo "Done\n";
+?>
+--EXPECT--
+[002] connected, gateway accepted 1
+[003] ping ok, COM_PING sent 0
+[004] ping ok, COM_PING sent 0
+[005] ping failed errno=2006, COM_PING sent 0
+[006] connected, gateway accepted 2
+Done
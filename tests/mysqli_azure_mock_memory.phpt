@@ -0,0 +1,62 @@
+--TEST--
+mysqlnd_azure_memory_stats() against the local mock server: cache and per connection memory is counted and given back
+--INI--
+mysqlnd_azure.enableRedirect="on"
+mysqlnd_azure.autoReconnect="on"
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$backend_port = MOCK_SERVER_BASE_PORT + 37;
+$gateway_port = MOCK_SERVER_BASE_PORT + 38;
+
+if (!mock_server_start($backend_port, array("tls" => true))
+    || !mock_server_start($gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $backend_port))) {
+    die("[001] cannot start mock servers\n");
+}
+
+$stats = mysqlnd_azure_memory_stats();
+echo implode(",", array_keys($stats)), "\n";
+echo implode(",", array_keys($stats["total"])), "\n";
+printf("[002] conn_data request=%d\n", $stats["conn_data"]["request"]);
+
+$link = mysqli_init();
+if (!@mysqli_real_connect($link, MOCK_SERVER_HOST, "memory_user", "secret", "memory_db", $gateway_port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT)) {
+    printf("[003] connect failed: [%d] %s\n", mysqli_connect_errno(), mysqli_connect_error());
+}
+
+//the conn keeps its connect arguments for autoReconnect, the redirect target went to the cache
+$stats = mysqlnd_azure_memory_stats();
+printf("[004] conn_data request>0 %s, redirect_cache persistent>0 %s, conn_handles allocations>0 %s\n",
+    $stats["conn_data"]["request"] > 0 ? "yes" : "no",
+    $stats["redirect_cache"]["persistent"] > 0 ? "yes" : "no",
+    $stats["conn_handles"]["allocations"] > 0 ? "yes" : "no");
+$held = $stats["conn_data"]["request"];
+
+//select_db replaces the copy of the database name
+$link->select_db("another_db");
+$stats = mysqlnd_azure_memory_stats();
+printf("[005] conn_data grew by %d\n", $stats["conn_data"]["request"] - $held);
+
+$link->close();
+$stats = mysqlnd_azure_memory_stats();
+printf("[006] conn_data request=%d peak>0 %s, allocations=frees %s\n", $stats["conn_data"]["request"],
+    $stats["conn_data"]["request_peak"] > 0 ? "yes" : "no",
+    $stats["conn_data"]["allocations"] == $stats["conn_data"]["frees"] ? "yes" : "no");
+printf("[007] total persistent_peak>=persistent %s\n", $stats["total"]["persistent_peak"] >= $stats["total"]["persistent"] ? "yes" : "no");
+
+echo "Done\n";
+?>
+--EXPECT--
+redirect_cache,conn_data,conn_options,conn_handles,deferred_close,tables,total
+persistent,persistent_peak,request,request_peak,allocations,frees,allocated
+[002] conn_data request=0
+[004] conn_data request>0 yes, redirect_cache persistent>0 yes, conn_handles allocations>0 yes
+[005] conn_data grew by 1
+[006] conn_data request=0 peak>0 yes, allocations=frees yes
+[007] total persistent_peak>=persistent yes
+Done
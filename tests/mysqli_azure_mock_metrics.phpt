@@ -0,0 +1,81 @@
+--TEST--
+mysqlnd_azure_metrics() against the local mock server: connect path, cache, failure and per server counters in Prometheus format
+--INI--
+mysqlnd_azure.enableRedirect="preferred"
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$backend_port = MOCK_SERVER_BASE_PORT + 18;
+$gateway_port = MOCK_SERVER_BASE_PORT + 19;
+$dead_port = MOCK_SERVER_BASE_PORT + 12; //nothing listens here
+
+if (!mock_server_start($backend_port, array("tls" => true))
+    || !mock_server_start($gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $backend_port))) {
+    die("[001] cannot start mock servers\n");
+}
+
+function mock_metrics_connect($step, $port) {
+    $link = mysqli_init();
+    $ret = @mysqli_real_connect($link, MOCK_SERVER_HOST, "metrics_user", "", NULL, $port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT);
+    printf("[%s] %s\n", $step, $ret ? "ok" : "failed");
+    if ($ret) {
+        $link->close();
+    }
+}
+
+mock_metrics_connect("002", $gateway_port);
+mock_metrics_connect("003", $gateway_port);
+mock_metrics_connect("004", $dead_port);
+
+$metrics = mysqlnd_azure_metrics();
+//every sample line is "name{labels} value"
+foreach (explode("\n", trim($metrics)) as $line) {
+    if ($line[0] != "#" && !preg_match('/^[a-z_]+(\{[a-z_]+="[^"]*"(,[a-z_]+="[^"]*")*\})? [0-9.]+$/', $line)) {
+        printf("[005] bad line: %s\n", $line);
+    }
+}
+foreach (explode("\n", $metrics) as $line) {
+    if (preg_match('/^mysqlnd_azure_(connects_total\{path="(redirect|cache)",outcome="success"\}|redirect_cache_lookups_total|connect_failures_total\{reason="network"\}|connect_duration_seconds_(count|bucket\{path="cache",le="\+Inf"\})|metrics_shared)/', $line)) {
+        echo $line, "\n";
+    }
+}
+//per server series, the non zero connects and the count of each server
+$servers = array(sprintf('host="%s",port="%d"', MOCK_SERVER_HOST, $gateway_port) => 'gateway',
+                 sprintf('host="%s",port="%d"', MOCK_SERVER_HOST, $dead_port) => 'dead',
+                 'host="other",port=""' => 'other');
+foreach (explode("\n", $metrics) as $line) {
+    if (preg_match('/^mysqlnd_azure_host_(connects_total\{.*\} [1-9]|connect_duration_seconds_count)/', $line)) {
+        echo strtr($line, $servers), "\n";
+    }
+}
+echo "Done\n";
+?>
+--EXPECTF--
+[002] ok
+[003] ok
+[004] failed
+mysqlnd_azure_connects_total{path="cache",outcome="success"} 1
+mysqlnd_azure_connects_total{path="redirect",outcome="success"} 1
+mysqlnd_azure_redirect_cache_lookups_total{result="hit"} 1
+mysqlnd_azure_redirect_cache_lookups_total{result="miss"} 2
+mysqlnd_azure_redirect_cache_lookups_total{result="stale"} 0
+mysqlnd_azure_connect_failures_total{reason="network"} 1
+mysqlnd_azure_connect_duration_seconds_count{path="none"} %d
+mysqlnd_azure_connect_duration_seconds_count{path="gateway"} %d
+mysqlnd_azure_connect_duration_seconds_bucket{path="cache",le="+Inf"} 1
+mysqlnd_azure_connect_duration_seconds_count{path="cache"} 1
+mysqlnd_azure_connect_duration_seconds_count{path="redirect"} 1
+mysqlnd_azure_connect_duration_seconds_count{path="fallback"} %d
+mysqlnd_azure_metrics_shared %d
+mysqlnd_azure_host_connects_total{gateway,path="cache",outcome="success"} 1
+mysqlnd_azure_host_connects_total{gateway,path="redirect",outcome="success"} 1
+mysqlnd_azure_host_connects_total{dead,path="%s",outcome="failure"} 1
+mysqlnd_azure_host_connect_duration_seconds_count{gateway} 2
+mysqlnd_azure_host_connect_duration_seconds_count{dead} 1
+mysqlnd_azure_host_connect_duration_seconds_count{other} 0
+Done
@@ -0,0 +1,43 @@
+--TEST--
+mysqlnd_azure.redirectPolicy against the local mock server: a host with policy off skips redirect although enableRedirect is on
+--INI--
+mysqlnd_azure.enableRedirect="on"
+mysqlnd_azure.redirectPolicy="*.database.azure.com=on;127.0.0.1=off"
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$backend_port = MOCK_SERVER_BASE_PORT + 25;
+$gateway_port = MOCK_SERVER_BASE_PORT + 26;
+
+if (!mock_server_start($backend_port, array("tls" => true))
+    || !mock_server_start($gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $backend_port))) {
+    die("[001] cannot start mock servers\n");
+}
+
+function mock_policy_connect($step, $flags) {
+    global $gateway_port, $backend_port;
+    $link = mysqli_init();
+    if (!@mysqli_real_connect($link, MOCK_SERVER_HOST, "policy_user", "", NULL, $gateway_port, NULL, $flags)) {
+        printf("[%s] connect failed: [%d] %s\n", $step, mysqli_connect_errno(), mysqli_connect_error());
+        return;
+    }
+    $port = preg_match('/-(\d+)$/', $link->server_info, $m) ? (int)$m[1] : 0;
+    printf("[%s] ok on %s\n", $step, $port == $gateway_port ? "gateway" : ($port == $backend_port ? "redirect target" : "unknown"));
+    $link->close();
+}
+
+//enableRedirect=on alone would refuse a connect without SSL
+mock_policy_connect("002", 0);
+mock_policy_connect("003", MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT);
+
+echo "Done\n";
+?>
+--EXPECT--
+[002] ok on gateway
+[003] ok on gateway
+Done
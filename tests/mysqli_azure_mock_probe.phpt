@@ -0,0 +1,54 @@
+--TEST--
+mysqlnd_azure_probe() against the local mock server: cache entries of a dead redirect target are dropped
+--INI--
+mysqlnd_azure.enableRedirect="preferred"
+mysqlnd_azure.probeTimeoutMs=500
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$backend_port = MOCK_SERVER_BASE_PORT + 16;
+$gateway_port = MOCK_SERVER_BASE_PORT + 17;
+$gateway_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_probe_gateway.json";
+
+$backend = mock_server_start($backend_port, array("tls" => true));
+if (!$backend || !mock_server_start($gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $backend_port, "stats-file" => $gateway_stats))) {
+    die("[001] cannot start mock servers\n");
+}
+
+function mock_probe_connect($step) {
+    global $gateway_port, $gateway_stats;
+    $link = mysqli_init();
+    $ret = @mysqli_real_connect($link, MOCK_SERVER_HOST, "probe_user", "", NULL, $gateway_port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT);
+    printf("[%s] %s gateway=%d\n", $step, $ret ? "ok" : "failed", mock_server_accepted($gateway_stats));
+    if ($ret) {
+        $link->close();
+    }
+}
+
+mock_probe_connect("002");
+//the target answers, the cache entry stays and the next connect skips the gateway
+printf("[003] dropped=%d\n", mysqlnd_azure_probe());
+mock_probe_connect("004");
+
+mock_server_stop($backend);
+printf("[005] dropped=%d\n", mysqlnd_azure_probe());
+printf("[006] dropped=%d\n", mysqlnd_azure_probe());
+//no failed try against the dead target, straight to the gateway
+mock_probe_connect("007");
+
+@unlink($gateway_stats);
+echo "Done\n";
+?>
+--EXPECT--
+[002] ok gateway=1
+[003] dropped=0
+[004] ok gateway=1
+[005] dropped=1
+[006] dropped=0
+[007] ok gateway=2
+Done
@@ -0,0 +1,85 @@
+--TEST--
+mysqlnd_azure.autoReconnect against the local mock server: reconnect through the gateway, replay of reads only while the session holds no state
+--INI--
+mysqlnd_azure.enableRedirect="preferred"
+mysqlnd_azure.autoReconnect="replay"
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$backend_port = MOCK_SERVER_BASE_PORT + 6;
+$gateway_port = MOCK_SERVER_BASE_PORT + 7;
+$drop_file = sys_get_temp_dir() . "/mysqlnd_azure_mock_reconnect.drop";
+$backend_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_reconnect_backend.json";
+$gateway_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_reconnect_gateway.json";
+
+if (!mock_server_start($backend_port, array("tls" => true, "drop-file" => $drop_file, "stats-file" => $backend_stats))
+    || !mock_server_start($gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $backend_port, "stats-file" => $gateway_stats))) {
+    die("[001] cannot start mock servers\n");
+}
+
+function mock_reconnect_query($step, $link, $query) {
+    global $backend_stats, $gateway_stats;
+    $ret = @$link->query($query);
+    printf("[%s] %s errno=%d gateway=%d backend=%d\n", $step, $ret ? "ok" : "failed", $link->errno,
+        mock_server_accepted($gateway_stats), mock_server_accepted($backend_stats));
+}
+
+$link = mysqli_init();
+if (!@mysqli_real_connect($link, MOCK_SERVER_HOST, "reconnect_user", "", NULL, $gateway_port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT)) {
+    die(sprintf("[002] connect failed: [%d] %s\n", mysqli_connect_errno(), mysqli_connect_error()));
+}
+mock_reconnect_query("003", $link, "SELECT 1");
+
+//a read outside a transaction is replayed on the new connection
+touch($drop_file);
+mock_reconnect_query("004", $link, "SELECT 'DROP_CONNECTION'");
+
+//a write reports the lost connection, but the conn is usable again
+touch($drop_file);
+mock_reconnect_query("005", $link, "UPDATE t SET a = 'DROP_CONNECTION'");
+mock_reconnect_query("006", $link, "SELECT 1");
+
+//the cache entry was refreshed by the reconnect, a new connect skips the gateway
+$link2 = mysqli_init();
+if (!@mysqli_real_connect($link2, MOCK_SERVER_HOST, "reconnect_user", "", NULL, $gateway_port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT)) {
+    printf("[007] connect failed: [%d] %s\n", mysqli_connect_errno(), mysqli_connect_error());
+}
+mock_reconnect_query("008", $link2, "SELECT 1");
+
+//the charset of set_charset is set again on the new connection
+printf("[009] set_charset %s\n", $link->set_charset("cp1251") ? "ok" : "failed");
+touch($drop_file);
+mock_reconnect_query("010", $link, "SELECT 'DROP_CONNECTION'");
+printf("[011] charset %s\n", $link->character_set_name());
+
+//a user variable is lost with the session, a read after it is not replayed
+mock_reconnect_query("012", $link, "SET @a = 1");
+touch($drop_file);
+mock_reconnect_query("013", $link, "SELECT @a, 'DROP_CONNECTION'");
+//the new session holds no state yet
+touch($drop_file);
+mock_reconnect_query("014", $link, "SELECT 'DROP_CONNECTION'");
+
+$link->close();
+$link2->close();
+@unlink($drop_file);
+echo "Done\n";
+?>
+--EXPECTF--
+[003] ok errno=0 gateway=1 backend=1
+[004] ok errno=0 gateway=2 backend=2
+[005] failed errno=%d gateway=3 backend=3
+[006] ok errno=0 gateway=3 backend=3
+[008] ok errno=0 gateway=3 backend=4
+[009] set_charset ok
+[010] ok errno=0 gateway=4 backend=5
+[011] charset cp1251
+[012] ok errno=0 gateway=4 backend=5
+[013] failed errno=%d gateway=5 backend=6
+[014] ok errno=0 gateway=6 backend=7
+Done
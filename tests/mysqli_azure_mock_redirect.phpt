@@ -0,0 +1,63 @@
+--TEST--
+Azure redirection test against the local mock server, azure and community Location formats and cache
+--INI--
+mysqlnd_azure.enableRedirect="preferred"
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$backend_port = MOCK_SERVER_BASE_PORT;
+$azure_port = MOCK_SERVER_BASE_PORT + 1;
+$community_port = MOCK_SERVER_BASE_PORT + 2;
+$backend_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_redirect_backend.json";
+$azure_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_redirect_azure.json";
+$community_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_redirect_community.json";
+
+if (!mock_server_start($backend_port, array("tls" => true, "stats-file" => $backend_stats))
+    || !mock_server_start($azure_port, array("tls" => true, "location" => "azure", "redirect-port" => $backend_port, "ttl" => 300, "stats-file" => $azure_stats))
+    || !mock_server_start($community_port, array("tls" => true, "location" => "community", "redirect-port" => $backend_port, "ttl" => 300, "stats-file" => $community_stats))) {
+    die("[001] cannot start mock servers\n");
+}
+
+function mock_connect_test($step, $port, $user) {
+    global $backend_stats, $azure_stats, $community_stats;
+
+    $link = mysqli_init();
+    $ret = @mysqli_real_connect($link, MOCK_SERVER_HOST, $user, "", NULL, $port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT);
+    if (!$ret) {
+        printf("[%s] connect failed: [%d] %s\n", $step, mysqli_connect_errno(), mysqli_connect_error());
+        return;
+    }
+    if (!$link->query("SELECT 1")) {
+        printf("[%s] query failed\n", $step);
+    }
+    printf("[%s] gateway(azure)=%d gateway(community)=%d backend=%d\n", $step,
+        mock_server_accepted($azure_stats), mock_server_accepted($community_stats), mock_server_accepted($backend_stats));
+    $link->close();
+}
+
+//Step 1: azure format, gateway handshake then redirect handshake
+mock_connect_test("002", $azure_port, "mock_user1");
+
+//Step 2: same profile again, cached redirect info is used and the gateway is skipped
+mock_connect_test("003", $azure_port, "mock_user1");
+
+//Step 3: community format
+mock_connect_test("004", $community_port, "mock_user2");
+
+//Step 4: redirection disabled, conn stays on the gateway
+ini_set("mysqlnd_azure.enableRedirect", "off");
+mock_connect_test("005", $azure_port, "mock_user3");
+
+echo "Done\n";
+?>
+--EXPECTF--
+[002] gateway(azure)=1 gateway(community)=0 backend=1
+[003] gateway(azure)=1 gateway(community)=0 backend=2
+[004] gateway(azure)=1 gateway(community)=1 backend=3
+[005] gateway(azure)=2 gateway(community)=1 backend=3
+Done
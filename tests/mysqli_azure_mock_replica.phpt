@@ -0,0 +1,82 @@
+--TEST--
+mysqlnd_azure.readReplicas against the local mock server: reads go to the replica, writes and reads after them to the primary, the handle stays on the primary
+--INI--
+mysqlnd_azure.enableRedirect="off"
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$primary_port = MOCK_SERVER_BASE_PORT + 8;
+$replica_port = MOCK_SERVER_BASE_PORT + 9;
+$dead_port = MOCK_SERVER_BASE_PORT + 12; //nothing listens here
+$replica_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_replica.json";
+
+if (!mock_server_start($primary_port) || !mock_server_start($replica_port, array("stats-file" => $replica_stats))) {
+    die("[001] cannot start mock servers\n");
+}
+ini_set("mysqlnd_azure.readReplicas", MOCK_SERVER_HOST . ":{$primary_port}=" . MOCK_SERVER_HOST . ":{$replica_port}");
+
+function mock_replica_name($port) {
+    global $primary_port, $replica_port;
+    return $port == $primary_port ? "primary" : ($port == $replica_port ? "replica" : "unknown");
+}
+
+//the mock answers with its port as the insert id, the server info tells where the handle itself is
+function mock_replica_query($step, $link, $query) {
+    global $replica_stats;
+    $ret = $link->query($query);
+    $handle_port = preg_match('/-(\d+)$/', $link->server_info, $m) ? (int)$m[1] : 0;
+    printf("[%s] %s on %s, handle on %s, replica connects=%d\n", $step, $ret ? "ok" : "failed",
+        mock_replica_name($link->insert_id), mock_replica_name($handle_port), mock_server_accepted($replica_stats));
+}
+
+$link = mysqli_init();
+if (!@mysqli_real_connect($link, MOCK_SERVER_HOST, "replica_user", "", NULL, $primary_port)) {
+    die(sprintf("[002] connect failed: [%d] %s\n", mysqli_connect_errno(), mysqli_connect_error()));
+}
+mock_replica_query("003", $link, "SELECT 1");
+mock_replica_query("004", $link, "SELECT 2");
+mock_replica_query("005", $link, "SELECT * FROM t FOR UPDATE");
+mock_replica_query("006", $link, "UPDATE t SET a = 1");
+//read your writes: the rest of the request reads from the primary
+mock_replica_query("007", $link, "SELECT 1");
+
+//another conn has its own writes
+$link2 = mysqli_init();
+if (!@mysqli_real_connect($link2, MOCK_SERVER_HOST, "replica_user", "", NULL, $primary_port)) {
+    printf("[008] connect failed: [%d] %s\n", mysqli_connect_errno(), mysqli_connect_error());
+}
+mock_replica_query("009", $link2, "SELECT 1");
+
+//as on the reuse of a persistent conn: the replica goes, the next read opens one for the new user
+printf("[010] change_user %s\n", $link2->change_user("replica_user2", "", NULL) ? "ok" : "failed");
+mock_replica_query("011", $link2, "SELECT 1");
+$link2->close();
+
+//an unreachable replica leaves the reads on the primary
+ini_set("mysqlnd_azure.readReplicas", MOCK_SERVER_HOST . ":{$primary_port}=" . MOCK_SERVER_HOST . ":{$dead_port}");
+$link3 = mysqli_init();
+if (!@mysqli_real_connect($link3, MOCK_SERVER_HOST, "replica_user", "", NULL, $primary_port)) {
+    printf("[012] connect failed: [%d] %s\n", mysqli_connect_errno(), mysqli_connect_error());
+}
+mock_replica_query("013", $link3, "SELECT 1");
+$link3->close();
+
+$link->close();
+echo "Done\n";
+?>
+--EXPECTF--
+[003] ok on replica, handle on primary, replica connects=1
+[004] ok on replica, handle on primary, replica connects=1
+[005] ok on primary, handle on primary, replica connects=1
+[006] ok on primary, handle on primary, replica connects=1
+[007] ok on primary, handle on primary, replica connects=1
+[009] ok on replica, handle on primary, replica connects=2
+[010] change_user ok
+[011] ok on replica, handle on primary, replica connects=3
+[013] ok on primary, handle on primary, replica connects=3
+Done
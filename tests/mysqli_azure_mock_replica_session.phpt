@@ -0,0 +1,59 @@
+--TEST--
+mysqlnd_azure.readReplicas against the local mock server: reads of session state, and reads on a persistent conn with session state of an earlier request, stay on the primary
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+if (!extension_loaded('pdo_mysql')) {
+    die('skip pdo_mysql extension not available');
+}
+if (!ini_get('allow_url_fopen')) {
+    die('skip allow_url_fopen is off');
+}
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$primary_port = MOCK_SERVER_BASE_PORT + 47;
+$replica_port = MOCK_SERVER_BASE_PORT + 48;
+$web_port = MOCK_SERVER_BASE_PORT + 49;
+
+if (!mock_server_start($primary_port) || !mock_server_start($replica_port)) {
+    die("[001] cannot start mock servers\n");
+}
+if (!mock_php_server_start($web_port, __DIR__ . "/mock_replica_session_router.php", array(
+        "mysqlnd_azure.enableRedirect" => "off",
+        "mysqlnd_azure.readReplicas" => MOCK_SERVER_HOST . ":{$primary_port}=" . MOCK_SERVER_HOST . ":{$replica_port}"))) {
+    die("[002] cannot start the web server\n");
+}
+
+//every statement is a request of its own, the read your writes stickiness of a request does not carry over
+function mock_session_request($step, $query) {
+    global $primary_port, $replica_port, $web_port;
+    $port = @file_get_contents("http://" . MOCK_SERVER_HOST . ":{$web_port}/?port={$primary_port}&query=" . urlencode($query));
+    printf("[%s] %s on %s\n", $step, $query,
+        $port == $primary_port ? "primary" : ($port == $replica_port ? "replica" : "unknown: " . var_export($port, true)));
+}
+
+mock_session_request("003", "SELECT 1");
+mock_session_request("004", "SELECT LAST_INSERT_ID()");
+mock_session_request("005", "SELECT FOUND_ROWS()");
+mock_session_request("006", "SELECT @@session.time_zone");
+mock_session_request("007", "SELECT 'user@example.com'");
+//the session state stays with the persistent conn
+mock_session_request("008", "SET time_zone = '+01:00'");
+mock_session_request("009", "SELECT NOW()");
+mock_session_request("010", "SELECT 1");
+
+echo "Done\n";
+?>
+--EXPECT--
+[003] SELECT 1 on replica
+[004] SELECT LAST_INSERT_ID() on primary
+[005] SELECT FOUND_ROWS() on primary
+[006] SELECT @@session.time_zone on primary
+[007] SELECT 'user@example.com' on replica
+[008] SET time_zone = '+01:00' on primary
+[009] SELECT NOW() on primary
+[010] SELECT 1 on primary
+Done
@@ -0,0 +1,57 @@
+--TEST--
+Redirect cache with several targets against the local mock server: a failed cached target is replaced by the next one without a gateway round
+--INI--
+mysqlnd_azure.enableRedirect="on"
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$first_port   = MOCK_SERVER_BASE_PORT + 29;
+$second_port  = MOCK_SERVER_BASE_PORT + 30;
+$gateway_port = MOCK_SERVER_BASE_PORT + 31;
+$first_control = sys_get_temp_dir() . "/mysqlnd_azure_mock_targets_first.ctl";
+$gateway_stats = sys_get_temp_dir() . "/mysqlnd_azure_mock_targets_gateway.json";
+
+mock_server_control($first_control, array("fail-rate" => 0));
+if (!mock_server_start($first_port, array("tls" => true, "control-file" => $first_control))
+    || !mock_server_start($second_port, array("tls" => true))
+    || !mock_server_start($gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => "$first_port,$second_port", "stats-file" => $gateway_stats))) {
+    die("[001] cannot start mock servers\n");
+}
+
+function mock_targets_connect($step) {
+    global $gateway_port, $first_port, $second_port, $gateway_stats;
+    $link = mysqli_init();
+    if (!@mysqli_real_connect($link, MOCK_SERVER_HOST, "targets_user", "", NULL, $gateway_port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT)) {
+        printf("[%s] connect failed: [%d] %s\n", $step, mysqli_connect_errno(), mysqli_connect_error());
+        return;
+    }
+    $port = preg_match('/-(\d+)$/', $link->server_info, $m) ? (int)$m[1] : 0;
+    printf("[%s] ok on %s, gateway accepted %d\n", $step, $port == $first_port ? "first target" : ($port == $second_port ? "second target" : "gateway"),
+        mock_server_accepted($gateway_stats));
+    $link->close();
+}
+
+//the gateway names both targets, the first one is used and both are cached. The next connect
+//takes the second one, which has no connect time measured yet
+mock_targets_connect("002");
+mock_targets_connect("003");
+
+//the first target goes away: the second one takes over, the gateway is not asked again
+mock_server_control($first_control, array("fail-rate" => 1, "fail-mode" => "close"));
+mock_targets_connect("004");
+mock_targets_connect("005");
+
+@unlink($first_control);
+echo "Done\n";
+?>
+--EXPECT--
+[002] ok on first target, gateway accepted 1
+[003] ok on second target, gateway accepted 1
+[004] ok on second target, gateway accepted 1
+[005] ok on second target, gateway accepted 1
+Done
@@ -0,0 +1,65 @@
+--TEST--
+mysqlnd_azure.traceFile against the local mock server: OTLP-JSON spans of a redirected connect under the application's trace
+--INI--
+mysqlnd_azure.enableRedirect="preferred"
+mysqlnd_azure.traceBatchSize=1
+mysqlnd_azure.traceFile={PWD}/mysqlnd_azure_mock_trace.jsonl
+--SKIPIF--
+<?php
+require_once('skipif_mock.inc');
+?>
+--FILE--
+<?php
+require_once("mock_server.inc");
+
+$backend_port = MOCK_SERVER_BASE_PORT + 23;
+$gateway_port = MOCK_SERVER_BASE_PORT + 24;
+$trace_file = __DIR__ . "/mysqlnd_azure_mock_trace.jsonl";
+@unlink($trace_file);
+
+if (!mock_server_start($backend_port, array("tls" => true))
+    || !mock_server_start($gateway_port, array("tls" => true, "location" => "azure", "redirect-port" => $backend_port))) {
+    die("[001] cannot start mock servers\n");
+}
+//a script cannot move the trace file elsewhere
+var_dump(ini_set("mysqlnd_azure.traceFile", sys_get_temp_dir() . "/mysqlnd_azure_mock_trace_elsewhere.jsonl"));
+var_dump(ini_get("mysqlnd_azure.traceFile") === $trace_file);
+
+var_dump(mysqlnd_azure_set_trace_parent("00-4BF92F3577B34DA6A3CE929D0E0E4736-00f067aa0ba902b7-01"));
+var_dump(mysqlnd_azure_set_trace_parent("00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01"));
+
+$link = mysqli_init();
+if (!@mysqli_real_connect($link, MOCK_SERVER_HOST, "trace_user", "", NULL, $gateway_port, NULL, MYSQLI_CLIENT_SSL | MYSQLI_CLIENT_SSL_DONT_VERIFY_SERVER_CERT)) {
+    die(sprintf("[002] connect failed: [%d] %s\n", mysqli_connect_errno(), mysqli_connect_error()));
+}
+$link->close();
+
+$lines = file($trace_file, FILE_IGNORE_NEW_LINES);
+printf("[003] lines=%d\n", count($lines));
+$request = json_decode($lines[0], true);
+$spans = $request["resourceSpans"][0]["scopeSpans"][0]["spans"];
+$root = $spans[0];
+printf("[004] %s trace=%s parent=%s kind=%d status=%d\n", $root["name"], $root["traceId"], $root["parentSpanId"], $root["kind"], $root["status"]["code"]);
+$names = array();
+foreach (array_slice($spans, 1) as $span) {
+    if ($span["traceId"] != $root["traceId"] || $span["parentSpanId"] != $root["spanId"]
+        || $span["startTimeUnixNano"] < $root["startTimeUnixNano"] || $span["endTimeUnixNano"] > $root["endTimeUnixNano"]) {
+        printf("[005] span %s outside of the connect span\n", $span["name"]);
+    }
+    $names[] = $span["name"];
+}
+var_dump(in_array("mysqlnd_azure.gateway_handshake", $names), in_array("mysqlnd_azure.redirect_handshake", $names));
+
+@unlink($trace_file);
+echo "Done\n";
+?>
+--EXPECT--
+bool(false)
+bool(true)
+bool(false)
+bool(true)
+[003] lines=1
+[004] mysqlnd_azure.connect trace=4bf92f3577b34da6a3ce929d0e0e4736 parent=00f067aa0ba902b7 kind=3 status=1
+bool(true)
+bool(true)
+Done
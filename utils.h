@@ -4,6 +4,11 @@
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
+#ifdef PHP_WIN32
+#include "win32/time.h"
+#else
+#include <sys/time.h>
+#endif
 
 #include "php_mysqlnd_azure.h"
 
@@ -54,5 +59,67 @@ extern FILE *logfile;
     }                                                                                        \
 } while (0)
 
+/* wall clock in microseconds, used to time connect phases */
+static inline uint64_t mysqlnd_azure_now_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+/*
+  USDT probes (provider mysqlnd_azure) for perf, bpftrace and systemtap, built with ./configure --enable-mysqlnd-azure-usdt.
+  A probe site is a single nop until a tracer attaches. Without the flag the probes and their timestamps compile to nothing.
+  Strings are const char*, ports and counts unsigned int, durations uint64_t microseconds.
+*/
+#ifdef HAVE_MYSQLND_AZURE_USDT
+#include <sys/sdt.h>
+#define AZURE_PROBE_NOW()                         mysqlnd_azure_now_us()
+#define AZURE_PROBE2(name, a1, a2)                DTRACE_PROBE2(mysqlnd_azure, name, a1, a2)
+#define AZURE_PROBE3(name, a1, a2, a3)            DTRACE_PROBE3(mysqlnd_azure, name, a1, a2, a3)
+#define AZURE_PROBE4(name, a1, a2, a3, a4)        DTRACE_PROBE4(mysqlnd_azure, name, a1, a2, a3, a4)
+#else
+#define AZURE_PROBE_NOW()                         ((uint64_t)0)
+#define AZURE_PROBE2(name, a1, a2)                do { (void)(a1); (void)(a2); } while (0)
+#define AZURE_PROBE3(name, a1, a2, a3)            do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+#define AZURE_PROBE4(name, a1, a2, a3, a4)        do { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } while (0)
+#endif
+
+/*
+  Minimal atomics for the data shared between threads (ZTS) or processes.
+  Loads acquire, stores release, counters are relaxed.
+*/
+#if defined(__GNUC__) || defined(__clang__)
+static inline uint32_t mysqlnd_azure_atomic_load_u32(volatile uint32_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void mysqlnd_azure_atomic_store_u32(volatile uint32_t *p, uint32_t v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline void *mysqlnd_azure_atomic_load_ptr(void * volatile *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void mysqlnd_azure_atomic_store_ptr(void * volatile *p, void *v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline void mysqlnd_azure_atomic_inc_u64(volatile uint64_t *p) { __atomic_fetch_add(p, 1, __ATOMIC_RELAXED); }
+static inline void mysqlnd_azure_atomic_add_u64(volatile uint64_t *p, uint64_t v) { __atomic_fetch_add(p, v, __ATOMIC_RELAXED); }
+static inline uint64_t mysqlnd_azure_atomic_add_fetch_u64(volatile uint64_t *p, uint64_t v) { return __atomic_add_fetch(p, v, __ATOMIC_RELAXED); }
+static inline uint64_t mysqlnd_azure_atomic_load_u64(volatile uint64_t *p) { return __atomic_load_n(p, __ATOMIC_RELAXED); }
+static inline void mysqlnd_azure_atomic_max_u64(volatile uint64_t *p, uint64_t v) { uint64_t old = __atomic_load_n(p, __ATOMIC_RELAXED); while (old < v && !__atomic_compare_exchange_n(p, &old, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)); }
+static inline void mysqlnd_azure_atomic_fence() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+static inline int mysqlnd_azure_atomic_cas_u32(volatile uint32_t *p, uint32_t expected, uint32_t v) { return __atomic_compare_exchange_n(p, &expected, v, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED); }
+static inline void mysqlnd_azure_atomic_inc_u32(volatile uint32_t *p) { __atomic_fetch_add(p, 1, __ATOMIC_SEQ_CST); }
+static inline void mysqlnd_azure_atomic_dec_u32(volatile uint32_t *p) { __atomic_fetch_sub(p, 1, __ATOMIC_SEQ_CST); }
+#elif defined(_MSC_VER)
+#include <intrin.h>
+static inline uint32_t mysqlnd_azure_atomic_load_u32(volatile uint32_t *p) { uint32_t v = *p; _ReadWriteBarrier(); return v; }
+static inline void mysqlnd_azure_atomic_store_u32(volatile uint32_t *p, uint32_t v) { _ReadWriteBarrier(); *p = v; }
+static inline void *mysqlnd_azure_atomic_load_ptr(void * volatile *p) { void *v = *p; _ReadWriteBarrier(); return v; }
+static inline void mysqlnd_azure_atomic_store_ptr(void * volatile *p, void *v) { _ReadWriteBarrier(); *p = v; }
+static inline void mysqlnd_azure_atomic_inc_u64(volatile uint64_t *p) { _InterlockedIncrement64((volatile __int64 *)p); }
+static inline void mysqlnd_azure_atomic_add_u64(volatile uint64_t *p, uint64_t v) { _InterlockedExchangeAdd64((volatile __int64 *)p, (__int64)v); }
+static inline uint64_t mysqlnd_azure_atomic_add_fetch_u64(volatile uint64_t *p, uint64_t v) { return (uint64_t)_InterlockedExchangeAdd64((volatile __int64 *)p, (__int64)v) + v; }
+static inline uint64_t mysqlnd_azure_atomic_load_u64(volatile uint64_t *p) { return (uint64_t)_InterlockedCompareExchange64((volatile __int64 *)p, 0, 0); }
+static inline void mysqlnd_azure_atomic_max_u64(volatile uint64_t *p, uint64_t v) { __int64 old = *(volatile __int64 *)p, seen; while ((uint64_t)old < v && (seen = _InterlockedCompareExchange64((volatile __int64 *)p, (__int64)v, old)) != old) old = seen; }
+static inline void mysqlnd_azure_atomic_fence() { MemoryBarrier(); }
+static inline int mysqlnd_azure_atomic_cas_u32(volatile uint32_t *p, uint32_t expected, uint32_t v) { return (uint32_t)_InterlockedCompareExchange((volatile long *)p, (long)v, (long)expected) == expected; }
+static inline void mysqlnd_azure_atomic_inc_u32(volatile uint32_t *p) { _InterlockedIncrement((volatile long *)p); }
+static inline void mysqlnd_azure_atomic_dec_u32(volatile uint32_t *p) { _InterlockedDecrement((volatile long *)p); }
+#else
+#error "mysqlnd_azure needs GCC/Clang __atomic builtins or MSVC intrinsics"
+#endif
 
 #endif // UTILS_H